@@ -0,0 +1,954 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "common.h"
+#include "exall.h"
+#include "archive.h"
+
+/*
+ * Single file backup archive.
+ *
+ *  header:  magic, version
+ *  entry:   magic, pathLength, commentLength, type, size, prot, days, mins, ticks, path, comment, body
+ *  index:   pathLength, commentLength, type, size, prot, days, mins, ticks, offsetHi, offsetLo, path, comment
+ *  footer:  indexOffsetHi, indexOffsetLo, count, magic
+ *
+ * All words are big endian. Incremental runs overwrite the old index with new entries and write a
+ * fresh index on close, so a later entry for the same path supersedes the earlier one. If the
+ * footer is missing (interrupted run) the index is rebuilt by scanning the entries.
+ */
+
+#define ARCHIVE_HEADER_WORDS 9
+#define ARCHIVE_INDEX_WORDS  10
+#define ARCHIVE_FOOTER_SIZE  16
+
+#ifdef _WIN32
+#define ARCHIVE_PATH_SEPARATOR "\\"
+#else
+#define ARCHIVE_PATH_SEPARATOR "/"
+#endif
+
+static archive_t* archive_main_archive = 0;
+static char* archive_copyBuffer = 0;
+
+
+static void
+archive_putU32(uint8_t* ptr, uint32_t value)
+{
+  ptr[0] = value >> 24;
+  ptr[1] = value >> 16;
+  ptr[2] = value >> 8;
+  ptr[3] = value;
+}
+
+
+static uint32_t
+archive_getU32(const uint8_t* ptr)
+{
+  return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3];
+}
+
+
+static int
+archive_writeAt(int fd, uint64_t offset, const void* data, size_t length)
+{
+  if (lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1) {
+    return -1;
+  }
+
+  const char* ptr = data;
+  while (length > 0) {
+    ssize_t written = write(fd, ptr, length);
+    if (written <= 0) {
+      return -1;
+    }
+    ptr += written;
+    length -= written;
+  }
+  return 0;
+}
+
+
+static int
+archive_readAt(int fd, uint64_t offset, void* data, size_t length)
+{
+  if (lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1) {
+    return -1;
+  }
+
+  char* ptr = data;
+  while (length > 0) {
+    ssize_t got = read(fd, ptr, length);
+    if (got <= 0) {
+      return -1;
+    }
+    ptr += got;
+    length -= got;
+  }
+  return 0;
+}
+
+
+static uint32_t
+archive_hashPath(const char* path)
+{
+  uint32_t hash = 2166136261u;
+  while (*path) {
+    hash ^= (uint8_t)*path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+const char*
+archive_parentPath(const char* path, char* buffer, int bufferSize)
+{
+  snprintf(buffer, bufferSize, "%s", path);
+  int i;
+  for (i = strlen(buffer)-1; i >= 0; --i) {
+    if (buffer[i] == '/') {
+      buffer[i] = 0;
+      return buffer;
+    } else if (buffer[i] == ':') {
+      if (buffer[i+1] == 0) {
+        return 0; // volume root has no parent
+      }
+      buffer[i+1] = 0;
+      return buffer;
+    }
+  }
+  return 0;
+}
+
+
+static void
+archive_freeEntry(archive_entry_t* entry)
+{
+  if (entry) {
+    if (entry->path) {
+      free(entry->path);
+    }
+    if (entry->info.name) {
+      free((void*)entry->info.name);
+    }
+    if (entry->info.comment) {
+      free((void*)entry->info.comment);
+    }
+    free(entry);
+  }
+}
+
+
+static void
+archive_rehash(archive_t* archive)
+{
+  if (archive->hash) {
+    free(archive->hash);
+  }
+
+  archive->hashSize = 1024;
+  while (archive->hashSize < archive->count*2) {
+    archive->hashSize *= 2;
+  }
+
+  archive->hash = calloc(archive->hashSize, sizeof(archive_entry_t*));
+  if (!archive->hash) {
+    fatalError("archive: out of memory");
+  }
+
+  for (uint32_t i = 0; i < archive->count; i++) {
+    archive_entry_t* entry = archive->entries[i];
+    uint32_t bucket = archive_hashPath(entry->path) & (archive->hashSize-1);
+    entry->hashNext = archive->hash[bucket];
+    archive->hash[bucket] = entry;
+  }
+}
+
+
+archive_entry_t*
+archive_find(archive_t* archive, const char* path)
+{
+  if (!archive->hash) {
+    return 0;
+  }
+
+  archive_entry_t* entry = archive->hash[archive_hashPath(path) & (archive->hashSize-1)];
+  while (entry) {
+    if (strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+    entry = entry->hashNext;
+  }
+  return 0;
+}
+
+
+static archive_entry_t*
+archive_insert(archive_t* archive, archive_entry_t* entry)
+{
+  archive_entry_t* existing = archive_find(archive, entry->path);
+
+  if (existing) {
+    // a later entry supersedes the earlier one, keep the slot so the hash chain stays valid
+    free(entry->path);
+    if (existing->info.name) {
+      free((void*)existing->info.name);
+    }
+    if (existing->info.comment) {
+      free((void*)existing->info.comment);
+    }
+    existing->info = entry->info;
+    existing->offset = entry->offset;
+    existing->bodyOffset = entry->bodyOffset;
+    existing->placeholder = entry->placeholder;
+    free(entry);
+    return existing;
+  }
+
+  if (archive->count >= archive->capacity) {
+    archive->capacity = archive->capacity ? archive->capacity*2 : 1024;
+    archive->entries = realloc(archive->entries, archive->capacity*sizeof(archive_entry_t*));
+    if (!archive->entries) {
+      fatalError("archive: out of memory");
+    }
+  }
+
+  archive->entries[archive->count++] = entry;
+
+  if (!archive->hash || archive->count > archive->hashSize) {
+    archive_rehash(archive);
+  } else {
+    uint32_t bucket = archive_hashPath(entry->path) & (archive->hashSize-1);
+    entry->hashNext = archive->hash[bucket];
+    archive->hash[bucket] = entry;
+  }
+
+  archive->childrenValid = 0;
+  return entry;
+}
+
+
+static char*
+archive_readString(int fd, uint64_t offset, uint32_t length)
+{
+  char* str = malloc(length+1);
+  if (!str) {
+    return 0;
+  }
+  if (length && archive_readAt(fd, offset, str, length) != 0) {
+    free(str);
+    return 0;
+  }
+  str[length] = 0;
+  return str;
+}
+
+
+static archive_entry_t*
+archive_newEntry(const char* path, const uint32_t* words, const char* comment)
+{
+  archive_entry_t* entry = calloc(1, sizeof(archive_entry_t));
+  if (!entry) {
+    fatalError("archive: out of memory");
+  }
+  entry->path = strdup(path);
+  entry->info.name = strdup(util_amigaBaseName(path));
+  entry->info.type = (int32_t)words[0];
+  entry->info.size = words[1];
+  entry->info.prot = words[2];
+  entry->info.ds.days = words[3];
+  entry->info.ds.mins = words[4];
+  entry->info.ds.ticks = words[5];
+  entry->info.comment = comment && *comment ? strdup(comment) : 0;
+  return entry;
+}
+
+
+static int
+archive_loadIndex(archive_t* archive, uint64_t fileSize)
+{
+  uint8_t footer[ARCHIVE_FOOTER_SIZE];
+
+  if (fileSize < 8+ARCHIVE_FOOTER_SIZE ||
+      archive_readAt(archive->fd, fileSize-ARCHIVE_FOOTER_SIZE, footer, sizeof(footer)) != 0 ||
+      archive_getU32(&footer[12]) != ARCHIVE_INDEX_MAGIC) {
+    return -1;
+  }
+
+  uint64_t indexOffset = ((uint64_t)archive_getU32(&footer[0]) << 32) | archive_getU32(&footer[4]);
+  uint32_t count = archive_getU32(&footer[8]);
+
+  if (indexOffset < 8 || indexOffset > fileSize-ARCHIVE_FOOTER_SIZE) {
+    return -1;
+  }
+
+  uint64_t indexLength = fileSize-ARCHIVE_FOOTER_SIZE-indexOffset;
+  uint8_t* index = malloc(indexLength ? indexLength : 1);
+  if (!index) {
+    fatalError("archive: out of memory");
+  }
+
+  if (archive_readAt(archive->fd, indexOffset, index, indexLength) != 0) {
+    free(index);
+    return -1;
+  }
+
+  uint8_t* ptr = index;
+  uint8_t* end = index+indexLength;
+  for (uint32_t i = 0; i < count; i++) {
+    if (end-ptr < ARCHIVE_INDEX_WORDS*4) {
+      free(index);
+      return -1;
+    }
+    uint32_t words[ARCHIVE_INDEX_WORDS];
+    for (int w = 0; w < ARCHIVE_INDEX_WORDS; w++) {
+      words[w] = archive_getU32(ptr);
+      ptr += 4;
+    }
+    uint32_t pathLength = words[0], commentLength = words[1];
+    if ((uint64_t)(end-ptr) < (uint64_t)pathLength+commentLength) {
+      free(index);
+      return -1;
+    }
+    char* path = malloc(pathLength+1);
+    char* comment = malloc(commentLength+1);
+    if (!path || !comment) {
+      fatalError("archive: out of memory");
+    }
+    memcpy(path, ptr, pathLength);
+    path[pathLength] = 0;
+    ptr += pathLength;
+    memcpy(comment, ptr, commentLength);
+    comment[commentLength] = 0;
+    ptr += commentLength;
+
+    archive_entry_t* entry = archive_newEntry(path, &words[2], comment);
+    entry->offset = ((uint64_t)words[8] << 32) | words[9];
+    entry->bodyOffset = entry->offset + ARCHIVE_HEADER_WORDS*4 + pathLength + commentLength;
+    archive_insert(archive, entry);
+    free(path);
+    free(comment);
+  }
+
+  free(index);
+  archive->endOffset = indexOffset;
+  return 0;
+}
+
+
+static void
+archive_scan(archive_t* archive, uint64_t fileSize)
+{
+  uint64_t offset = 8;
+
+  for (;;) {
+    uint8_t header[ARCHIVE_HEADER_WORDS*4];
+    if (offset+sizeof(header) > fileSize ||
+        archive_readAt(archive->fd, offset, header, sizeof(header)) != 0 ||
+        archive_getU32(header) != ARCHIVE_ENTRY_MAGIC) {
+      break;
+    }
+
+    uint32_t words[ARCHIVE_HEADER_WORDS];
+    for (int w = 0; w < ARCHIVE_HEADER_WORDS; w++) {
+      words[w] = archive_getU32(&header[w*4]);
+    }
+
+    uint32_t pathLength = words[1], commentLength = words[2];
+    uint64_t bodyOffset = offset+sizeof(header)+pathLength+commentLength;
+    uint32_t size = (int32_t)words[3] > 0 ? 0 : words[4];
+
+    if (bodyOffset+size > fileSize) {
+      break;
+    }
+
+    char* path = archive_readString(archive->fd, offset+sizeof(header), pathLength);
+    char* comment = archive_readString(archive->fd, offset+sizeof(header)+pathLength, commentLength);
+    if (!path || !comment) {
+      if (path) {
+        free(path);
+      }
+      if (comment) {
+        free(comment);
+      }
+      break;
+    }
+
+    archive_entry_t* entry = archive_newEntry(path, &words[3], comment);
+    entry->offset = offset;
+    entry->bodyOffset = bodyOffset;
+    archive_insert(archive, entry);
+    free(path);
+    free(comment);
+
+    offset = bodyOffset+size;
+  }
+
+  archive->endOffset = offset;
+  archive->dirty = 1;
+}
+
+
+archive_t*
+archive_open(const char* filename, int writable)
+{
+  int fd = util_open(filename, writable ? O_RDWR|O_CREAT : O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+
+#ifndef _WIN32
+  if (writable) {
+    fchmod(fd, 0644);
+  }
+#endif
+
+  archive_t* archive = calloc(1, sizeof(archive_t));
+  if (!archive) {
+    close(fd);
+    return 0;
+  }
+
+  archive->fd = fd;
+  archive->writable = writable;
+
+  off_t fileSize = lseek(fd, 0, SEEK_END);
+  uint8_t header[8];
+
+  if (fileSize == 0 && writable) {
+    archive_putU32(&header[0], ARCHIVE_MAGIC);
+    archive_putU32(&header[4], ARCHIVE_VERSION);
+    if (archive_writeAt(fd, 0, header, sizeof(header)) != 0) {
+      archive_close(archive);
+      return 0;
+    }
+    archive->endOffset = sizeof(header);
+    archive->dirty = 1;
+    return archive;
+  }
+
+  if (fileSize < (off_t)sizeof(header) ||
+      archive_readAt(fd, 0, header, sizeof(header)) != 0 ||
+      archive_getU32(&header[0]) != ARCHIVE_MAGIC ||
+      archive_getU32(&header[4]) > ARCHIVE_VERSION) {
+    archive->writable = 0;
+    archive_close(archive);
+    errno = EINVAL;
+    return 0;
+  }
+
+  if (archive_loadIndex(archive, fileSize) != 0) {
+    fprintf(stderr, "%s: index missing or damaged, rebuilding from entries\n", filename);
+    archive_scan(archive, fileSize);
+  }
+
+  return archive;
+}
+
+
+static int
+archive_writeIndex(archive_t* archive)
+{
+  uint64_t offset = archive->endOffset;
+  uint32_t count = 0;
+  size_t bufferSize = 64*1024, used = 0;
+  uint8_t* buffer = malloc(bufferSize);
+
+  if (!buffer) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < archive->count; i++) {
+    archive_entry_t* entry = archive->entries[i];
+    if (entry->placeholder) {
+      continue;
+    }
+
+    uint32_t pathLength = strlen(entry->path);
+    uint32_t commentLength = entry->info.comment ? strlen(entry->info.comment) : 0;
+    size_t recordLength = ARCHIVE_INDEX_WORDS*4 + pathLength + commentLength;
+
+    if (used+recordLength > bufferSize) {
+      if (archive_writeAt(archive->fd, offset, buffer, used) != 0) {
+        free(buffer);
+        return -1;
+      }
+      offset += used;
+      used = 0;
+      if (recordLength > bufferSize) {
+        bufferSize = recordLength;
+        buffer = realloc(buffer, bufferSize);
+        if (!buffer) {
+          return -1;
+        }
+      }
+    }
+
+    uint8_t* ptr = &buffer[used];
+    uint32_t words[ARCHIVE_INDEX_WORDS] = {
+      pathLength, commentLength, entry->info.type, entry->info.size, entry->info.prot,
+      entry->info.ds.days, entry->info.ds.mins, entry->info.ds.ticks,
+      (uint32_t)(entry->offset >> 32), (uint32_t)entry->offset
+    };
+    for (int w = 0; w < ARCHIVE_INDEX_WORDS; w++) {
+      archive_putU32(ptr, words[w]);
+      ptr += 4;
+    }
+    memcpy(ptr, entry->path, pathLength);
+    ptr += pathLength;
+    if (commentLength) {
+      memcpy(ptr, entry->info.comment, commentLength);
+    }
+    used += recordLength;
+    count++;
+  }
+
+  uint8_t footer[ARCHIVE_FOOTER_SIZE];
+  archive_putU32(&footer[0], (uint32_t)(archive->endOffset >> 32));
+  archive_putU32(&footer[4], (uint32_t)archive->endOffset);
+  archive_putU32(&footer[8], count);
+  archive_putU32(&footer[12], ARCHIVE_INDEX_MAGIC);
+
+  int error = archive_writeAt(archive->fd, offset, buffer, used) != 0 ||
+    archive_writeAt(archive->fd, offset+used, footer, sizeof(footer)) != 0 ||
+    ftruncate(archive->fd, (off_t)(offset+used+sizeof(footer))) != 0;
+
+  free(buffer);
+  return error ? -1 : 0;
+}
+
+
+// gives a forked process its own file offset into a read-only archive
+int
+archive_reopen(archive_t* archive, const char* filename)
+{
+  int fd = util_open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (archive->fd >= 0) {
+    close(archive->fd);
+  }
+  archive->fd = fd;
+  return 0;
+}
+
+
+void
+archive_close(archive_t* archive)
+{
+  if (!archive) {
+    return;
+  }
+
+  if (archive->writable && archive->dirty) {
+    if (archive_writeIndex(archive) != 0) {
+      fprintf(stderr, "archive: failed to write index\n");
+    }
+  }
+
+  if (archive->fd >= 0) {
+    close(archive->fd);
+  }
+
+  for (uint32_t i = 0; i < archive->count; i++) {
+    archive_freeEntry(archive->entries[i]);
+  }
+
+  if (archive->pending) {
+    archive_freeEntry(archive->pending);
+  }
+
+  if (archive->entries) {
+    free(archive->entries);
+  }
+
+  if (archive->hash) {
+    free(archive->hash);
+  }
+
+  free(archive);
+}
+
+
+static void
+archive_buildChildren(archive_t* archive)
+{
+  char parent[PATH_MAX];
+
+  for (uint32_t i = 0; i < archive->count; i++) {
+    archive->entries[i]->children = 0;
+    archive->entries[i]->childNext = 0;
+  }
+
+  // placeholders may be appended while we walk, so re-check count each time round
+  for (uint32_t i = 0; i < archive->count; i++) {
+    archive_entry_t* entry = archive->entries[i];
+    if (!archive_parentPath(entry->path, parent, sizeof(parent))) {
+      continue;
+    }
+    archive_entry_t* dir = archive_find(archive, parent);
+    if (!dir) {
+      uint32_t words[6] = {1, 0, 0, 0, 0, 0};
+      dir = archive_newEntry(parent, words, 0);
+      dir->placeholder = 1;
+      dir = archive_insert(archive, dir);
+    }
+    entry->childNext = dir->children;
+    dir->children = entry;
+  }
+
+  archive->childrenValid = 1;
+}
+
+
+archive_entry_t*
+archive_children(archive_t* archive, const char* path)
+{
+  if (!archive->childrenValid) {
+    archive_buildChildren(archive);
+  }
+
+  archive_entry_t* dir = archive_find(archive, path);
+  return dir ? dir->children : 0;
+}
+
+
+int
+archive_beginEntry(archive_t* archive, dir_entry_t* info, const char* path)
+{
+  if (!archive->writable) {
+    return -1;
+  }
+
+  if (archive->pending) {
+    archive_freeEntry(archive->pending);
+  }
+
+  uint32_t words[6] = {info->type, info->size, info->prot, info->ds.days, info->ds.mins, info->ds.ticks};
+  archive_entry_t* entry = archive_newEntry(path, words, info->comment);
+  uint32_t pathLength = strlen(entry->path);
+  uint32_t commentLength = entry->info.comment ? strlen(entry->info.comment) : 0;
+
+  entry->offset = archive->endOffset;
+  entry->bodyOffset = entry->offset + ARCHIVE_HEADER_WORDS*4 + pathLength + commentLength;
+  archive->pending = entry;
+  archive->dirty = 1;
+
+  uint8_t header[ARCHIVE_HEADER_WORDS*4];
+  uint32_t headerWords[ARCHIVE_HEADER_WORDS] = {
+    ARCHIVE_ENTRY_MAGIC, pathLength, commentLength, entry->info.type, entry->info.size,
+    entry->info.prot, entry->info.ds.days, entry->info.ds.mins, entry->info.ds.ticks
+  };
+  for (int w = 0; w < ARCHIVE_HEADER_WORDS; w++) {
+    archive_putU32(&header[w*4], headerWords[w]);
+  }
+
+  if (archive_writeAt(archive->fd, entry->offset, header, sizeof(header)) != 0 ||
+      write(archive->fd, entry->path, pathLength) != (ssize_t)pathLength ||
+      (commentLength && write(archive->fd, entry->info.comment, commentLength) != (ssize_t)commentLength)) {
+    return -1;
+  }
+
+  // the body is written by the caller at the current file position
+  return 0;
+}
+
+
+int
+archive_endEntry(archive_t* archive, uint32_t size)
+{
+  archive_entry_t* entry = archive->pending;
+  if (!entry) {
+    return -1;
+  }
+
+  archive->pending = 0;
+
+  if (entry->info.type < 0 && size != entry->info.size) {
+    uint8_t word[4];
+    archive_putU32(word, size);
+    if (archive_writeAt(archive->fd, entry->offset+4*4, word, sizeof(word)) != 0) {
+      archive_freeEntry(entry);
+      return -1;
+    }
+    entry->info.size = size;
+  }
+
+  archive->endOffset = entry->bodyOffset + (entry->info.type < 0 ? entry->info.size : 0);
+  archive_insert(archive, entry)->seen = 1;
+  return 0;
+}
+
+
+int
+archive_readBody(archive_t* archive, archive_entry_t* entry)
+{
+  if (lseek(archive->fd, (off_t)entry->bodyOffset, SEEK_SET) == (off_t)-1) {
+    return -1;
+  }
+  return 0;
+}
+
+
+static int
+archive_isUnder(const char* path, const char* root)
+{
+  size_t rootLength = strlen(root);
+  if (strncmp(path, root, rootLength) != 0) {
+    return 0;
+  }
+  if (rootLength && root[rootLength-1] == ':') {
+    return path[rootLength] != 0;
+  }
+  return path[rootLength] == '/';
+}
+
+
+void
+archive_markSeen(archive_t* archive, const char* path)
+{
+  // marks the whole subtree so skipped directories survive a prune
+  for (uint32_t i = 0; i < archive->count; i++) {
+    archive_entry_t* entry = archive->entries[i];
+    if (strcmp(entry->path, path) == 0 || archive_isUnder(entry->path, path)) {
+      entry->seen = 1;
+    }
+  }
+}
+
+
+uint32_t
+archive_pruneUnseen(archive_t* archive, const char* root)
+{
+  uint32_t removed = 0, kept = 0;
+
+  for (uint32_t i = 0; i < archive->count; i++) {
+    archive_entry_t* entry = archive->entries[i];
+    if (!entry->seen && !entry->placeholder && archive_isUnder(entry->path, root)) {
+      printf("%c[31m%s \xF0\x9F\x92\x80\xF0\x9F\x92\x80\xF0\x9F\x92\x80 REMOVED \xF0\x9F\x92\x80\xF0\x9F\x92\x80\xF0\x9F\x92\x80%c[0m\n", 27, entry->path, 27); // red, utf-8 skulls
+      archive_freeEntry(entry);
+      removed++;
+    } else {
+      archive->entries[kept++] = entry;
+    }
+  }
+
+  if (removed) {
+    archive->count = kept;
+    archive->dirty = 1;
+    archive->childrenValid = 0;
+    archive_rehash(archive);
+  }
+
+  return removed;
+}
+
+
+void
+archive_cleanup(void)
+{
+  if (archive_main_archive) {
+    archive_close(archive_main_archive);
+    archive_main_archive = 0;
+  }
+
+  if (archive_copyBuffer) {
+    free(archive_copyBuffer);
+    archive_copyBuffer = 0;
+  }
+}
+
+
+static int
+archive_comparePaths(const void* a, const void* b)
+{
+  return strcmp((*(archive_entry_t**)a)->path, (*(archive_entry_t**)b)->path);
+}
+
+
+static int
+archive_selected(archive_entry_t* entry, const char* prefix)
+{
+  if (entry->placeholder) {
+    return 0;
+  }
+  if (!prefix) {
+    return 1;
+  }
+  return strcmp(entry->path, prefix) == 0 || archive_isUnder(entry->path, prefix);
+}
+
+
+static char*
+archive_localPath(const char* path)
+{
+  // mirror the layout squirt_backup produces: each path component becomes a safe local name
+  char* local = calloc(1, 1);
+  size_t length = 0;
+  char* component = strdup(path);
+  char* ptr = component;
+
+  if (!local || !component) {
+    fatalError("archive: out of memory");
+  }
+
+  while (*ptr) {
+    char* end = ptr;
+    while (*end && *end != ':' && *end != '/') {
+      end++;
+    }
+    char separator = *end;
+    if (separator == ':') {
+      end++;
+    }
+    char save = *end;
+    *end = 0;
+    // util_safeName() can make a component longer
+    char* safe = util_safeName(ptr);
+    if (!safe || !(local = realloc(local, length + strlen(safe) + strlen(ARCHIVE_PATH_SEPARATOR) + 1))) {
+      fatalError("archive: out of memory");
+    }
+    length += sprintf(local+length, "%s%s", safe, ARCHIVE_PATH_SEPARATOR);
+    free(safe);
+    *end = save;
+    if (*end == '/') {
+      end++;
+    }
+    ptr = end;
+  }
+
+  free(component);
+  return local;
+}
+
+
+static void
+archive_extractEntry(archive_t* archive, archive_entry_t* entry)
+{
+  char parent[PATH_MAX];
+  char* cwd = getcwd(0, 0);
+
+  if (archive_parentPath(entry->path, parent, sizeof(parent))) {
+    char* localDir = archive_localPath(parent);
+    util_mkpath(localDir);
+    if (chdir(localDir) != 0) {
+      fatalError("unable to chdir to %s", localDir);
+    }
+    free(localDir);
+  }
+
+  char* safe = util_safeName(entry->info.name);
+
+  if (entry->info.type > 0) {
+    util_mkdir(safe, 0777);
+  } else {
+    int fd = open(safe, O_WRONLY|O_CREAT|O_TRUNC|_O_BINARY, 0777);
+    if (fd < 0) {
+      fatalError("failed to create %s", entry->path);
+    }
+
+    if (archive_readBody(archive, entry) != 0) {
+      fatalError("failed to read %s", entry->path);
+    }
+
+    uint32_t remaining = entry->info.size;
+    while (remaining > 0) {
+      int length = remaining > (uint32_t)BLOCK_SIZE ? BLOCK_SIZE : (int)remaining;
+      if (read(archive->fd, archive_copyBuffer, length) != length) {
+        fatalError("failed to read %s", entry->path);
+      }
+      if (write(fd, archive_copyBuffer, length) != length) {
+        fatalError("failed to write %s", entry->path);
+      }
+      remaining -= length;
+    }
+    close(fd);
+  }
+
+  exall_saveExAllData(&entry->info, entry->path);
+  printf("\xE2\x9C\x85 %s\n", entry->path); // utf-8 tick
+
+  free(safe);
+  if (chdir(cwd) != 0) {
+    fatalError("failed to cd to %s", cwd);
+  }
+  free(cwd);
+}
+
+
+_Noreturn static void
+archive_usage(void)
+{
+  fatalError("invalid arguments\nusage: %s list|extract archive_file [path]", main_argv0);
+}
+
+
+void
+archive_main(int argc, char* argv[])
+{
+  if (argc < 3 || argc > 4) {
+    archive_usage();
+  }
+
+  const char* command = argv[1];
+  const char* prefix = argc == 4 ? argv[3] : 0;
+  int extract = 0;
+
+  if (strcmp(command, "extract") == 0) {
+    extract = 1;
+  } else if (strcmp(command, "list") != 0) {
+    archive_usage();
+  }
+
+  archive_main_archive = archive_open(argv[2], 0);
+  if (!archive_main_archive) {
+    fatalError("unable to open archive %s", argv[2]);
+  }
+
+  archive_t* archive = archive_main_archive;
+  archive_entry_t** sorted = malloc(sizeof(archive_entry_t*)*(archive->count+1));
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < archive->count; i++) {
+    if (archive_selected(archive->entries[i], prefix)) {
+      sorted[count++] = archive->entries[i];
+    }
+  }
+  qsort(sorted, count, sizeof(archive_entry_t*), archive_comparePaths);
+
+  if (extract) {
+    archive_copyBuffer = malloc(BLOCK_SIZE);
+    // children first so directory datestamps are applied after their contents are written
+    for (uint32_t i = count; i > 0; i--) {
+      archive_extractEntry(archive, sorted[i-1]);
+    }
+  } else {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      dir_entry_t* info = &sorted[i]->info;
+      dir_printProtectFlags(info);
+      printf(" %12s %s %s%c", util_formatNumber(info->size), dir_formatDateTime(info), sorted[i]->path, info->type > 0 ? '/' : ' ');
+      if (info->comment) {
+        printf(" (%s)", info->comment);
+      }
+      printf("\n");
+      if (info->type < 0) {
+        total += info->size;
+      }
+    }
+    printf("%s entries, ", util_formatNumber(count));
+    printf("%s bytes\n", util_formatNumber(total));
+  }
+
+  free(sorted);
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include "dir.h"
+
+#define ARCHIVE_MAGIC        0x53514152 // SQAR
+#define ARCHIVE_ENTRY_MAGIC  0x5351454E // SQEN
+#define ARCHIVE_INDEX_MAGIC  0x53514958 // SQIX
+#define ARCHIVE_VERSION      1
+
+typedef struct archive_entry {
+  char* path;
+  dir_entry_t info;
+  uint64_t offset;      // offset of the entry header
+  uint64_t bodyOffset;  // offset of the file body
+  int seen;
+  int placeholder;     // implied parent directory, never written to the index
+  struct archive_entry* hashNext;
+  struct archive_entry* childNext;
+  struct archive_entry* children;
+} archive_entry_t;
+
+typedef struct {
+  int fd;
+  int writable;
+  int dirty;
+  uint64_t endOffset;
+  uint32_t count;
+  uint32_t capacity;
+  archive_entry_t** entries;
+  archive_entry_t** hash;
+  uint32_t hashSize;
+  int childrenValid;
+  archive_entry_t* pending;
+} archive_t;
+
+archive_t*
+archive_open(const char* filename, int writable);
+
+void
+archive_close(archive_t* archive);
+
+int
+archive_reopen(archive_t* archive, const char* filename);
+
+archive_entry_t*
+archive_find(archive_t* archive, const char* path);
+
+archive_entry_t*
+archive_children(archive_t* archive, const char* path);
+
+int
+archive_beginEntry(archive_t* archive, dir_entry_t* info, const char* path);
+
+int
+archive_endEntry(archive_t* archive, uint32_t size);
+
+int
+archive_readBody(archive_t* archive, archive_entry_t* entry);
+
+void
+archive_markSeen(archive_t* archive, const char* path);
+
+uint32_t
+archive_pruneUnseen(archive_t* archive, const char* root);
+
+const char*
+archive_parentPath(const char* path, char* buffer, int bufferSize);
+
+void
+archive_cleanup(void);
+
+void
+archive_main(int argc, char* argv[]);
@@ -16,6 +16,7 @@
 #include "common.h"
 #include "exall.h"
 #include "crc32.h"
+#include "archive.h"
 
 static void
 backup_backupDir(const char* dir);
@@ -27,6 +28,7 @@ static char* backup_skipFile = 0;
 static char* backup_dirBuffer = 0;
 static int backup_prune = 0;
 static int backup_crcVerify = 0;
+static archive_t* backup_archive = 0;
 
 void
 backup_cleanup(void)
@@ -45,6 +47,12 @@ backup_cleanup(void)
     free(backup_dirBuffer);
     backup_dirBuffer = 0;
   }
+
+  if (backup_archive) {
+    // writes the index, so an interrupted backup still leaves a usable archive
+    archive_close(backup_archive);
+    backup_archive = 0;
+  }
 }
 
 
@@ -223,6 +231,49 @@ backup_doCrcVerify(const char* path)
   return error;
 }
 
+static int
+backup_archiveIdentical(dir_entry_t* entry, const char* path)
+{
+  archive_entry_t* archived = archive_find(backup_archive, path);
+
+  if (archived && exall_identicalExAllData(&archived->info, entry)) {
+    archived->seen = 1;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static void
+backup_archiveFile(dir_entry_t* entry, const char* path, const char* updateMessage)
+{
+  uint32_t protect;
+
+  if (archive_beginEntry(backup_archive, entry, path) != 0) {
+    fatalError("failed to write archive entry for %s", path);
+  }
+
+  int32_t length = squirt_suckFileToFd(path, entry, backup_archive->fd, updateMessage, restore_printProgress, &protect);
+
+  if (length < 0 || archive_endEntry(backup_archive, length) != 0) {
+    fatalError("failed to backup %s", path);
+  }
+}
+
+
+static void
+backup_archiveDir(dir_entry_t* entry, const char* path)
+{
+  if (!backup_archiveIdentical(entry, path)) {
+    if (archive_beginEntry(backup_archive, entry, path) != 0 ||
+	archive_endEntry(backup_archive, 0) != 0) {
+      fatalError("failed to write archive entry for %s", path);
+    }
+  }
+}
+
+
 static void
 backup_backupList(dir_entry_list_t* list)
 {
@@ -242,7 +293,14 @@ backup_backupList(dir_entry_list_t* list)
       int skip = skipFile;
       int skipReason = 0; // 0=no skip, 1=metadata identical, 2=CRC32 verified identical
 
-      if (!skipFile) {
+      if (skipFile && backup_archive) {
+	archive_markSeen(backup_archive, path);
+      }
+
+      if (!skipFile && backup_archive) {
+	skip = backup_archiveIdentical(entry, path);
+	skipReason = skip;
+      } else if (!skipFile) {
 	dir_entry_t *temp = dir_newDirEntry();
 	struct stat st;
 	if (stat(util_amigaBaseName(path), &st) == 0) {
@@ -286,15 +344,18 @@ backup_backupList(dir_entry_list_t* list)
 	char updateMessage[PATH_MAX];
 	snprintf(updateMessage, sizeof(updateMessage), "%s saving...", path);
 
-	if (squirt_suckFile(path, updateMessage, restore_printProgress, 0, &protect) < 0) {
+	if (backup_archive) {
+	  backup_archiveFile(entry, path, updateMessage);
+	} else if (squirt_suckFileCached(path, entry, updateMessage, restore_printProgress, 0, &protect) < 0) {
 	  /*
 	    FILE* fp = fopen("skip-entry", "wb+");
 	    fprintf(fp, "%s\n", path);
 	    fclose(fp);
 	  */
 	    fatalError("failed to backup %s", path);
+	} else {
+	  exall_saveExAllData(entry, path);
 	}
-	exall_saveExAllData(entry, path);
 
 	if (backup_crcVerify) {
 	  // Always perform CRC check after download
@@ -346,9 +407,16 @@ backup_backupList(dir_entry_list_t* list)
       }
       if (!skipFile) {
 	backup_backupDir(entry->name);
-	exall_saveExAllData(entry, path);
+	if (backup_archive) {
+	  backup_archiveDir(entry, path);
+	} else {
+	  exall_saveExAllData(entry, path);
+	}
 	free((void*)path);
       } else {
+	if (backup_archive) {
+	  archive_markSeen(backup_archive, path);
+	}
 	  printf("\xF0\x9F\x9A\xAB %c[1m%s \xE2\x80\x94\xE2\x80\x94\xE2\x80\x94SKIPPED\xE2\x80\x94\xE2\x80\x94\xE2\x80\x94 %c[0m\n", 27, path, 27); // utf-8 no entry bold
 	free((void*)path);
       }
@@ -357,7 +425,7 @@ backup_backupList(dir_entry_list_t* list)
     entry = entry->next;
   }
 
-  if (backup_prune) {
+  if (backup_prune && !backup_archive) {
     util_dirOperation(".", backup_pruneFiles, list);
   }
 }
@@ -381,6 +449,10 @@ backup_pushDir(const char* dir)
     fatalError("unable to backup %s", backup_currentDir);
   }
 
+  if (backup_archive) {
+    return getcwd(0, 0);
+  }
+
   char* safe = util_safeName(dir);
   if (!safe) {
     fatalError("failed to create safe name");
@@ -469,7 +541,7 @@ backup_loadSkipFile(const char* filename, int ignoreErrors)
 _Noreturn static void
 backup_usage(void)
 {
-  fatalError("invalid arguments\nusage: %s [--crc32] [--prune] [--skipfile=skipfile] hostname dir_name", main_argv0);
+  fatalError("invalid arguments\nusage: %s [--crc32] [--prune] [--skipfile=skipfile] [--archive=archive_file] hostname dir_name", main_argv0);
 }
 
 
@@ -481,6 +553,7 @@ backup_main(int argc, char* argv[])
   const char* hostname = 0;
   char* path = 0;
   char* skipfile = 0;
+  char* archiveFile = 0;
   int argvIndex = 1;
 
   while (argvIndex < argc) {
@@ -489,6 +562,7 @@ backup_main(int argc, char* argv[])
        {"prune",    no_argument, &backup_prune, 'p'},
        {"crc32",    no_argument, &backup_crcVerify, 'c'},
        {"skipfile", required_argument, 0, 's'},
+       {"archive",  required_argument, 0, 'a'},
        {0, 0, 0, 0}
       };
     int option_index = 0;
@@ -504,6 +578,12 @@ backup_main(int argc, char* argv[])
 	}
 	skipfile = optarg;
 	break;
+      case 'a':
+	if (optarg == 0 || strlen(optarg) == 0) {
+	  backup_usage();
+	}
+	archiveFile = optarg;
+	break;
       case '?':
       default:
 	backup_usage();
@@ -530,6 +610,16 @@ backup_main(int argc, char* argv[])
     backup_skipFile = backup_loadSkipFile(".skip", 1);
   }
 
+  if (archiveFile) {
+    if (backup_crcVerify) {
+      fatalError("--crc32 is not supported with --archive");
+    }
+    backup_archive = archive_open(archiveFile, 1);
+    if (!backup_archive) {
+      fatalError("unable to open archive %s", archiveFile);
+    }
+  }
+
   util_connect(hostname);
 
   char* token = strtok(path, ":");
@@ -563,6 +653,12 @@ backup_main(int argc, char* argv[])
 
   if (dir) {
     backup_backupDir(dir);
+
+    if (backup_archive && backup_prune) {
+      char* root = backup_fullPath(dir);
+      archive_pruneUnseen(backup_archive, root);
+      free(root);
+    }
     
     // Change back to parent directory to release lock on last backed up directory
     // This prevents "object in use" errors when trying to delete the directory
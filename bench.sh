@@ -0,0 +1,202 @@
+#!/usr/bin/env bash
+#
+# Loopback benchmark: runs the client tools against squirtd_posix on 127.0.0.1 and reports
+# wall time, throughput and syscall counts for a range of file sizes and directory shapes,
+# followed by squirt_rtt's per-command latencies.
+#
+# Daemon calls are the read/write-class syscalls counted in /proc/<pid>/io (Linux only). Client syscalls
+# are counted by a second, untimed run under strace -f -c when strace is installed.
+#
+# usage: bench.sh [build_dir]
+#
+
+BUILD=$(cd "${1:-build}" && pwd)
+PORT=${SQUIRT_BENCH_PORT:-6970}
+HOST=127.0.0.1:$PORT
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/squirt_bench.XXXXXX")
+ROOT=$WORK/root
+DAEMON_PID=
+
+STRACE=
+if command -v strace >/dev/null 2>&1 && strace -f -c -o /dev/null true >/dev/null 2>&1; then
+  STRACE=strace
+fi
+
+
+cleanup()
+{
+  if [ -n "$DAEMON_PID" ]; then
+    kill "$DAEMON_PID" 2>/dev/null
+    wait "$DAEMON_PID" 2>/dev/null
+  fi
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+
+fail()
+{
+  echo "bench: $*" >&2
+  exit 1
+}
+
+
+now_ms()
+{
+  if [ -n "$EPOCHREALTIME" ]; then
+    local t=${EPOCHREALTIME/[.,]/}
+    echo $((t/1000))
+  else
+    perl -MTime::HiRes=time -e 'printf "%d\n", time*1000'
+  fi
+}
+
+
+daemon_syscalls()
+{
+  if [ -r "/proc/$DAEMON_PID/io" ]; then
+    awk '$1 == "syscr:" || $1 == "syscw:" {n += $2} END {print n}' "/proc/$DAEMON_PID/io"
+  else
+    echo -
+  fi
+}
+
+
+# make_file path size_in_kb
+make_file()
+{
+  mkdir -p "$(dirname "$1")"
+  dd if=/dev/urandom of="$1" bs=1024 count="$2" 2>/dev/null
+}
+
+
+# make_tree dir depth width files_per_dir file_kb
+make_tree()
+{
+  local dir=$1 depth=$2 width=$3 files=$4 kb=$5
+  mkdir -p "$dir"
+  for ((i = 0; i < files; i++)); do
+    make_file "$dir/file$i" "$kb"
+  done
+  if ((depth > 1)); then
+    for ((i = 0; i < width; i++)); do
+      make_tree "$dir/dir$i" $((depth-1)) "$width" "$files" "$kb"
+    done
+  fi
+}
+
+
+tree_bytes()
+{
+  find "$1" -type f -exec cat {} + | wc -c | tr -d ' '
+}
+
+
+print_header()
+{
+  printf "%-28s %10s %10s %19s %16s\n" "" "ms" "MB/s" "daemon rd/wr calls" "client syscalls"
+}
+
+
+# run label bytes setup_function command...
+run()
+{
+  local label=$1 bytes=$2 setup=$3
+  shift 3
+
+  $setup
+  local d0 t0 t1 d1
+  d0=$(daemon_syscalls)
+  t0=$(now_ms)
+  "$@" >"$WORK/out" 2>&1 || { cat "$WORK/out"; fail "$label failed"; }
+  t1=$(now_ms)
+  d1=$(daemon_syscalls)
+
+  local daemon=- client=-
+  if [ "$d0" != "-" ]; then
+    daemon=$((d1-d0))
+  fi
+
+  if [ -n "$STRACE" ]; then
+    $setup
+    $STRACE -f -c -o "$WORK/strace" "$@" >/dev/null 2>&1
+    client=$(awk '$NF == "total" {print $4}' "$WORK/strace")
+  fi
+
+  local ms=$((t1-t0)) rate=-
+  if [ "$bytes" -gt 0 ]; then
+    rate=$(awk -v b="$bytes" -v ms="$ms" 'BEGIN {printf "%.1f", ms ? b/ms/1000 : 0}')
+  fi
+
+  printf "%-28s %10d %10s %19s %16s\n" "$label" "$ms" "$rate" "$daemon" "$client"
+}
+
+
+nothing()
+{
+  :
+}
+
+
+[ -x "$BUILD/squirtd_posix" ] || fail "$BUILD/squirtd_posix not built"
+
+mkdir -p "$ROOT/work" "$WORK/local" "$WORK/down"
+
+"$BUILD/squirtd_posix" --port="$PORT" "$ROOT" work: >"$WORK/daemon.log" 2>&1 &
+DAEMON_PID=$!
+
+for ((i = 0; i < 50; i++)); do
+  "$BUILD/squirt_cwd" "$HOST" >/dev/null 2>&1 && break
+  sleep 0.1
+done
+((i < 50)) || fail "squirtd_posix didn't start, see $WORK/daemon.log"
+
+echo "squirt loopback benchmark against squirtd_posix on $HOST"
+[ -n "$STRACE" ] || echo "(strace not found, client syscalls not counted)"
+echo
+
+print_header
+
+for kb in 1 64 1024 16384; do
+  make_file "$WORK/local/f$kb" "$kb"
+  run "squirt ${kb}K" $((kb*1024)) nothing "$BUILD/squirt" "$HOST" "$WORK/local/f$kb"
+done
+
+cd "$WORK/down" || fail "no $WORK/down"
+for kb in 1 64 1024 16384; do
+  run "squirt_suck ${kb}K" $((kb*1024)) nothing "$BUILD/squirt_suck" "$HOST" "work:f$kb"
+  cmp -s "f$kb" "$WORK/local/f$kb" || fail "squirt_suck ${kb}K corrupted the file"
+done
+
+run "squirt_exec true" 0 nothing "$BUILD/squirt_exec" "$HOST" true
+
+echo
+
+# shape: depth width files_per_dir file_kb
+SHAPES="flat:1:0:256:1 wide:2:16:16:4 deep:12:1:4:16"
+
+for shape in $SHAPES; do
+  IFS=: read -r name depth width files kb <<<"$shape"
+  make_tree "$ROOT/work/$name" "$depth" "$width" "$files" "$kb"
+  bytes=$(tree_bytes "$ROOT/work/$name")
+  count=$(find "$ROOT/work/$name" -type f | wc -l | tr -d ' ')
+  backup=$WORK/backup_$name
+  mkdir -p "$backup"
+  cd "$backup" || fail "no $backup"
+
+  clean_backup() { rm -rf "$backup/work"; }
+  clean_restore() { rm -rf "$ROOT/work/${name}_restored"; }
+
+  run "squirt_dir $name" 0 nothing "$BUILD/squirt_dir" "$HOST" "work:$name"
+  run "squirt_backup $name ($count)" "$bytes" clean_backup "$BUILD/squirt_backup" "$HOST" "work:$name"
+  run "squirt_backup $name again" 0 nothing "$BUILD/squirt_backup" "$HOST" "work:$name"
+
+  rm -rf "work/${name}_restored"
+  cp -R "work/$name" "work/${name}_restored"
+  run "squirt_restore $name ($count)" "$bytes" clean_restore "$BUILD/squirt_restore" --quiet "$HOST" "work:${name}_restored"
+  run "squirt_restore $name again" 0 nothing "$BUILD/squirt_restore" --quiet "$HOST" "work:${name}_restored"
+  diff -r "$ROOT/work/$name" "$ROOT/work/${name}_restored" >/dev/null || fail "squirt_restore $name didn't match"
+done
+
+echo
+"$BUILD/squirt_rtt" --count=50 "$HOST"
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "common.h"
+
+/*
+ * Persistent content cache for files sucked from the Amiga. Each file is kept in the cache
+ * folder under a hash of its host and path, with a .key file alongside recording the host, path,
+ * size and datestamp it was sucked at. The file's listing entry, or a STAT of it, is enough to
+ * tell whether the copy is still good, so an unchanged file costs at most one round trip rather
+ * than its whole length.
+ *
+ * A hit touches the copy, and when a new file takes the cache over its size cap the copies
+ * touched longest ago are removed first. The folder is counted once per run and a running total
+ * kept after that, so it's only scanned again when the total goes over the cap. SQUIRT_CACHE_SIZE
+ * sets the cap in megabytes, 0 turns the cache off.
+ */
+
+#define CACHE_DEFAULT_SIZE_MB 64
+#define CACHE_KEY_MAX         (PATH_MAX*2)
+#define CACHE_STALE_SECONDS   (60*60)
+
+typedef struct {
+  char name[32];
+  time_t mtime;
+  off_t size;
+} cache_file_t;
+
+static int cache_tempFd = -1;
+static uint32_t cache_tempSize;
+static int64_t cache_total = -1;
+static char cache_tempPath[PATH_MAX];
+static char cache_entryPath[PATH_MAX];
+static char cache_key[CACHE_KEY_MAX];
+
+
+void
+cache_cleanup(void)
+{
+  if (cache_tempFd >= 0) {
+    close(cache_tempFd);
+    unlink(cache_tempPath);
+    cache_tempFd = -1;
+  }
+}
+
+
+static uint64_t
+cache_maxSize(void)
+{
+  const char* size = getenv("SQUIRT_CACHE_SIZE");
+  return (uint64_t)(size ? strtoul(size, 0, 10) : CACHE_DEFAULT_SIZE_MB) * 1024 * 1024;
+}
+
+
+static const char*
+cache_folder(void)
+{
+  static char folder[PATH_MAX];
+  snprintf(folder, sizeof(folder), "%s/.squirt_cache/", util_getHomeDir());
+  return folder;
+}
+
+
+// filename can be cached, it's a full path and the cache isn't turned off
+int
+cache_enabled(const char* filename)
+{
+  // relative names depend on wherever squirtd was last cd'ed
+  return cache_maxSize() > 0 && hello_hostname() && strchr(filename, ':');
+}
+
+
+// the copy's path (without .key) for filename whatever version of it's cached
+static void
+cache_entryFor(const char* filename)
+{
+  const char* host = hello_hostname();
+
+  // amiga names are case insensitive
+  snprintf(cache_key, sizeof(cache_key), "%s\n%s", host, filename);
+  for (char* p = cache_key + strlen(host) + 1; *p; p++) {
+    *p = tolower((unsigned char)*p);
+  }
+
+  // fnv-1a of the host and path
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char* p = cache_key; *p; p++) {
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+  }
+
+  snprintf(cache_entryPath, sizeof(cache_entryPath), "%s%016llx", cache_folder(), (unsigned long long)hash);
+}
+
+
+// the key the copy of the version of filename described by remote must have
+static void
+cache_makeKey(const char* filename, dir_entry_t* remote)
+{
+  cache_entryFor(filename);
+
+  size_t length = strlen(cache_key);
+  snprintf(cache_key+length, sizeof(cache_key)-length, "\n%u %u %u %u\n", remote->size, remote->ds.days, remote->ds.mins, remote->ds.ticks);
+}
+
+
+static int
+cache_keyMatches(void)
+{
+  char keyPath[PATH_MAX+4], buffer[CACHE_KEY_MAX];
+  snprintf(keyPath, sizeof(keyPath), "%s.key", cache_entryPath);
+
+  int fd = util_open(keyPath, O_RDONLY|_O_BINARY);
+  if (fd < 0) {
+    return 0;
+  }
+
+  int length = read(fd, buffer, sizeof(buffer)-1);
+  close(fd);
+
+  return length == (int)strlen(cache_key) && memcmp(buffer, cache_key, length) == 0;
+}
+
+
+// some version of filename is cached, so it's worth finding out whether it's the current one
+int
+cache_contains(const char* filename)
+{
+  char keyPath[PATH_MAX+4];
+  struct stat st;
+
+  cache_entryFor(filename);
+  snprintf(keyPath, sizeof(keyPath), "%s.key", cache_entryPath);
+  return stat(keyPath, &st) == 0;
+}
+
+
+// a descriptor for the cached copy of filename if it's the version remote describes, otherwise -1
+int
+cache_open(const char* filename, dir_entry_t* remote)
+{
+  if (remote->type >= 0) {
+    return -1;
+  }
+
+  cache_makeKey(filename, remote);
+  if (!cache_keyMatches()) {
+    return -1;
+  }
+
+  struct stat st;
+  int fd = util_open(cache_entryPath, O_RDONLY|_O_BINARY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) != 0 || st.st_size != (off_t)remote->size) {
+    close(fd);
+    return -1;
+  }
+
+  // most recently used
+  utime(cache_entryPath, 0);
+
+  return fd;
+}
+
+
+// starts caching filename as it's sucked, remote is the version being sucked. 0 if it won't be cached
+int
+cache_create(const char* filename, dir_entry_t* remote)
+{
+  cache_cleanup();
+
+  if (remote->type >= 0 || remote->size > cache_maxSize()) {
+    return 0;
+  }
+
+  cache_makeKey(filename, remote);
+  cache_tempSize = remote->size;
+
+  util_mkpath(cache_folder());
+  snprintf(cache_tempPath, sizeof(cache_tempPath), "%s%d.tmp", cache_folder(), getpid());
+
+  if ((cache_tempFd = open(cache_tempPath, O_WRONLY|O_CREAT|O_TRUNC|_O_BINARY, 0666)) < 0) {
+    return 0;
+  }
+
+  return 1;
+}
+
+
+void
+cache_write(const void* data, int length)
+{
+  if (cache_tempFd >= 0 && write(cache_tempFd, data, length) != length) {
+    // a full disk shouldn't fail the suck
+    cache_cleanup();
+  }
+}
+
+
+static int
+cache_compareAge(const void* a, const void* b)
+{
+  time_t one = ((const cache_file_t*)a)->mtime, two = ((const cache_file_t*)b)->mtime;
+  return one < two ? -1 : one > two;
+}
+
+
+static void
+cache_evict(void)
+{
+  DIR* dp = opendir(cache_folder());
+  if (!dp) {
+    return;
+  }
+
+  cache_file_t* files = 0;
+  uint32_t count = 0, capacity = 0;
+  uint64_t total = 0, maxSize = cache_maxSize();
+  struct dirent* de;
+
+  while ((de = readdir(dp)) != NULL) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s%s", cache_folder(), de->d_name);
+    if (de->d_name[0] == '.' || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    // left by a suck that was killed part way
+    if (strstr(de->d_name, ".tmp") && st.st_mtime < time(0) - CACHE_STALE_SECONDS) {
+      unlink(path);
+      continue;
+    }
+
+    // the copies are bare hashes, keys and temporary files have a .
+    if (strchr(de->d_name, '.') || strlen(de->d_name) >= sizeof(files->name)) {
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity ? capacity*2 : 64;
+      if (!(files = realloc(files, capacity*sizeof(cache_file_t)))) {
+	fatalError("out of memory");
+      }
+    }
+
+    snprintf(files[count].name, sizeof(files->name), "%s", de->d_name);
+    files[count].mtime = st.st_mtime;
+    files[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+
+  closedir(dp);
+
+  if (total > maxSize) {
+    qsort(files, count, sizeof(cache_file_t), cache_compareAge);
+    for (uint32_t i = 0; i < count && total > maxSize; i++) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s%s.key", cache_folder(), files[i].name);
+      unlink(path);
+      snprintf(path, sizeof(path), "%s%s", cache_folder(), files[i].name);
+      unlink(path);
+      total -= files[i].size;
+    }
+  }
+
+  free(files);
+  cache_total = total;
+}
+
+
+// keeps the file cache_create() started if all of it arrived, otherwise throws it away
+void
+cache_commit(int complete)
+{
+  if (cache_tempFd < 0) {
+    return;
+  }
+
+  if (!complete) {
+    cache_cleanup();
+    return;
+  }
+
+  int error = close(cache_tempFd);
+  cache_tempFd = -1;
+  if (error != 0) {
+    unlink(cache_tempPath);
+    return;
+  }
+
+  char keyPath[PATH_MAX+4], keyTempPath[PATH_MAX+4];
+  snprintf(keyPath, sizeof(keyPath), "%s.key", cache_entryPath);
+  snprintf(keyTempPath, sizeof(keyTempPath), "%s.key", cache_tempPath);
+
+  // the old key goes first so nothing can pair it with the new copy
+  struct stat old;
+  int replacing = stat(cache_entryPath, &old) == 0;
+  unlink(keyPath);
+  unlink(cache_entryPath);
+  if (replacing && cache_total >= 0) {
+    cache_total -= old.st_size;
+  }
+
+  int fd = open(keyTempPath, O_WRONLY|O_CREAT|O_TRUNC|_O_BINARY, 0666);
+  int written = fd >= 0 && write(fd, cache_key, strlen(cache_key)) == (int)strlen(cache_key);
+  if (fd >= 0 && close(fd) != 0) {
+    written = 0;
+  }
+
+  if (!written || rename(cache_tempPath, cache_entryPath) != 0 || rename(keyTempPath, keyPath) != 0) {
+    unlink(keyTempPath);
+    unlink(cache_tempPath);
+    unlink(cache_entryPath);
+    return;
+  }
+
+  if (cache_total >= 0) {
+    cache_total += cache_tempSize;
+  }
+
+  if (cache_total < 0 || (uint64_t)cache_total > cache_maxSize()) {
+    cache_evict();
+  }
+}
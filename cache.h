@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include "dir.h"
+
+void
+cache_cleanup(void);
+
+int
+cache_enabled(const char* filename);
+
+int
+cache_contains(const char* filename);
+
+int
+cache_open(const char* filename, dir_entry_t* remote);
+
+int
+cache_create(const char* filename, dir_entry_t* remote);
+
+void
+cache_write(const void* data, int length);
+
+void
+cache_commit(int complete);
@@ -10,21 +10,34 @@
 #include <time.h>
 #include <stdarg.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#ifndef FICLONE
+// from linux/fs.h, which can't be included alongside common.h's BLOCK_SIZE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
 
 #include "main.h"
 #include "common.h"
 #include "argv.h"
 #include "srl.h"
 #include "exec.h"
+#include "crc32.h"
 
 typedef struct hostfile {
   char* localFilename;
-  char* backupFilename;
+  char* backupFilename;    // reflinked copy, only where the filesystem can clone
   char** argv;
   char* remoteFilename;
   struct hostfile* next;
   dir_datestamp_t dateStamp;
   uint32_t remoteProtection;
+  int snapshot;            // the download succeeded and the fields below are valid
+  off_t size;
+  time_t mtime;
+  long mtimeNsec;
+  uint32_t crc;
 } cli_hostfile_t;
 
 // Forward declarations
@@ -35,13 +48,13 @@ static char* cli_currentDir = 0;
 static dir_entry_list_t *cli_dirEntryList = 0;
 static char* cli_readLineBase = 0;
 static char* cli_reconstructedText = 0;
+static char** cli_assigns = 0;
+static int cli_assignCount = 0;
 static int cli_isLocalCompletion = 0;  // Flag for local filesystem completion
 
 void
 cli_cleanup(void)
 {
-  srl_writeHistory();
-
   if (cli_readLineBase) {
     free(cli_readLineBase);
     cli_readLineBase = 0;
@@ -50,6 +63,15 @@ cli_cleanup(void)
   dir_freeEntryLists();
   cli_dirEntryList = 0;
 
+  if (cli_assigns) {
+    for (int i = 0; i < cli_assignCount; i++) {
+      free(cli_assigns[i]);
+    }
+    free(cli_assigns);
+    cli_assigns = 0;
+    cli_assignCount = 0;
+  }
+
   if (cli_currentDir) {
     free(cli_currentDir);
     cli_currentDir = 0;
@@ -67,6 +89,9 @@ cli_changeDir(const char* dir)
 
   cli_currentDir = malloc(strlen(dir)+1);
   strcpy(cli_currentDir, dir);
+
+  // most completions are in the current directory, have it ready
+  dir_prefetch(cli_currentDir);
   return 1;
 }
 
@@ -80,120 +105,79 @@ cli_prompt(void)
 }
 
 
-static int
-cli_compareFile(const char* one, const char* two)
+static long
+cli_mtimeNsec(struct stat* st)
 {
-  int identical = 1, fd1 = -1, fd2 = -1;
-
-  if (one == NULL && two == NULL) {
-    identical = 1;
-    goto cleanup;
-  }
-
-  if (one) {
-    fd1 = open(one, O_RDONLY|_O_BINARY);
-  }
-
-  if (two) {
-    fd2 = open(two, O_RDONLY|_O_BINARY);
-  }
-
-  if (fd1 == -1 && fd2 == -1) {
-    identical = 1;
-    goto cleanup;
-  } else if (fd1 == -1 || fd2 == -1) {
-    identical = 0;
-    goto cleanup;
-  }
-
-  unsigned char c1, c2;
-  int r1, r2;
-  do {
-    r1 = read(fd1, &c1, sizeof(c1));
-    r2 = read(fd2, &c2, sizeof(c2));
-    if (r1 != r2 || c1 != c2) {
-      identical = 0;
-      goto cleanup;
-    }
-  } while (r1 && r2);
-
- cleanup:
-
-  if (fd1 >= 0) {
-    close(fd1);
-  }
-
-  if (fd2 >= 0) {
-    close(fd2);
-  }
-
-  return identical;
+#if defined(__APPLE__)
+  return st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  (void)st;
+  return 0;
+#else
+  return st->st_mtim.tv_nsec;
+#endif
 }
 
 
 static char*
-cli_duplicateFile(const char* from)
+cli_cloneFile(const char* from)
 {
+#ifdef FICLONE
+  // a reflink costs no extra writes, so keep one for an exact comparison later
   int toLength = strlen(from) + strlen(".orig") + 1;
   char *to = malloc(toLength);
+  if (!to) {
+    return 0;
+  }
   snprintf(to, toLength, "%s.orig", from);
 
-  int fd_to, fd_from;
-  char buf[4096];
-  ssize_t nread;
-  int saved_errno;
+  int fd_from = open(from, O_RDONLY);
+  int fd_to = open(to, O_TRUNC|O_WRONLY|O_CREAT, 0666);
+  int cloned = fd_from >= 0 && fd_to >= 0 && ioctl(fd_to, FICLONE, fd_from) == 0;
 
-  fd_from = open(from, O_RDONLY|_O_BINARY);
-  if (fd_from < 0) {
-    free(to);
-    return 0;
+  if (fd_from >= 0) {
+    close(fd_from);
+  }
+  if (fd_to >= 0) {
+    close(fd_to);
   }
 
-  fd_to = open(to, O_TRUNC|O_WRONLY|O_CREAT|_O_BINARY , 0666);
-  if (fd_to < 0) {
-    goto out_error;
+  if (!cloned) {
+    unlink(to);
+    free(to);
+    return 0;
   }
 
-  while (nread = read(fd_from, buf, sizeof buf), nread > 0) {
-    char *out_ptr = buf;
-    ssize_t nwritten;
+  return to;
+#else
+  (void)from;
+  return 0;
+#endif
+}
 
-    do {
-      nwritten = write(fd_to, out_ptr, nread);
 
-      if (nwritten >= 0) {
-	nread -= nwritten;
-	out_ptr += nwritten;
-      } else if (errno != EINTR) {
-	goto out_error;
-      }
-    } while (nread > 0);
+static int
+cli_fileModified(cli_hostfile_t* file, struct stat* st)
+{
+  if (st->st_size != file->size) {
+    return 1;
   }
 
-  if (nread == 0) {
-    if (close(fd_to) < 0) {
-      fd_to = -1;
-      goto out_error;
-    }
-    close(fd_from);
-
-    /* Success! */
-    return to;
+  if (st->st_mtime == file->mtime && cli_mtimeNsec(st) == file->mtimeNsec) {
+    return 0;
   }
 
- out_error:
-  saved_errno = errno;
-
-  if (to) {
-    free(to);
+  // touched but the same size, the contents decide
+  if (file->backupFilename) {
+    return !util_compareFiles(file->localFilename, file->backupFilename);
   }
 
-  close(fd_from);
-  if (fd_to >= 0)
-    close(fd_to);
+  uint32_t crc;
+  if (crc32_sum(file->localFilename, &crc) != 0) {
+    return 1;
+  }
 
-  errno = saved_errno;
-  return 0;
+  return crc != file->crc;
 }
 
 
@@ -269,16 +253,22 @@ cli_convertFileToHost(cli_hostfile_t** list, const char* remote)
   util_mkpath(file->localFilename);
 
   memset(&file->dateStamp, 0, sizeof(file->dateStamp));
-  int error = squirt_suckFile(file->remoteFilename, 0, 0, file->localFilename, &file->remoteProtection);
+  int error = squirt_suckFileWithCrc(file->remoteFilename, file->localFilename, &file->remoteProtection, &file->crc);
   if (error == -ERROR_SUCK_ON_DIR) {
     fprintf(stderr, "error: failed to access remote directory %s\n", file->remoteFilename);
     free(file);
     return 0;
   } else {
+    struct stat st;
     if (error < 0) {
       unlink(file->localFilename);
+    } else if (stat(file->localFilename, &st) == 0) {
+      file->snapshot = 1;
+      file->size = st.st_size;
+      file->mtime = st.st_mtime;
+      file->mtimeNsec = cli_mtimeNsec(&st);
+      file->backupFilename = cli_cloneFile(file->localFilename);
     }
-    file->backupFilename = cli_duplicateFile(file->localFilename);
     if (*list) {
       cli_hostfile_t* ptr = *list;
       while (ptr->next) {
@@ -306,16 +296,14 @@ cli_saveFileIfModified(cli_hostfile_t* file)
     return 1; // Consider this "successful" - the file was intentionally removed
   }
   
-  if (!file->backupFilename) {
+  if (!file->snapshot) {
     return 1;
   }
   
-  int comparison = cli_compareFile(file->localFilename, file->backupFilename);
-  
-  if (comparison == 0) {
+  if (cli_fileModified(file, &st)) {
     success = squirt_file(file->localFilename, 0, file->remoteFilename, 1, 0) == 0;
     if (success) {
-      success = protect_file(file->remoteFilename, file->remoteProtection, 0);
+      success = protect_file(file->remoteFilename, file->remoteProtection, 0) == 0;
     }
   } else {
     success = 1; // No upload needed, but this is "successful"
@@ -755,6 +743,88 @@ cli_hostCommand(int argc, char** argv)
 }
 
 
+static int
+cli_isSimpleNamespaceArgument(const char* arg)
+{
+  static const char* keywords[] = {"all", "quiet", "force", "from", 0};
+
+  if (strpbrk(arg, "#?*()|~[]%=")) {
+    return 0;
+  }
+
+  for (int i = 0; keywords[i]; i++) {
+    if (strcasecmp(arg, keywords[i]) == 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+// delete, makedir and rename on plain names go straight to the daemon rather than
+// through a shell. Anything with wildcards or options falls back to the Amiga command.
+static int
+cli_namespaceCommand(int argc, char** argv, int* code)
+{
+  int isDelete = strcasecmp(argv[0], "delete") == 0;
+  int isMakeDir = strcasecmp(argv[0], "makedir") == 0;
+  int isRename = strcasecmp(argv[0], "rename") == 0;
+
+  if ((!isDelete && !isMakeDir && !isRename) || argc < 2) {
+    return 0;
+  }
+
+  if (isRename) {
+    const char* to;
+    if (argc == 3) {
+      to = argv[2];
+    } else if (argc == 4 && (strcasecmp(argv[2], "to") == 0 || strcasecmp(argv[2], "as") == 0)) {
+      to = argv[3];
+    } else {
+      return 0;
+    }
+
+    if (!cli_isSimpleNamespaceArgument(argv[1]) || !cli_isSimpleNamespaceArgument(to)) {
+      return 0;
+    }
+
+    *code = fsop_rename(argv[1], to);
+    if (*code) {
+      fprintf(stderr, "rename: %s failed (%s)\n", argv[1], util_getErrorString(*code));
+    }
+    return 1;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (!cli_isSimpleNamespaceArgument(argv[i])) {
+      return 0;
+    }
+  }
+
+  fsop_operation_t* operations = calloc(argc-1, sizeof(fsop_operation_t));
+  if (!operations) {
+    fatalError("malloc failed");
+  }
+
+  for (int i = 1; i < argc; i++) {
+    operations[i-1].command = isDelete ? SQUIRT_COMMAND_DELETE : SQUIRT_COMMAND_MKDIR;
+    operations[i-1].name = argv[i];
+  }
+
+  *code = fsop_batch(operations, argc-1);
+
+  for (int i = 1; i < argc; i++) {
+    if (operations[i-1].error) {
+      fprintf(stderr, "%s: %s failed (%s)\n", argv[0], argv[i], util_getErrorString(operations[i-1].error));
+    }
+  }
+
+  free(operations);
+  return 1;
+}
+
+
 static int
 cli_runCommand(char* line)
 {
@@ -882,7 +952,9 @@ cli_runCommand(char* line)
     }
     
     // Execute as regular command
-    code = exec_cmd(argc, argv);
+    if (!cli_namespaceCommand(argc, argv, &code)) {
+      code = exec_cmd(argc, argv);
+    }
   }
 
   argv_free(argv);
@@ -898,9 +970,95 @@ cli_onExit(void)
 }
 
 
+static char**
+cli_readVolumes(int* count)
+{
+  static const char* command = "volumes";
+  char** volumes = 0;
+  int capacity = 0;
+
+  *count = 0;
+
+  if (!hello_supports(SQUIRT_CAP_VOLUMES)) {
+    return 0;
+  }
+
+  if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_VOLUMES) != 0) {
+    fatalError("failed to connect to squirtd server");
+  }
+
+  if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, command) != 0) {
+    fatalError("send() command failed");
+  }
+
+  uint32_t nameLength;
+  for (int first = 1;; first = 0) {
+    if (util_recvU32(main_socketFd, &nameLength) != 0) {
+      fatalError("volumes: failed to read name length");
+    }
+
+    if (nameLength == 0xFFFFFFFF) {
+      break;
+    }
+
+    if (nameLength == 0 && first) {
+      // an older squirtd, that was the status of an unknown command
+      return 0;
+    }
+
+    char* name = util_recvLatin1AsUtf8(main_socketFd, nameLength);
+    uint32_t type;
+    if (!name || util_recvU32(main_socketFd, &type) != 0) {
+      fatalError("volumes: failed to read entry");
+    }
+
+    // the utf-8 name can be longer than the latin-1 one squirtd sent
+    size_t length = strlen(name);
+    int duplicate = 0;
+    for (int i = 0; i < *count; i++) {
+      if (strncasecmp(volumes[i], name, length) == 0 && volumes[i][length] == ':') {
+	duplicate = 1;
+      }
+    }
+
+    if (!duplicate) {
+      if (*count+1 >= capacity) {
+	capacity = capacity ? capacity*2 : 32;
+	if (!(volumes = realloc(volumes, capacity*sizeof(char*)))) {
+	  fatalError("out of memory");
+	}
+      }
+      if (!(volumes[*count] = malloc(length+2))) {
+	fatalError("out of memory");
+      }
+      sprintf(volumes[*count], "%s:", name);
+      (*count)++;
+      volumes[*count] = 0;
+    }
+
+    free(name);
+  }
+
+  uint32_t error;
+  if (util_recvU32(main_socketFd, &error) != 0) {
+    fatalError("volumes: failed to read remote status");
+  }
+
+  return volumes;
+}
+
+
 static char**
 cli_queryAmigaAssigns(int* count)
 {
+  char** volumes = cli_readVolumes(count);
+  if (volumes && *count > 0) {
+    return volumes;
+  }
+  free(volumes);
+
+  // older daemons don't have the volumes command, parse what assign and info print
+
   // Query Amiga system for actual assigns, devices, and volumes
   // This provides truly authentic completion based on real system state
   
@@ -1082,26 +1240,12 @@ cli_getAmigaAssignSuggestion(int* list_index, const char* match_text, int match_
   // Dynamic Amiga assign/device/volume detection by querying actual system
   // This provides authentic completion suggestions based on real Amiga state
   
-  // Dynamic assign/device/volume detection by querying actual Amiga system
-  static char** cached_assigns = NULL;
-  static int cached_count = 0;
-  static time_t last_cache_time = 0;
-  
-  // Refresh cache every 30 seconds or on first call
-  time_t current_time = time(NULL);
-  if (!cached_assigns || (current_time - last_cache_time) > 30) {
-    // Free previous cache
-    if (cached_assigns) {
-      for (int i = 0; i < cached_count; i++) {
-        free(cached_assigns[i]);
-      }
-      free(cached_assigns);
-    }
-    
-    // Query Amiga system for actual assigns and volumes
-    cached_assigns = cli_queryAmigaAssigns(&cached_count);
-    last_cache_time = current_time;
+  // Queried once per session, assigns and volumes rarely change while we're connected
+  if (!cli_assigns) {
+    cli_assigns = cli_queryAmigaAssigns(&cli_assignCount);
   }
+  char** cached_assigns = cli_assigns;
+  int cached_count = cli_assignCount;
   
   // Use cached results (fallback to basic list if query fails)
   const char** assigns_to_use;
@@ -1583,17 +1727,22 @@ cli_completeHook(const char* text, const char* full_command_line)
       ei--;
     }
     
-    if (cli_dirEntryList) {
-      dir_freeEntryList(cli_dirEntryList);
+    // the listing is owned by the dir cache, which needs an absolute path
+    char* key;
+    if (strchr(cli_readLineBase, ':') || !cli_currentDir) {
+      key = strdup(cli_readLineBase);
+    } else {
+      size_t length = strlen(cli_currentDir);
+      int needSlash = length && cli_currentDir[length-1] != ':' && cli_currentDir[length-1] != '/';
+      key = malloc(length + strlen(cli_readLineBase) + 2);
+      sprintf(key, "%s%s%s", cli_currentDir, needSlash ? "/" : "", cli_readLineBase);
     }
 
-    cli_dirEntryList = dir_read(cli_readLineBase);
+    cli_dirEntryList = dir_readCached(key);
+    free(key);
   } else {
     // For local completion, we don't need Amiga directory listing
-    if (cli_dirEntryList) {
-      dir_freeEntryList(cli_dirEntryList);
-      cli_dirEntryList = NULL;
-    }
+    cli_dirEntryList = NULL;
   }
   
   free(full_path);
@@ -1615,7 +1764,9 @@ cli_main(int argc, char* argv[])
 
   util_connect(argv[1]);
   util_onCtrlC(cli_onExit);
+  dir_enableCache();
 
+  history_open(util_getHistoryFile(), argv[1]);
   srl_init(cli_prompt, cli_completeHook, cli_completeGenerator);
 
   do {
@@ -1628,6 +1779,9 @@ cli_main(int argc, char* argv[])
     char* command = srl_gets();
     if (command && strlen(command)) {
       cli_runCommand(command);
+      // the command may have changed anything, check datestamps before reuse
+      dir_revalidateCache();
+      cli_dirEntryList = 0;
     }
   } while (1);
 }
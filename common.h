@@ -8,9 +8,74 @@ typedef enum {
   SQUIRT_COMMAND_SUCK,
   SQUIRT_COMMAND_DIR,
   SQUIRT_COMMAND_CWD,
-  SQUIRT_COMMAND_SET_INFO
+  SQUIRT_COMMAND_SET_INFO,
+  SQUIRT_COMMAND_MKDIR,
+  SQUIRT_COMMAND_DELETE,
+  SQUIRT_COMMAND_RENAME,
+  SQUIRT_COMMAND_BATCH,
+  SQUIRT_COMMAND_SQUIRT_WITH_INFO,
+  SQUIRT_COMMAND_STAT,
+  SQUIRT_COMMAND_VOLUMES,
+  SQUIRT_COMMAND_MEMORY,
+  SQUIRT_COMMAND_HELLO,
+  SQUIRT_COMMAND_STATS,
+  SQUIRT_COMMAND_EXEC_JOBS,
+  SQUIRT_COMMAND_CLI_FRAMED,
+  SQUIRT_COMMAND_TREE,
+  SQUIRT_COMMAND_COUNT // not a command, the number of them
 } command_t;
 
+// advertised by SQUIRT_COMMAND_HELLO, the commands a daemon from before it understands are implied
+typedef enum {
+  SQUIRT_CAP_FSOP = 1<<0,             // SQUIRT_COMMAND_MKDIR, DELETE and RENAME
+  SQUIRT_CAP_BATCH = 1<<1,
+  SQUIRT_CAP_SQUIRT_WITH_INFO = 1<<2,
+  SQUIRT_CAP_STAT = 1<<3,
+  SQUIRT_CAP_VOLUMES = 1<<4,
+  SQUIRT_CAP_MEMORY = 1<<5,
+  SQUIRT_CAP_STATS = 1<<6,
+  SQUIRT_CAP_EXEC_JOBS = 1<<7,
+  SQUIRT_CAP_CLI_FRAMED = 1<<8,
+  SQUIRT_CAP_TREE = 1<<9
+} capability_t;
+
+// the u32 words of a SQUIRT_COMMAND_STATS reply after its length, 64 bit values go high word first.
+// The number of each command served follows, SQUIRT_STATS_COMMAND_COUNT of them in command_t order
+typedef enum {
+  SQUIRT_STATS_UPTIME,           // seconds
+  SQUIRT_STATS_BYTES_IN_HI,
+  SQUIRT_STATS_BYTES_IN_LO,
+  SQUIRT_STATS_BYTES_OUT_HI,
+  SQUIRT_STATS_BYTES_OUT_LO,
+  SQUIRT_STATS_MEMORY_CURRENT,
+  SQUIRT_STATS_MEMORY_PEAK,
+  SQUIRT_STATS_CHIP_FREE,
+  SQUIRT_STATS_FAST_FREE,
+  SQUIRT_STATS_DOS_USECS_HI,     // time spent in dos.library file calls
+  SQUIRT_STATS_DOS_USECS_LO,
+  SQUIRT_STATS_SOCKET_USECS_HI,  // time spent in send() and recv(), waiting for a command doesn't count
+  SQUIRT_STATS_SOCKET_USECS_LO,
+  SQUIRT_STATS_COMMAND_COUNT,
+  SQUIRT_STATS_COMMANDS
+} stats_word_t;
+
+// SQUIRT_COMMAND_TREE is followed by records, each a u32 tree_record_t then, other than for
+// TREE_RECORD_END, a u32 length and a path below the command's folder. squirtd replies with the
+// number of records that failed, then a u32 record number and error for each of the first
+// TREE_MAX_FAILURES of them
+typedef enum {
+  TREE_RECORD_END,
+  TREE_RECORD_DIR,   // created if it isn't there already
+  TREE_RECORD_FILE,  // protection, days, mins and ticks, a u32 length and comment, a u32 size and the data
+  TREE_RECORD_INFO   // protection, days, mins and ticks, a u32 length and comment
+} tree_record_t;
+
+typedef enum {
+  SQUIRT_VOLUME_DEVICE,
+  SQUIRT_VOLUME_ASSIGN,
+  SQUIRT_VOLUME_VOLUME
+} volume_type_t;
+
 typedef enum {
   _ERROR_SUCCESS,
   ERROR_EXEC_FAILED,
@@ -26,7 +91,32 @@ typedef enum {
   ERROR_FATAL_CREATE_FILE_FAILED,
   ERROR_FATAL_FILE_WRITE_FAILED,
   ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE,
+
+  // new codes go here, the numbers above are what older squirtds send
+  ERROR_MKDIR_FAILED,
+  ERROR_DELETE_FAILED,
+  ERROR_RENAME_FAILED,
+  ERROR_SET_COMMENT_FAILED,
+  ERROR_CREATE_FILE_FAILED,  // unlike the fatal ones, only the file failed and the connection carries on
+  ERROR_FILE_WRITE_FAILED,
 } _error_t;
 
+// a fatal error ends the connection
+#define ERROR_IS_FATAL(error) ((error) >= ERROR_FATAL_ERROR && (error) <= ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE)
+
 static const int BLOCK_SIZE = 8192;
 static const int NETWORK_PORT = 6969;
+static const int STAT_LENGTH = 24; // type, size, protection and datestamp, all u32
+static const int MEMORY_LENGTH = 8; // bytes allocated now and at the peak, both u32
+static const int HELLO_LENGTH = 8; // protocol version and capabilities, both u32
+static const int SQUIRT_PROTOCOL_VERSION = 1;
+
+// SQUIRT_COMMAND_CLI_FRAMED output comes in frames of a u32 length and the output
+static const uint32_t EXEC_FRAME_END = 0xFFFFFFFF; // in place of a length, the command's return code follows
+
+// SQUIRT_COMMAND_EXEC_JOBS output comes in frames of a u32 job number, a u32 length and the output
+static const uint32_t EXEC_JOB_EXITED = 0xFFFFFFFF; // in place of a length, the job's return code follows
+static const uint32_t EXEC_JOBS_DONE = 0xFFFFFFFF; // in place of a job number, the status follows
+static const int32_t EXEC_JOB_NOT_STARTED = -1; // the return code of a job that couldn't be run
+static const uint32_t EXEC_MAX_JOBS = 8; // how many run at once
+static const uint32_t TREE_MAX_FAILURES = 64;
@@ -8,12 +8,6 @@
 #include <stdio.h>
 #endif
 
-typedef struct crc32ctx
-{
-  uint32_t crc;
-  uint32_t length;
-} crc32_ctx_t;
-
 static const uint32_t crctab[256] = {
     0x0,
     0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b,
@@ -71,7 +65,7 @@ static const uint32_t crctab[256] = {
 
 #define COMPUTE(var, ch)  (var) = (var) << 8 ^ crctab[(var) >> 24 ^ (ch)]
 
-static void
+void
 crc32_init(crc32_ctx_t* ctx)
 {
   ctx->crc = 0;
@@ -79,15 +73,21 @@ crc32_init(crc32_ctx_t* ctx)
 }
 
 
-static void
-crc32_computeUint8(crc32_ctx_t* ctx, uint8_t data)
+void
+crc32_computeBlock(crc32_ctx_t* ctx, const uint8_t* data, int length)
 {
-  COMPUTE(ctx->crc, data);
-  ctx->length++;
+  uint32_t crc = ctx->crc;
+
+  ctx->length += length;
+  while (length--) {
+    COMPUTE(crc, *data++);
+  }
+
+  ctx->crc = crc;
 }
 
 
-static void
+void
 crc32_finilize(crc32_ctx_t* ctx)
 {
   uint32_t len = ctx->length;
@@ -97,7 +97,11 @@ crc32_finilize(crc32_ctx_t* ctx)
   ctx->crc = ~ctx->crc;
 }
 
+#ifdef AMIGA
 static char buffer[4096];
+#else
+static char buffer[64*1024];
+#endif
 
 int
 crc32_sum(const char* filename, uint32_t *outCrc)
@@ -124,10 +128,7 @@ crc32_sum(const char* filename, uint32_t *outCrc)
 #else
   while((len = fread(buffer, 1, sizeof(buffer), fp))) {
 #endif
-    char* ptr = buffer;
-    while (len--) {
-      crc32_computeUint8(&crc, *ptr++);
-    }
+    crc32_computeBlock(&crc, (uint8_t*)buffer, len);
   }
 
   crc32_finilize(&crc);
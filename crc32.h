@@ -1,6 +1,21 @@
 #pragma once
 #include <stdint.h>
 
+typedef struct crc32ctx
+{
+  uint32_t crc;
+  uint32_t length;
+} crc32_ctx_t;
+
+void
+crc32_init(crc32_ctx_t* ctx);
+
+void
+crc32_computeBlock(crc32_ctx_t* ctx, const uint8_t* data, int length);
+
+void
+crc32_finilize(crc32_ctx_t* ctx);
+
 int
 crc32_sum(const char* filename, uint32_t *outCrc);
 
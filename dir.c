@@ -6,12 +6,37 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
 #include <sys/stat.h>
 
 #include "main.h"
 #include "common.h"
 
+#define DIR_CACHE_BUCKETS 256
+
+typedef struct dir_cache_entry {
+  char* path;
+  dir_entry_list_t* list;
+  int busy;          // being walked by dir_process(), freed once it's done
+  int stale;
+  int haveDateStamp; // the directory's own datestamp when it was listed
+  dir_datestamp_t ds;
+  int checked;       // known current, no datestamp check needed before use
+  struct dir_cache_entry* next;
+} dir_cache_entry_t;
+
 static dir_entry_list_t* dir_entryLists = 0;
+static int dir_cacheEnabled = 0;
+static dir_cache_entry_t* dir_cache[DIR_CACHE_BUCKETS];
+static uint32_t dir_listings = 0;
+static uint32_t dir_cacheHits = 0;
+static int dir_prefetchStat = 0;
+static char* dir_prefetchPath = 0;
+static int dir_prefetchListing = 0;
+static dir_entry_list_t* dir_uncachedList = 0;
+
+static void
+dir_flushCache(void);
 
 
 dir_entry_list_t*
@@ -38,7 +63,20 @@ dir_newEntryList(void)
 void
 dir_cleanup(void)
 {
+  dir_flushCache();
+  dir_cacheEnabled = 0;
+  dir_listings = dir_cacheHits = 0;
+
+  if (dir_prefetchPath) {
+    util_setBeforeCommand(0);
+    free(dir_prefetchPath);
+    dir_prefetchPath = 0;
+  }
 
+  if (dir_uncachedList) {
+    dir_freeEntryList(dir_uncachedList);
+    dir_uncachedList = 0;
+  }
 }
 
 
@@ -109,8 +147,8 @@ dir_freeEntryLists(void)
 }
 
 
-void
-dir_freeEntryList(dir_entry_list_t* list)
+static void
+dir_unlinkEntryList(dir_entry_list_t* list)
 {
   dir_entry_list_t* ptr = dir_entryLists;
   while (ptr) {
@@ -129,6 +167,13 @@ dir_freeEntryList(dir_entry_list_t* list)
     ptr = ptr->next;
   }
 
+  list->next = list->prev = 0;
+}
+
+
+static void
+dir_freeEntries(dir_entry_list_t* list)
+{
   dir_entry_t* entry = list->head;
 
   while (entry) {
@@ -141,7 +186,152 @@ dir_freeEntryList(dir_entry_list_t* list)
 }
 
 
+void
+dir_freeEntryList(dir_entry_list_t* list)
+{
+  dir_unlinkEntryList(list);
+  dir_freeEntries(list);
+}
+
+
+static uint32_t
+dir_cacheHash(const char* path, size_t length)
+{
+  // AmigaDOS names are case insensitive
+  uint32_t hash = 5381;
+  for (size_t i = 0; i < length; i++) {
+    hash = hash*33 + (uint8_t)tolower((uint8_t)path[i]);
+  }
+  return hash % DIR_CACHE_BUCKETS;
+}
+
+
+static size_t
+dir_cacheKeyLength(const char* path)
+{
+  size_t length = strlen(path);
+  while (length > 1 && path[length-1] == '/') {
+    length--;
+  }
+  return length;
+}
+
+
+static dir_cache_entry_t**
+dir_cacheFind(const char* path, size_t length)
+{
+  dir_cache_entry_t** ptr = &dir_cache[dir_cacheHash(path, length)];
+
+  while (*ptr) {
+    if (strlen((*ptr)->path) == length && strncasecmp((*ptr)->path, path, length) == 0) {
+      break;
+    }
+    ptr = &(*ptr)->next;
+  }
+
+  return ptr;
+}
+
+
+static void
+dir_cacheFree(dir_cache_entry_t* entry)
+{
+  dir_freeEntries(entry->list);
+  free(entry->path);
+  free(entry);
+}
+
+
 static void
+dir_cacheRemove(dir_cache_entry_t** ptr)
+{
+  dir_cache_entry_t* entry = *ptr;
+  *ptr = entry->next;
+  if (entry->busy) {
+    entry->stale = 1;
+  } else {
+    dir_cacheFree(entry);
+  }
+}
+
+
+static void
+dir_flushCache(void)
+{
+  for (int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+    while (dir_cache[i]) {
+      dir_cacheRemove(&dir_cache[i]);
+    }
+  }
+}
+
+
+void
+dir_enableCache(void)
+{
+  dir_cacheEnabled = 1;
+}
+
+
+static void
+dir_invalidateSubtree(const char* path, size_t length)
+{
+  for (int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+    dir_cache_entry_t** ptr = &dir_cache[i];
+    while (*ptr) {
+      const char* cached = (*ptr)->path;
+      if (strncasecmp(cached, path, length) == 0 && (cached[length] == 0 || cached[length] == '/')) {
+	dir_cacheRemove(ptr);
+      } else {
+	ptr = &(*ptr)->next;
+      }
+    }
+  }
+}
+
+
+void
+dir_invalidate(const char* path)
+{
+  if (!strchr(path, ':')) {
+    // relative to wherever the daemon was last cd'ed, so we can't tell which listing changed
+    dir_flushCache();
+    return;
+  }
+
+  size_t length = dir_cacheKeyLength(path);
+
+  // the object itself and anything under it, in case it was a directory
+  if (path[length-1] != ':') {
+    dir_invalidateSubtree(path, length);
+  }
+
+  // and the listing it appears in
+  size_t parentLength = length;
+  while (parentLength > 0 && path[parentLength-1] != '/' && path[parentLength-1] != ':') {
+    parentLength--;
+  }
+  if (parentLength > 0 && path[parentLength-1] == '/') {
+    parentLength--;
+  }
+  if (parentLength > 0 && parentLength < length) {
+    dir_cache_entry_t** ptr = dir_cacheFind(path, parentLength);
+    if (*ptr) {
+      dir_cacheRemove(ptr);
+    }
+  }
+}
+
+
+void
+dir_getListingStats(uint32_t* listings, uint32_t* cacheHits)
+{
+  *listings = dir_listings;
+  *cacheHits = dir_cacheHits;
+}
+
+
+void
 dir_printProtectFlags(dir_entry_t* entry)
 {
   char bits[] = {'d', 'e', 'w', 'r', 'a', 'p', 's', 'h'};
@@ -174,6 +364,35 @@ dir_formatDateTime(dir_entry_t* entry)
 }
 
 
+// Amiga clocks keep local time, the inverse of exall.c's conversion
+void
+dir_localDateStamp(time_t time, dir_datestamp_t* ds)
+{
+  struct tm* tm = localtime(&time);
+
+  // days since 1970-01-01 of the local date
+  int y = tm->tm_year + 1900 - (tm->tm_mon < 2);
+  int era = y / 400;
+  int yoe = y - era * 400;
+  int mp = (tm->tm_mon + 10) % 12;
+  int doy = (153 * mp + 2) / 5 + tm->tm_mday - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int days = era * 146097 + doe - 719468;
+
+  ds->days = days - DIR_AMIGA_EPOC_ADJUSTMENT_DAYS;
+  ds->mins = tm->tm_hour * 60 + tm->tm_min;
+  ds->ticks = tm->tm_sec * 50;
+}
+
+
+uint32_t
+dir_localProtection(uint32_t mode)
+{
+  // the low bits deny, a read only file can't be written or deleted on the Amiga either
+  return (mode & S_IWUSR) ? 0 : DIR_PROTECTION_WRITE_DELETE;
+}
+
+
 static void
 squirt_dirPrintEntryList( dir_entry_list_t* list)
 {
@@ -278,8 +497,8 @@ dir_getDirEntry(dir_entry_list_t* entryList)
 }
 
 
-dir_entry_list_t*
-dir_read(const char* command)
+static void
+dir_sendRequest(const char* command)
 {
   if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_DIR) != 0) {
     fatalError("failed to connect to squirtd server %d", main_socketFd);
@@ -289,6 +508,13 @@ dir_read(const char* command)
     fatalError("send() command failed");
   }
 
+  dir_listings++;
+}
+
+
+static dir_entry_list_t*
+dir_recvListing(const char* command)
+{
   uint32_t more;
   dir_entry_list_t *entryList = dir_newEntryList();
   do {
@@ -306,26 +532,306 @@ dir_read(const char* command)
     entryList = 0;
   }
 
-  dir_cleanup();
-
   return entryList;
 }
 
 
+dir_entry_list_t*
+dir_read(const char* command)
+{
+  trace_span_t span;
+
+  trace_begin(&span);
+  dir_sendRequest(command);
+  dir_entry_list_t* list = dir_recvListing(command);
+  trace_end(&span, "dir", command);
+
+  return list;
+}
+
+
+// the STAT can go out with another request and be read with dir_recvStat() before its reply
+void
+dir_sendStat(const char* path)
+{
+  if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_STAT) != 0) {
+    fatalError("failed to connect to squirtd server");
+  }
+
+  if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, path) != 0) {
+    fatalError("send() name failed");
+  }
+}
+
+
+uint32_t
+dir_recvStat(dir_entry_t* entry)
+{
+  uint32_t length;
+
+  if (util_recvU32(main_socketFd, &length) != 0) {
+    fatalError("stat: failed to read remote status");
+  }
+
+  if (length == 0) {
+    // only the status of an unknown command, hello_supports() should have caught that
+    return ERROR_FATAL_ERROR;
+  }
+
+  uint32_t words[6], error;
+  for (int i = 0; i < 6; i++) {
+    if (util_recvU32(main_socketFd, &words[i]) != 0) {
+      fatalError("stat: failed to read remote status");
+    }
+  }
+
+  if (util_recvU32(main_socketFd, &error) != 0) {
+    fatalError("stat: failed to read remote status");
+  }
+
+  entry->type = (int32_t)words[0];
+  entry->size = words[1];
+  entry->prot = words[2];
+  entry->ds.days = words[3];
+  entry->ds.mins = words[4];
+  entry->ds.ticks = words[5];
+
+  return error;
+}
+
+
+int
+dir_stat(const char* path, dir_entry_t* entry)
+{
+  if (!hello_supports(SQUIRT_CAP_STAT)) {
+    return ERROR_FATAL_ERROR;
+  }
+
+  dir_sendStat(path);
+  return dir_recvStat(entry);
+}
+
+
+static int
+dir_sameDateStamp(dir_datestamp_t* a, dir_datestamp_t* b)
+{
+  return a->days == b->days && a->mins == b->mins && a->ticks == b->ticks;
+}
+
+
+static dir_cache_entry_t*
+dir_cacheStore(const char* command, dir_entry_list_t* entryList, dir_datestamp_t* ds)
+{
+  size_t length = dir_cacheKeyLength(command);
+  dir_cache_entry_t* cached = calloc(1, sizeof(dir_cache_entry_t));
+
+  if (!cached || !(cached->path = malloc(length+1))) {
+    free(cached);
+    return 0;
+  }
+
+  memcpy(cached->path, command, length);
+  cached->path[length] = 0;
+  dir_unlinkEntryList(entryList);
+  cached->list = entryList;
+  cached->checked = 1;
+  if (ds) {
+    cached->haveDateStamp = 1;
+    cached->ds = *ds;
+  }
+
+  dir_cache_entry_t** ptr = dir_cacheFind(command, length);
+  cached->next = *ptr;
+  *ptr = cached;
+
+  return cached;
+}
+
+
+static void
+dir_completePrefetch(void)
+{
+  if (!dir_prefetchPath) {
+    return;
+  }
+
+  util_setBeforeCommand(0);
+
+  char* path = dir_prefetchPath;
+  dir_prefetchPath = 0;
+
+  dir_entry_t stat = {0};
+  uint32_t statError = dir_prefetchStat ? dir_recvStat(&stat) : ERROR_FATAL_ERROR;
+
+  if (dir_prefetchListing) {
+    dir_entry_list_t* entryList = dir_recvListing(path);
+    if (entryList && !dir_cacheStore(path, entryList, statError == 0 ? &stat.ds : 0)) {
+      dir_freeEntryList(entryList);
+    }
+  } else {
+    dir_cache_entry_t** ptr = dir_cacheFind(path, dir_cacheKeyLength(path));
+    if (*ptr) {
+      if (statError == 0 && dir_sameDateStamp(&stat.ds, &(*ptr)->ds)) {
+	(*ptr)->checked = 1;
+      } else {
+	dir_cacheRemove(ptr);
+      }
+    }
+  }
+
+  free(path);
+}
+
+
+void
+dir_prefetch(const char* path)
+{
+  dir_completePrefetch();
+
+  if (!dir_cacheEnabled || !strchr(path, ':')) {
+    return;
+  }
+
+  dir_cache_entry_t* cached = *dir_cacheFind(path, dir_cacheKeyLength(path));
+
+  if (cached && cached->checked) {
+    return;
+  }
+
+  // asked before anything is sent, the handshake can't happen with replies outstanding
+  dir_prefetchStat = hello_supports(SQUIRT_CAP_STAT);
+
+  if (!(dir_prefetchPath = strdup(path))) {
+    return;
+  }
+
+  // unchecked entries always have a datestamp, dir_revalidateCache() drops the rest
+  if (dir_prefetchStat) {
+    dir_sendStat(path);
+  }
+
+  dir_prefetchListing = !cached;
+  if (dir_prefetchListing) {
+    dir_sendRequest(path);
+  }
+
+  // the replies are read by whatever talks to the daemon next
+  util_flush(main_socketFd);
+  util_setBeforeCommand(dir_completePrefetch);
+}
+
+
+void
+dir_revalidateCache(void)
+{
+  for (int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+    dir_cache_entry_t** ptr = &dir_cache[i];
+    while (*ptr) {
+      if ((*ptr)->haveDateStamp) {
+	(*ptr)->checked = 0;
+	ptr = &(*ptr)->next;
+      } else {
+	dir_cacheRemove(ptr);
+      }
+    }
+  }
+}
+
+
+dir_entry_list_t*
+dir_readCached(const char* path)
+{
+  dir_completePrefetch();
+
+  if (dir_uncachedList) {
+    dir_freeEntryList(dir_uncachedList);
+    dir_uncachedList = 0;
+  }
+
+  if (!dir_cacheEnabled || !strchr(path, ':')) {
+    return dir_uncachedList = dir_read(path);
+  }
+
+  size_t length = dir_cacheKeyLength(path);
+  dir_cache_entry_t** ptr = dir_cacheFind(path, length);
+
+  if (*ptr && !(*ptr)->checked) {
+    dir_entry_t stat = {0};
+    if (dir_stat(path, &stat) == 0 && dir_sameDateStamp(&stat.ds, &(*ptr)->ds)) {
+      (*ptr)->checked = 1;
+    } else {
+      dir_cacheRemove(dir_cacheFind(path, length));
+    }
+    ptr = dir_cacheFind(path, length);
+  }
+
+  if (*ptr) {
+    dir_cacheHits++;
+    return (*ptr)->list;
+  }
+
+  // datestamp first, so a change made while listing shows up next time
+  int statSent = hello_supports(SQUIRT_CAP_STAT);
+  if (statSent) {
+    dir_sendStat(path);
+  }
+  dir_sendRequest(path);
+
+  dir_entry_t stat = {0};
+  uint32_t statError = statSent ? dir_recvStat(&stat) : ERROR_FATAL_ERROR;
+  dir_entry_list_t* entryList = dir_recvListing(path);
+
+  if (!entryList) {
+    return 0;
+  }
+
+  dir_cache_entry_t* cached = dir_cacheStore(path, entryList, statError == 0 ? &stat.ds : 0);
+  if (!cached) {
+    return dir_uncachedList = entryList;
+  }
+
+  return cached->list;
+}
+
+
 int
 dir_process(const char* command, void(*process)(dir_entry_list_t*))
 {
   int error = 0;
-  dir_entry_list_t *entryList = dir_read(command);
+  dir_entry_list_t *entryList;
+  dir_cache_entry_t* cached = 0;
+
+  if (dir_cacheEnabled && strchr(command, ':')) {
+    cached = *dir_cacheFind(command, dir_cacheKeyLength(command));
+  }
+
+  if (cached) {
+    dir_cacheHits++;
+    entryList = cached->list;
+  } else {
+    entryList = dir_read(command);
+
+    if (entryList && dir_cacheEnabled && strchr(command, ':')) {
+      cached = dir_cacheStore(command, entryList, 0);
+    }
+  }
 
   if (entryList == 0) {
     error = -1;
   } else {
+    if (cached) {
+      cached->busy++;
+    }
+
     if (process) {
       process(entryList);
     }
 
-    dir_freeEntryList(entryList);
+    if (!cached) {
+      dir_freeEntryList(entryList);
+    } else if (--cached->busy == 0 && cached->stale) {
+      dir_cacheFree(cached);
+    }
   }
   return error;
 }
@@ -1,7 +1,9 @@
 #pragma once
 #include <stdint.h>
+#include <time.h>
 
 #define DIR_AMIGA_EPOC_ADJUSTMENT_DAYS 2922
+#define DIR_PROTECTION_WRITE_DELETE ((1<<2)|(1<<0)) // the deny bits a read only file gets
 
 
 typedef struct {
@@ -51,8 +53,44 @@ dir_read(const char* command);
 int
 dir_process(const char* command, void(*process)(dir_entry_list_t*));
 
+void
+dir_enableCache(void);
+
+void
+dir_invalidate(const char* path);
+
+int
+dir_stat(const char* path, dir_entry_t* entry);
+
+void
+dir_sendStat(const char* path);
+
+uint32_t
+dir_recvStat(dir_entry_t* entry);
+
+dir_entry_list_t*
+dir_readCached(const char* path);
+
+void
+dir_prefetch(const char* path);
+
+void
+dir_revalidateCache(void);
+
+void
+dir_getListingStats(uint32_t* listings, uint32_t* cacheHits);
+
+void
+dir_printProtectFlags(dir_entry_t* entry);
+
 char*
 dir_formatDateTime(dir_entry_t* entry);
 
+void
+dir_localDateStamp(time_t time, dir_datestamp_t* ds);
+
+uint32_t
+dir_localProtection(uint32_t mode);
+
 void
 dir_main(int argc, char* argv[]);
@@ -3,12 +3,22 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "argv.h"
 #include "main.h"
 #include "common.h"
 
+#define EXEC_RETURN_ERROR 10 // a squirtd without SQUIRT_CAP_CLI_FRAMED only says that a command failed
+
+typedef struct {
+  char* data;
+  int length;
+  int size;
+} exec_buffer_t;
+
 static char* exec_command = 0;
+static int32_t exec_returnCode = 0;
 
 
 void
@@ -21,13 +31,102 @@ exec_cleanup(void)
 }
 
 
+// plain ASCII is written straight through, Latin-1 and the Amiga's CSI are translated for the terminal
+static void
+exec_writeOutput(const char* data, uint32_t length, void* context)
+{
+  (void)context;
+  uint32_t i = 0;
+
+  while (i < length && (uint8_t)data[i] < 0x80) {
+    i++;
+  }
+
+  if (i == length) {
+    size_t ignored __attribute__((unused)) = write(1, data, length);
+    return;
+  }
+
+  char* utf8 = malloc(length*2);
+  uint32_t u = 0;
+  for (i = 0; i < length; i++) {
+    uint8_t c = data[i];
+    if (c == 0x9B) {
+      utf8[u++] = 27;
+      utf8[u++] = '[';
+    } else if (c >= 0x80) {
+      utf8[u++] = 0xC0 | (c >> 6);
+      utf8[u++] = 0x80 | (c & 0x3F);
+    } else {
+      utf8[u++] = c;
+    }
+  }
+  size_t ignored __attribute__((unused)) = write(1, utf8, u);
+  free(utf8);
+}
+
+
+static void
+exec_captureOutput(const char* data, uint32_t length, void* context)
+{
+  exec_buffer_t* capture = context;
+
+  if (capture->length+length+1 > (uint32_t)capture->size) {
+    capture->size = (capture->length+length+1)*2;
+    capture->data = realloc(capture->data, capture->size);
+  }
+  memcpy(&capture->data[capture->length], data, length);
+  capture->length += length;
+}
+
+
+// SQUIRT_COMMAND_CLI_FRAMED output is read a whole chunk at a time and handed to output(), returns the command's return code
+static int32_t
+exec_recvFrames(void (*output)(const char* data, uint32_t length, void* context), void* context)
+{
+  uint32_t length, returnCode;
+  char buffer[4096];
+
+  while (util_recvU32(main_socketFd, &length) == 0) {
+    if (length == EXEC_FRAME_END) {
+      if (util_recvU32(main_socketFd, &returnCode) != 0) {
+	break;
+      }
+      return (int32_t)returnCode;
+    }
+
+    while (length) {
+      uint32_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+      if (util_recv(main_socketFd, buffer, chunk, 0) != chunk) {
+	fatalError("exec: failed to read output");
+      }
+      output(buffer, chunk, context);
+      length -= chunk;
+    }
+  }
+
+  fatalError("exec: failed to read output");
+}
+
+
+// the return code of the command last run by exec_cmd() or exec_captureCmd()
+int32_t
+exec_getReturnCode(void)
+{
+  return exec_returnCode;
+}
+
+
 int
 exec_cmd(int argc, char** argv)
 {
   uint8_t commandCode;
   int commandLength = 0;
+  trace_span_t span;
   exec_command = 0;
 
+  trace_begin(&span);
+
   if (argc == 2 && strcmp("cd", argv[0]) == 0) {
     commandLength = strlen(argv[1]);
     exec_command = malloc(commandLength+1);
@@ -45,7 +144,7 @@ exec_cmd(int argc, char** argv)
       strcat(exec_command, " ");
       strcat(exec_command, argv[i]);
     }
-    commandCode = SQUIRT_COMMAND_CLI;
+    commandCode = hello_supports(SQUIRT_CAP_CLI_FRAMED) ? SQUIRT_COMMAND_CLI_FRAMED : SQUIRT_COMMAND_CLI;
   }
 
   if (util_sendCommand(main_socketFd, commandCode) != 0) {
@@ -56,7 +155,9 @@ exec_cmd(int argc, char** argv)
     fatalError("send() command failed");
   }
 
-  if (commandCode != SQUIRT_COMMAND_CD) {
+  if (commandCode == SQUIRT_COMMAND_CLI_FRAMED) {
+    exec_returnCode = exec_recvFrames(exec_writeOutput, 0);
+  } else if (commandCode != SQUIRT_COMMAND_CD) {
     uint8_t c;
     char buffer[1024];
     int bindex = 0;
@@ -100,6 +201,11 @@ exec_cmd(int argc, char** argv)
     fatalError("exec: failed to read remote status");
   }
 
+  if (commandCode != SQUIRT_COMMAND_CLI_FRAMED) {
+    exec_returnCode = error ? EXEC_RETURN_ERROR : 0;
+  }
+
+  trace_end(&span, commandCode == SQUIRT_COMMAND_CD ? "cd" : "exec", exec_command);
   exec_cleanup();
 
   return error;
@@ -111,8 +217,11 @@ exec_captureCmd(uint32_t* errorCode, int argc, char** argv)
 {
   uint8_t commandCode;
   int commandLength = 0;
+  trace_span_t span;
   exec_command = 0;
 
+  trace_begin(&span);
+
   int outputLength = 255;
   int outputSize = 0;
   char* output = malloc(outputLength);
@@ -128,7 +237,7 @@ exec_captureCmd(uint32_t* errorCode, int argc, char** argv)
     strcat(exec_command, " ");
     strcat(exec_command, argv[i]);
   }
-  commandCode = SQUIRT_COMMAND_CLI;
+  commandCode = hello_supports(SQUIRT_CAP_CLI_FRAMED) ? SQUIRT_COMMAND_CLI_FRAMED : SQUIRT_COMMAND_CLI;
 
   if (util_sendCommand(main_socketFd, commandCode) != 0) {
     fatalError("failed to connect to squirtd server");
@@ -138,7 +247,12 @@ exec_captureCmd(uint32_t* errorCode, int argc, char** argv)
     fatalError("send() command failed");
   }
 
-  if (commandCode != SQUIRT_COMMAND_CD) {
+  if (commandCode == SQUIRT_COMMAND_CLI_FRAMED) {
+    exec_buffer_t capture = {output, outputSize, outputLength};
+    exec_returnCode = exec_recvFrames(exec_captureOutput, &capture);
+    capture.data[capture.length] = 0;
+    output = capture.data;
+  } else if (commandCode != SQUIRT_COMMAND_CD) {
     uint8_t c;
     int exitState = 0;
     while (util_recv(main_socketFd, &c, 1, 0) == 1) {
@@ -168,6 +282,11 @@ exec_captureCmd(uint32_t* errorCode, int argc, char** argv)
     fatalError("exec: failed to read remote status");
   }
 
+  if (commandCode != SQUIRT_COMMAND_CLI_FRAMED) {
+    exec_returnCode = error ? EXEC_RETURN_ERROR : 0;
+  }
+
+  trace_end(&span, commandCode == SQUIRT_COMMAND_CD ? "cd" : "exec", exec_command);
   exec_cleanup();
 
   *errorCode = error;
@@ -175,23 +294,279 @@ exec_captureCmd(uint32_t* errorCode, int argc, char** argv)
 }
 
 
+// prints a job's output a line at a time, so the jobs' lines don't get mixed up
+static void
+exec_printLine(int job, const char* data, int length)
+{
+  char* line = malloc(length*2+2);
+  int l = 0;
+
+  for (int i = 0; i < length; i++) {
+    if ((uint8_t)data[i] == 0x9B) {
+      line[l++] = 27;
+      line[l++] = '[';
+    } else {
+      line[l++] = data[i];
+    }
+  }
+  if (!l || line[l-1] != '\n') {
+    line[l++] = '\n';
+  }
+  line[l] = 0;
+
+  char* utf8 = util_latin1ToUtf8(line);
+  printf("[%d] %s", job+1, utf8);
+  fflush(stdout);
+  free(utf8);
+  free(line);
+}
+
+
+static void
+exec_addOutput(exec_buffer_t* output, int job, const char* data, int length)
+{
+  if (output->length+length > output->size) {
+    output->size = (output->length+length)*2;
+    output->data = realloc(output->data, output->size);
+  }
+  memcpy(&output->data[output->length], data, length);
+  output->length += length;
+
+  int start = 0;
+  for (int i = 0; i < output->length; i++) {
+    if (output->data[i] == '\n') {
+      exec_printLine(job, &output->data[start], i-start+1);
+      start = i+1;
+    }
+  }
+
+  memmove(output->data, &output->data[start], output->length-start);
+  output->length -= start;
+}
+
+
+static void
+exec_flushOutput(exec_buffer_t* output, int job)
+{
+  if (output->length) {
+    exec_printLine(job, output->data, output->length);
+    output->length = 0;
+  }
+}
+
+
+// one command after another on a squirtd that can't run them at once
+static uint32_t
+exec_jobsInTurn(int count, char** commands, int32_t* returnCodes)
+{
+  exec_buffer_t output = {0};
+
+  for (int i = 0; i < count; i++) {
+    uint32_t error;
+    char* result = exec_captureCmd(&error, 1, &commands[i]);
+    if (ERROR_IS_FATAL(error)) {
+      free(result);
+      free(output.data);
+      return error;
+    }
+    exec_addOutput(&output, i, result, strlen(result));
+    exec_flushOutput(&output, i);
+    returnCodes[i] = exec_returnCode;
+    free(result);
+  }
+
+  free(output.data);
+  return 0;
+}
+
+
+// runs the commands up to concurrency at a time, each line of output is printed prefixed with its job's number
+uint32_t
+exec_jobs(int concurrency, int count, char** commands, int32_t* returnCodes)
+{
+  trace_span_t span;
+  uint32_t job, length, error;
+  char detail[64];
+
+  for (int i = 0; i < count; i++) {
+    returnCodes[i] = EXEC_JOB_NOT_STARTED;
+  }
+
+  if (!hello_supports(SQUIRT_CAP_EXEC_JOBS)) {
+    return exec_jobsInTurn(count, commands, returnCodes);
+  }
+
+  trace_begin(&span);
+
+  if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_EXEC_JOBS) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(main_socketFd, "") != 0 ||
+      util_sendU32(main_socketFd, concurrency) != 0 ||
+      util_sendU32(main_socketFd, count) != 0) {
+    fatalError("send() command failed");
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, commands[i]) != 0) {
+      fatalError("send() command failed");
+    }
+  }
+
+  exec_buffer_t* output = calloc(count, sizeof(exec_buffer_t));
+  char buffer[1024];
+
+  while (util_recvU32(main_socketFd, &job) == 0 && job != EXEC_JOBS_DONE) {
+    if (job >= (uint32_t)count || util_recvU32(main_socketFd, &length) != 0) {
+      fatalError("exec: bad job output from squirtd");
+    }
+
+    if (length == EXEC_JOB_EXITED) {
+      uint32_t returnCode;
+      if (util_recvU32(main_socketFd, &returnCode) != 0) {
+	fatalError("exec: failed to read job status");
+      }
+      exec_flushOutput(&output[job], job);
+      returnCodes[job] = (int32_t)returnCode;
+      continue;
+    }
+
+    while (length) {
+      uint32_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+      if (util_recv(main_socketFd, buffer, chunk, 0) != chunk) {
+	fatalError("exec: failed to read job output");
+      }
+      exec_addOutput(&output[job], job, buffer, chunk);
+      length -= chunk;
+    }
+  }
+
+  if (util_recvU32(main_socketFd, &error) != 0) {
+    fatalError("exec: failed to read remote status");
+  }
+
+  for (int i = 0; i < count; i++) {
+    free(output[i].data);
+  }
+  free(output);
+
+  snprintf(detail, sizeof(detail), "%d commands, %d at once", count, concurrency);
+  trace_end(&span, "exec jobs", detail);
+
+  return error;
+}
+
+
+static void
+exec_usage(void)
+{
+  fatalError("incorrect number of arguments\nusage: %s hostname command to be executed\n       %s --jobs=N hostname [command ...]", main_argv0, main_argv0);
+}
+
+
+static void
+exec_runJobs(int concurrency, int count, char** commands)
+{
+  char** lines = 0;
+  char* line = 0;
+  size_t size = 0;
+  ssize_t length;
+
+  // without commands on the command line they're read from stdin, one per line
+  if (count == 0) {
+    while ((length = getline(&line, &size, stdin)) > 0) {
+      while (length && (line[length-1] == '\n' || line[length-1] == '\r')) {
+	line[--length] = 0;
+      }
+      if (length) {
+	lines = realloc(lines, (count+1)*sizeof(char*));
+	lines[count++] = strdup(line);
+      }
+    }
+    free(line);
+    commands = lines;
+  }
+
+  int32_t* returnCodes = malloc((count ? count : 1)*sizeof(int32_t));
+  uint32_t error = exec_jobs(concurrency, count, commands, returnCodes);
+  int failed = 0;
+
+  if (error == 0) {
+    for (int i = 0; i < count; i++) {
+      if (returnCodes[i] == EXEC_JOB_NOT_STARTED) {
+	printf("[%d] %s: couldn't be started\n", i+1, commands[i]);
+	failed++;
+      } else if (returnCodes[i] != 0) {
+	printf("[%d] %s: return code %d\n", i+1, commands[i], returnCodes[i]);
+	failed++;
+      }
+    }
+  }
+
+  free(returnCodes);
+  if (lines) {
+    for (int i = 0; i < count; i++) {
+      free(lines[i]);
+    }
+    free(lines);
+  }
+
+  if (error != 0) {
+    fatalError("%s", util_getErrorString(error));
+  }
+
+  if (failed) {
+    fflush(stdout);
+    fatalError("%d of %d jobs failed", failed, count);
+  }
+}
+
+
 void
 exec_main(int argc, char* argv[])
 {
-  if (argc < 3) {
-    fatalError("incorrect number of arguments\nusage: %s hostname command to be executed", argv[0]);
+  static struct option long_options[] =
+    {
+     {"jobs", required_argument, 0, 'j'},
+     {0, 0, 0, 0}
+    };
+  int jobs = 0, c;
+
+  // options stop at the hostname, the command's own options are left alone
+  while ((c = getopt_long(argc, argv, "+j:", long_options, 0)) != -1) {
+    switch (c) {
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs < 1) {
+	exec_usage();
+      }
+      break;
+    default:
+      exec_usage();
+      break;
+    }
   }
 
-  util_connect(argv[1]);
-
-  for (int i = 0; i < argc-2; i++) {
-    argv[i] = argv[i+2];
+  if (argc-optind < (jobs ? 1 : 2)) {
+    exec_usage();
   }
 
-  argc-=2;
+  util_connect(argv[optind]);
+
+  argv += optind+1;
+  argc -= optind+1;
+
+  if (jobs) {
+    exec_runJobs(jobs, argc, argv);
+    return;
+  }
 
   uint32_t error = exec_cmd(argc, argv);
 
+  if (error == ERROR_EXEC_FAILED && exec_returnCode > 0) {
+    // exit as the command did, like a shell
+    fprintf(stderr, "%s: return code %d\n", main_argv0, exec_returnCode);
+    main_cleanupAndExit(exec_returnCode);
+  }
+
   if (error != 0) {
     fatalError("%s", util_getErrorString(error));
   }
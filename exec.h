@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 
 int
 exec_cmd(int argc, char** argv);
@@ -6,6 +7,12 @@ exec_cmd(int argc, char** argv);
 char*
 exec_captureCmd(uint32_t* errorCode, int argc, char** argv);
 
+int32_t
+exec_getReturnCode(void);
+
+uint32_t
+exec_jobs(int concurrency, int count, char** commands, int32_t* returnCodes);
+
 void
 exec_cleanup(void);
 
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#endif
+
+#include "main.h"
+#include "common.h"
+
+/*
+ * Fan-out: squirt the same files to several Amigas at once.
+ *
+ * Every host gets its own non-blocking connection and one poll() loop keeps them all moving.
+ * Each block of a file is read from disk once and sent to every host; the next block is read
+ * when they have all sent it, so the slowest Amiga sets the pace rather than the sum of them.
+ * A host that fails is dropped and the others carry on.
+ */
+
+#define FANOUT_BLOCK_SIZE         (64*1024)
+#define FANOUT_CONNECT_TIMEOUT_MS 5000
+#define FANOUT_TIMEOUT_MS         60000
+
+#ifndef _WIN32
+typedef struct {
+  char* hostname;          // as given, with any :port
+  int fd;                  // -1 once the host has been dropped
+  int connected;
+  const char* error;       // why it was dropped
+  uint32_t requestSent;    // how much of fanout_request has gone out
+  uint32_t blockSent;      // and of the current block
+  uint8_t reply[4];
+  uint32_t replyReceived;
+  uint32_t status;
+  int files, failed;
+  uint64_t bytes;
+  struct timeval end;      // when its last reply came in
+} fanout_host_t;
+
+static fanout_host_t* fanout_hosts = 0;
+static int fanout_hostCount = 0;
+static char* fanout_request = 0;
+static uint32_t fanout_requestLength = 0;
+static char* fanout_block = 0;
+static int fanout_fileFd = -1;
+#endif
+
+
+void
+fanout_cleanup(void)
+{
+#ifndef _WIN32
+  for (int i = 0; i < fanout_hostCount; i++) {
+    if (fanout_hosts[i].fd >= 0) {
+      close(fanout_hosts[i].fd);
+    }
+    free(fanout_hosts[i].hostname);
+  }
+  free(fanout_hosts);
+  fanout_hosts = 0;
+  fanout_hostCount = 0;
+
+  free(fanout_request);
+  fanout_request = 0;
+
+  free(fanout_block);
+  fanout_block = 0;
+
+  if (fanout_fileFd >= 0) {
+    close(fanout_fileFd);
+    fanout_fileFd = -1;
+  }
+#endif
+}
+
+
+#ifndef _WIN32
+static void
+fanout_drop(fanout_host_t* host, const char* error)
+{
+  close(host->fd);
+  host->fd = -1;
+  host->error = error;
+  gettimeofday(&host->end, NULL);
+}
+
+
+static void
+fanout_addHosts(const char* hosts)
+{
+  char* list = strdup(hosts);
+  char* save = 0;
+
+  for (char* hostname = strtok_r(list, ",", &save); hostname; hostname = strtok_r(0, ",", &save)) {
+    fanout_hosts = realloc(fanout_hosts, sizeof(fanout_host_t)*(fanout_hostCount+1));
+    fanout_host_t* host = &fanout_hosts[fanout_hostCount++];
+    memset(host, 0, sizeof(*host));
+    host->hostname = strdup(hostname);
+    host->fd = -1;
+  }
+
+  free(list);
+}
+
+
+// every host is connected to at once, a host that doesn't answer only costs one timeout
+static void
+fanout_connect(void)
+{
+  struct pollfd pfds[fanout_hostCount];
+  fanout_host_t* polled[fanout_hostCount];
+
+  for (int i = 0; i < fanout_hostCount; i++) {
+    fanout_host_t* host = &fanout_hosts[i];
+    char hostname[PATH_MAX];
+    snprintf(hostname, sizeof(hostname), "%s", host->hostname);
+    int port = util_hostnamePort(hostname);
+
+    if ((host->fd = util_startConnect(hostname, port)) < 0) {
+      host->error = "failed to connect";
+    }
+  }
+
+  for (;;) {
+    int n = 0;
+    for (int i = 0; i < fanout_hostCount; i++) {
+      if (fanout_hosts[i].fd >= 0 && !fanout_hosts[i].connected) {
+	pfds[n].fd = fanout_hosts[i].fd;
+	pfds[n].events = POLLOUT;
+	polled[n++] = &fanout_hosts[i];
+      }
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    int ready = poll(pfds, n, FANOUT_CONNECT_TIMEOUT_MS);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+
+    for (int i = 0; i < n; i++) {
+      int error = 0;
+      socklen_t len = sizeof(error);
+
+      if (ready <= 0) {
+	fanout_drop(polled[i], "failed to connect");
+      } else if (pfds[i].revents) {
+	if (getsockopt(polled[i]->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+	  fanout_drop(polled[i], "failed to connect");
+	} else {
+	  polled[i]->connected = 1;
+	}
+      }
+    }
+  }
+}
+
+
+static void
+fanout_putU32(uint32_t value)
+{
+  value = htonl(value);
+  memcpy(&fanout_request[fanout_requestLength], &value, sizeof(value));
+  fanout_requestLength += sizeof(value);
+}
+
+
+// the request every host is sent, up to the file data
+static void
+fanout_setRequest(uint32_t command, const char* name, int hasLength, uint32_t length)
+{
+  char* latin1 = util_utf8ToLatin1(name);
+  uint32_t nameLength = strlen(latin1);
+
+  fanout_requestLength = 0;
+  fanout_request = realloc(fanout_request, nameLength+12);
+  fanout_putU32(command);
+  fanout_putU32(nameLength);
+  memcpy(&fanout_request[fanout_requestLength], latin1, nameLength);
+  fanout_requestLength += nameLength;
+  if (hasLength) {
+    fanout_putU32(length);
+  }
+
+  free(latin1);
+}
+
+
+static int
+fanout_sending(fanout_host_t* host, uint32_t blockLength)
+{
+  return host->requestSent < fanout_requestLength || host->blockSent < blockLength;
+}
+
+
+static void
+fanout_readBlock(const char* filename, uint32_t length)
+{
+  uint32_t total = 0;
+
+  while (total < length) {
+    ssize_t len = read(fanout_fileFd, &fanout_block[total], length-total);
+    if (len <= 0) {
+      fatalError("failed to read %s", filename);
+    }
+    total += len;
+  }
+}
+
+
+static void
+fanout_send(fanout_host_t* host, uint32_t blockLength)
+{
+  ssize_t len;
+  int request = host->requestSent < fanout_requestLength;
+
+  if (request) {
+    len = send(host->fd, &fanout_request[host->requestSent], fanout_requestLength-host->requestSent, 0);
+  } else {
+    len = send(host->fd, &fanout_block[host->blockSent], blockLength-host->blockSent, 0);
+  }
+
+  if (len < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      fanout_drop(host, "send() failed");
+    }
+    return;
+  }
+
+  trace_addBytes(len);
+  if (request) {
+    host->requestSent += len;
+  } else {
+    host->blockSent += len;
+    host->bytes += len;
+  }
+}
+
+
+static void
+fanout_receive(fanout_host_t* host)
+{
+  ssize_t len = recv(host->fd, &host->reply[host->replyReceived], sizeof(host->reply)-host->replyReceived, 0);
+
+  if (len == 0) {
+    fanout_drop(host, "connection closed by Amiga");
+  } else if (len < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      fanout_drop(host, "recv() failed");
+    }
+  } else {
+    trace_addBytes(len);
+    host->replyReceived += len;
+    if (host->replyReceived == sizeof(host->reply)) {
+      uint32_t status;
+      memcpy(&status, host->reply, sizeof(status));
+      host->status = ntohl(status);
+      gettimeofday(&host->end, NULL);
+    }
+  }
+}
+
+
+// sends fanout_request and then length bytes of fanout_fileFd to every host, and reads back their statuses
+static void
+fanout_exchange(const char* filename, uint32_t length)
+{
+  uint32_t blockStart = 0, blockLength = 0;
+  int n = 0;
+
+  for (int i = 0; i < fanout_hostCount; i++) {
+    fanout_hosts[i].requestSent = fanout_hosts[i].blockSent = fanout_hosts[i].replyReceived = 0;
+  }
+
+  for (;;) {
+    struct pollfd pfds[fanout_hostCount];
+    fanout_host_t* polled[fanout_hostCount];
+    int blockSent = 1;
+
+    for (int i = 0; i < fanout_hostCount; i++) {
+      if (fanout_hosts[i].fd >= 0 && fanout_sending(&fanout_hosts[i], blockLength)) {
+	blockSent = 0;
+      }
+    }
+
+    if (blockSent && blockStart+blockLength < length) {
+      blockStart += blockLength;
+      blockLength = length-blockStart < FANOUT_BLOCK_SIZE ? length-blockStart : FANOUT_BLOCK_SIZE;
+      fanout_readBlock(filename, blockLength);
+      for (int i = 0; i < fanout_hostCount; i++) {
+	fanout_hosts[i].blockSent = 0;
+      }
+    }
+
+    n = 0;
+    for (int i = 0; i < fanout_hostCount; i++) {
+      fanout_host_t* host = &fanout_hosts[i];
+      if (host->fd < 0) {
+	continue;
+      }
+      if (fanout_sending(host, blockLength)) {
+	pfds[n].events = POLLOUT;
+      } else if (blockStart+blockLength == length && host->replyReceived < sizeof(host->reply)) {
+	pfds[n].events = POLLIN;
+      } else {
+	continue; // waiting for the others to send the block
+      }
+      pfds[n].fd = host->fd;
+      polled[n++] = host;
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    int ready = poll(pfds, n, FANOUT_TIMEOUT_MS);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (ready <= 0) {
+	fanout_drop(polled[i], "timed out");
+      } else if (pfds[i].revents & (POLLOUT|POLLERR|POLLHUP) && pfds[i].events == POLLOUT) {
+	fanout_send(polled[i], blockLength);
+      } else if (pfds[i].revents) {
+	fanout_receive(polled[i]);
+      }
+    }
+  }
+}
+
+
+static void
+fanout_file(const char* filename, int toCwd)
+{
+  struct stat st;
+  trace_span_t span;
+
+  if (stat(filename, &st) == -1 || (fanout_fileFd = util_open(filename, O_RDONLY|_O_BINARY)) < 0) {
+    fatalError("failed to open %s", filename);
+  }
+
+  trace_begin(&span);
+
+  printf("squirting %s (%s bytes)\n", filename, util_formatNumber(st.st_size));
+  fanout_setRequest(toCwd ? SQUIRT_COMMAND_SQUIRT_TO_CWD : SQUIRT_COMMAND_SQUIRT, basename((char*)filename), 1, st.st_size);
+  fanout_exchange(filename, st.st_size);
+
+  close(fanout_fileFd);
+  fanout_fileFd = -1;
+
+  for (int i = 0; i < fanout_hostCount; i++) {
+    fanout_host_t* host = &fanout_hosts[i];
+    if (host->fd < 0) {
+      continue;
+    }
+    if (host->status == 0) {
+      host->files++;
+    } else {
+      host->failed++;
+      fprintf(stderr, "**FAILED** to squirt %s to %s\n%s\n", filename, host->hostname, util_getErrorString(host->status));
+      if (ERROR_IS_FATAL(host->status)) {
+	fanout_drop(host, util_getErrorString(host->status));
+      }
+    }
+  }
+
+  trace_end(&span, "fanout", filename);
+}
+
+
+static void
+fanout_cd(const char* dest)
+{
+  fanout_setRequest(SQUIRT_COMMAND_CD, dest, 0, 0);
+  fanout_exchange(dest, 0);
+
+  for (int i = 0; i < fanout_hostCount; i++) {
+    if (fanout_hosts[i].fd >= 0 && fanout_hosts[i].status != 0) {
+      fanout_drop(&fanout_hosts[i], util_getErrorString(fanout_hosts[i].status));
+    }
+  }
+}
+#endif
+
+
+void
+fanout_run(const char* hosts, const char* dest, int count, char** filenames)
+{
+#ifdef _WIN32
+  (void)hosts, (void)dest, (void)count, (void)filenames;
+  fatalError("--hosts is not supported on this platform");
+#else
+  struct timeval start;
+  int failed = 0;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  fanout_addHosts(hosts);
+  fanout_block = malloc(FANOUT_BLOCK_SIZE);
+
+  gettimeofday(&start, NULL);
+  fanout_connect();
+
+  if (dest) {
+    fanout_cd(dest);
+  }
+
+  for (int i = 0; i < count; i++) {
+    fanout_file(filenames[i], dest != 0);
+  }
+
+  for (int i = 0; i < fanout_hostCount; i++) {
+    fanout_host_t* host = &fanout_hosts[i];
+    double elapsed = (host->end.tv_sec - start.tv_sec) + (host->end.tv_usec - start.tv_usec) / 1000000.0;
+
+    printf("%-24s ", host->hostname);
+    if (host->error || host->failed) {
+      if (host->error) {
+	printf("**FAILED** %d of %d files squirted (%s)\n", host->files, count, host->error);
+      } else {
+	printf("**FAILED** %d of %d files squirted\n", host->files, count);
+      }
+      failed++;
+    } else {
+      printf("%d files, %s bytes in %0.02f seconds ", host->files, util_formatNumber(host->bytes), elapsed);
+      util_printFormatSpeed(host->bytes, elapsed > 0 ? elapsed : 1);
+      printf("\n");
+    }
+  }
+
+  if (failed) {
+    fflush(stdout);
+    fatalError("%d of %d hosts failed", failed, fanout_hostCount);
+  }
+#endif
+}
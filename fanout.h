@@ -0,0 +1,7 @@
+#pragma once
+
+void
+fanout_cleanup(void);
+
+void
+fanout_run(const char* hosts, const char* dest, int count, char** filenames);
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#include "main.h"
+#include "common.h"
+#include "fsop.h"
+
+
+static void
+fsop_sendOperation(uint32_t command, const char* name, const char* newName)
+{
+  if (util_sendCommand(main_socketFd, command) != 0) {
+    fatalError("failed to connect to squirtd server");
+  }
+
+  if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, name) != 0) {
+    fatalError("send() name failed");
+  }
+
+  if (command == SQUIRT_COMMAND_RENAME) {
+    if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, newName) != 0) {
+      fatalError("send() new name failed");
+    }
+  }
+}
+
+
+static void
+fsop_invalidate(uint32_t command, const char* name, const char* newName)
+{
+  dir_invalidate(name);
+  if (command == SQUIRT_COMMAND_RENAME) {
+    dir_invalidate(newName);
+  }
+}
+
+
+// a daemon without the native commands runs the AmigaDOS ones instead
+static int
+fsop_legacy(uint32_t command, const char* name, const char* newName)
+{
+  char buffer[PATH_MAX*2];
+  uint32_t error = 0, failed;
+
+  if (command == SQUIRT_COMMAND_MKDIR) {
+    snprintf(buffer, sizeof(buffer), "makedir \"%s\"", name);
+    failed = ERROR_MKDIR_FAILED;
+  } else if (command == SQUIRT_COMMAND_DELETE) {
+    snprintf(buffer, sizeof(buffer), "delete \"%s\" QUIET", name);
+    failed = ERROR_DELETE_FAILED;
+  } else {
+    snprintf(buffer, sizeof(buffer), "rename \"%s\" \"%s\"", name, newName);
+    failed = ERROR_RENAME_FAILED;
+  }
+
+  // one argument, so the quotes reach the Amiga shell
+  free(exec_captureCmd(&error, 1, (char*[]){buffer}));
+  fsop_invalidate(command, name, newName);
+
+  return error ? failed : 0;
+}
+
+
+static int
+fsop_single(uint32_t command, const char* name, const char* newName)
+{
+  if (!hello_supports(SQUIRT_CAP_FSOP)) {
+    return fsop_legacy(command, name, newName);
+  }
+
+  fsop_sendOperation(command, name, newName);
+  fsop_invalidate(command, name, newName);
+
+  uint32_t error;
+
+  if (util_recvU32(main_socketFd, &error) != 0) {
+    fatalError("fsop: failed to read remote status");
+  }
+
+  return error;
+}
+
+
+int
+fsop_makeDir(const char* dir)
+{
+  return fsop_single(SQUIRT_COMMAND_MKDIR, dir, 0);
+}
+
+
+int
+fsop_delete(const char* filename)
+{
+  return fsop_single(SQUIRT_COMMAND_DELETE, filename, 0);
+}
+
+
+int
+fsop_rename(const char* from, const char* to)
+{
+  return fsop_single(SQUIRT_COMMAND_RENAME, from, to);
+}
+
+
+static uint32_t
+fsop_sendBatch(fsop_operation_t* operations, uint32_t count)
+{
+  if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_BATCH) != 0) {
+    fatalError("failed to connect to squirtd server");
+  }
+
+  if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, "") != 0 ||
+      util_sendU32(main_socketFd, count) != 0) {
+    fatalError("send() batch failed");
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (util_sendU32(main_socketFd, operations[i].command) != 0 ||
+	util_sendLengthAndUtf8StringAsLatin1(main_socketFd, operations[i].name) != 0) {
+      fatalError("send() batch failed");
+    }
+    if (operations[i].command == SQUIRT_COMMAND_RENAME &&
+	util_sendLengthAndUtf8StringAsLatin1(main_socketFd, operations[i].newName) != 0) {
+      fatalError("send() batch failed");
+    }
+    fsop_invalidate(operations[i].command, operations[i].name, operations[i].newName);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (util_recvU32(main_socketFd, &operations[i].error) != 0) {
+      fatalError("fsop: failed to read remote status");
+    }
+    if (ERROR_IS_FATAL(operations[i].error)) {
+      // the daemon gives up on the rest of the batch
+      for (uint32_t j = i+1; j < count; j++) {
+	operations[j].error = operations[i].error;
+      }
+      break;
+    }
+  }
+
+  uint32_t error;
+
+  if (util_recvU32(main_socketFd, &error) != 0) {
+    fatalError("fsop: failed to read remote status");
+  }
+
+  return error;
+}
+
+
+int
+fsop_batch(fsop_operation_t* operations, uint32_t count)
+{
+  uint32_t error = 0;
+
+  if (!hello_supports(SQUIRT_CAP_BATCH)) {
+    for (uint32_t i = 0; i < count; i++) {
+      operations[i].error = fsop_single(operations[i].command, operations[i].name, operations[i].newName);
+      if (!error) {
+	error = operations[i].error;
+      }
+    }
+    return error;
+  }
+
+  // the daemon replies as it goes, so keep each request small enough not to fill its send buffer
+  for (uint32_t i = 0; i < count; i += FSOP_MAX_BATCH) {
+    uint32_t batchCount = count-i > FSOP_MAX_BATCH ? FSOP_MAX_BATCH : count-i;
+    uint32_t batchError = fsop_sendBatch(&operations[i], batchCount);
+    if (!error || ERROR_IS_FATAL(batchError)) {
+      error = batchError;
+    }
+    if (ERROR_IS_FATAL(error)) {
+      for (uint32_t j = i+batchCount; j < count; j++) {
+	operations[j].error = error;
+      }
+      break;
+    }
+  }
+
+  return error;
+}
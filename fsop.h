@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+#define FSOP_MAX_BATCH 256
+
+typedef struct {
+  uint32_t command;     // SQUIRT_COMMAND_MKDIR, SQUIRT_COMMAND_DELETE or SQUIRT_COMMAND_RENAME
+  const char* name;
+  const char* newName;  // only used by SQUIRT_COMMAND_RENAME
+  uint32_t error;
+} fsop_operation_t;
+
+int
+fsop_makeDir(const char* dir);
+
+int
+fsop_delete(const char* filename);
+
+int
+fsop_rename(const char* from, const char* to);
+
+int
+fsop_batch(fsop_operation_t* operations, uint32_t count);
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "common.h"
+
+/*
+ * Capability handshake. The first time a tool needs to choose between a newer command and the
+ * legacy protocol it sends SQUIRT_COMMAND_HELLO, which answers with a length, the protocol
+ * version and a capability bitmap. A daemon from before HELLO only sends the status of an
+ * unknown command, so a zero length means legacy and none of the newer commands.
+ *
+ * The answer is kept for the host, so reconnecting (restore jobs, squirt_master sessions) doesn't
+ * ask again.
+ */
+
+static char* hello_host = 0;
+static int hello_known = 0;
+static uint32_t hello_protocolVersion = 0;
+static uint32_t hello_capabilities = 0;
+
+
+void
+hello_cleanup(void)
+{
+  if (hello_host) {
+    free(hello_host);
+    hello_host = 0;
+  }
+  hello_known = 0;
+}
+
+
+void
+hello_connected(const char* hostname, int port)
+{
+  char host[256];
+  snprintf(host, sizeof(host), "%s:%d", hostname, port);
+
+  if (hello_host && strcmp(hello_host, host) == 0) {
+    return;
+  }
+
+  hello_cleanup();
+  hello_host = strdup(host);
+}
+
+
+// "host:port" of the squirtd we're talking to
+const char*
+hello_hostname(void)
+{
+  return hello_host;
+}
+
+
+static void
+hello_sendCommand(uint32_t command, const char* name)
+{
+  if (util_sendCommand(main_socketFd, command) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(main_socketFd, name) != 0) {
+    fatalError("hello: send() failed");
+  }
+}
+
+
+static void
+hello_recvU32(uint32_t* value)
+{
+  if (util_recvU32(main_socketFd, value) != 0) {
+    fatalError("hello: failed to read remote status");
+  }
+}
+
+
+// skips the part of a reply we don't need, leaving the status
+static void
+hello_skip(uint32_t length)
+{
+  char buffer[64];
+
+  while (length > 0) {
+    uint32_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+    if (util_recv(main_socketFd, buffer, chunk, 0) != chunk) {
+      fatalError("hello: failed to read remote status");
+    }
+    length -= chunk;
+  }
+}
+
+
+static void
+hello_exchange(void)
+{
+  uint32_t length, error;
+
+  hello_protocolVersion = 0;
+  hello_capabilities = 0;
+
+  hello_sendCommand(SQUIRT_COMMAND_HELLO, "hello");
+  hello_recvU32(&length);
+
+  if (length == 0) {
+    // that was the status of an unknown command
+    return;
+  }
+
+  if (length >= (uint32_t)HELLO_LENGTH) {
+    hello_recvU32(&hello_protocolVersion);
+    hello_recvU32(&hello_capabilities);
+    length -= HELLO_LENGTH;
+  }
+
+  // a newer daemon may send more than we know about
+  hello_skip(length);
+  hello_recvU32(&error);
+}
+
+
+static void
+hello_require(void)
+{
+  if (!hello_known) {
+    hello_exchange();
+    hello_known = 1;
+  }
+}
+
+
+uint32_t
+hello_version(void)
+{
+  hello_require();
+  return hello_protocolVersion;
+}
+
+
+int
+hello_supports(uint32_t capability)
+{
+  hello_require();
+  return (hello_capabilities & capability) == capability;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+
+void
+hello_cleanup(void);
+
+void
+hello_connected(const char* hostname, int port);
+
+const char*
+hello_hostname(void);
+
+uint32_t
+hello_version(void);
+
+int
+hello_supports(uint32_t capability);
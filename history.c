@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
+
+#include "main.h"
+#include "history.h"
+
+/*
+ * Command line history shared by every squirt_cli session.
+ *
+ *  file:    one "host<TAB>command" line per command, appended under an exclusive lock
+ *
+ * The file is a log: running a command again appends it again and the older line is dead.
+ * Sessions tail the file before each prompt, so commands typed in other sessions are merged
+ * in the order they were run. When dead lines outnumber live ones the file is compacted to a
+ * temporary file and renamed over the log; sessions notice the new inode and reload.
+ *
+ * Lines without a host (the old history format) are adopted by the host that loads them.
+ * Each of the current host's commands is indexed by its trigrams for reverse search.
+ */
+
+#define HISTORY_MAX_ENTRIES   500000
+#define HISTORY_HASH_BUCKETS  (1<<18)
+#define HISTORY_TRIGRAM_LISTS (1<<16)
+#define HISTORY_COMPACT_SLACK 1024
+#define HISTORY_MAX_RECORD    4096
+
+typedef struct {
+  char* line;
+  int host;
+  int live;
+  int next;          // hash chain
+} history_entry_t;
+
+typedef struct {
+  int* ids;          // ascending entry ids
+  int count;
+  int capacity;
+} history_posting_t;
+
+static char* history_filename = 0;
+static char** history_hosts = 0;
+static int history_hostCount = 0;
+static int history_host = -1;
+
+static history_entry_t* history_entries = 0;
+static int history_count = 0;
+static int history_capacity = 0;
+static int history_liveCount = 0;
+static int* history_buckets = 0;
+static history_posting_t* history_trigrams = 0;
+
+static off_t history_offset = 0;
+static ino_t history_inode = 0;
+
+static char* history_query = 0;
+static int* history_matches = 0;
+static int history_matchCount = 0;
+static int history_matchGeneration = -1;
+
+
+static void
+history_reset(void)
+{
+  for (int i = 0; i < history_count; i++) {
+    free(history_entries[i].line);
+  }
+  free(history_entries);
+  history_entries = 0;
+  history_count = history_capacity = history_liveCount = 0;
+
+  if (history_trigrams) {
+    for (int i = 0; i < HISTORY_TRIGRAM_LISTS; i++) {
+      free(history_trigrams[i].ids);
+    }
+    free(history_trigrams);
+    history_trigrams = 0;
+  }
+
+  free(history_buckets);
+  history_buckets = 0;
+
+  free(history_query);
+  history_query = 0;
+  free(history_matches);
+  history_matches = 0;
+  history_matchCount = 0;
+  history_matchGeneration = -1;
+
+  history_offset = 0;
+  history_inode = 0;
+}
+
+
+void
+history_cleanup(void)
+{
+  history_reset();
+
+  for (int i = 0; i < history_hostCount; i++) {
+    free(history_hosts[i]);
+  }
+  free(history_hosts);
+  history_hosts = 0;
+  history_hostCount = 0;
+  history_host = -1;
+
+  if (history_filename) {
+    free(history_filename);
+    history_filename = 0;
+  }
+}
+
+
+static int
+history_internHost(const char* host, size_t length)
+{
+  for (int i = 0; i < history_hostCount; i++) {
+    if (strlen(history_hosts[i]) == length && strncmp(history_hosts[i], host, length) == 0) {
+      return i;
+    }
+  }
+
+  char** hosts = realloc(history_hosts, (history_hostCount+1)*sizeof(char*));
+  if (!hosts) {
+    fatalError("out of memory");
+  }
+  history_hosts = hosts;
+
+  if (!(history_hosts[history_hostCount] = malloc(length+1))) {
+    fatalError("out of memory");
+  }
+  memcpy(history_hosts[history_hostCount], host, length);
+  history_hosts[history_hostCount][length] = 0;
+
+  return history_hostCount++;
+}
+
+
+static uint32_t
+history_hash(int host, const char* line)
+{
+  uint32_t hash = 2166136261u ^ (uint32_t)host;
+  for (; *line; line++) {
+    hash = (hash ^ (uint8_t)*line) * 16777619u;
+  }
+  return hash & (HISTORY_HASH_BUCKETS-1);
+}
+
+
+static uint32_t
+history_trigramHash(const char* ptr)
+{
+  uint32_t trigram = ((uint32_t)(uint8_t)ptr[0] << 16) | ((uint32_t)(uint8_t)ptr[1] << 8) | (uint8_t)ptr[2];
+  return (trigram * 2654435761u) >> 16;
+}
+
+
+static void
+history_indexEntry(int id)
+{
+  const char* line = history_entries[id].line;
+
+  for (size_t i = 0; line[i] && line[i+1] && line[i+2]; i++) {
+    history_posting_t* posting = &history_trigrams[history_trigramHash(&line[i])];
+
+    if (posting->count && posting->ids[posting->count-1] == id) {
+      continue;
+    }
+
+    if (posting->count == posting->capacity) {
+      int capacity = posting->capacity ? posting->capacity*2 : 8;
+      int* ids = realloc(posting->ids, capacity*sizeof(int));
+      if (!ids) {
+	fatalError("out of memory");
+      }
+      posting->ids = ids;
+      posting->capacity = capacity;
+    }
+
+    posting->ids[posting->count++] = id;
+  }
+}
+
+
+static void
+history_append(int host, const char* line, size_t lineLength)
+{
+  if (lineLength == 0 || host < 0) {
+    return;
+  }
+
+  if (history_count == history_capacity) {
+    int capacity = history_capacity ? history_capacity*2 : 1024;
+    history_entry_t* entries = realloc(history_entries, capacity*sizeof(history_entry_t));
+    if (!entries) {
+      fatalError("out of memory");
+    }
+    history_entries = entries;
+    history_capacity = capacity;
+  }
+
+  history_entry_t* entry = &history_entries[history_count];
+  if (!(entry->line = malloc(lineLength+1))) {
+    fatalError("out of memory");
+  }
+  memcpy(entry->line, line, lineLength);
+  entry->line[lineLength] = 0;
+  entry->host = host;
+  entry->live = 1;
+
+  // the newest copy of a command is the only one that counts
+  uint32_t hash = history_hash(host, entry->line);
+  for (int id = history_buckets[hash]; id >= 0; id = history_entries[id].next) {
+    if (history_entries[id].live && history_entries[id].host == host && strcmp(history_entries[id].line, entry->line) == 0) {
+      history_entries[id].live = 0;
+      history_liveCount--;
+      break;
+    }
+  }
+
+  entry->next = history_buckets[hash];
+  history_buckets[hash] = history_count;
+  history_liveCount++;
+
+  if (host == history_host) {
+    history_indexEntry(history_count);
+  }
+
+  history_count++;
+}
+
+
+static void
+history_allocate(void)
+{
+  if (!(history_buckets = malloc(HISTORY_HASH_BUCKETS*sizeof(int))) ||
+      !(history_trigrams = calloc(HISTORY_TRIGRAM_LISTS, sizeof(history_posting_t)))) {
+    fatalError("out of memory");
+  }
+  memset(history_buckets, 0xff, HISTORY_HASH_BUCKETS*sizeof(int));
+}
+
+
+static void
+history_readLog(void)
+{
+  struct stat st;
+  FILE* fp = fopen(history_filename, "r");
+
+  if (!fp) {
+    return;
+  }
+
+  if (fstat(fileno(fp), &st) != 0) {
+    fclose(fp);
+    return;
+  }
+
+  if (st.st_ino != history_inode || st.st_size < history_offset) {
+    // compacted by another session, or the first load
+    history_reset();
+    history_inode = st.st_ino;
+
+    history_allocate();
+  }
+
+  if (st.st_size > history_offset && fseek(fp, (long)history_offset, SEEK_SET) == 0) {
+    char record[HISTORY_MAX_RECORD];
+
+    while (fgets(record, sizeof(record), fp)) {
+      size_t length = strlen(record);
+
+      if (record[length-1] != '\n') {
+	if (feof(fp)) {
+	  break; // still being written, pick it up next time
+	}
+
+	// longer than any line srl reads, skip it
+	int c;
+	while ((c = fgetc(fp)) != EOF && (length++, c != '\n'));
+	if (c == EOF) {
+	  break;
+	}
+	history_offset += length;
+	continue;
+      }
+
+      history_offset += length;
+      record[--length] = 0;
+
+      char* tab = strchr(record, '\t');
+      if (tab) {
+	history_append(history_internHost(record, tab-record), tab+1, length-(tab+1-record));
+      } else {
+	history_append(history_host, record, length);
+      }
+    }
+  }
+
+  fclose(fp);
+}
+
+
+static int
+history_lock(void)
+{
+  // retried when the log is renamed over between the open and getting the lock
+  for (int i = 0; i < 5; i++) {
+    int fd = open(history_filename, O_WRONLY|O_APPEND|O_CREAT, 0600);
+    if (fd < 0) {
+      return -1;
+    }
+#ifndef _WIN32
+    struct stat locked, current;
+    if (flock(fd, LOCK_EX) == 0 && fstat(fd, &locked) == 0 &&
+	stat(history_filename, &current) == 0 && locked.st_ino == current.st_ino) {
+      return fd;
+    }
+    close(fd);
+#else
+    return fd;
+#endif
+  }
+
+  return -1;
+}
+
+
+static void
+history_compact(void)
+{
+  int fd = history_lock();
+  if (fd < 0) {
+    return;
+  }
+
+  // pick up anything appended since we loaded
+  history_readLog();
+
+  char temp[PATH_MAX];
+  snprintf(temp, sizeof(temp), "%s.%d", history_filename, (int)getpid());
+  FILE* fp = fopen(temp, "w");
+
+  if (fp) {
+    int skip = history_liveCount > HISTORY_MAX_ENTRIES ? history_liveCount - HISTORY_MAX_ENTRIES : 0;
+    int failed = 0;
+
+    for (int i = 0; i < history_count && !failed; i++) {
+      if (history_entries[i].live && skip-- <= 0) {
+	failed = fprintf(fp, "%s\t%s\n", history_hosts[history_entries[i].host], history_entries[i].line) < 0;
+      }
+    }
+
+    if (fclose(fp) != 0 || failed || rename(temp, history_filename) != 0) {
+      unlink(temp);
+    }
+  }
+
+  close(fd);
+
+  history_readLog();
+}
+
+
+void
+history_open(const char* filename, const char* host)
+{
+  history_cleanup();
+
+  if (!(history_filename = strdup(filename))) {
+    fatalError("out of memory");
+  }
+  history_host = history_internHost(host, strlen(host));
+
+  history_readLog();
+
+  if (!history_buckets) {
+    // no log yet
+    history_inode = (ino_t)-1;
+    history_allocate();
+    return;
+  }
+
+  if (history_count - history_liveCount > history_liveCount + HISTORY_COMPACT_SLACK ||
+      history_liveCount > HISTORY_MAX_ENTRIES) {
+    history_compact();
+  }
+}
+
+
+void
+history_sync(void)
+{
+  if (history_filename) {
+    history_readLog();
+  }
+}
+
+
+void
+history_add(const char* line)
+{
+  if (!line || !*line || strchr(line, '\n') || history_host < 0) {
+    return;
+  }
+
+  int fd = history_filename ? history_lock() : -1;
+  int written = 0;
+
+  if (fd >= 0) {
+    size_t length = strlen(history_hosts[history_host]) + strlen(line) + 2;
+    char* record = malloc(length+1);
+    if (record) {
+      snprintf(record, length+1, "%s\t%s\n", history_hosts[history_host], line);
+      written = write(fd, record, length) == (ssize_t)length;
+      free(record);
+    }
+    close(fd);
+  }
+
+  if (written) {
+    // our line comes back in file order, after whatever other sessions appended
+    history_readLog();
+  } else {
+    // no usable history file, keep the session's history in memory only
+    history_append(history_host, line, strlen(line));
+  }
+}
+
+
+const char*
+history_get(int id)
+{
+  if (id < 0 || id >= history_count) {
+    return 0;
+  }
+  return history_entries[id].line;
+}
+
+
+static int
+history_visible(int id)
+{
+  return history_entries[id].live && history_entries[id].host == history_host;
+}
+
+
+int
+history_previous(int id)
+{
+  if (id < 0) {
+    id = history_count;
+  }
+
+  for (int i = id-1; i >= 0; i--) {
+    if (history_visible(i)) {
+      return i;
+    }
+  }
+
+  return id < history_count ? id : -1;
+}
+
+
+int
+history_next(int id)
+{
+  if (id < 0) {
+    return -1;
+  }
+
+  for (int i = id+1; i < history_count; i++) {
+    if (history_visible(i)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+static void
+history_addMatch(int id)
+{
+  if (!history_matches) {
+    if (!(history_matches = malloc((history_count+1)*sizeof(int)))) {
+      fatalError("out of memory");
+    }
+  }
+  history_matches[history_matchCount++] = id;
+}
+
+
+static void
+history_findMatches(const char* substring)
+{
+  int narrowing = history_query && history_matchGeneration == history_count && strstr(substring, history_query);
+
+  if (narrowing) {
+    // typing another character only ever removes matches
+    int count = history_matchCount;
+    history_matchCount = 0;
+    for (int i = 0; i < count; i++) {
+      if (strstr(history_entries[history_matches[i]].line, substring)) {
+	history_matches[history_matchCount++] = history_matches[i];
+      }
+    }
+  } else {
+    free(history_matches);
+    history_matches = 0;
+    history_matchCount = 0;
+
+    history_posting_t* shortest = 0;
+    for (size_t i = 0; substring[i] && substring[i+1] && substring[i+2]; i++) {
+      history_posting_t* posting = &history_trigrams[history_trigramHash(&substring[i])];
+      if (!shortest || posting->count < shortest->count) {
+	shortest = posting;
+      }
+    }
+
+    if (shortest) {
+      for (int i = shortest->count-1; i >= 0; i--) {
+	int id = shortest->ids[i];
+	if (history_visible(id) && strstr(history_entries[id].line, substring)) {
+	  history_addMatch(id);
+	}
+      }
+    } else {
+      for (int id = history_count-1; id >= 0; id--) {
+	if (history_visible(id) && strstr(history_entries[id].line, substring)) {
+	  history_addMatch(id);
+	}
+      }
+    }
+  }
+
+  free(history_query);
+  history_query = strdup(substring);
+  history_matchGeneration = history_count;
+}
+
+
+const char*
+history_search(const char* substring, int n)
+{
+  if (!substring || n < 0 || !history_trigrams) {
+    return 0;
+  }
+
+  if (!history_query || history_matchGeneration != history_count || strcmp(substring, history_query) != 0) {
+    history_findMatches(substring);
+  }
+
+  return n < history_matchCount ? history_entries[history_matches[n]].line : 0;
+}
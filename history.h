@@ -0,0 +1,25 @@
+#pragma once
+
+void
+history_open(const char* filename, const char* host);
+
+void
+history_cleanup(void);
+
+void
+history_sync(void);
+
+void
+history_add(const char* line);
+
+const char*
+history_get(int id);
+
+int
+history_previous(int id);
+
+int
+history_next(int id);
+
+const char*
+history_search(const char* substring, int n);
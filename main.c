@@ -19,10 +19,7 @@ int main_socketFd = 0;
 _Noreturn void
 main_cleanupAndExit(int errorCode)
 {
-  if (main_socketFd) {
-    close(main_socketFd);
-    main_socketFd = 0;
-  }
+  util_disconnect(0);
   backup_cleanup();
   cli_cleanup();
   cwd_cleanup();
@@ -30,9 +27,19 @@ main_cleanupAndExit(int errorCode)
   suck_cleanup();
   dir_cleanup();
   srl_cleanup();
+  history_cleanup();
   squirt_cleanup();
   restore_cleanup();
   protect_cleanup();
+  archive_cleanup();
+  master_cleanup();
+  hello_cleanup();
+  watch_cleanup();
+  sync_cleanup();
+  fanout_cleanup();
+  tree_cleanup();
+  cache_cleanup();
+  trace_cleanup();
   exit(errorCode);
 }
 
@@ -53,6 +60,7 @@ main_fatalError(const char *format, ...)
 int main(int argc, char* argv[])
 {
   main_argv0 = argv[0];
+  argc = trace_parseArgs(argc, argv);
 
   setlocale(LC_NUMERIC, "");
 
@@ -82,9 +90,21 @@ int main(int argc, char* argv[])
     restore_main(argc, argv);
   } else if (strstr(basename(argv[0]), "squirt_cwd")) {
     cwd_main(argc, argv);
+  } else if (strstr(basename(argv[0]), "squirt_archive")) {
+    archive_main(argc, argv);
+  } else if (strstr(basename(argv[0]), "squirt_master")) {
+    master_main(argc, argv);
+  } else if (strstr(basename(argv[0]), "squirt_rtt")) {
+    rtt_main(argc, argv);
+  } else if (strstr(basename(argv[0]), "squirt_stats")) {
+    stats_main(argc, argv);
+  } else if (strstr(basename(argv[0]), "squirt_sync")) {
+    sync_main(argc, argv);
   } else {
     squirt_main(argc, argv);
   }
 
+  // finished between commands, a borrowed session can be reused
+  util_disconnect(1);
   main_cleanupAndExit(EXIT_SUCCESS);
 }
@@ -6,12 +6,25 @@
 #include "exec.h"
 #include "suck.h"
 #include "srl.h"
+#include "history.h"
 #include "dir.h"
 #include "main.h"
 #include "backup.h"
 #include "squirt.h"
 #include "restore.h"
 #include "protect.h"
+#include "archive.h"
+#include "fsop.h"
+#include "master.h"
+#include "rtt.h"
+#include "hello.h"
+#include "trace.h"
+#include "stats.h"
+#include "watch.h"
+#include "sync.h"
+#include "fanout.h"
+#include "tree.h"
+#include "cache.h"
 
 #ifndef _WIN32
 #include <netinet/in.h>
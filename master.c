@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "main.h"
+#include "common.h"
+
+/*
+ * Connection master, similar to ssh's ControlMaster.
+ *
+ * squirt_master listens on a unix socket named after the host. util_connect() tries that socket
+ * first: the master passes it an already connected squirtd session, and the tool passes it back
+ * when it finishes between commands. A tool that fails or is interrupted keeps its session and
+ * it's closed with the tool, so only sessions known to be in sync are reused.
+ *
+ * Returned sessions are moved back to the directory the first session started in, so every tool
+ * starts where a fresh connection would. Sessions left idle for too long are closed.
+ */
+
+#define MASTER_MAX_CLIENTS        64
+#define MASTER_DEFAULT_IDLE       300
+#define MASTER_DEFAULT_SESSIONS   1
+#define MASTER_REPLY_TIMEOUT_MS   5000
+
+#ifndef _WIN32
+typedef struct {
+  int fd;
+  time_t idleSince;
+} master_session_t;
+
+static char* master_path = 0;
+static int master_listenFd = -1;
+static master_session_t master_idle[MASTER_MAX_CLIENTS];
+static int master_idleCount = 0;
+static int master_waiting[MASTER_MAX_CLIENTS];  // clients queued for a session
+static int master_waitingCount = 0;
+static int master_borrowers[MASTER_MAX_CLIENTS]; // clients holding a session
+static int master_borrowerCount = 0;
+static int master_sessionCount = 0;              // idle and lent
+static char* master_cwd = 0;
+#endif
+
+
+void
+master_cleanup(void)
+{
+#ifndef _WIN32
+  if (master_listenFd >= 0) {
+    close(master_listenFd);
+    master_listenFd = -1;
+    if (master_path) {
+      unlink(master_path);
+    }
+  }
+
+  for (int i = 0; i < master_idleCount; i++) {
+    close(master_idle[i].fd);
+  }
+  master_idleCount = 0;
+
+  for (int i = 0; i < master_waitingCount; i++) {
+    close(master_waiting[i]);
+  }
+  master_waitingCount = 0;
+
+  for (int i = 0; i < master_borrowerCount; i++) {
+    close(master_borrowers[i]);
+  }
+  master_borrowerCount = 0;
+  master_sessionCount = 0;
+
+  if (master_path) {
+    free(master_path);
+    master_path = 0;
+  }
+
+  if (master_cwd) {
+    free(master_cwd);
+    master_cwd = 0;
+  }
+#endif
+}
+
+
+#ifndef _WIN32
+static void
+master_onSignal(int signal)
+{
+  (void)signal;
+  main_cleanupAndExit(EXIT_SUCCESS);
+}
+
+
+static void
+master_onExit(void)
+{
+  main_cleanupAndExit(EXIT_SUCCESS);
+}
+
+
+static int
+master_recvU32(int fd, uint32_t* value)
+{
+  // a daemon that has gone away shouldn't hang every tool waiting on the master
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  if (util_flush(fd) != 0 || poll(&pfd, 1, MASTER_REPLY_TIMEOUT_MS) != 1) {
+    return -1;
+  }
+  return util_recvU32(fd, value);
+}
+
+
+static char*
+master_readCwd(int fd)
+{
+  uint32_t length, error;
+  char* cwd = 0;
+
+  if (util_sendCommand(fd, SQUIRT_COMMAND_CWD) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(fd, "cwd") != 0 ||
+      master_recvU32(fd, &length) != 0 ||
+      !(cwd = util_recvLatin1AsUtf8(fd, length)) ||
+      master_recvU32(fd, &error) != 0) {
+    free(cwd);
+    return 0;
+  }
+
+  return cwd;
+}
+
+
+static int
+master_resetSession(int fd)
+{
+  uint32_t error;
+
+  if (!master_cwd) {
+    return 0;
+  }
+
+  // also proves the session is still in step with the daemon
+  if (util_sendCommand(fd, SQUIRT_COMMAND_CD) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(fd, master_cwd) != 0 ||
+      master_recvU32(fd, &error) != 0 || error != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static int
+master_openSession(const char* hostname, int port)
+{
+  if (master_idleCount > 0) {
+    // the most recently used session is the least likely to have timed out
+    return master_idle[--master_idleCount].fd;
+  }
+
+  int fd = util_connectSocket(hostname, port);
+  if (fd < 0) {
+    fprintf(stderr, "%s: failed to connect to server %s:%d\n", main_argv0, hostname, port);
+    return -1;
+  }
+
+  if (!master_cwd && !(master_cwd = master_readCwd(fd))) {
+    close(fd);
+    return -1;
+  }
+
+  master_sessionCount++;
+  return fd;
+}
+
+
+static void
+master_closeSession(int fd)
+{
+  close(fd);
+  master_sessionCount--;
+}
+
+
+static void
+master_idleSession(int fd)
+{
+  if (master_resetSession(fd) != 0 || master_idleCount == MASTER_MAX_CLIENTS) {
+    master_closeSession(fd);
+    return;
+  }
+
+  master_idle[master_idleCount].fd = fd;
+  master_idle[master_idleCount].idleSince = time(0);
+  master_idleCount++;
+}
+
+
+static void
+master_removeIdle(int index)
+{
+  master_closeSession(master_idle[index].fd);
+  memmove(&master_idle[index], &master_idle[index+1], (master_idleCount-index-1)*sizeof(master_session_t));
+  master_idleCount--;
+}
+
+
+static void
+master_serveWaiting(const char* hostname, int port, int maxSessions)
+{
+  while (master_waitingCount > 0 && (master_idleCount > 0 || master_sessionCount < maxSessions)) {
+    int client = master_waiting[0];
+    memmove(&master_waiting[0], &master_waiting[1], (--master_waitingCount)*sizeof(int));
+
+    int fd = master_openSession(hostname, port);
+    if (fd < 0) {
+      // the tool falls back to connecting itself and reports the error
+      close(client);
+      continue;
+    }
+
+    if (util_sendFd(client, fd) != 0) {
+      close(client);
+      master_idleSession(fd);
+      continue;
+    }
+
+    // the tool owns the session now, our copy isn't needed
+    close(fd);
+    master_borrowers[master_borrowerCount++] = client;
+  }
+}
+
+
+static int
+master_listen(const char* path)
+{
+  struct sockaddr_un addr = {0};
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fatalError("socket path too long: %s", path);
+  }
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fatalError("failed to create socket");
+  }
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    fatalError("a master is already running on %s", path);
+  }
+  close(fd);
+
+  // whatever is left is from a master that didn't exit cleanly
+  unlink(path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    fatalError("failed to create socket");
+  }
+
+  mode_t mask = umask(077);
+  int failed = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0;
+  umask(mask);
+
+  if (failed || listen(fd, MASTER_MAX_CLIENTS) != 0) {
+    close(fd);
+    fatalError("failed to listen on %s: %s", path, strerror(errno));
+  }
+
+  return fd;
+}
+
+
+static void
+master_usage(void)
+{
+  fatalError("usage: %s [--idle=seconds] [--sessions=count] hostname", main_argv0);
+}
+#endif
+
+
+void
+master_main(int argc, char* argv[])
+{
+#ifdef _WIN32
+  (void)argc,(void)argv;
+  fatalError("squirt_master is not supported on this platform");
+#else
+  int argvIndex = 1;
+  int idleTimeout = MASTER_DEFAULT_IDLE, maxSessions = MASTER_DEFAULT_SESSIONS;
+  char* hostname = 0;
+
+  while (argvIndex < argc) {
+    static struct option long_options[] =
+      {
+       {"idle", required_argument, 0, 'i'},
+       {"sessions", required_argument, 0, 's'},
+       {0, 0, 0, 0}
+      };
+    int option_index = 0;
+    int c = getopt_long (argc, argv, "", long_options, &option_index);
+    if (c != -1) {
+      argvIndex = optind;
+      switch (c) {
+      case 0:
+	break;
+      case 'i':
+	idleTimeout = atoi(optarg);
+	break;
+      case 's':
+	maxSessions = atoi(optarg);
+	break;
+      case '?':
+      default:
+	master_usage();
+	break;
+      }
+    } else {
+      if (hostname == 0) {
+	hostname = argv[argvIndex];
+      } else {
+	master_usage();
+      }
+      optind++;
+      argvIndex++;
+    }
+  }
+
+  if (hostname == 0 || idleTimeout <= 0 || maxSessions <= 0 || maxSessions > MASTER_MAX_CLIENTS) {
+    master_usage();
+  }
+
+  int port = util_hostnamePort(hostname);
+
+  util_mkpath("/tmp/.squirt");
+  if (!(master_path = strdup(util_getMasterPath(hostname, port)))) {
+    fatalError("out of memory");
+  }
+
+  master_listenFd = master_listen(master_path);
+
+  util_onCtrlC(master_onExit);
+  signal(SIGTERM, master_onSignal);
+  signal(SIGHUP, master_onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%s: holding sessions to %s:%d on %s\n", main_argv0, hostname, port, master_path);
+  fflush(stdout);
+
+  for (;;) {
+    struct pollfd fds[1+MASTER_MAX_CLIENTS*2];
+    int nfds = 0;
+
+    // stop accepting while the queue is full, the backlog holds the rest
+    fds[nfds].fd = master_listenFd;
+    fds[nfds++].events = master_waitingCount < MASTER_MAX_CLIENTS ? POLLIN : 0;
+
+    for (int i = 0; i < master_borrowerCount; i++) {
+      fds[nfds].fd = master_borrowers[i];
+      fds[nfds++].events = POLLIN;
+    }
+
+    // an idle session only becomes readable when the daemon closes it
+    for (int i = 0; i < master_idleCount; i++) {
+      fds[nfds].fd = master_idle[i].fd;
+      fds[nfds++].events = POLLIN;
+    }
+
+    int timeout = -1;
+    time_t now = time(0);
+    for (int i = 0; i < master_idleCount; i++) {
+      int remaining = (int)(master_idle[i].idleSince + idleTimeout - now);
+      if (remaining < 0) {
+	remaining = 0;
+      }
+      if (timeout < 0 || remaining*1000 < timeout) {
+	timeout = remaining*1000;
+      }
+    }
+
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      fatalError("poll failed: %s", strerror(errno));
+    }
+
+    // walk backwards so removals don't disturb the fds still to be checked
+    int idleBase = 1+master_borrowerCount;
+    now = time(0);
+    for (int i = master_idleCount-1; i >= 0; i--) {
+      if (fds[idleBase+i].revents || now - master_idle[i].idleSince >= idleTimeout) {
+	master_removeIdle(i);
+      }
+    }
+
+    for (int i = master_borrowerCount-1; i >= 0; i--) {
+      if (fds[1+i].revents) {
+	int client = master_borrowers[i];
+	int fd = util_recvFd(client);
+	close(client);
+	memmove(&master_borrowers[i], &master_borrowers[i+1], (master_borrowerCount-i-1)*sizeof(int));
+	master_borrowerCount--;
+
+	if (fd >= 0) {
+	  master_idleSession(fd);
+	} else {
+	  // the tool closed the session itself
+	  master_sessionCount--;
+	}
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int client = accept(master_listenFd, 0, 0);
+      if (client >= 0) {
+	master_waiting[master_waitingCount++] = client;
+      }
+    }
+
+    master_serveWaiting(hostname, port, maxSessions);
+  }
+#endif
+}
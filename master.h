@@ -0,0 +1,7 @@
+#pragma once
+
+void
+master_cleanup(void);
+
+void
+master_main(int argc, char* argv[]);
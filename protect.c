@@ -21,6 +21,10 @@ int
 protect_file(const char* filename, uint32_t protection, dir_datestamp_t* dateStamp)
 {
   dir_datestamp_t _dateStamp = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+  trace_span_t span;
+
+  trace_begin(&span);
+
   if (dateStamp == 0) {
     dateStamp = &_dateStamp;
   }
@@ -55,6 +59,10 @@ protect_file(const char* filename, uint32_t protection, dir_datestamp_t* dateSta
     fatalError("protect: failed to read remote status");
   }
 
+  trace_end(&span, "protect", filename);
+
+  dir_invalidate(filename);
+
   if (error != 0) {
     fprintf(stderr, "\n**FAILED** to protect %s\n%s\n", filename, util_getErrorString(error));
   }
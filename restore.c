@@ -10,11 +10,17 @@
 #include <limits.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 
 #include "main.h"
 #include "common.h"
 #include "exall.h"
+#include "archive.h"
 
 typedef enum {
   UPDATE_NOUPDATE,
@@ -22,18 +28,70 @@ typedef enum {
   UPDATE_EXALL,
 } restore_update_t;
 
+typedef enum {
+  PLAN_MKDIR,
+  PLAN_UPLOAD,
+  PLAN_EXALL,
+  PLAN_VERIFY,
+} restore_plan_op_t;
+
+typedef struct {
+  restore_plan_op_t op;
+  int isDir;
+  char* path;                 // Amiga path
+  char* localDir;             // directory holding the backup copy, 0 for archive restores
+  char* localName;
+  uint32_t size;
+  dir_entry_t* info;          // metadata to apply, owned by the plan unless archived
+  archive_entry_t* archived;
+} restore_plan_item_t;
+
 static char* restore_currentDir = 0;
 static char* restore_dirBuffer = 0;
 static char* restore_skipFile = 0;
 static int restore_quiet = 0;
 static int restore_crcVerify = 0;
+static archive_t* restore_archive = 0;
+static char* restore_archiveFile = 0;
+static char* restore_hostname = 0;
+static int restore_dryRun = 0;
+static int restore_jobs = 1;
+static restore_plan_item_t* restore_plan = 0;
+static uint32_t restore_planCount = 0;
+static uint32_t restore_planCapacity = 0;
 
 static void
-restore_restoreDir(const char* remote);
+restore_restoreDir(const char* remote, int remoteExists);
 
 void
 restore_cleanup()
 {
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    restore_plan_item_t* item = &restore_plan[i];
+    free(item->path);
+    free(item->localDir);
+    free(item->localName);
+    if (item->info && !item->archived) {
+      dir_freeEntry(item->info);
+    }
+  }
+
+  if (restore_plan) {
+    free(restore_plan);
+    restore_plan = 0;
+  }
+  restore_planCount = restore_planCapacity = 0;
+
+  if (restore_hostname) {
+    free(restore_hostname);
+    restore_hostname = 0;
+  }
+
+  if (restore_archiveFile) {
+    free(restore_archiveFile);
+    restore_archiveFile = 0;
+  }
+
   if (restore_currentDir) {
     free(restore_currentDir);
     restore_currentDir = 0;
@@ -49,6 +107,10 @@ restore_cleanup()
     restore_skipFile = 0;
   }
 
+  if (restore_archive) {
+    archive_close(restore_archive);
+    restore_archive = 0;
+  }
 }
 
 
@@ -120,64 +182,9 @@ restore_pushDir(const char* dir)
     strcpy(restore_currentDir, dir);
   }
 
-  if (util_cd(restore_currentDir) != 0) {
-    // Directory doesn't exist, try to create it
-    printf("Directory %s doesn't exist, creating it...\n", restore_currentDir);
-    
-    // Use CLI command to create the directory
-    char createDirCmd[PATH_MAX];
-    snprintf(createDirCmd, sizeof(createDirCmd), "makedir \"%s\"", restore_currentDir);
-    
-    if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_CLI) != 0) {
-      fatalError("failed to connect to squirtd server");
-    }
-    
-    if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, createDirCmd) != 0) {
-      fatalError("send() makedir command failed");
-    }
-    
-    // Read the command output using the same pattern as exec_cmd
-    uint8_t c;
-    char buffer[1024];
-    int bindex = 0;
-    int exitState = 0;
-    while (util_recv(main_socketFd, &c, 1, 0) == 1) {
-      if (c == 0) {
-        exitState++;
-        if (exitState == 4) {
-          break;
-        }
-      } else if (c == 0x9B) {
-        buffer[bindex] = 0;
-        // Optionally print output for debugging
-        // printf("%s", buffer);
-        bindex = 0;
-      } else {
-        buffer[bindex++] = c;
-        if (c == '\n' || bindex == sizeof(buffer)-1) {
-          buffer[bindex] = 0;
-          // Optionally print output for debugging
-          // printf("%s", buffer);
-          bindex = 0;
-        }
-      }
-    }
-    
-    uint32_t error;
-    if (util_recvU32(main_socketFd, &error) != 0) {
-      fatalError("makedir: failed to read remote status");
-    }
-    
-    if (error != 0) {
-      fatalError("failed to create directory %s (error: %d)", restore_currentDir, error);
-    }
-    
-    printf("Directory %s created successfully\n", restore_currentDir);
-    
-    // Now try to change to the directory again
-    if (util_cd(restore_currentDir) != 0) {
-      fatalError("unable to restore %s even after creating it", restore_currentDir);
-    }
+  if (restore_archive) {
+    // nothing to walk locally, the archive index stands in for the backup tree
+    return getcwd(0, 0);
   }
 
   char* safe = util_safeName(dir);
@@ -214,28 +221,66 @@ restore_popDir(char* cwd)
 }
 
 
-static int
-restore_updateExAll(const char* filename, const char* path)
+int
+restore_applyExAll(dir_entry_t* entry, const char* filename, const char* path)
 {
-  dir_entry_t *temp = dir_newDirEntry();
-  if (!exall_readExAllData(temp, filename)) {
-    fatalError("unabled to read exall data for %s\n", filename);
-  }
-
-  int error =  protect_file(path, temp->prot, &temp->ds);
+  int error =  protect_file(path, entry->prot, &entry->ds);
 
-  if (temp->comment && strlen(temp->comment) > 0) {
+  if (entry->comment && strlen(entry->comment) > 0) {
     char buffer[PATH_MAX];
-    snprintf(buffer, sizeof(buffer), "filenote \"%s\" \"%s\"", path, temp->comment);
+    snprintf(buffer, sizeof(buffer), "filenote \"%s\" \"%s\"", path, entry->comment);
     if (util_exec(buffer) != 0) {
       fprintf(stderr, "failed to set comment %s\n", filename);
     }
+    dir_invalidate(path);
   }
 
-    dir_freeEntry(temp);
+  return error;
+}
 
 
-  return error;
+static dir_entry_t*
+restore_readExAll(const char* filename)
+{
+  dir_entry_t *temp = dir_newDirEntry();
+  if (!exall_readExAllData(temp, filename)) {
+    fatalError("unabled to read exall data for %s\n", filename);
+  }
+  return temp;
+}
+
+
+static int
+restore_sameDatestamp(dir_entry_t* a, dir_entry_t* b)
+{
+  return a->ds.days == b->ds.days && a->ds.mins == b->ds.mins && a->ds.ticks == b->ds.ticks;
+}
+
+
+static void
+restore_addToPlan(restore_plan_op_t op, int isDir, const char* path, const char* localName, uint32_t size, dir_entry_t* info, archive_entry_t* archived)
+{
+  if (restore_planCount == restore_planCapacity) {
+    restore_planCapacity = restore_planCapacity ? restore_planCapacity*2 : 256;
+    restore_plan = realloc(restore_plan, restore_planCapacity*sizeof(restore_plan_item_t));
+    if (!restore_plan) {
+      fatalError("out of memory");
+    }
+  }
+
+  restore_plan_item_t* item = &restore_plan[restore_planCount++];
+  item->op = op;
+  item->isDir = isDir;
+  item->path = strdup(path);
+  item->localDir = archived ? 0 : getcwd(0, 0);
+  item->localName = localName ? strdup(localName) : 0;
+  item->size = size;
+  item->info = info;
+  item->archived = archived;
+
+  if (!item->path || (!archived && !item->localDir)) {
+    fatalError("out of memory");
+  }
 }
 
 
@@ -263,7 +308,12 @@ restore_remoteFileNeedsUpdating(const char* filename, int isDir, dir_entry_t* li
 	  fatalError("unable to read exall data for %s\n", filename);
 	}
 	if (!exall_identicalExAllData(temp, entry)) {
-	  update = UPDATE_EXALL;
+	  // a file with a different datestamp may have different contents too
+	  if (isDir || restore_sameDatestamp(temp, entry)) {
+	    update = UPDATE_EXALL;
+	  } else {
+	    update = UPDATE_CREATE;
+	  }
 	}
       } else if (st.st_size != (off_t)entry->size) {
 	update = UPDATE_CREATE;
@@ -322,14 +372,6 @@ restore_operation(const char* filename, void* data)
   dir_entry_t* entry = data;
   char* path = restore_fullPath(filename);
 
-  // On restore, filename is already the safe filename (with prefix)
-  // We need to use it as source for reading, but send the original name to Amiga
-  char* safeFilename = strdup(filename);
-  if (!safeFilename) {
-    free(path);
-    fatalError("failed to duplicate filename %s", filename);
-  }
-  
   // Get original filename by removing "squirt_" prefix if present (Windows only)
   const char* originalFilename = filename;
 #ifdef _WIN32
@@ -338,7 +380,8 @@ restore_operation(const char* filename, void* data)
   }
 #endif
 
-  // Create path with original filename for Amiga operations
+  // Create path with original filename for Amiga operations, the
+  // local safe filename is what gets read
   char* originalPath = restore_fullOriginalPath(filename);
 
   int isDir = util_isDirectory(filename);
@@ -346,152 +389,35 @@ restore_operation(const char* filename, void* data)
 
   if (isDir) {
     if (update == UPDATE_CREATE) {
-      char buffer[PATH_MAX];
-      snprintf(buffer, sizeof(buffer), "makedir \"%s\"", path);
-      if (util_exec(buffer) != 0) {
-	fatalError("failed to create %s", filename);
-      }
+      restore_addToPlan(PLAN_MKDIR, 1, originalPath, filename, 0, 0, 0);
     }
-    restore_restoreDir(filename);
-    switch (update) {
-    case UPDATE_CREATE:
-    case UPDATE_EXALL:
-      printf("\xE2\x8C\x9B %s restoring...", path); // utf-8 hourglass
-      fflush(stdout);
-
-      if (restore_updateExAll(originalFilename, originalPath) != 0) {
-	fatalError("failed to update ExAll for %s", originalFilename);
-      }
-
-#ifndef _WIN32
-	printf("\r%c[K", 27);
-#else
-	printf("\r");
-#endif
-	printf("\xE2\x9C\x85 %s restoring...done\n", path); // utf-8 tick
-      break;
-    case UPDATE_NOUPDATE:
-
+    restore_restoreDir(filename, update != UPDATE_CREATE);
+    // directory metadata goes after the children, writing them changes the datestamp
+    if (update == UPDATE_NOUPDATE) {
       if (!restore_quiet) {
 	printf("\xE2\x9C\x85 %s\n", path); // utf-8 tick
       }
-      break;
+    } else {
+      restore_addToPlan(PLAN_EXALL, 1, originalPath, filename, 0, restore_readExAll(originalFilename), 0);
     }
   } else {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+      fatalError("unable to read %s\n", filename);
+    }
+
     switch (update) {
     case UPDATE_CREATE:
+      restore_addToPlan(PLAN_UPLOAD, 0, originalPath, filename, st.st_size, restore_readExAll(originalFilename), 0);
+      break;
     case UPDATE_EXALL:
-      printf("\xE2\x8C\x9B %s restoring...", path); // utf-8 hourglass
-      fflush(stdout);
-      char updateMessage[PATH_MAX];
-      sprintf(updateMessage, "\xE2\x9C\x85 %s updating...", path);
-      
-      // When restoring to Amiga, use the original filename as destination
-      // but read from local safe filename
-      int uploadAttempts = 0;
-      int maxAttempts = restore_crcVerify ? 3 : 1; // Allow retries only with CRC32 verification
-      
-      while (uploadAttempts < maxAttempts) {
-        uploadAttempts++;
-        
-        if (squirt_file(safeFilename, updateMessage, originalFilename, 1, restore_printProgress) != 0) {
-          fatalError("failed to restore %s\n", path);
-        }
-        
-        if (restore_crcVerify) {
-          int crcResult = backup_doCrcVerify(path);
-          if (crcResult == 1) {
-            // CRC mismatch
-            if (uploadAttempts < maxAttempts) {
-              printf("\n\xE2\x9D\x8C CRC32 mismatch for %s - retrying upload (attempt %d/%d)\n", path, uploadAttempts + 1, maxAttempts);
-              continue; // Retry upload
-            } else {
-              fatalError("CRC32 verification failed for %s after %d attempts", path, maxAttempts);
-            }
-          } else if (crcResult == 2) {
-            fatalError("CRC32 verification failed - remote file not found: %s", path);
-          }
-          // CRC verification passed (crcResult == 0)
-        }
-        
-        break; // Upload successful, exit retry loop
-      }
-      
-      if (restore_updateExAll(originalFilename, originalPath) != 0) {
-	fatalError("failed to update ExAll for %s", originalFilename);
-      }
-#ifndef _WIN32
-	printf("\r%c[K", 27);
-#else
-	printf("\r");
-#endif
-	if (restore_crcVerify) {
-	  printf("\xE2\x9C\x85 %s restoring...done (CRC OK)\n", path); // utf-8 tick with CRC verification
-	} else {
-	  printf("\xE2\x9C\x85 %s restoring...done\n", path); // utf-8 tick
-	}
+      restore_addToPlan(PLAN_EXALL, 0, originalPath, filename, 0, restore_readExAll(originalFilename), 0);
       break;
     case UPDATE_NOUPDATE:
-
       if (restore_crcVerify) {
-	int crcResult = backup_doCrcVerify(path);
-	if (crcResult == 1) {
-	  // CRC mismatch - file needs to be re-uploaded
-	  printf("\xE2\x9D\x8C CRC32 mismatch detected for %s - file will be re-uploaded\n", path);
-	  
-	  // Change update status to force re-upload
-	  printf("\xE2\x8C\x9B %s restoring...", path); // utf-8 hourglass
-	  fflush(stdout);
-	  
-	  // Perform upload with retry logic
-	  int retryAttempts = 0;
-	  int maxRetryAttempts = 3;
-	  
-	  while (retryAttempts < maxRetryAttempts) {
-	    retryAttempts++;
-	    
-	    if (squirt_file(safeFilename, path, originalFilename, 1, restore_printProgress) != 0) {
-	      fatalError("failed to restore %s\n", path);
-	    }
-	    
-	    int retryCrcResult = backup_doCrcVerify(path);
-	    if (retryCrcResult == 1) {
-	      // Still mismatch
-	      if (retryAttempts < maxRetryAttempts) {
-	        printf("\n\xE2\x9D\x8C CRC32 mismatch for %s - retrying upload (attempt %d/%d)\n", path, retryAttempts + 1, maxRetryAttempts);
-	        continue;
-	      } else {
-	        fatalError("CRC32 verification failed for %s after %d attempts", path, maxRetryAttempts);
-	      }
-	    } else if (retryCrcResult == 2) {
-	      fatalError("CRC32 verification failed - remote file not found: %s", path);
-	    }
-	    // CRC verification passed
-	    break;
-	  }
-	  
-	  if (restore_updateExAll(originalFilename, originalPath) != 0) {
-	    fatalError("failed to update ExAll for %s", originalFilename);
-	  }
-	  
-#ifndef _WIN32
-	  printf("\r%c[K", 27);
-#else
-	  printf("\r");
-#endif
-	  printf("\xE2\x9C\x85 %s restoring...done (CRC OK)\n", path); // utf-8 tick with CRC verification
-	} else if (crcResult == 2) {
-	  fatalError("CRC32 verification failed - remote file not found: %s", path);
-	} else {
-	  // CRC verification passed - file is identical
-	  if (!restore_quiet) {
-	    printf("\xE2\x9C\x85 %s (CRC verified - no change)\n", path); // utf-8 tick with CRC verification message
-	  }
-	}
-      } else {
-	if (!restore_quiet) {
-	  printf("\xE2\x9C\x85 %s\n", path); // utf-8 tick
-	}
+	restore_addToPlan(PLAN_VERIFY, 0, originalPath, filename, st.st_size, restore_readExAll(originalFilename), 0);
+      } else if (!restore_quiet) {
+	printf("\xE2\x9C\x85 %s\n", path); // utf-8 tick
       }
       break;
     }
@@ -502,6 +428,62 @@ restore_operation(const char* filename, void* data)
 }
 
 
+static void
+restore_archiveOperation(archive_entry_t* archived, dir_entry_t* list)
+{
+  dir_entry_t* info = &archived->info;
+  dir_entry_t* entry = list;
+  restore_update_t update = UPDATE_NOUPDATE;
+
+  while (entry) {
+    if (strcmp(entry->name, info->name) == 0) {
+      break;
+    }
+    entry = entry->next;
+  }
+
+  if (!entry || (info->type < 0 && entry->size != info->size)) {
+    update = UPDATE_CREATE;
+  } else if (!exall_identicalExAllData(info, entry)) {
+    update = UPDATE_EXALL;
+  }
+
+  char* path = restore_fullPath(info->name);
+
+  if (info->type > 0) {
+    if (update == UPDATE_CREATE) {
+      restore_addToPlan(PLAN_MKDIR, 1, path, 0, 0, 0, archived);
+    }
+    restore_restoreDir(info->name, update != UPDATE_CREATE);
+    if (update != UPDATE_NOUPDATE) {
+      restore_addToPlan(PLAN_EXALL, 1, path, 0, 0, info, archived);
+    }
+  } else if (update == UPDATE_CREATE) {
+    restore_addToPlan(PLAN_UPLOAD, 0, path, 0, info->size, info, archived);
+  } else if (update == UPDATE_EXALL) {
+    restore_addToPlan(PLAN_EXALL, 0, path, 0, 0, info, archived);
+  }
+
+  if (update == UPDATE_NOUPDATE && !restore_quiet) {
+    printf("\xE2\x9C\x85 %s\n", path); // utf-8 tick
+  }
+
+  free(path);
+}
+
+
+static void
+restore_archiveList(dir_entry_list_t* list)
+{
+  archive_entry_t* archived = archive_children(restore_archive, restore_currentDir);
+
+  while (archived) {
+    restore_archiveOperation(archived, list->head);
+    archived = archived->childNext;
+  }
+}
+
+
 static int
 restore_skip(const char* filename)
 {
@@ -521,13 +503,25 @@ restore_skip(const char* filename)
 static void
 restore_list(dir_entry_list_t* list)
 {
-  util_dirOperation(".", restore_operation, list->head);
+  if (restore_archive) {
+    restore_archiveList(list);
+  } else {
+    util_dirOperation(".", restore_operation, list->head);
+  }
 
   dir_entry_t* entry = list->head;
   while (entry) {
     struct stat st;
     if (!restore_skip(entry->name)) {
-      if (stat(entry->name, &st) != 0) {
+      int exists;
+      if (restore_archive) {
+	char* path = restore_fullPath(entry->name);
+	exists = archive_find(restore_archive, path) != 0;
+	free(path);
+      } else {
+	exists = stat(entry->name, &st) == 0;
+      }
+      if (!exists) {
 	char* path = restore_fullPath(entry->name);
 	char* cwd = getcwd(0, 0);
 	if (!cwd) {
@@ -542,78 +536,441 @@ restore_list(dir_entry_list_t* list)
 }
 
 static void
-restore_restoreDir(const char* remote)
+restore_restoreDir(const char* remote, int remoteExists)
 {
   char* local = restore_pushDir(remote);
 
-  if (dir_process(restore_currentDir, restore_list) != 0) {
-    // Directory doesn't exist, try to create it
-    printf("Directory %s doesn't exist, creating it...\n", remote);
-    
-    // Use CLI command to create the directory
-    char createDirCmd[PATH_MAX];
-    snprintf(createDirCmd, sizeof(createDirCmd), "makedir \"%s\"", remote);
-    
-    if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_CLI) != 0) {
-      fatalError("failed to connect to squirtd server");
+  if (remoteExists) {
+    if (dir_process(restore_currentDir, restore_list) != 0) {
+      fatalError("unable to read %s", restore_currentDir);
     }
-    
-    if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, createDirCmd) != 0) {
-      fatalError("send() makedir command failed");
+  } else {
+    // nothing on the Amiga yet, everything below here gets created
+    dir_entry_list_t empty = {0};
+    restore_list(&empty);
+  }
+
+  restore_popDir(local);
+}
+
+
+static int
+restore_planMissingDirs(const char* dir)
+{
+  size_t length = strlen(dir);
+
+  if (length == 0 || dir[length-1] == ':' || util_cd(dir) == 0) {
+    return 1;
+  }
+
+  char* parent = strdup(dir);
+  if (!parent) {
+    fatalError("out of memory");
+  }
+
+  char* slash = strrchr(parent, '/');
+  if (slash) {
+    *slash = 0;
+  } else {
+    char* colon = strchr(parent, ':');
+    if (colon) {
+      *(colon+1) = 0;
+    } else {
+      *parent = 0;
     }
-    
-    // Read the command output using the same pattern as exec_cmd
-    uint8_t c;
-    char buffer[1024];
-    int bindex = 0;
-    int exitState = 0;
-    while (util_recv(main_socketFd, &c, 1, 0) == 1) {
-      if (c == 0) {
-        exitState++;
-        if (exitState == 4) {
-          break;
-        }
-      } else if (c == 0x9B) {
-        buffer[bindex] = 0;
-        // Optionally print output for debugging
-        // printf("%s", buffer);
-        bindex = 0;
-      } else {
-        buffer[bindex++] = c;
-        if (c == '\n' || bindex == sizeof(buffer)-1) {
-          buffer[bindex] = 0;
-          // Optionally print output for debugging
-          // printf("%s", buffer);
-          bindex = 0;
-        }
+  }
+
+  restore_planMissingDirs(parent);
+  free(parent);
+
+  restore_addToPlan(PLAN_MKDIR, 1, dir, 0, 0, 0, 0);
+  return 0;
+}
+
+
+static void
+restore_printDone(const char* path, const char* status)
+{
+  if (restore_jobs == 1) {
+#ifndef _WIN32
+    printf("\r%c[K", 27);
+#else
+    printf("\r");
+#endif
+  }
+  printf("\xE2\x9C\x85 %s %s\n", path, status); // utf-8 tick
+  fflush(stdout);
+}
+
+
+static void
+restore_upload(restore_plan_item_t* item, int maxAttempts)
+{
+  char updateMessage[PATH_MAX];
+  snprintf(updateMessage, sizeof(updateMessage), "\xE2\x9C\x85 %s updating...", item->path);
+
+  // interleaved progress bars from several jobs would be unreadable
+  void (*progress)(const char*, struct timeval*, uint32_t, uint32_t) = restore_jobs == 1 ? restore_printProgress : 0;
+
+  if (restore_jobs == 1) {
+    printf("\xE2\x8C\x9B %s restoring...", item->path); // utf-8 hourglass
+    fflush(stdout);
+  }
+
+  for (int attempt = 1;; attempt++) {
+    int error;
+
+    if (item->archived) {
+      error = archive_readBody(restore_archive, item->archived) != 0 ||
+	squirt_fileFromFd(restore_archive->fd, item->size, item->path, updateMessage, item->path, item->info, progress) != 0;
+    } else {
+      error = squirt_fileWithInfo(item->localName, updateMessage, item->path, item->info, progress) != 0;
+    }
+
+    if (error) {
+      fatalError("failed to restore %s\n", item->path);
+    }
+
+    if (!restore_crcVerify) {
+      break;
+    }
+
+    int crcResult = backup_doCrcVerify(item->path);
+    if (crcResult == 0) {
+      break;
+    } else if (crcResult == 2) {
+      fatalError("CRC32 verification failed - remote file not found: %s", item->path);
+    } else if (attempt >= maxAttempts) {
+      fatalError("CRC32 verification failed for %s after %d attempts", item->path, maxAttempts);
+    }
+
+    printf("\n\xE2\x9D\x8C CRC32 mismatch for %s - retrying upload (attempt %d/%d)\n", item->path, attempt + 1, maxAttempts);
+  }
+
+  restore_printDone(item->path, restore_crcVerify ? "restoring...done (CRC OK)" : "restoring...done");
+}
+
+
+static void
+restore_executeItem(restore_plan_item_t* item)
+{
+  if (item->localDir && chdir(item->localDir) != 0) {
+    fatalError("unable to chdir to %s", item->localDir);
+  }
+
+  switch (item->op) {
+  case PLAN_MKDIR:
+    {
+      uint32_t error = fsop_makeDir(item->path);
+      if (error != 0) {
+	fatalError("failed to create directory %s (%s)", item->path, util_getErrorString(error));
       }
     }
-    
-    uint32_t error;
-    if (util_recvU32(main_socketFd, &error) != 0) {
-      fatalError("makedir: failed to read remote status");
+    break;
+  case PLAN_UPLOAD:
+    restore_upload(item, restore_crcVerify ? 3 : 1); // Allow retries only with CRC32 verification
+    break;
+  case PLAN_EXALL:
+    if (restore_applyExAll(item->info, item->info->name, item->path) != 0) {
+      fatalError("failed to update ExAll for %s", item->path);
     }
-    
-    if (error != 0) {
-      fatalError("failed to create directory %s (error: %d)", remote, error);
+    restore_printDone(item->path, "restoring...done");
+    break;
+  case PLAN_VERIFY:
+    {
+      int crcResult = backup_doCrcVerify(item->path);
+      if (crcResult == 1) {
+	printf("\xE2\x9D\x8C CRC32 mismatch detected for %s - file will be re-uploaded\n", item->path);
+	restore_upload(item, 3);
+      } else if (crcResult == 2) {
+	fatalError("CRC32 verification failed - remote file not found: %s", item->path);
+      } else if (!restore_quiet) {
+	printf("\xE2\x9C\x85 %s (CRC verified - no change)\n", item->path); // utf-8 tick with CRC verification message
+	fflush(stdout);
+      }
     }
-    
-    printf("Directory %s created successfully\n", remote);
-    
-    // Now try to read the directory again
-    if (dir_process(restore_currentDir, restore_list) != 0) {
-      fatalError("unable to read %s even after creating it", remote);
+    break;
+  }
+}
+
+
+static int
+restore_isFileItem(restore_plan_item_t* item)
+{
+  return item->op != PLAN_MKDIR && !item->isDir;
+}
+
+
+static void
+restore_connect(void)
+{
+  char* hostname = strdup(restore_hostname);
+  if (!hostname) {
+    fatalError("out of memory");
+  }
+  util_connect(hostname);
+  dir_enableCache();
+  free(hostname);
+}
+
+
+#ifndef _WIN32
+_Noreturn static void
+restore_worker(int queue, volatile uint8_t* done)
+{
+  // every job gets its own connection and its own offset into the archive
+  restore_connect();
+
+  if (restore_archive && archive_reopen(restore_archive, restore_archiveFile) != 0) {
+    fatalError("unable to open archive %s", restore_archiveFile);
+  }
+
+  uint32_t index;
+  while (read(queue, &index, sizeof(index)) == sizeof(index)) {
+    restore_executeItem(&restore_plan[index]);
+    done[index] = 1;
+  }
+
+  close(queue);
+  util_disconnect(1);
+  main_cleanupAndExit(EXIT_SUCCESS);
+}
+
+
+static void
+restore_executeParallel(void)
+{
+  int queue[2];
+  int failed = 0, jobs = 0;
+  uint32_t queued = 0, completed = 0;
+
+  for (uint32_t i = 0; i < restore_planCount && jobs < restore_jobs; i++) {
+    jobs += restore_isFileItem(&restore_plan[i]);
+  }
+
+  if (jobs == 0) {
+    return;
+  }
+
+  pid_t* pids = calloc(jobs, sizeof(pid_t));
+  volatile uint8_t* done = mmap(0, restore_planCount, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+  if (!pids || done == MAP_FAILED || pipe(queue) != 0) {
+    fatalError("unable to start restore jobs");
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  fflush(stdout);
+  fflush(stderr);
+
+  // squirtd only serves one connection at a time, so don't hold ours while the jobs run
+  util_disconnect(1);
+
+  for (int i = 0; i < jobs; i++) {
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      fatalError("unable to start restore jobs");
+    } else if (pids[i] == 0) {
+      close(queue[1]);
+      restore_worker(queue[0], done);
     }
   }
 
-  restore_popDir(local);
+  close(queue[0]);
+
+  // jobs pull the next file off the pipe as they finish the last one
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    if (restore_isFileItem(&restore_plan[i])) {
+      if (write(queue[1], &i, sizeof(i)) != sizeof(i)) {
+	break;
+      }
+      queued++;
+    }
+  }
+  close(queue[1]);
+
+  for (int i = 0; i < jobs; i++) {
+    int status;
+    if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    completed += done[i];
+    // the jobs' writes never reached our listing cache
+    if (done[i]) {
+      dir_invalidate(restore_plan[i].path);
+    }
+  }
+
+  free(pids);
+  munmap((void*)done, restore_planCount);
+
+  // a job that never got a connection doesn't lose any work, the others pick it up
+  if (completed != queued) {
+    fatalError("%u of %u files were not restored (%d of %d restore jobs failed)", queued-completed, queued, failed, jobs);
+  }
+
+  restore_connect();
+}
+#endif
+
+
+// the whole plan is streamed as one tree, in the order restore_execute() runs it one item at a time
+static void
+restore_executeTree(void)
+{
+  uint32_t* records = malloc(restore_planCount*sizeof(uint32_t));
+
+  if (!records) {
+    fatalError("out of memory");
+  }
+
+  tree_begin("");
+
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    if (restore_plan[i].op == PLAN_MKDIR) {
+      records[i] = tree_makeDir(restore_plan[i].path);
+    }
+  }
+
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    restore_plan_item_t* item = &restore_plan[i];
+    if (!restore_isFileItem(item)) {
+      continue;
+    }
+    if (item->localDir && chdir(item->localDir) != 0) {
+      fatalError("unable to chdir to %s", item->localDir);
+    }
+    if (item->op == PLAN_EXALL) {
+      records[i] = tree_setInfo(item->path, item->info);
+    } else if (item->archived) {
+      if (archive_readBody(restore_archive, item->archived) != 0) {
+	fatalError("failed to restore %s\n", item->path);
+      }
+      records[i] = tree_fileFromFd(restore_archive->fd, item->size, item->path, item->info);
+    } else {
+      records[i] = tree_file(item->localName, item->path, item->info);
+    }
+  }
+
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    if (restore_plan[i].op == PLAN_EXALL && restore_plan[i].isDir) {
+      records[i] = tree_setInfo(restore_plan[i].path, restore_plan[i].info);
+    }
+  }
+
+  uint32_t failed = tree_end();
+
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    if (restore_plan[i].op != PLAN_MKDIR && !tree_recordError(records[i])) {
+      restore_printDone(restore_plan[i].path, "restoring...done");
+    }
+  }
+
+  free(records);
+
+  if (failed) {
+    fatalError("%u of the planned changes were not made", failed);
+  }
+}
+
+
+static void
+restore_execute(void)
+{
+  char* cwd = getcwd(0, 0);
+
+  // without --crc32 there's nothing to check between files, so with one job it can all be streamed
+  if (restore_jobs == 1 && !restore_crcVerify && hello_supports(SQUIRT_CAP_TREE)) {
+    restore_executeTree();
+    if (cwd) {
+      if (chdir(cwd)) {
+	fatalError("failed to cd to %s", cwd);
+      }
+      free(cwd);
+    }
+    return;
+  }
+
+  // directories first, parents were planned before their children
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    if (restore_plan[i].op == PLAN_MKDIR) {
+      restore_executeItem(&restore_plan[i]);
+    }
+  }
+
+#ifndef _WIN32
+  if (restore_jobs > 1) {
+    restore_executeParallel();
+  } else
+#endif
+  {
+    for (uint32_t i = 0; i < restore_planCount; i++) {
+      if (restore_isFileItem(&restore_plan[i])) {
+	restore_executeItem(&restore_plan[i]);
+      }
+    }
+  }
+
+  // directory metadata last, children were planned before their parents
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    if (restore_plan[i].op == PLAN_EXALL && restore_plan[i].isDir) {
+      restore_executeItem(&restore_plan[i]);
+    }
+  }
+
+  if (cwd) {
+    if (chdir(cwd)) {
+      fatalError("failed to cd to %s", cwd);
+    }
+    free(cwd);
+  }
+}
+
+
+static void
+restore_printPlan(void)
+{
+  uint32_t mkdirs = 0, uploads = 0, updates = 0, verifies = 0;
+  uint64_t uploadBytes = 0;
+
+  for (uint32_t i = 0; i < restore_planCount; i++) {
+    restore_plan_item_t* item = &restore_plan[i];
+    switch (item->op) {
+    case PLAN_MKDIR:
+      printf("mkdir   %s\n", item->path);
+      mkdirs++;
+      break;
+    case PLAN_UPLOAD:
+      printf("upload  %s (%'u bytes)\n", item->path, item->size);
+      uploadBytes += item->size;
+      uploads++;
+      break;
+    case PLAN_EXALL:
+      printf("update  %s\n", item->path);
+      updates++;
+      break;
+    case PLAN_VERIFY:
+      printf("verify  %s\n", item->path);
+      verifies++;
+      break;
+    }
+  }
+
+  printf("\n%u directories to create, %u files to upload (%'llu bytes), %u metadata updates", mkdirs, uploads, (unsigned long long)uploadBytes, updates);
+  if (restore_crcVerify) {
+    printf(", %u files to verify", verifies);
+  }
+  printf("\n");
 }
 
 
 _Noreturn static void
 restore_usage(void)
 {
-  fatalError("invalid arguments\nusage: %s hostname dir_name", main_argv0);
+  fatalError("invalid arguments\nusage: %s [--quiet] [--crc32] [--dry-run] [--jobs=N] [--skipfile=skipfile] [--archive=archive_file] hostname dir_name", main_argv0);
 }
 
 void
@@ -622,6 +979,7 @@ restore_main(int argc, char* argv[])
   const char* hostname = 0;
   char* path = 0;
   char* skipFile = 0;
+  char* archiveFile = 0;
   int argvIndex = 1;
 
   while (argvIndex < argc) {
@@ -629,7 +987,10 @@ restore_main(int argc, char* argv[])
       {
        {"quiet",    no_argument, &restore_quiet, 'q'},
        {"crc32",    no_argument, &restore_crcVerify, 'c'},
+       {"dry-run",  no_argument, &restore_dryRun, 'd'},
+       {"jobs",     required_argument, 0, 'j'},
        {"skipfile", required_argument, 0, 's'},
+       {"archive",  required_argument, 0, 'a'},
        {0, 0, 0, 0}
       };
     int option_index = 0;
@@ -646,6 +1007,18 @@ restore_main(int argc, char* argv[])
 	}
 	skipFile = optarg;
 	break;
+      case 'a':
+	if (optarg == 0 || strlen(optarg) == 0) {
+	  restore_usage();
+	}
+	archiveFile = optarg;
+	break;
+      case 'j':
+	if (optarg == 0 || atoi(optarg) < 1) {
+	  restore_usage();
+	}
+	restore_jobs = atoi(optarg);
+	break;
       case '?':
       default:
 	restore_usage();
@@ -666,12 +1039,33 @@ restore_main(int argc, char* argv[])
     restore_usage();
   }
 
+#ifdef _WIN32
+  restore_jobs = 1; // no fork(), restore runs over a single connection
+#endif
+
+  if (archiveFile) {
+    if (restore_crcVerify) {
+      fatalError("--crc32 is not supported with --archive");
+    }
+    restore_archiveFile = strdup(archiveFile);
+    restore_archive = archive_open(archiveFile, 0);
+    if (!restore_archive) {
+      fatalError("unable to open archive %s", archiveFile);
+    }
+  }
+
   if (skipFile) {
     restore_skipFile = backup_loadSkipFile(skipFile, 0);
   } else {
     restore_skipFile = backup_loadSkipFile(".skip", 1);
   }
 
+  // util_connect() consumes the port, jobs need their own copy to connect with
+  restore_hostname = strdup(hostname);
+  if (!restore_hostname || (archiveFile && !restore_archiveFile)) {
+    fatalError("out of memory");
+  }
+
   util_connect(hostname);
 
   char* token = strtok(path, ":");
@@ -704,7 +1098,20 @@ restore_main(int argc, char* argv[])
   }
 
   if (dir) {
-    restore_restoreDir(dir);
+    char* fullDir = restore_fullPath(dir);
+    if (!fullDir) {
+      fatalError("out of memory");
+    }
+    int exists = restore_planMissingDirs(fullDir);
+    free(fullDir);
+
+    restore_restoreDir(dir, exists);
+
+    if (restore_dryRun) {
+      restore_printPlan();
+    } else {
+      restore_execute();
+    }
     
     // Change back to parent directory to release lock on created directory
     // This prevents "object in use" errors when trying to delete the directory
@@ -726,5 +1133,11 @@ restore_main(int argc, char* argv[])
     }
   }
 
-  printf("\nrestore complete!\n");
+  uint32_t listings, cacheHits;
+  dir_getListingStats(&listings, &cacheHits);
+  printf("\n%u directory listings, %u served from cache\n", listings, cacheHits);
+
+  if (!restore_dryRun) {
+    printf("\nrestore complete!\n");
+  }
 }
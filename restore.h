@@ -1,7 +1,13 @@
 #pragma once
+#include "dir.h"
 
 void
 restore_printProgress(const char* filename, struct timeval* start, uint32_t total, uint32_t fileLength);
+
+// sets the protection, datestamp and comment of an Amiga file to entry's
+int
+restore_applyExAll(dir_entry_t* entry, const char* filename, const char* path);
+
 void
 restore_main(int argc, char* argv[]);
 
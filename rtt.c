@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "main.h"
+#include "common.h"
+
+/*
+ * Round trip benchmark: times each small request from the first byte sent to the status read,
+ * which is where Nagle's algorithm and delayed ACKs show up. --memory also reports squirtd's
+ * allocations before and after the run.
+ */
+
+#define RTT_DEFAULT_COUNT 50
+
+typedef struct {
+  const char* name;
+  void (*run)(const char* cwd);
+} rtt_test_t;
+
+
+static double
+rtt_now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+
+static int
+rtt_compare(const void* a, const void* b)
+{
+  double one = *(const double*)a, two = *(const double*)b;
+  return one < two ? -1 : one > two;
+}
+
+
+static void
+rtt_cwd(const char* cwd)
+{
+  (void)cwd;
+  free((void*)cwd_read());
+}
+
+
+static void
+rtt_cd(const char* cwd)
+{
+  if (util_cd(cwd) != 0) {
+    fatalError("cd %s failed", cwd);
+  }
+}
+
+
+static void
+rtt_stat(const char* cwd)
+{
+  dir_entry_t entry;
+  if (dir_stat(cwd, &entry) != 0) {
+    fatalError("stat %s failed (squirtd too old?)", cwd);
+  }
+}
+
+
+static void
+rtt_dir(const char* cwd)
+{
+  dir_entry_list_t* list = dir_read(cwd);
+  if (!list) {
+    fatalError("dir %s failed", cwd);
+  }
+  dir_freeEntryList(list);
+}
+
+
+// 0 if squirtd is too old to track its memory
+static int
+rtt_readMemory(uint32_t* current, uint32_t* peak)
+{
+  uint32_t length, error;
+
+  if (!hello_supports(SQUIRT_CAP_MEMORY)) {
+    return 0;
+  }
+
+  if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_MEMORY) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(main_socketFd, "memory") != 0 ||
+      util_recvU32(main_socketFd, &length) != 0) {
+    fatalError("failed to read squirtd memory");
+  }
+
+  if (length == 0) {
+    return 0;
+  }
+
+  if (util_recvU32(main_socketFd, current) != 0 ||
+      util_recvU32(main_socketFd, peak) != 0 ||
+      util_recvU32(main_socketFd, &error) != 0) {
+    fatalError("failed to read squirtd memory");
+  }
+
+  return 1;
+}
+
+
+static void
+rtt_printMemory(const char* when)
+{
+  uint32_t current, peak;
+
+  if (rtt_readMemory(&current, &peak)) {
+    printf("squirtd memory %s: %u bytes allocated, %u peak\n", when, current, peak);
+  } else {
+    printf("squirtd memory %s: not supported by this squirtd\n", when);
+  }
+}
+
+
+static void
+rtt_usage(void)
+{
+  fatalError("usage: %s [--count=N] [--memory] hostname", main_argv0);
+}
+
+
+void
+rtt_main(int argc, char* argv[])
+{
+  int argvIndex = 1, count = RTT_DEFAULT_COUNT, memory = 0;
+  char* hostname = 0;
+
+  while (argvIndex < argc) {
+    static struct option long_options[] =
+      {
+       {"count", required_argument, 0, 'c'},
+       {"memory", no_argument, 0, 'm'},
+       {0, 0, 0, 0}
+      };
+    int option_index = 0;
+    int c = getopt_long (argc, argv, "", long_options, &option_index);
+    if (c != -1) {
+      argvIndex = optind;
+      switch (c) {
+      case 0:
+	break;
+      case 'c':
+	count = atoi(optarg);
+	break;
+      case 'm':
+	memory = 1;
+	break;
+      case '?':
+      default:
+	rtt_usage();
+	break;
+      }
+    } else {
+      if (hostname == 0) {
+	hostname = argv[argvIndex];
+      } else {
+	rtt_usage();
+      }
+      optind++;
+      argvIndex++;
+    }
+  }
+
+  if (hostname == 0 || count <= 0) {
+    rtt_usage();
+  }
+
+  double start = rtt_now();
+  util_connect(hostname);
+  printf("connect %8.2f ms\n", rtt_now()-start);
+
+  const char* cwd = cwd_read();
+  double* times = malloc(count * sizeof(double));
+  static const rtt_test_t tests[] = {
+    {"cwd", rtt_cwd},
+    {"cd", rtt_cd},
+    {"stat", rtt_stat},
+    {"dir", rtt_dir},
+  };
+
+  if (!times) {
+    fatalError("out of memory");
+  }
+
+  if (memory) {
+    rtt_printMemory("before");
+  }
+
+  printf("%-7s %8s %8s %8s   (%d round trips in %s)\n", "", "min", "median", "max", count, cwd);
+
+  for (size_t t = 0; t < sizeof(tests)/sizeof(tests[0]); t++) {
+    for (int i = 0; i < count; i++) {
+      start = rtt_now();
+      tests[t].run(cwd);
+      times[i] = rtt_now()-start;
+    }
+
+    qsort(times, count, sizeof(double), rtt_compare);
+    printf("%-7s %8.2f %8.2f %8.2f ms\n", tests[t].name, times[0], times[count/2], times[count-1]);
+  }
+
+  // repeating the same commands shouldn't move the peak
+  if (memory) {
+    rtt_printMemory("after");
+  }
+
+  free(times);
+  free((void*)cwd);
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+void
+rtt_main(int argc, char* argv[]);
@@ -0,0 +1,155 @@
+#!/usr/bin/env bash
+#
+# Loopback smoke test: runs the client tools against squirtd_posix on 127.0.0.1 and checks that
+# squirting, sucking, listing, file operations and CLI commands do what they should, then runs
+# the commands the original squirtd had against squirtd_posix --legacy to exercise the fallbacks.
+#
+# usage: smoke.sh [build_dir]
+#
+
+BUILD=$(cd "${1:-build}" && pwd)
+PORT=${SQUIRT_SMOKE_PORT:-6971}
+HOST=127.0.0.1:$PORT
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/squirt_smoke.XXXXXX")
+ROOT=$WORK/root
+DAEMON_PID=
+FAILED=0
+
+
+cleanup()
+{
+  stop_daemon
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+
+fail()
+{
+  echo "smoke: $*" >&2
+  exit 1
+}
+
+
+check()
+{
+  local label=$1
+  shift
+
+  if "$@" >"$WORK/out" 2>&1; then
+    echo "ok      $label"
+  else
+    echo "FAILED  $label"
+    sed 's/^/        /' "$WORK/out"
+    FAILED=$((FAILED+1))
+  fi
+}
+
+
+stop_daemon()
+{
+  if [ -n "$DAEMON_PID" ]; then
+    kill "$DAEMON_PID" 2>/dev/null
+    wait "$DAEMON_PID" 2>/dev/null
+    DAEMON_PID=
+  fi
+}
+
+
+# start_daemon [squirtd_posix options]
+start_daemon()
+{
+  stop_daemon
+  rm -rf "$ROOT"
+  mkdir -p "$ROOT/work"
+
+  "$BUILD/squirtd_posix" --port="$PORT" "$@" "$ROOT" work: >"$WORK/daemon.log" 2>&1 &
+  DAEMON_PID=$!
+
+  for ((i = 0; i < 50; i++)); do
+    "$BUILD/squirt_cwd" "$HOST" >/dev/null 2>&1 && return
+    sleep 0.1
+  done
+  fail "squirtd_posix didn't start, see $WORK/daemon.log"
+}
+
+
+squirt_file()
+{
+  "$BUILD/squirt" "$HOST" "$WORK/local/file" && cmp "$WORK/local/file" "$ROOT/work/file"
+}
+
+
+suck_file()
+{
+  rm -f "$WORK/down/file"
+  (cd "$WORK/down" && SQUIRT_CACHE_SIZE=0 "$BUILD/squirt_suck" "$HOST" work:file) && cmp "$WORK/local/file" "$WORK/down/file"
+}
+
+
+list_dir()
+{
+  "$BUILD/squirt_dir" "$HOST" work: | grep -q "file"
+}
+
+
+exec_command()
+{
+  "$BUILD/squirt_exec" "$HOST" "echo squirted" </dev/null | grep -q "^squirted$"
+}
+
+
+# pushes a tree, then removes and adds things locally and pushes again, which takes mkdir,
+# delete and the set info operations on the remote side
+sync_tree()
+{
+  rm -rf "$WORK/tree"
+  mkdir -p "$WORK/tree/a/b" "$WORK/tree/gone"
+  echo one >"$WORK/tree/a/one"
+  echo two >"$WORK/tree/a/b/two"
+  echo three >"$WORK/tree/gone/three"
+
+  "$BUILD/squirt_sync" --delete "$HOST" "$WORK/tree" work:tree </dev/null || return 1
+  diff -r "$WORK/tree" "$ROOT/work/tree" || return 1
+
+  rm -rf "$WORK/tree/gone"
+  mkdir "$WORK/tree/new"
+  echo four >"$WORK/tree/new/four"
+
+  "$BUILD/squirt_sync" --delete "$HOST" "$WORK/tree" work:tree </dev/null || return 1
+  diff -r "$WORK/tree" "$ROOT/work/tree"
+}
+
+
+# without --dest a folder goes to the destination folder like a file does, not to the folder
+# squirtd_posix was started in
+squirt_folder()
+{
+  "$BUILD/squirt" "$HOST" "$WORK/tree" && "$BUILD/squirt" "$HOST" "$WORK/local/file" || return 1
+  [ ! -e "$ROOT/tree" ] && diff -r "$WORK/tree" "$ROOT/work/tree" && cmp "$WORK/local/file" "$ROOT/work/file"
+}
+
+
+[ -x "$BUILD/squirtd_posix" ] || fail "$BUILD/squirtd_posix not built"
+
+mkdir -p "$WORK/local" "$WORK/down"
+dd if=/dev/urandom of="$WORK/local/file" bs=1024 count=300 2>/dev/null
+
+for mode in "" --legacy; do
+  start_daemon $mode
+  echo "squirtd_posix $mode"
+
+  check "squirt" squirt_file
+  check "squirt_suck" suck_file
+  check "squirt_dir" list_dir
+  check "squirt_exec" exec_command
+
+  # the fallbacks for these run amiga commands like makedir, which the host shell doesn't have
+  if [ -z "$mode" ]; then
+    check "squirt_sync" sync_tree
+    rm -rf "$ROOT/work/tree"
+    check "squirt folder" squirt_folder
+  fi
+done
+
+((FAILED == 0)) || fail "$FAILED checks failed"
@@ -33,23 +33,48 @@ squirt_cleanup(void)
 }
 
 
-int
-squirt_file(const char* filename, const char* progressHeader, const char* destFilename, int writeToCurrentDir, void (*progress)(const char* filename, struct timeval* start, uint32_t total, uint32_t fileLength))
+uint32_t
+squirt_applyInfo(const char* amigaFilename, dir_entry_t* info)
 {
-  int total = 0;
-  int32_t fileLength;
-  struct stat st;
+  uint32_t error = protect_file(amigaFilename, info->prot, &info->ds);
+
+  if (!error && info->comment && info->comment[0]) {
+    char buffer[PATH_MAX*2];
+    snprintf(buffer, sizeof(buffer), "filenote \"%s\" \"%s\"", amigaFilename, info->comment);
+    free(exec_captureCmd(&error, 1, (char*[]){buffer}));
+    if (error) {
+      error = ERROR_SET_COMMENT_FAILED;
+    }
+  }
 
+  return error;
+}
+
+
+static int
+squirt_send(int fd, int32_t fileLength, const char* filename, const char* progressHeader, const char* destFilename, int writeToCurrentDir, dir_entry_t* info, void (*progress)(const char* filename, struct timeval* start, uint32_t total, uint32_t fileLength))
+{
+  int total = 0;
   struct timeval start, end;
+  uint32_t command;
+  dir_entry_t* legacyInfo = 0;
+  trace_span_t span;
 
-  if (stat(filename, &st) == -1) {
-    fprintf(stderr, "Error: Cannot access file '%s' - %s\n", filename, strerror(errno));
-    return -1; // Return error code instead of terminating
+  trace_begin(&span);
+
+  if (info && !hello_supports(SQUIRT_CAP_SQUIRT_WITH_INFO)) {
+    // applied with separate commands once the file is written
+    legacyInfo = info;
+    info = 0;
   }
 
-  fileLength = st.st_size;
+  if (info) {
+    command = SQUIRT_COMMAND_SQUIRT_WITH_INFO;
+  } else {
+    command = writeToCurrentDir ? SQUIRT_COMMAND_SQUIRT_TO_CWD : SQUIRT_COMMAND_SQUIRT;
+  }
 
-  if (util_sendCommand(main_socketFd, writeToCurrentDir ? SQUIRT_COMMAND_SQUIRT_TO_CWD : SQUIRT_COMMAND_SQUIRT) != 0) {
+  if (util_sendCommand(main_socketFd, command) != 0) {
     fatalError("failed to connect to squirtd server");
   }
 
@@ -65,14 +90,18 @@ squirt_file(const char* filename, const char* progressHeader, const char* destFi
     fatalError("send() name failed");
   }
 
-  if (util_sendU32(main_socketFd, fileLength) != 0) {
-    fatalError("send() fileLength failed");
+  if (info) {
+    if (util_sendU32(main_socketFd, info->prot) != 0 ||
+	util_sendU32(main_socketFd, info->ds.days) != 0 ||
+	util_sendU32(main_socketFd, info->ds.mins) != 0 ||
+	util_sendU32(main_socketFd, info->ds.ticks) != 0 ||
+	util_sendLengthAndUtf8StringAsLatin1(main_socketFd, info->comment ? info->comment : "") != 0) {
+      fatalError("send() file info failed");
+    }
   }
 
-  squirt_fileFd = util_open(filename, O_RDONLY|_O_BINARY);
-
-  if (!squirt_fileFd) {
-    fatalError("failed to open %s", filename);
+  if (util_sendU32(main_socketFd, fileLength) != 0) {
+    fatalError("send() fileLength failed");
   }
 
   squirt_readBuffer = malloc(BLOCK_SIZE);
@@ -82,24 +111,27 @@ squirt_file(const char* filename, const char* progressHeader, const char* destFi
     gettimeofday(&start, NULL);
   }
 
-  do {
-    int len;
-    if ((len = read(squirt_fileFd, squirt_readBuffer, BLOCK_SIZE) ) < 0) {
+  util_cork(main_socketFd, 1);
+
+  while (total < fileLength) {
+    int len, requestLength = fileLength - total > BLOCK_SIZE ? BLOCK_SIZE : fileLength - total;
+    if ((len = read(fd, squirt_readBuffer, requestLength)) <= 0) {
       fatalError("failed to read %s", filename);
     } else {
-      if ((send(main_socketFd, squirt_readBuffer, len, 0)) != len) {
+      if (util_send(main_socketFd, squirt_readBuffer, len) != 0) {
 	fatalError("send() failed");
       }
-      //      int old = total;
       total += len;
-      //      if (((((old*100)/fileLength))/100) - (((total*100)/fileLength)/100) > 2) {
       if (progress) {
 	progress(progressHeader ? progressHeader : filename, &start, total, fileLength);
       }
-	//      }
     }
+  }
 
-  } while (total < fileLength);
+  if (util_flush(main_socketFd) != 0) {
+    fatalError("send() failed");
+  }
+  util_cork(main_socketFd, 0);
 
   if (progress == util_printProgress) {
     util_printProgress(progressHeader ? progressHeader :filename, &start, total, fileLength);
@@ -111,6 +143,14 @@ squirt_file(const char* filename, const char* progressHeader, const char* destFi
     fatalError("squirt: failed to read remote status");
   }
 
+  trace_end(&span, "squirt", filename);
+
+  dir_invalidate(amigaFilename);
+
+  if (error == 0 && legacyInfo) {
+    error = squirt_applyInfo(amigaFilename, legacyInfo);
+  }
+
   if (error == 0) {
     if (progress == util_printProgress) {
       gettimeofday(&end, NULL);
@@ -124,6 +164,56 @@ squirt_file(const char* filename, const char* progressHeader, const char* destFi
     fprintf(stderr, "\n**FAILED** to squirt %s\n%s\n", filename, util_getErrorString(error));
   }
 
+  return error;
+}
+
+
+static int
+squirt_openAndSend(const char* filename, const char* progressHeader, const char* destFilename, int writeToCurrentDir, dir_entry_t* info, void (*progress)(const char* filename, struct timeval* start, uint32_t total, uint32_t fileLength))
+{
+  struct stat st;
+
+  if (stat(filename, &st) == -1) {
+    fprintf(stderr, "Error: Cannot access file '%s' - %s\n", filename, strerror(errno));
+    return -1; // Return error code instead of terminating
+  }
+
+  squirt_fileFd = util_open(filename, O_RDONLY|_O_BINARY);
+
+  if (squirt_fileFd < 0) {
+    squirt_fileFd = 0;
+    fatalError("failed to open %s", filename);
+  }
+
+  int error = squirt_send(squirt_fileFd, st.st_size, filename, progressHeader, destFilename, writeToCurrentDir, info, progress);
+
+  squirt_cleanup();
+
+  return error;
+}
+
+
+int
+squirt_file(const char* filename, const char* progressHeader, const char* destFilename, int writeToCurrentDir, void (*progress)(const char* filename, struct timeval* start, uint32_t total, uint32_t fileLength))
+{
+  return squirt_openAndSend(filename, progressHeader, destFilename, writeToCurrentDir, 0, progress);
+}
+
+
+int
+squirt_fileWithInfo(const char* filename, const char* progressHeader, const char* destFilename, dir_entry_t* info, void (*progress)(const char* filename, struct timeval* start, uint32_t total, uint32_t fileLength))
+{
+  // protection, datestamp and comment are applied by the daemon once the file is written
+  return squirt_openAndSend(filename, progressHeader, destFilename, 1, info, progress);
+}
+
+
+int
+squirt_fileFromFd(int fd, int32_t fileLength, const char* filename, const char* progressHeader, const char* destFilename, dir_entry_t* info, void (*progress)(const char* filename, struct timeval* start, uint32_t total, uint32_t fileLength))
+{
+  // fd is owned by the caller and must already be positioned at the start of the data
+  int error = squirt_send(fd, fileLength, filename, progressHeader, destFilename, 1, info, progress);
+
   squirt_cleanup();
 
   return error;
@@ -133,19 +223,24 @@ squirt_file(const char* filename, const char* progressHeader, const char* destFi
 _Noreturn static void
 squirt_usage(void)
 {
-  fatalError("invalid arguments\nusage: %s [--dest=destination folder] hostname filename", main_argv0);
+  fatalError("invalid arguments\nusage: %s [--dest=destination folder] hostname filename|folder\n       %s --hosts=hostname,hostname... [--dest=destination folder] filename...\n       %s --watch [--exec=command] [--debounce=ms] hostname local_folder remote_folder", main_argv0, main_argv0, main_argv0);
 }
 
 void
 squirt_main(int argc, char* argv[])
 {
-  int argvIndex = 1;
-  char *dest = 0, *hostname = 0, * filename = 0;
+  int argvIndex = 1, watch = 0, debounce = WATCH_DEFAULT_DEBOUNCE_MS, argCount = 0;
+  char *dest = 0, *hostname = 0, * filename = 0, *remoteDir = 0, *command = 0, *hosts = 0;
+  char* args[argc];
 
   while (argvIndex < argc) {
     static struct option long_options[] =
       {
        {"dest", required_argument, 0, 'd'},
+       {"watch", no_argument, 0, 'w'},
+       {"exec", required_argument, 0, 'e'},
+       {"debounce", required_argument, 0, 'b'},
+       {"hosts", required_argument, 0, 'h'},
        {0, 0, 0, 0}
       };
     int option_index = 0;
@@ -158,27 +253,63 @@ squirt_main(int argc, char* argv[])
       case 'd':
 	dest = optarg;
 	break;
+      case 'w':
+	watch = 1;
+	break;
+      case 'e':
+	command = optarg;
+	break;
+      case 'b':
+	debounce = atoi(optarg);
+	break;
+      case 'h':
+	hosts = optarg;
+	break;
       case '?':
       default:
 	squirt_usage();
 	break;
       }
     } else {
-      if (hostname == 0) {
-	hostname = argv[argvIndex];
-      } else {
-	filename = argv[argvIndex];
-      }
+      args[argCount++] = argv[argvIndex];
       optind++;
       argvIndex++;
     }
   }
 
-  if (hostname == 0 || filename == 0) {
+  if (hosts) {
+    // every argument is a file to squirt to each of the hosts
+    if (argCount == 0 || watch || command) {
+      squirt_usage();
+    }
+    fanout_run(hosts, dest, argCount, args);
+    return;
+  }
+
+  if (argCount != (watch ? 3 : 2)) {
+    squirt_usage();
+  }
+
+  hostname = args[0];
+  filename = args[1];
+  remoteDir = watch ? args[2] : 0;
+
+  if (hostname == 0 || filename == 0 || (watch && (remoteDir == 0 || dest || debounce <= 0)) || (!watch && command)) {
     squirt_usage();
   }
 
   util_connect(hostname);
+
+  struct stat st;
+  if (!watch && stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+    tree_upload(filename, dest ? dest : "");
+    return;
+  }
+
+  if (watch) {
+    watch_run(filename, remoteDir, command, debounce);
+  }
+
   char buffer[PATH_MAX];
   if (dest) {
     sprintf(buffer, "cd %s", dest);
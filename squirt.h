@@ -1,11 +1,21 @@
 #pragma once
 #include <stdint.h>
+#include "dir.h"
 
 void
 squirt_cleanup(void);
 
+uint32_t
+squirt_applyInfo(const char* amigaFilename, dir_entry_t* info);
+
 int
 squirt_file(const char* filename, const char* progressHeader, const char* destFilename, int writeToCurrentDir, void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength));
 
+int
+squirt_fileWithInfo(const char* filename, const char* progressHeader, const char* destFilename, dir_entry_t* info, void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength));
+
+int
+squirt_fileFromFd(int fd, int32_t fileLength, const char* filename, const char* progressHeader, const char* destFilename, dir_entry_t* info, void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength));
+
 void
 squirt_main(int argc, char* argv[]);
@@ -3,11 +3,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dos/dostags.h>
+#include <dos/dosextens.h>
 #include <exec/execbase.h>
+#include <exec/memory.h>
+#include <devices/timer.h>
 #include <proto/dos.h>
 #include <proto/exec.h>
 #include <proto/socket.h>
+#include <proto/timer.h>
 #include <proto/dos.h>
+#include <netinet/tcp.h>
 #include "common.h"
 
 //#define DEBUG_OUTPUT
@@ -26,19 +31,43 @@
 FILE* log_fd;
 #endif
 
+#define SQUIRTD_LISTEN_BACKLOG 8
+#define SQUIRTD_CAPABILITIES (SQUIRT_CAP_FSOP|SQUIRT_CAP_BATCH|SQUIRT_CAP_SQUIRT_WITH_INFO|SQUIRT_CAP_STAT|SQUIRT_CAP_VOLUMES|SQUIRT_CAP_MEMORY|SQUIRT_CAP_STATS|SQUIRT_CAP_EXEC_JOBS|SQUIRT_CAP_CLI_FRAMED|SQUIRT_CAP_TREE)
+
+#ifndef UNIQUE_ID
+#define UNIQUE_ID -1
+#endif
+
 typedef struct {
   uint32_t protection;
   struct DateStamp dateStamp;
 } squirtd_file_info_t;
 
 struct Process *squirtd_proc = 0;
-static uint32_t squirtd_execError = 0;
+static int32_t squirtd_execReturnCode = 0;
 static int squirtd_listenFd = 0;
 static int squirtd_connectionFd = 0;
 static char* squirtd_filename = 0;
+static uint32_t squirtd_filenameSize = 0;
 static char* squirtd_rxBuffer = 0;
+static struct FileInfoBlock* squirtd_fileInfo = 0;
+static struct ExAllControl* squirtd_exAllControl = 0;
+static char squirtd_string[256];
+static uint32_t squirtd_memCurrent = 0;
+static uint32_t squirtd_memPeak = 0;
 static BPTR  squirtd_outputFd = 0;
 static BPTR squirtd_inputFd = 0;
+static char squirtd_txBuffer[1460];
+static int squirtd_txLength = 0;
+static char squirtd_programPath[256];
+static struct DateStamp squirtd_started;
+static uint32_t squirtd_commands[SQUIRT_COMMAND_COUNT];
+static uint64_t squirtd_bytesIn = 0;
+static uint64_t squirtd_bytesOut = 0;
+static uint64_t squirtd_dosTime = 0;
+static uint64_t squirtd_socketTime = 0;
+static uint32_t squirtd_eclockRate = 0;
+static struct timerequest squirtd_timerRequest;
 
 static const char* exec_command;
 static BPTR exec_inputFd, exec_outputFd;
@@ -46,30 +75,160 @@ static BPTR exec_inputFd, exec_outputFd;
 #ifdef __GNUC__
 struct Library *SocketBase = 0;
 #endif
+struct Device *TimerBase = 0;
+
+
+// E-clock ticks, always 0 if timer.device couldn't be opened
+static uint64_t
+stats_now(void)
+{
+  struct EClockVal clock;
+
+  if (!TimerBase) {
+    return 0;
+  }
+
+  ReadEClock(&clock);
+  return ((uint64_t)clock.ev_hi << 32) | clock.ev_lo;
+}
+
+
+static uint64_t
+stats_usecs(uint64_t ticks)
+{
+  if (!squirtd_eclockRate) {
+    return 0;
+  }
+
+  return ticks / squirtd_eclockRate * 1000000 + ticks % squirtd_eclockRate * 1000000 / squirtd_eclockRate;
+}
+
+
+static void
+stats_dos(uint64_t start)
+{
+  squirtd_dosTime += stats_now() - start;
+}
+
+
+// allocations are tracked so the client can ask how much memory squirtd has needed at once
+static void
+mem_track(int32_t size)
+{
+  squirtd_memCurrent += size;
+  if (squirtd_memCurrent > squirtd_memPeak) {
+    squirtd_memPeak = squirtd_memCurrent;
+  }
+}
+
+
+static void*
+mem_alloc(uint32_t size)
+{
+  uint32_t* block = malloc(size+sizeof(uint32_t));
+
+  if (!block) {
+    return 0;
+  }
+
+  *block = size;
+  mem_track(size);
+  return block+1;
+}
+
+
+static void
+mem_free(void* ptr)
+{
+  if (ptr) {
+    uint32_t* block = (uint32_t*)ptr-1;
+    mem_track(-(int32_t)*block);
+    free(block);
+  }
+}
+
+
+static void
+session_free(void)
+{
+  mem_free(squirtd_rxBuffer);
+  squirtd_rxBuffer = 0;
+
+  mem_free(squirtd_filename);
+  squirtd_filename = 0;
+  squirtd_filenameSize = 0;
+
+  if (squirtd_fileInfo) {
+    FreeDosObject(DOS_FIB, squirtd_fileInfo);
+    mem_track(-(int32_t)sizeof(struct FileInfoBlock));
+    squirtd_fileInfo = 0;
+  }
+
+  if (squirtd_exAllControl) {
+    FreeDosObject(DOS_EXALLCONTROL, squirtd_exAllControl);
+    mem_track(-(int32_t)sizeof(struct ExAllControl));
+    squirtd_exAllControl = 0;
+  }
+}
+
+
+// buffers are kept for as long as squirtd runs, a steady stream of commands doesn't allocate
+static int
+session_allocate(void)
+{
+  if (!squirtd_rxBuffer && !(squirtd_rxBuffer = mem_alloc(BLOCK_SIZE))) {
+    return -1;
+  }
+
+  if (!squirtd_fileInfo) {
+    if (!(squirtd_fileInfo = AllocDosObject(DOS_FIB, NULL))) {
+      return -1;
+    }
+    mem_track(sizeof(struct FileInfoBlock));
+  }
+
+  if (!squirtd_exAllControl) {
+    if (!(squirtd_exAllControl = AllocDosObject(DOS_EXALLCONTROL, NULL))) {
+      return -1;
+    }
+    mem_track(sizeof(struct ExAllControl));
+  }
+
+  return 0;
+}
+
+
+static char*
+session_filename(uint32_t length)
+{
+  if (length >= squirtd_filenameSize) {
+    mem_free(squirtd_filename);
+    squirtd_filenameSize = length < sizeof(squirtd_string) ? sizeof(squirtd_string) : length+1;
+    if (!(squirtd_filename = mem_alloc(squirtd_filenameSize))) {
+      squirtd_filenameSize = 0;
+    }
+  }
+
+  return squirtd_filename;
+}
 
 
 static void
 cleanupForNextRun(void)
 {
+  uint64_t start = stats_now();
+
   if (squirtd_inputFd > 0) {
     Close(squirtd_inputFd);
     squirtd_inputFd = 0;
   }
 
-  if (squirtd_rxBuffer) {
-    free(squirtd_rxBuffer);
-    squirtd_rxBuffer = 0;
-  }
-
   if (squirtd_outputFd > 0) {
     Close(squirtd_outputFd);
     squirtd_outputFd = 0;
   }
 
-  if (squirtd_filename) {
-    free(squirtd_filename);
-    squirtd_filename = 0;
-  }
+  stats_dos(start);
 }
 
 
@@ -84,6 +243,7 @@ cleanup(void)
     CloseSocket(squirtd_connectionFd);
     squirtd_connectionFd = 0;
   }
+  squirtd_txLength = 0;
 
   if (squirtd_listenFd > 0) {
     CloseSocket(squirtd_listenFd);
@@ -91,12 +251,18 @@ cleanup(void)
   }
 
   cleanupForNextRun();
+  session_free();
 
 #ifdef __GNUC__
   if (SocketBase) {
     CloseLibrary(SocketBase);
   }
 #endif
+
+  if (TimerBase) {
+    CloseDevice((struct IORequest*)&squirtd_timerRequest);
+    TimerBase = 0;
+  }
 }
 
 
@@ -116,322 +282,1207 @@ _fatalError(void)
 }
 
 
+static int
+sendRaw(int fd, const char* buffer, int length)
+{
+  while (length > 0) {
+    uint64_t start = stats_now();
+    int len = send(fd, (APTR)buffer, length, 0);
+    squirtd_socketTime += stats_now() - start;
+    if (len <= 0) {
+      return -1;
+    }
+    squirtd_bytesOut += len;
+    buffer += len;
+    length -= len;
+  }
+  return 0;
+}
+
+
+static int
+sendFlush(int fd)
+{
+  int length = squirtd_txLength;
+  squirtd_txLength = 0;
+  return length ? sendRaw(fd, squirtd_txBuffer, length) : 0;
+}
+
+
+// replies are runs of small words, they're collected and sent before the next read
+static int
+sendAll(int fd, const void* buffer, int length)
+{
+  const char* ptr = buffer;
+
+  if (squirtd_txLength + length <= (int)sizeof(squirtd_txBuffer)) {
+    memcpy(&squirtd_txBuffer[squirtd_txLength], ptr, length);
+    squirtd_txLength += length;
+    return 0;
+  }
+
+  int fill = sizeof(squirtd_txBuffer) - squirtd_txLength;
+  memcpy(&squirtd_txBuffer[squirtd_txLength], ptr, fill);
+  squirtd_txLength += fill;
+
+  if (sendFlush(fd) != 0) {
+    return -1;
+  }
+
+  return sendRaw(fd, ptr+fill, length-fill);
+}
+
+
+static uint32_t
+sendU32(int fd, uint32_t status)
+{
+  if (sendAll(fd, &status, sizeof(status)) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  return 0;
+}
+
+
+// every read from the client goes through here so it's counted
+static int
+recvRaw(int fd, void* buffer, int length)
+{
+  uint64_t start = stats_now();
+  int len = recv(fd, buffer, length, 0);
+  squirtd_socketTime += stats_now() - start;
+  if (len > 0) {
+    squirtd_bytesIn += len;
+  }
+  return len;
+}
+
+
+static int
+recvAll(int fd, void* buffer, int length)
+{
+  char* ptr = buffer;
+  int total = 0;
+
+  if (sendFlush(fd) != 0) {
+    return -1;
+  }
+
+  while (total < length) {
+    int len = recvRaw(fd, ptr+total, length-total);
+    if (len <= 0) {
+      return -1;
+    }
+    total += len;
+  }
+  return 0;
+}
+
+
+static void
+freeString(char* str)
+{
+  if (str != squirtd_string) {
+    mem_free(str);
+  }
+}
+
+
+// comments and rename targets fit in squirtd_string, anything longer is allocated
+static char*
+recvString(int fd)
+{
+  uint32_t length;
+  if (recvAll(fd, &length, sizeof(length)) != 0) {
+    return 0;
+  }
+
+  char* str = length < sizeof(squirtd_string) ? squirtd_string : mem_alloc(length+1);
+  if (!str) {
+    return 0;
+  }
+
+  if (recvAll(fd, str, length) != 0) {
+    freeString(str);
+    return 0;
+  }
+
+  str[length] = 0;
+  return str;
+}
+
+
+static char*
+recvFilename(int fd)
+{
+  uint32_t length;
+  if (recvAll(fd, &length, sizeof(length)) != 0 || !session_filename(length) ||
+      recvAll(fd, squirtd_filename, length) != 0) {
+    return 0;
+  }
+
+  squirtd_filename[length] = 0;
+  return squirtd_filename;
+}
+
+
+static void
+exec_runner(void)
+{
+  squirtd_execReturnCode = SystemTags((APTR)exec_command, SYS_Output, exec_outputFd, TAG_DONE, 0);
+
+  if (exec_outputFd) {
+    Close(exec_outputFd);
+  }
+}
+
+static const uint32_t PutChProc=0x16c04e75; /* move.b d0,(a3)+ ; rts */
+
+// framed output is sent as length prefixed chunks, otherwise it's streamed raw and ended by 4 null bytes
+static uint32_t
+exec_run(int fd, const char* command, int framed)
+{
+  uint32_t error = 0;
+  exec_command = command;
+  squirtd_execReturnCode = EXEC_JOB_NOT_STARTED;
+
+  char pipe[32];
+  uint32_t procId = (uint32_t)squirtd_proc;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+  RawDoFmt((APTR)"PIPE:%ux", // CONST_STRPTR FormatString
+	   &procId,   // APTR DataStream
+	   (void (*)())&PutChProc,         // VOID_FUNC PutChProc
+	   pipe     // APTR PutChData
+	   );
+#pragma GCC diagnostic pop
+
+
+  if ((exec_outputFd = Open((APTR)pipe, MODE_NEWFILE)) == 0) {
+    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+    goto cleanup;
+  }
+
+  if ((exec_inputFd = Open((APTR)pipe, MODE_OLDFILE)) == 0) {
+    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+    goto cleanup;
+  }
+
+
+  CreateNewProcTags(NP_Entry, (uint32_t)exec_runner, NP_Cli, 1, TAG_DONE, 0);
+
+  char buffer[256];
+  int length;
+  while ((length = Read(exec_inputFd, buffer, framed ? sizeof(buffer) : 16)) > 0) {
+    // output is streamed to the terminal as it's produced
+    if ((framed && sendU32(fd, length) != 0) || sendAll(fd, buffer, length) != 0 || sendFlush(fd) != 0) {
+      error = ERROR_FATAL_SEND_FAILED;
+      goto cleanup;
+    }
+  }
+
+ cleanup:
+
+  if (!error && squirtd_execReturnCode != 0) {
+    error = ERROR_EXEC_FAILED;
+  }
+
+  if (framed) {
+    if (sendU32(fd, EXEC_FRAME_END) != 0 || sendU32(fd, squirtd_execReturnCode) != 0) {
+      error = ERROR_FATAL_SEND_FAILED;
+    }
+  } else if (sendU32(fd, 0) != 0) {
+    // sending 4 null bytes breaks out of the terminal read loop in squirt_execCmd
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+  if (exec_inputFd) {
+    Close(exec_inputFd);
+  }
+
+  return error;
+}
+
+
+typedef struct {
+  struct Message message;   // hands the job to its process
+  const char* command;
+  BPTR inputFd;             // squirtd's end of the job's pipe, 0 when the job isn't running
+  BPTR outputFd;            // the job's end, closed by the job when it finishes
+  struct DosPacket* packet; // the read squirtd has waiting on the pipe
+  int32_t returnCode;
+  uint32_t id;
+  char buffer[256];
+} exec_job_t;
+
+
+static void
+exec_jobRunner(void)
+{
+  struct Process* proc = (struct Process*)FindTask(0);
+  exec_job_t* job;
+
+  WaitPort(&proc->pr_MsgPort);
+  job = (exec_job_t*)GetMsg(&proc->pr_MsgPort);
+
+  job->returnCode = SystemTags((APTR)job->command, SYS_Output, job->outputFd, TAG_DONE, 0);
+
+  // squirtd reads end of file once the pipe is closed, so the return code is set by then
+  Close(job->outputFd);
+}
+
+
+// the pipes are read with packets so that one job's output doesn't hold up another's
+static void
+exec_jobRead(exec_job_t* job, struct MsgPort* port)
+{
+  struct FileHandle* fh = BADDR(job->inputFd);
+
+  job->packet->dp_Type = ACTION_READ;
+  job->packet->dp_Arg1 = fh->fh_Arg1;
+  job->packet->dp_Arg2 = (LONG)job->buffer;
+  job->packet->dp_Arg3 = sizeof(job->buffer);
+  SendPkt(job->packet, fh->fh_Type, port);
+}
+
+
+static int
+exec_jobStart(exec_job_t* job, uint32_t id, const char* command, struct MsgPort* port)
+{
+  char pipe[32];
+  ULONG args[] = {(ULONG)squirtd_proc, id};
+  struct Process* proc = 0;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+  RawDoFmt((APTR)"PIPE:%lx.%lu", args, (void (*)())&PutChProc, pipe);
+#pragma GCC diagnostic pop
+
+  job->command = command;
+  job->id = id;
+  job->inputFd = 0;
+
+  if ((job->outputFd = Open((APTR)pipe, MODE_NEWFILE)) == 0 ||
+      (job->inputFd = Open((APTR)pipe, MODE_OLDFILE)) == 0 ||
+      (proc = CreateNewProcTags(NP_Entry, (uint32_t)exec_jobRunner, NP_Cli, 1, NP_Name, (uint32_t)"squirtd job", TAG_DONE, 0)) == 0) {
+    if (job->inputFd) {
+      Close(job->inputFd);
+      job->inputFd = 0;
+    }
+    if (job->outputFd) {
+      Close(job->outputFd);
+    }
+    return -1;
+  }
+
+  job->message.mn_Length = sizeof(exec_job_t);
+  job->message.mn_ReplyPort = 0;
+  PutMsg(&proc->pr_MsgPort, &job->message);
+
+  exec_jobRead(job, port);
+  return 0;
+}
+
+
+static uint32_t
+exec_jobs(int fd)
+{
+  uint32_t error = 0, concurrency, count, next = 0, running = 0;
+  char** commands = 0;
+  exec_job_t* jobs = 0;
+  struct MsgPort* port = 0;
+
+  if (recvAll(fd, &concurrency, sizeof(concurrency)) != 0 || recvAll(fd, &count, sizeof(count)) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  if (concurrency == 0 || concurrency > EXEC_MAX_JOBS) {
+    concurrency = EXEC_MAX_JOBS;
+  }
+
+  if (!(commands = mem_alloc((count+1)*sizeof(char*)))) {
+    return ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+  }
+  memset(commands, 0, (count+1)*sizeof(char*));
+
+  // recvString() shares squirtd_string between short strings, every command has to be kept
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t length;
+    if (recvAll(fd, &length, sizeof(length)) != 0 ||
+	(commands[i] = mem_alloc(length+1)) == 0 ||
+	recvAll(fd, commands[i], length) != 0) {
+      error = ERROR_FATAL_RECV_FAILED;
+      goto cleanup;
+    }
+    commands[i][length] = 0;
+  }
+
+  if (!(jobs = mem_alloc(concurrency*sizeof(exec_job_t))) ||
+      !(port = CreateMsgPort())) {
+    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+    goto done;
+  }
+  memset(jobs, 0, concurrency*sizeof(exec_job_t));
+
+  for (uint32_t i = 0; i < concurrency; i++) {
+    if (!(jobs[i].packet = AllocDosObject(DOS_STDPKT, 0))) {
+      error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+      goto done;
+    }
+  }
+
+  while (next < count || running) {
+    // after a failed send no more jobs are started, the running ones are still drained so they can finish
+    for (uint32_t i = 0; i < concurrency && next < count && !error; i++) {
+      if (!jobs[i].inputFd) {
+	if (exec_jobStart(&jobs[i], next, commands[next], port) == 0) {
+	  running++;
+	} else if (sendU32(fd, next) != 0 || sendU32(fd, EXEC_JOB_EXITED) != 0 || sendU32(fd, EXEC_JOB_NOT_STARTED) != 0) {
+	  error = ERROR_FATAL_SEND_FAILED;
+	}
+	next++;
+      }
+    }
+
+    if (error) {
+      next = count;
+    }
+
+    if (!running) {
+      continue;
+    }
+
+    struct Message* message;
+    WaitPort(port);
+    while ((message = GetMsg(port))) {
+      struct DosPacket* packet = (struct DosPacket*)message->mn_Node.ln_Name;
+      exec_job_t* job = jobs;
+
+      while (job->packet != packet) {
+	job++;
+      }
+
+      if (packet->dp_Res1 > 0) {
+	if (!error &&
+	    (sendU32(fd, job->id) != 0 || sendU32(fd, packet->dp_Res1) != 0 ||
+	     sendAll(fd, job->buffer, packet->dp_Res1) != 0 || sendFlush(fd) != 0)) {
+	  error = ERROR_FATAL_SEND_FAILED;
+	}
+	exec_jobRead(job, port);
+      } else {
+	Close(job->inputFd);
+	job->inputFd = 0;
+	running--;
+	if (!error &&
+	    (sendU32(fd, job->id) != 0 || sendU32(fd, EXEC_JOB_EXITED) != 0 || sendU32(fd, job->returnCode) != 0)) {
+	  error = ERROR_FATAL_SEND_FAILED;
+	}
+      }
+    }
+  }
+
+ done:
+
+  // the status has to follow the frames even when the jobs couldn't be set up
+  if (error != ERROR_FATAL_SEND_FAILED && sendU32(fd, EXEC_JOBS_DONE) != 0) {
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+ cleanup:
+
+  if (jobs) {
+    for (uint32_t i = 0; i < concurrency; i++) {
+      if (jobs[i].packet) {
+	FreeDosObject(DOS_STDPKT, jobs[i].packet);
+      }
+    }
+    mem_free(jobs);
+  }
+
+  if (port) {
+    DeleteMsgPort(port);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    mem_free(commands[i]);
+  }
+  mem_free(commands);
+
+  return error;
+}
+
+
+static uint32_t
+exec_dir(int fd, const char* dir)
+{
+  struct ExAllControl* eac = squirtd_exAllControl;
+  void* data = squirtd_rxBuffer;
+  uint32_t error = 0;
+  int more = 0;
+
+  BPTR lock = Lock((APTR)dir, ACCESS_READ);
+
+  if (!lock) {
+    error = ERROR_FILE_READ_FAILED;
+    goto cleanup;
+  }
+
+  eac->eac_LastKey = 0;
+  eac->eac_MatchString = 0;
+  eac->eac_MatchFunc = 0;
+  do {
+    uint64_t start = stats_now();
+    more = ExAll(lock, data, BLOCK_SIZE, ED_COMMENT, eac);
+    stats_dos(start);
+    if ((!more) && (IoErr() != ERROR_NO_MORE_ENTRIES)) {
+      goto cleanup;
+      break;
+    }
+    if (eac->eac_Entries == 0) {
+      /* ExAll failed normally with no entries */
+      continue; /* ("more" is *usually* zero) */
+    }
+    struct ExAllData *ead = (struct ExAllData *) data;
+    do {
+      uint32_t nameLength = strlen((char*)ead->ed_Name);
+      uint32_t commentLength = strlen((char*)ead->ed_Comment);
+      if (sendAll(fd, &nameLength, sizeof(nameLength)) != 0 ||
+	  sendAll(fd, ead->ed_Name, nameLength) != 0 ||
+	  sendAll(fd, &ead->ed_Type, sizeof(ead->ed_Type)) != 0 ||
+	  sendAll(fd, &ead->ed_Size, sizeof(ead->ed_Size)) != 0 ||
+	  sendAll(fd, &ead->ed_Prot, sizeof(ead->ed_Prot)) != 0 ||
+	  sendAll(fd, &ead->ed_Days, sizeof(ead->ed_Days)) != 0 ||
+	  sendAll(fd, &ead->ed_Mins, sizeof(ead->ed_Mins)) != 0 ||
+	  sendAll(fd, &ead->ed_Ticks, sizeof(ead->ed_Ticks)) != 0 ||
+	  sendAll(fd, &commentLength, sizeof(commentLength)) != 0 ||
+	  sendAll(fd, ead->ed_Comment, commentLength) != 0) {
+	error = ERROR_FATAL_SEND_FAILED;
+	goto cleanup;
+      }
+      ead = ead->ed_Next;
+    } while (ead);
+  } while (more);
+
+
+ cleanup:
+
+  if (sendU32(fd, 0xFFFFFFFF) != 0) { ; // not status, terminating word
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+  if (more) {
+    // an abandoned scan can't be reused without ExAllEnd(), which needs V39, so start over
+    FreeDosObject(DOS_EXALLCONTROL, eac);
+    squirtd_exAllControl = AllocDosObject(DOS_EXALLCONTROL, NULL);
+    if (!squirtd_exAllControl) {
+      mem_track(-(int32_t)sizeof(struct ExAllControl));
+      error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+    }
+  }
+
+  if (lock) {
+    UnLock(lock);
+  }
+
+  return error;
+}
+
+
+static uint32_t
+exec_cwd(int fd)
+{
+  char name[108];
+  NameFromLock(squirtd_proc->pr_CurrentDir, (STRPTR)name, sizeof(name)-1);
+  int32_t len = strlen(name);
+
+  if (sendAll(fd, &len, sizeof(len)) != 0 ||
+      sendAll(fd, name, len) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+exec_volumes(int fd)
+{
+  uint32_t error = 0, size = 0;
+  char* buffer = 0;
+  struct DosList* dl = LockDosList(LDF_ALL|LDF_READ);
+  struct DosList* ptr;
+
+  // copy the names out first, nothing is sent while the dos list is locked
+  for (ptr = dl; (ptr = NextDosEntry(ptr, LDF_ALL)) != 0;) {
+    size += 2 + ((UBYTE*)BADDR(ptr->dol_Name))[0];
+  }
+
+  // usually fits in the receive buffer, which isn't in use
+  if ((buffer = size < (uint32_t)BLOCK_SIZE ? squirtd_rxBuffer : mem_alloc(size+1))) {
+    char* out = buffer;
+    for (ptr = dl; (ptr = NextDosEntry(ptr, LDF_ALL)) != 0 && out < buffer+size;) {
+      UBYTE* name = BADDR(ptr->dol_Name);
+      *out++ = ptr->dol_Type == DLT_DEVICE ? SQUIRT_VOLUME_DEVICE :
+	ptr->dol_Type == DLT_VOLUME ? SQUIRT_VOLUME_VOLUME : SQUIRT_VOLUME_ASSIGN;
+      *out++ = name[0];
+      memcpy(out, name+1, name[0]);
+      out += name[0];
+    }
+    size = out-buffer;
+  }
+
+  UnLockDosList(LDF_ALL|LDF_READ);
+
+  if (!buffer) {
+    error = ERROR_FATAL_ERROR;
+    goto cleanup;
+  }
+
+  for (char* in = buffer; in < buffer+size; in += 2 + (UBYTE)in[1]) {
+    uint32_t nameLength = (UBYTE)in[1];
+    if (nameLength == 0) {
+      continue;
+    }
+    if (sendU32(fd, nameLength) != 0 ||
+	sendAll(fd, in+2, nameLength) != 0 ||
+	sendU32(fd, (UBYTE)in[0]) != 0) {
+      error = ERROR_FATAL_SEND_FAILED;
+      goto cleanup;
+    }
+  }
+
+ cleanup:
+
+  if (sendU32(fd, 0xFFFFFFFF) != 0) { // not status, terminating word
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+  if (buffer != squirtd_rxBuffer) {
+    mem_free(buffer);
+  }
+
+  return error;
+}
+
+
+static uint32_t
+exec_cd(const char* dir)
+{
+  BPTR lock = Lock((APTR)dir, ACCESS_READ);
+
+  if (!lock) {
+    return ERROR_CD_FAILED;
+  }
+
+  if (Examine(lock, squirtd_fileInfo) && squirtd_fileInfo->fib_DirEntryType > 0) {
+    BPTR oldLock = CurrentDir(lock);
+
+    if (oldLock) {
+      UnLock(oldLock);
+    }
+    return 0;
+  } else {
+    UnLock(lock);
+    return ERROR_CD_FAILED;
+  }
+}
+
+
+static uint32_t
+file_setInfo(int fd, const char* filename)
+{
+  squirtd_file_info_t info;
+  int len;
+  if ((len = recvRaw(fd, &info, sizeof(info))) == sizeof(info)) {
+    if (!SetProtection((STRPTR)filename, info.protection)) {
+      return ERROR_SET_PROTECTION_FAILED;
+    }
+    if ((uint32_t)info.dateStamp.ds_Days != 0xFFFFFFFF) {
+      if (!SetFileDate((STRPTR)filename, &info.dateStamp)) {
+	return ERROR_SET_DATESTAMP_FAILED;
+      }
+    }
+    return 0;
+  }
+
+  return ERROR_FATAL_RECV_FAILED;
+}
+
+
+static uint32_t
+file_makeDir(const char* dir)
+{
+  BPTR lock = CreateDir((APTR)dir);
+
+  if (!lock) {
+    return ERROR_MKDIR_FAILED;
+  }
+
+  UnLock(lock);
+  return 0;
+}
+
+
+static uint32_t
+file_delete(const char* filename)
+{
+  return DeleteFile((APTR)filename) ? 0 : ERROR_DELETE_FAILED;
+}
+
+
+static uint32_t
+file_rename(int fd, const char* filename)
+{
+  char* newName = recvString(fd);
+
+  if (!newName) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  uint32_t error = Rename((APTR)filename, (APTR)newName) ? 0 : ERROR_RENAME_FAILED;
+  freeString(newName);
+
+  return error;
+}
+
+
+static uint32_t
+file_batch(int fd)
+{
+  uint32_t count, error = 0;
+
+  if (recvAll(fd, &count, sizeof(count)) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t command, status;
+    if (recvAll(fd, &command, sizeof(command)) != 0) {
+      return ERROR_FATAL_RECV_FAILED;
+    }
+
+    char* filename = recvFilename(fd);
+    if (!filename) {
+      return ERROR_FATAL_RECV_FAILED;
+    }
+
+    if (command == SQUIRT_COMMAND_MKDIR) {
+      status = file_makeDir(filename);
+    } else if (command == SQUIRT_COMMAND_DELETE) {
+      status = file_delete(filename);
+    } else if (command == SQUIRT_COMMAND_RENAME) {
+      status = file_rename(fd, filename);
+    } else {
+      status = ERROR_FATAL_RECV_FAILED; // can't skip a payload we don't understand
+    }
+
+    if (sendU32(fd, status) != 0) {
+      return ERROR_FATAL_SEND_FAILED;
+    }
+
+    if (ERROR_IS_FATAL(status)) {
+      return status;
+    }
+
+    if (!error) {
+      error = status;
+    }
+  }
+
+  return error;
+}
+
+
+static uint32_t
+file_get(int fd)
+{
+  int32_t fileLength;
+  if (recvRaw(fd, (void*)&fileLength, sizeof(fileLength)) != sizeof(fileLength)) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  uint64_t start = stats_now();
+  DeleteFile((APTR)squirtd_filename);
+  squirtd_outputFd = Open((APTR)squirtd_filename, MODE_NEWFILE);
+  stats_dos(start);
+
+  if (squirtd_outputFd == 0) {
+    return ERROR_FATAL_CREATE_FILE_FAILED;
+  }
+
+  int total = 0, timeout = 0, length, blockSize = BLOCK_SIZE;
+  do {
+    if (fileLength-total < BLOCK_SIZE) {
+      blockSize = fileLength-total;
+    }
+    if ((length = recvRaw(fd, (void*)squirtd_rxBuffer, blockSize)) < 0) {
+      return ERROR_FATAL_RECV_FAILED;
+    }
+    if (length) {
+      total += length;
+      start = stats_now();
+      LONG written = Write(squirtd_outputFd, squirtd_rxBuffer, length);
+      stats_dos(start);
+      if (written != length) {
+	return ERROR_FATAL_FILE_WRITE_FAILED;
+      }
+      timeout = 0;
+    } else {
+      timeout++;
+    }
+  } while (timeout < 2 && total < fileLength);
+
+  return 0;
+}
+
+
+static uint32_t
+file_getWithInfo(int fd)
+{
+  squirtd_file_info_t info;
+
+  if (recvAll(fd, &info, sizeof(info)) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  char* comment = recvString(fd);
+  if (!comment) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  uint32_t error = file_get(fd);
+
+  if (!error) {
+    // the datestamp would be overwritten by Close(), so finish the file first
+    Close(squirtd_outputFd);
+    squirtd_outputFd = 0;
+
+    if (!SetProtection((STRPTR)squirtd_filename, info.protection)) {
+      error = ERROR_SET_PROTECTION_FAILED;
+    } else if ((uint32_t)info.dateStamp.ds_Days != 0xFFFFFFFF &&
+	       !SetFileDate((STRPTR)squirtd_filename, &info.dateStamp)) {
+      error = ERROR_SET_DATESTAMP_FAILED;
+    } else if (!SetComment((STRPTR)squirtd_filename, (STRPTR)comment)) {
+      error = ERROR_SET_COMMENT_FAILED;
+    }
+  }
+
+  freeString(comment);
+  return error;
+}
+
+
+// a tree record's path is below the folder the tree is written to, and like a squirted file a
+// path without a volume is in destFolder
+static uint32_t
+tree_recvPath(int fd, const char* root, const char* destFolder, char** path)
+{
+  uint32_t length, rootLength = strlen(root), destFolderLength = strlen(destFolder);
+  char* name;
+
+  if (recvAll(fd, &length, sizeof(length)) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  if (!(*path = mem_alloc(destFolderLength+rootLength+length+2))) {
+    return ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+  }
+
+  name = *path+destFolderLength;
+  strcpy(name, root);
+  if (rootLength && root[rootLength-1] != ':' && root[rootLength-1] != '/') {
+    name[rootLength++] = '/';
+  }
+
+  if (recvAll(fd, name+rootLength, length) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  name[rootLength+length] = 0;
+
+  if (strchr(name, ':')) {
+    memmove(*path, name, rootLength+length+1);
+  } else {
+    memcpy(*path, destFolder, destFolderLength);
+  }
+
+  return 0;
+}
+
+
 static uint32_t
-sendU32(int fd, uint32_t status)
+tree_makeDir(const char* path)
 {
-  if (send(fd, (void*)&status, sizeof(status), 0) != sizeof(status)) {
-    return ERROR_FATAL_SEND_FAILED;
+  BPTR lock = CreateDir((APTR)path);
+
+  if (!lock) {
+    // a folder that's already there is fine
+    int isDir = (lock = Lock((APTR)path, ACCESS_READ)) && Examine(lock, squirtd_fileInfo) && squirtd_fileInfo->fib_DirEntryType > 0;
+    if (lock) {
+      UnLock(lock);
+    }
+    return isDir ? 0 : ERROR_MKDIR_FAILED;
   }
 
+  UnLock(lock);
   return 0;
 }
 
 
-static void
-exec_runner(void)
+static uint32_t
+tree_setInfo(const char* path, squirtd_file_info_t* info, const char* comment)
 {
-  squirtd_execError = SystemTags((APTR)exec_command, SYS_Output, exec_outputFd, TAG_DONE, 0) == 0 ? 0 : ERROR_EXEC_FAILED;
-
-  if (exec_outputFd) {
-    Close(exec_outputFd);
+  if (!SetProtection((STRPTR)path, info->protection)) {
+    return ERROR_SET_PROTECTION_FAILED;
+  } else if ((uint32_t)info->dateStamp.ds_Days != 0xFFFFFFFF && !SetFileDate((STRPTR)path, &info->dateStamp)) {
+    return ERROR_SET_DATESTAMP_FAILED;
+  } else if (!SetComment((STRPTR)path, (STRPTR)comment)) {
+    return ERROR_SET_COMMENT_FAILED;
   }
+
+  return 0;
 }
 
-static const uint32_t PutChProc=0x16c04e75; /* move.b d0,(a3)+ ; rts */
 
 static uint32_t
-exec_run(int fd, const char* command)
+tree_info(int fd, const char* path, uint32_t* recordError)
 {
-  uint32_t error = 0;
-  exec_command = command;
+  squirtd_file_info_t info;
+  char* comment;
 
-  char pipe[32];
-  uint32_t procId = (uint32_t)squirtd_proc;
+  if (recvAll(fd, &info, sizeof(info)) != 0 || !(comment = recvString(fd))) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-  RawDoFmt((APTR)"PIPE:%ux", // CONST_STRPTR FormatString
-	   &procId,   // APTR DataStream
-	   (void (*)())&PutChProc,         // VOID_FUNC PutChProc
-	   pipe     // APTR PutChData
-	   );
-#pragma GCC diagnostic pop
+  *recordError = tree_setInfo(path, &info, comment);
+  freeString(comment);
+  return 0;
+}
 
 
-  if ((exec_outputFd = Open((APTR)pipe, MODE_NEWFILE)) == 0) {
-    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
-    goto cleanup;
-  }
+// a file that can't be written still has its data read, so the records after it stay in step
+static uint32_t
+tree_file(int fd, const char* path, uint32_t* recordError)
+{
+  squirtd_file_info_t info;
+  uint32_t fileLength, total = 0, error = 0;
+  char* comment;
 
-  if ((exec_inputFd = Open((APTR)pipe, MODE_OLDFILE)) == 0) {
-    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
-    goto cleanup;
+  if (recvAll(fd, &info, sizeof(info)) != 0 || !(comment = recvString(fd))) {
+    return ERROR_FATAL_RECV_FAILED;
   }
 
+  if (recvAll(fd, &fileLength, sizeof(fileLength)) != 0) {
+    freeString(comment);
+    return ERROR_FATAL_RECV_FAILED;
+  }
 
-  CreateNewProcTags(NP_Entry, (uint32_t)exec_runner, NP_Cli, 1, TAG_DONE, 0);
+  uint64_t start = stats_now();
+  DeleteFile((APTR)path);
+  squirtd_outputFd = Open((APTR)path, MODE_NEWFILE);
+  stats_dos(start);
 
-  char buffer[16];
-  int length;
-  while ((length = Read(exec_inputFd, buffer, sizeof(buffer))) > 0) {
-    if (send(fd, buffer, length, 0) != length) {
-      error = ERROR_FATAL_SEND_FAILED;
-      goto cleanup;
-    }
+  if (!squirtd_outputFd) {
+    *recordError = ERROR_CREATE_FILE_FAILED;
   }
 
- cleanup:
-
-  if (!error) {
-    error = squirtd_execError;
+  while (total < fileLength) {
+    int blockSize = fileLength-total < (uint32_t)BLOCK_SIZE ? (int)(fileLength-total) : BLOCK_SIZE;
+    if (recvAll(fd, squirtd_rxBuffer, blockSize) != 0) {
+      error = ERROR_FATAL_RECV_FAILED;
+      break;
+    }
+    if (!*recordError) {
+      start = stats_now();
+      LONG written = Write(squirtd_outputFd, squirtd_rxBuffer, blockSize);
+      stats_dos(start);
+      if (written != blockSize) {
+	*recordError = ERROR_FILE_WRITE_FAILED;
+      }
+    }
+    total += blockSize;
   }
 
-  // sending 4 null bytes breaks out of the terminal read loop in squirt_execCmd
-  if (sendU32(fd, 0) != 0) {
-    error = ERROR_FATAL_SEND_FAILED;
+  if (squirtd_outputFd) {
+    // the datestamp would be overwritten by Close(), so finish the file first
+    Close(squirtd_outputFd);
+    squirtd_outputFd = 0;
   }
 
-  if (exec_inputFd) {
-    Close(exec_inputFd);
+  if (!error && !*recordError) {
+    *recordError = tree_setInfo(path, &info, comment);
   }
 
+  freeString(comment);
   return error;
 }
 
 
+// the records are streamed without waiting for replies, so a failed record is noted and the rest carry on
 static uint32_t
-exec_dir(int fd, const char* dir)
+file_tree(int fd, const char* root, const char* destFolder)
 {
-  struct ExAllControl*  eac = 0;
-  void* data = 0;
-  uint32_t error = 0;
-
-  BPTR lock = Lock((APTR)dir, ACCESS_READ);
+  uint32_t type, record = 0, failed = 0, error = 0;
+  uint32_t* failures = mem_alloc(TREE_MAX_FAILURES*2*sizeof(uint32_t));
 
-  if (!lock) {
-    error = ERROR_FILE_READ_FAILED;
-    goto cleanup;
+  if (!failures) {
+    return ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
   }
 
-  data = malloc(BLOCK_SIZE);
-
-  eac = AllocDosObject(DOS_EXALLCONTROL, NULL);
-
-  if (!eac) {
-    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
-    goto cleanup;
-  }
+  for (;; record++) {
+    uint32_t recordError = 0;
+    char* path = 0;
 
-  eac->eac_LastKey = 0;
-  int more;
-  do {
-    more = ExAll(lock, data, BLOCK_SIZE, ED_COMMENT, eac);
-    if ((!more) && (IoErr() != ERROR_NO_MORE_ENTRIES)) {
-      goto cleanup;
+    if (recvAll(fd, &type, sizeof(type)) != 0) {
+      error = ERROR_FATAL_RECV_FAILED;
       break;
     }
-    if (eac->eac_Entries == 0) {
-      /* ExAll failed normally with no entries */
-      continue; /* ("more" is *usually* zero) */
-    }
-    struct ExAllData *ead = (struct ExAllData *) data;
-    do {
-      uint32_t nameLength = strlen((char*)ead->ed_Name);
-      uint32_t commentLength = strlen((char*)ead->ed_Comment);
-      if (send(fd, (void*)&nameLength, sizeof(nameLength), 0) != sizeof(nameLength) ||
-	  send(fd, ead->ed_Name, nameLength, 0) != (int)nameLength ||
-	  send(fd, (void*)&ead->ed_Type, sizeof(ead->ed_Type), 0) != sizeof(ead->ed_Type) ||
-	  send(fd, (void*)&ead->ed_Size, sizeof(ead->ed_Size), 0) != sizeof(ead->ed_Size) ||
-	  send(fd, (void*)&ead->ed_Prot, sizeof(ead->ed_Prot), 0) != sizeof(ead->ed_Prot) ||
-	  send(fd, (void*)&ead->ed_Days, sizeof(ead->ed_Days), 0) != sizeof(ead->ed_Days) ||
-	  send(fd, (void*)&ead->ed_Mins, sizeof(ead->ed_Mins), 0) != sizeof(ead->ed_Mins) ||
-	  send(fd, (void*)&ead->ed_Ticks, sizeof(ead->ed_Ticks), 0) != sizeof(ead->ed_Ticks) ||
-	  send(fd, (void*)&commentLength, sizeof(commentLength), 0) != sizeof(commentLength) ||
-	  send(fd, ead->ed_Comment, commentLength, 0) != (int)commentLength) {
-	error = ERROR_FATAL_SEND_FAILED;
-	goto cleanup;
-      }
-      ead = ead->ed_Next;
-    } while (ead);
-  } while (more);
 
+    if (type == TREE_RECORD_END) {
+      break;
+    }
 
- cleanup:
+    if ((error = tree_recvPath(fd, root, destFolder, &path)) == 0) {
+      if (type == TREE_RECORD_DIR) {
+	recordError = tree_makeDir(path);
+      } else if (type == TREE_RECORD_FILE) {
+	error = tree_file(fd, path, &recordError);
+      } else if (type == TREE_RECORD_INFO) {
+	error = tree_info(fd, path, &recordError);
+      } else {
+	error = ERROR_FATAL_RECV_FAILED; // can't skip a record we don't understand
+      }
+    }
 
-  if (sendU32(fd, 0xFFFFFFFF) != 0) { ; // not status, terminating word
-    error = ERROR_FATAL_SEND_FAILED;
-  }
+    mem_free(path);
 
-  if (eac) {
-    FreeDosObject(DOS_EXALLCONTROL,eac);
-  }
+    if (error) {
+      break;
+    }
 
-  if (data) {
-    free(data);
+    if (recordError) {
+      if (failed < TREE_MAX_FAILURES) {
+	failures[failed*2] = record;
+	failures[failed*2+1] = recordError;
+      }
+      failed++;
+    }
   }
 
-  if (lock) {
-    UnLock(lock);
+  if (!error) {
+    if (sendU32(fd, failed) != 0 ||
+	sendAll(fd, failures, (failed < TREE_MAX_FAILURES ? failed : TREE_MAX_FAILURES)*2*sizeof(uint32_t)) != 0) {
+      error = ERROR_FATAL_SEND_FAILED;
+    }
   }
 
+  mem_free(failures);
   return error;
 }
 
 
 static uint32_t
-exec_cwd(int fd)
+file_stat(int fd, const char* filename)
 {
-  char name[108];
-  NameFromLock(squirtd_proc->pr_CurrentDir, (STRPTR)name, sizeof(name)-1);
-  int32_t len = strlen(name);
+  struct FileInfoBlock* fileInfo = squirtd_fileInfo;
+  uint32_t error = 0;
+
+  BPTR lock = Lock((APTR)filename, ACCESS_READ);
+
+  if (!lock || !Examine(lock, fileInfo)) {
+    memset(fileInfo, 0, sizeof(*fileInfo));
+    error = ERROR_FILE_READ_FAILED;
+  }
+
+  if (lock) {
+    UnLock(lock);
+  }
 
-  if (send(fd, (void*)&len, sizeof(len), 0) != sizeof(len) ||
-      (send(fd, name, len, 0) != len)) {
+  // the length goes first, an older squirtd answers with a bare zero status
+  if (sendU32(fd, STAT_LENGTH) != 0 ||
+      sendU32(fd, fileInfo->fib_DirEntryType) != 0 ||
+      sendU32(fd, fileInfo->fib_Size) != 0 ||
+      sendU32(fd, fileInfo->fib_Protection) != 0 ||
+      sendU32(fd, fileInfo->fib_Date.ds_Days) != 0 ||
+      sendU32(fd, fileInfo->fib_Date.ds_Minute) != 0 ||
+      sendU32(fd, fileInfo->fib_Date.ds_Tick) != 0) {
     return ERROR_FATAL_SEND_FAILED;
   }
 
-  return 0;
+  return error;
 }
 
 
 static uint32_t
-exec_cd(const char* dir)
+file_send(int fd, char* filename)
 {
-  BPTR lock = Lock((APTR)dir, ACCESS_READ);
+  struct FileInfoBlock* fileInfo = squirtd_fileInfo;
+  uint32_t error = 0;
 
-  if (!lock) {
-    return ERROR_CD_FAILED;
+  // examining the open file saves a Lock()/Examine()/UnLock() of the same path
+  uint64_t start = stats_now();
+  squirtd_inputFd = Open((APTR)filename, MODE_OLDFILE);
+  int examined = squirtd_inputFd && ExamineFH(squirtd_inputFd, fileInfo);
+  stats_dos(start);
+
+  if (!examined) {
+    LONG ioErr = IoErr();
+    if (ioErr == ERROR_OBJECT_WRONG_TYPE) {
+      error = ERROR_SUCK_ON_DIR; // Open() refuses directories
+    } else if (ioErr != ERROR_OBJECT_NOT_FOUND) {
+      error = ERROR_FILE_READ_FAILED;
+    }
+    return sendU32(fd, 0xFFFFFFFF) != 0 ? ERROR_FATAL_SEND_FAILED : error;
   }
 
-  struct FileInfoBlock fileInfo;
-  Examine(lock, &fileInfo);
+  int32_t size = fileInfo->fib_Size;
 
-  if (fileInfo.fib_DirEntryType > 0) {
-    BPTR oldLock = CurrentDir(lock);
+  if (sendU32(fd, size) != 0 ||
+      sendU32(fd, fileInfo->fib_Protection) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
 
-    if (oldLock) {
-      UnLock(oldLock);
+  int32_t total = 0;
+  while (total < size) {
+    start = stats_now();
+    int len = Read(squirtd_inputFd, squirtd_rxBuffer, BLOCK_SIZE);
+    stats_dos(start);
+    if (len <= 0) {
+      // the client is waiting for size bytes, so this connection can't recover
+      return ERROR_FATAL_SEND_FAILED;
     }
-    return 0;
-  } else {
-    UnLock(lock);
-    return ERROR_CD_FAILED;
+    if (len > size-total) {
+      len = size-total;
+    }
+    if (sendAll(fd, squirtd_rxBuffer, len) != 0) {
+      return ERROR_FATAL_SEND_FAILED;
+    }
+    total += len;
   }
+
+  return error;
 }
 
 
 static uint32_t
-file_setInfo(int fd, const char* filename)
+exec_memory(int fd)
 {
-  squirtd_file_info_t info;
-  int len;
-  if ((len = recv(fd, &info, sizeof(info), 0)) == sizeof(info)) {
-    if (!SetProtection((STRPTR)filename, info.protection)) {
-      return ERROR_SET_PROTECTION_FAILED;
-    }
-    if ((uint32_t)info.dateStamp.ds_Days != 0xFFFFFFFF) {
-      if (!SetFileDate((STRPTR)filename, &info.dateStamp)) {
-	return ERROR_SET_DATESTAMP_FAILED;
-      }
-    }
-    return 0;
+  // the length goes first, an older squirtd answers with a bare zero status
+  if (sendU32(fd, MEMORY_LENGTH) != 0 ||
+      sendU32(fd, squirtd_memCurrent) != 0 ||
+      sendU32(fd, squirtd_memPeak) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
   }
 
-  return ERROR_FATAL_RECV_FAILED;
+  return 0;
 }
 
 
 static uint32_t
-file_get(int fd)
+exec_hello(int fd)
 {
-  int32_t fileLength;
-  if (recv(fd, (void*)&fileLength, sizeof(fileLength), 0) != sizeof(fileLength)) {
-    return ERROR_FATAL_RECV_FAILED;
+  // the length goes first, an older squirtd answers with a bare zero status
+  if (sendU32(fd, HELLO_LENGTH) != 0 ||
+      sendU32(fd, SQUIRT_PROTOCOL_VERSION) != 0 ||
+      sendU32(fd, SQUIRTD_CAPABILITIES) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
   }
 
-  DeleteFile((APTR)squirtd_filename);
-
-  if ((squirtd_outputFd = Open((APTR)squirtd_filename, MODE_NEWFILE)) == 0) {
-    return ERROR_FATAL_CREATE_FILE_FAILED;
-  }
+  return 0;
+}
 
-  squirtd_rxBuffer = malloc(BLOCK_SIZE);
-  int total = 0, timeout = 0, length, blockSize = BLOCK_SIZE;
-  do {
-    if (fileLength-total < BLOCK_SIZE) {
-      blockSize = fileLength-total;
-    }
-    if ((length = recv(fd, (void*)squirtd_rxBuffer, blockSize, 0)) < 0) {
-      return ERROR_FATAL_RECV_FAILED;
-    }
-    if (length) {
-      total += length;
-      if (Write(squirtd_outputFd, squirtd_rxBuffer, length) != length) {
-	return ERROR_FATAL_FILE_WRITE_FAILED;
-      }
-      timeout = 0;
-    } else {
-      timeout++;
-    }
-  } while (timeout < 2 && total < fileLength);
 
-  return 0;
+static uint32_t
+sendU64(int fd, uint64_t value)
+{
+  return sendU32(fd, value >> 32) || sendU32(fd, value);
 }
 
 
 static uint32_t
-file_send(int fd, char* filename)
+exec_stats(int fd)
 {
-  int32_t size = -1;
-  uint32_t error = 0;
+  struct DateStamp now;
+  DateStamp(&now);
+
+  uint32_t uptime = (now.ds_Days - squirtd_started.ds_Days) * 24 * 60 * 60 +
+    (now.ds_Minute - squirtd_started.ds_Minute) * 60 +
+    (now.ds_Tick - squirtd_started.ds_Tick) / TICKS_PER_SECOND;
+
+  // the length goes first, an older squirtd answers with a bare zero status
+  if (sendU32(fd, (SQUIRT_STATS_COMMANDS + SQUIRT_COMMAND_COUNT) * 4) != 0 ||
+      sendU32(fd, uptime) != 0 ||
+      sendU64(fd, squirtd_bytesIn) != 0 ||
+      sendU64(fd, squirtd_bytesOut) != 0 ||
+      sendU32(fd, squirtd_memCurrent) != 0 ||
+      sendU32(fd, squirtd_memPeak) != 0 ||
+      sendU32(fd, AvailMem(MEMF_CHIP)) != 0 ||
+      sendU32(fd, AvailMem(MEMF_FAST)) != 0 ||
+      sendU64(fd, stats_usecs(squirtd_dosTime)) != 0 ||
+      sendU64(fd, stats_usecs(squirtd_socketTime)) != 0 ||
+      sendU32(fd, SQUIRT_COMMAND_COUNT) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
 
-  BPTR lock = Lock((APTR)filename, ACCESS_READ);
-  if (!lock) {
-    if (send(fd, (void*)&size, sizeof(size), 0) != sizeof(size)) {
+  for (int i = 0; i < SQUIRT_COMMAND_COUNT; i++) {
+    if (sendU32(fd, squirtd_commands[i]) != 0) {
       return ERROR_FATAL_SEND_FAILED;
     }
-    return 0;
   }
 
-  struct FileInfoBlock infoBlock;
-  Examine(lock, &infoBlock);
-  UnLock(lock);
+  return 0;
+}
 
-  if (infoBlock.fib_DirEntryType > 0) {
-    size = -1;
-    error = ERROR_SUCK_ON_DIR;
-  } else {
-    size = infoBlock.fib_Size;
+
+// multi-session: like inetd, hand the connection to a new squirtd process with its own state and current dir
+static int
+session_spawn(int fd, const char* destFolder)
+{
+  char command[sizeof(squirtd_programPath)+256];
+  BPTR input = 0, output = 0;
+  LONG id = ReleaseSocket(fd, UNIQUE_ID);
+
+  if (id < 0) {
+    CloseSocket(fd);
+    return -1;
   }
 
-  if (send(fd, (void*)&size, sizeof(size), 0) != sizeof(size) ||
-      send(fd, (void*)&infoBlock.fib_Protection, sizeof(infoBlock.fib_Protection), 0) != sizeof(infoBlock.fib_Protection)) {
-    return ERROR_FATAL_SEND_FAILED;
+  if (strlen(destFolder) > sizeof(command)-sizeof(squirtd_programPath)-32) {
+    goto error;
   }
 
-  squirtd_inputFd = Open((APTR)squirtd_filename, MODE_OLDFILE);
+  ULONG args[] = {(ULONG)squirtd_programPath, (ULONG)id, (ULONG)destFolder};
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+  RawDoFmt((APTR)"\"%s\" --session=%ld \"%s\"", args, (void (*)())&PutChProc, command);
+#pragma GCC diagnostic pop
 
-  if (!squirtd_inputFd) {
-    return ERROR_FILE_READ_FAILED;
+  if ((input = Open((APTR)"NIL:", MODE_OLDFILE)) == 0 ||
+      (output = Open((APTR)"NIL:", MODE_NEWFILE)) == 0) {
+    goto error;
   }
 
-  squirtd_rxBuffer = malloc(BLOCK_SIZE);
+  // the new process closes input and output when it exits
+  if (SystemTags((APTR)command, SYS_Input, input, SYS_Output, output, SYS_Asynch, TRUE, TAG_DONE, 0) != -1) {
+    return 0;
+  }
 
-  int32_t total = 0;
-  do {
-    int len;
-    if ((len = Read(squirtd_inputFd, squirtd_rxBuffer, BLOCK_SIZE) ) < 0) {
-      return ERROR_FILE_READ_FAILED;
-    } else {
-      if (send(fd, squirtd_rxBuffer, len, 0) != len) {
-	return ERROR_FATAL_SEND_FAILED;
-      }
-      total += len;
-    }
+ error:
+  if (input) {
+    Close(input);
+  }
 
-  } while (total < size);
+  if (output) {
+    Close(output);
+  }
 
-  return error;
+  // take the socket back so it doesn't leak
+  if ((fd = ObtainSocket(id, AF_INET, SOCK_STREAM, 0)) >= 0) {
+    CloseSocket(fd);
+  }
+
+  return -1;
 }
 
 
@@ -482,12 +1533,35 @@ main(int argc, char **argv)
   log_fd = fopen(filename, "w+");
 #endif
 
-  if (argc != 2) {
-    fatalError("squirtd: dest_folder\n");
+  const char* destFolder = 0;
+  int multiSession = 0;
+  LONG sessionId = -1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--multi") == 0) {
+      multiSession = 1;
+    } else if (strncmp(argv[i], "--session=", 10) == 0) {
+      sessionId = atol(argv[i]+10);
+    } else if (!destFolder) {
+      destFolder = argv[i];
+    } else {
+      fatalError("squirtd: [--multi] dest_folder\n");
+    }
+  }
+
+  if (!destFolder) {
+    fatalError("squirtd: [--multi] dest_folder\n");
   }
 
   squirtd_proc->pr_WindowPtr = (APTR)-1; // disable requesters
 
+  DateStamp(&squirtd_started);
+  if (OpenDevice((APTR)TIMERNAME, UNIT_ECLOCK, (struct IORequest*)&squirtd_timerRequest, 0) == 0) {
+    struct EClockVal clock;
+    TimerBase = squirtd_timerRequest.tr_node.io_Device;
+    squirtd_eclockRate = ReadEClock(&clock);
+  }
+
 #ifdef __GNUC__
   SocketBase = OpenLibrary((APTR)"bsdsocket.library", 4);
   if (!SocketBase) {
@@ -495,7 +1569,15 @@ main(int argc, char **argv)
   }
 #endif
 
-  squirtd_connectionFd = inetd_getSocket(squirtd_proc);
+  if (sessionId >= 0) {
+    // started by a --multi squirtd, serves the one connection it was handed, just as under inetd
+    squirtd_connectionFd = ObtainSocket(sessionId, AF_INET, SOCK_STREAM, 0);
+    if (squirtd_connectionFd < 0) {
+      fatalError("ObtainSocket() failed\n");
+    }
+  } else {
+    squirtd_connectionFd = inetd_getSocket(squirtd_proc);
+  }
 
   if (squirtd_connectionFd >= 0) {
     inetd = 1;
@@ -517,7 +1599,16 @@ main(int argc, char **argv)
     fatalError("bind() failed\n");
   }
 
-  if (listen(squirtd_listenFd, 1)) {
+  if (multiSession) {
+    char name[108];
+    if (!NameFromLock(GetProgramDir(), (STRPTR)squirtd_programPath, sizeof(squirtd_programPath)) ||
+	!GetProgramName((STRPTR)name, sizeof(name)) ||
+	!AddPart((STRPTR)squirtd_programPath, FilePart((STRPTR)name), sizeof(squirtd_programPath))) {
+      fatalError("unable to find squirtd\n");
+    }
+  }
+
+  if (listen(squirtd_listenFd, multiSession ? SQUIRTD_LISTEN_BACKLOG : 1)) {
     fatalError("listen() failed\n");
   }
 
@@ -528,10 +1619,22 @@ main(int argc, char **argv)
     fatalError("accept failed\n");
   }
 
+  if (multiSession) {
+    session_spawn(squirtd_connectionFd, destFolder);
+    squirtd_connectionFd = 0;
+    goto reconnect;
+  }
+
  inetd_start:
   {
-  const LONG socketTimeout = 1000;
+  const LONG socketTimeout = 1000, noDelay = 1;
   setsockopt(squirtd_connectionFd, SOL_SOCKET, SO_RCVTIMEO, (char*)&socketTimeout, sizeof(socketTimeout));
+  // replies are coalesced by sendAll(), so Nagle would only add delayed-ACK stalls
+  setsockopt(squirtd_connectionFd, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+  }
+
+  if (session_allocate() != 0) {
+    goto error;
   }
 
  again:
@@ -543,27 +1646,34 @@ main(int argc, char **argv)
     uint32_t nameLength;
   } command;
 
-  if (recv(squirtd_connectionFd, (void*)&command.command, sizeof(command.command), 0) != sizeof(command.command) ||
-     recv(squirtd_connectionFd, (void*)&command.nameLength, sizeof(command.nameLength), 0) != sizeof(command.nameLength)) {
+  // waiting for the client isn't socket I/O
+  uint64_t socketTime = squirtd_socketTime;
+  if (recvAll(squirtd_connectionFd, &command, sizeof(command)) != 0) {
     error = ERROR_FATAL_RECV_FAILED;
     goto error;
   }
+  squirtd_socketTime = socketTime;
+
+  if (command.command < SQUIRT_COMMAND_COUNT) {
+    squirtd_commands[command.command]++;
+  }
 
-  const char* destFolder = argv[1];
   char* filenamePtr;
-  int fullPathLen;
+  int fullPathLen, destFolderLen = 0;
   if (command.command == SQUIRT_COMMAND_SQUIRT) {
-    int destFolderLen = strlen(destFolder);
-    fullPathLen = command.nameLength+destFolderLen;
-    squirtd_filename = malloc(fullPathLen+1);
-    strcpy(squirtd_filename, destFolder);
-    filenamePtr = squirtd_filename+destFolderLen;
-  } else {
-    fullPathLen = command.nameLength;
-    filenamePtr = squirtd_filename = malloc(command.nameLength+1);
+    destFolderLen = strlen(destFolder);
+  }
+
+  fullPathLen = command.nameLength+destFolderLen;
+  if (!session_filename(fullPathLen)) {
+    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+    goto error;
   }
 
-  if (recv(squirtd_connectionFd, filenamePtr, command.nameLength, 0) != (int)command.nameLength) {
+  memcpy(squirtd_filename, destFolder, destFolderLen);
+  filenamePtr = squirtd_filename+destFolderLen;
+
+  if (recvRaw(squirtd_connectionFd, filenamePtr, command.nameLength) != (int)command.nameLength) {
     error = ERROR_FATAL_RECV_FAILED;
     goto error;
   }
@@ -572,7 +1682,9 @@ main(int argc, char **argv)
 
 
   if (command.command == SQUIRT_COMMAND_CLI) {
-    error = exec_run(squirtd_connectionFd, squirtd_filename);
+    error = exec_run(squirtd_connectionFd, squirtd_filename, 0);
+  } else if (command.command == SQUIRT_COMMAND_CLI_FRAMED) {
+    error = exec_run(squirtd_connectionFd, squirtd_filename, 1);
   } else if (command.command == SQUIRT_COMMAND_CD) {
     error = exec_cd(squirtd_filename);
   } else if (command.command == SQUIRT_COMMAND_SUCK) {
@@ -583,18 +1695,42 @@ main(int argc, char **argv)
     error = exec_cwd(squirtd_connectionFd);
   } else if (command.command == SQUIRT_COMMAND_SET_INFO) {
     error = file_setInfo(squirtd_connectionFd, squirtd_filename);
+  } else if (command.command == SQUIRT_COMMAND_MKDIR) {
+    error = file_makeDir(squirtd_filename);
+  } else if (command.command == SQUIRT_COMMAND_DELETE) {
+    error = file_delete(squirtd_filename);
+  } else if (command.command == SQUIRT_COMMAND_RENAME) {
+    error = file_rename(squirtd_connectionFd, squirtd_filename);
+  } else if (command.command == SQUIRT_COMMAND_BATCH) {
+    error = file_batch(squirtd_connectionFd);
   } else if (command.command == SQUIRT_COMMAND_SQUIRT ||
 	     command.command == SQUIRT_COMMAND_SQUIRT_TO_CWD) {
     error = file_get(squirtd_connectionFd);
+  } else if (command.command == SQUIRT_COMMAND_SQUIRT_WITH_INFO) {
+    error = file_getWithInfo(squirtd_connectionFd);
+  } else if (command.command == SQUIRT_COMMAND_STAT) {
+    error = file_stat(squirtd_connectionFd, squirtd_filename);
+  } else if (command.command == SQUIRT_COMMAND_TREE) {
+    error = file_tree(squirtd_connectionFd, squirtd_filename, destFolder);
+  } else if (command.command == SQUIRT_COMMAND_VOLUMES) {
+    error = exec_volumes(squirtd_connectionFd);
+  } else if (command.command == SQUIRT_COMMAND_MEMORY) {
+    error = exec_memory(squirtd_connectionFd);
+  } else if (command.command == SQUIRT_COMMAND_HELLO) {
+    error = exec_hello(squirtd_connectionFd);
+  } else if (command.command == SQUIRT_COMMAND_STATS) {
+    error = exec_stats(squirtd_connectionFd);
+  } else if (command.command == SQUIRT_COMMAND_EXEC_JOBS) {
+    error = exec_jobs(squirtd_connectionFd);
   }
 
-  if (sendU32(squirtd_connectionFd, error) != 0) {
+  if (sendU32(squirtd_connectionFd, error) != 0 || sendFlush(squirtd_connectionFd) != 0) {
     error = ERROR_FATAL_SEND_FAILED;
   }
 
   cleanupForNextRun();
 
-  if (error < ERROR_FATAL_ERROR) {
+  if (!ERROR_IS_FATAL(error)) {
     goto again;
   }
 
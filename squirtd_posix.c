@@ -0,0 +1,1676 @@
+/*
+ * squirtd_posix - a stand-in for squirtd that runs on the host.
+ *
+ * Speaks the same protocol as the Amiga daemon so the client tools can be exercised without
+ * an Amiga. Amiga paths are mapped below a root folder: "VOL:dir/file" becomes
+ * "<root>/VOL/dir/file". CLI commands are run by /bin/sh, so Amiga commands won't exist, but
+ * the framing is identical.
+ *
+ * usage: squirtd_posix [--port=port] [--multi] [--legacy] root_folder dest_folder
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+#include "common.h"
+
+#define SQUIRTD_AMIGA_EPOCH 252460800 // 1978-01-01 in unix time
+#define SQUIRTD_COMMENT_XATTR "user.squirt.comment"
+#define SQUIRTD_PROTECTION_XATTR "user.squirt.protection"
+#define SQUIRTD_LISTEN_BACKLOG 8
+#define SQUIRTD_CAPABILITIES (SQUIRT_CAP_FSOP|SQUIRT_CAP_BATCH|SQUIRT_CAP_SQUIRT_WITH_INFO|SQUIRT_CAP_STAT|SQUIRT_CAP_VOLUMES|SQUIRT_CAP_MEMORY|SQUIRT_CAP_STATS|SQUIRT_CAP_EXEC_JOBS|SQUIRT_CAP_CLI_FRAMED|SQUIRT_CAP_TREE)
+
+static char squirtd_root[PATH_MAX];
+static const char* squirtd_destFolder = 0;
+static int squirtd_listenFd = -1;
+static int squirtd_connectionFd = -1;
+static char* squirtd_filename = 0;
+static size_t squirtd_filenameSize = 0;
+static char* squirtd_rxBuffer = 0;
+static uint32_t squirtd_memCurrent = 0;
+static uint32_t squirtd_memPeak = 0;
+static int squirtd_fileFd = -1;
+static char squirtd_txBuffer[1460];
+static size_t squirtd_txLength = 0;
+static int squirtd_corked = 0;
+static int squirtd_legacy = 0;
+static time_t squirtd_started;
+static uint32_t squirtd_commands[SQUIRT_COMMAND_COUNT];
+static uint64_t squirtd_bytesIn = 0;
+static uint64_t squirtd_bytesOut = 0;
+static uint64_t squirtd_dosTime = 0;
+static uint64_t squirtd_socketTime = 0;
+
+
+// nanoseconds, file and socket calls are timed like squirtd times them with the E-clock
+static uint64_t
+stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void
+stats_dos(uint64_t start)
+{
+  squirtd_dosTime += stats_now() - start;
+}
+
+
+// like squirtd only the session buffers are counted, they're kept between commands
+static void
+mem_track(int64_t size)
+{
+  squirtd_memCurrent += size;
+  if (squirtd_memCurrent > squirtd_memPeak) {
+    squirtd_memPeak = squirtd_memCurrent;
+  }
+}
+
+
+static void
+session_free(void)
+{
+  if (squirtd_rxBuffer) {
+    free(squirtd_rxBuffer);
+    squirtd_rxBuffer = 0;
+    mem_track(-BLOCK_SIZE);
+  }
+
+  if (squirtd_filename) {
+    free(squirtd_filename);
+    squirtd_filename = 0;
+    mem_track(-(int64_t)squirtd_filenameSize);
+    squirtd_filenameSize = 0;
+  }
+}
+
+
+static int
+session_allocate(void)
+{
+  if (!squirtd_rxBuffer) {
+    if (!(squirtd_rxBuffer = malloc(BLOCK_SIZE))) {
+      return -1;
+    }
+    mem_track(BLOCK_SIZE);
+  }
+
+  return 0;
+}
+
+
+static char*
+session_filename(size_t length)
+{
+  if (length >= squirtd_filenameSize) {
+    if (squirtd_filename) {
+      free(squirtd_filename);
+      mem_track(-(int64_t)squirtd_filenameSize);
+    }
+    squirtd_filenameSize = length < 256 ? 256 : length+1;
+    if ((squirtd_filename = malloc(squirtd_filenameSize))) {
+      mem_track(squirtd_filenameSize);
+    } else {
+      squirtd_filenameSize = 0;
+    }
+  }
+
+  return squirtd_filename;
+}
+
+
+static void
+cleanupForNextRun(void)
+{
+  if (squirtd_fileFd >= 0) {
+    uint64_t start = stats_now();
+    close(squirtd_fileFd);
+    stats_dos(start);
+    squirtd_fileFd = -1;
+  }
+}
+
+
+_Noreturn static void
+fatalError(const char* msg)
+{
+  fprintf(stderr, "squirtd_posix: %s\n", msg);
+
+  cleanupForNextRun();
+  session_free();
+
+  if (squirtd_connectionFd >= 0) {
+    close(squirtd_connectionFd);
+  }
+
+  if (squirtd_listenFd >= 0) {
+    close(squirtd_listenFd);
+  }
+
+  exit(1);
+}
+
+
+static int
+sendRaw(int fd, const void* buffer, size_t length)
+{
+  const char* ptr = buffer;
+  while (length > 0) {
+    uint64_t start = stats_now();
+    ssize_t len = send(fd, ptr, length, 0);
+    squirtd_socketTime += stats_now() - start;
+    if (len <= 0) {
+      return -1;
+    }
+    squirtd_bytesOut += len;
+    ptr += len;
+    length -= len;
+  }
+  return 0;
+}
+
+
+static int
+sendFlush(int fd)
+{
+  size_t length = squirtd_txLength;
+  squirtd_txLength = 0;
+  return length ? sendRaw(fd, squirtd_txBuffer, length) : 0;
+}
+
+
+// replies are runs of small words, they're collected and sent before the next read
+static int
+sendAll(int fd, const void* buffer, size_t length)
+{
+  const char* ptr = buffer;
+
+  if (squirtd_txLength + length <= sizeof(squirtd_txBuffer)) {
+    memcpy(&squirtd_txBuffer[squirtd_txLength], ptr, length);
+    squirtd_txLength += length;
+    return 0;
+  }
+
+  size_t fill = sizeof(squirtd_txBuffer) - squirtd_txLength;
+  memcpy(&squirtd_txBuffer[squirtd_txLength], ptr, fill);
+  squirtd_txLength += fill;
+
+  if (sendFlush(fd) != 0) {
+    return -1;
+  }
+
+  return sendRaw(fd, ptr+fill, length-fill);
+}
+
+
+static void
+sendCork(int fd, int cork)
+{
+  if (cork == squirtd_corked) {
+    return;
+  }
+  squirtd_corked = cork;
+
+#if defined(TCP_CORK)
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, (void*)&cork, sizeof(cork));
+#elif defined(TCP_NOPUSH)
+  setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (void*)&cork, sizeof(cork));
+#else
+  (void)fd, (void)cork;
+#endif
+}
+
+
+static uint32_t
+sendU32(int fd, uint32_t value)
+{
+  value = htonl(value);
+  return sendAll(fd, &value, sizeof(value)) == 0 ? 0 : ERROR_FATAL_SEND_FAILED;
+}
+
+
+// every read from the client goes through here so it's counted
+static ssize_t
+recvRaw(int fd, void* buffer, size_t length)
+{
+  uint64_t start = stats_now();
+  ssize_t len = recv(fd, buffer, length, 0);
+  squirtd_socketTime += stats_now() - start;
+  if (len > 0) {
+    squirtd_bytesIn += len;
+  }
+  return len;
+}
+
+
+static int
+recvAll(int fd, void* buffer, size_t length)
+{
+  char* ptr = buffer;
+
+  if (sendFlush(fd) != 0) {
+    return -1;
+  }
+
+  while (length > 0) {
+    ssize_t len = recvRaw(fd, ptr, length);
+    if (len <= 0) {
+      return -1;
+    }
+    ptr += len;
+    length -= len;
+  }
+  return 0;
+}
+
+
+static int
+recvU32(int fd, uint32_t* value)
+{
+  if (recvAll(fd, value, sizeof(*value)) != 0) {
+    return -1;
+  }
+  *value = ntohl(*value);
+  return 0;
+}
+
+
+static char*
+recvString(int fd)
+{
+  uint32_t length;
+  if (recvU32(fd, &length) != 0) {
+    return 0;
+  }
+
+  char* str = malloc(length+1);
+  if (!str) {
+    return 0;
+  }
+
+  if (recvAll(fd, str, length) != 0) {
+    free(str);
+    return 0;
+  }
+
+  str[length] = 0;
+  return str;
+}
+
+
+static char*
+posix_currentVolume(void)
+{
+  char cwd[PATH_MAX];
+  size_t rootLength = strlen(squirtd_root);
+
+  if (!getcwd(cwd, sizeof(cwd)) || strncmp(cwd, squirtd_root, rootLength) != 0 || cwd[rootLength] != '/') {
+    return strdup("");
+  }
+
+  char* volume = strdup(&cwd[rootLength+1]);
+  char* slash = strchr(volume, '/');
+  if (slash) {
+    *slash = 0;
+  }
+  return volume;
+}
+
+
+static char*
+posix_mapPath(const char* amigaPath)
+{
+  char* path = malloc(PATH_MAX);
+  const char* colon = strchr(amigaPath, ':');
+  const char* rest = amigaPath;
+
+  if (!path) {
+    fatalError("out of memory");
+  }
+
+  path[0] = 0;
+
+  if (colon) {
+    if (colon == amigaPath) {
+      char* volume = posix_currentVolume();
+      snprintf(path, PATH_MAX, "%s/%s/", squirtd_root, volume);
+      free(volume);
+    } else {
+      snprintf(path, PATH_MAX, "%s/%.*s/", squirtd_root, (int)(colon-amigaPath), amigaPath);
+    }
+    rest = colon+1;
+  }
+
+  // each leading slash is a parent directory in AmigaDOS
+  while (*rest == '/') {
+    strncat(path, "../", PATH_MAX-strlen(path)-1);
+    rest++;
+  }
+
+  strncat(path, rest, PATH_MAX-strlen(path)-1);
+
+  if (path[0] == 0) {
+    strcpy(path, ".");
+  }
+
+  return path;
+}
+
+
+static uint32_t
+posix_protection(const char* path, struct stat* st)
+{
+#ifdef __linux__
+  uint32_t stored;
+  if (getxattr(path, SQUIRTD_PROTECTION_XATTR, &stored, sizeof(stored)) == sizeof(stored)) {
+    return ntohl(stored);
+  }
+#else
+  (void)path;
+#endif
+
+  // Amiga RWED bits are set when the operation is denied
+  uint32_t prot = 0;
+  if (!(st->st_mode & S_IRUSR)) {
+    prot |= 0x8;
+  }
+  if (!(st->st_mode & S_IWUSR)) {
+    prot |= 0x5;
+  }
+  if (!(st->st_mode & S_IXUSR) && !S_ISDIR(st->st_mode)) {
+    prot |= 0x2;
+  }
+  return prot;
+}
+
+
+static char*
+posix_comment(const char* path)
+{
+#ifdef __linux__
+  char buffer[80];
+  ssize_t length = getxattr(path, SQUIRTD_COMMENT_XATTR, buffer, sizeof(buffer)-1);
+  if (length > 0) {
+    buffer[length] = 0;
+    return strdup(buffer);
+  }
+#else
+  (void)path;
+#endif
+  return strdup("");
+}
+
+
+static void
+posix_dateStamp(struct stat* st, uint32_t* days, uint32_t* mins, uint32_t* ticks)
+{
+  time_t t = st->st_mtime > SQUIRTD_AMIGA_EPOCH ? st->st_mtime - SQUIRTD_AMIGA_EPOCH : 0;
+#ifdef __APPLE__
+  long nsec = st->st_mtimespec.tv_nsec;
+#else
+  long nsec = st->st_mtim.tv_nsec;
+#endif
+  *days = t / 86400;
+  *mins = (t % 86400) / 60;
+  *ticks = (t % 60) * 50 + nsec / 20000000;
+}
+
+
+// framed output is sent as length prefixed chunks, otherwise it's streamed raw and ended by 4 null bytes
+static uint32_t
+exec_run(int fd, const char* command, int framed)
+{
+  uint32_t error = 0;
+  int32_t returnCode = EXEC_JOB_NOT_STARTED;
+  size_t length = strlen(command) + 8;
+  char* shellCommand = malloc(length);
+
+  snprintf(shellCommand, length, "%s 2>&1", command);
+  FILE* fp = popen(shellCommand, "r");
+  free(shellCommand);
+
+  if (!fp) {
+    error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+    goto cleanup;
+  }
+
+  char buffer[256];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    // output is streamed to the terminal as it's produced
+    if ((framed && sendU32(fd, len) != 0) || sendAll(fd, buffer, len) != 0 || sendFlush(fd) != 0) {
+      error = ERROR_FATAL_SEND_FAILED;
+      goto cleanup;
+    }
+  }
+
+ cleanup:
+
+  if (fp) {
+    int status = pclose(fp);
+    returnCode = WIFEXITED(status) ? WEXITSTATUS(status) : EXEC_JOB_NOT_STARTED;
+    if (!error && status != 0) {
+      error = ERROR_EXEC_FAILED;
+    }
+  }
+
+  if (framed) {
+    if (sendU32(fd, EXEC_FRAME_END) != 0 || sendU32(fd, returnCode) != 0) {
+      error = ERROR_FATAL_SEND_FAILED;
+    }
+  } else if (sendU32(fd, 0) != 0) {
+    // sending 4 null bytes breaks out of the terminal read loop in squirt_execCmd
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+  return error;
+}
+
+
+typedef struct {
+  pid_t pid;
+  int outputFd; // the read end of the job's stdout and stderr, -1 when the job isn't running
+  uint32_t id;
+} exec_job_t;
+
+
+static int
+exec_jobStart(exec_job_t* job, uint32_t id, const char* command)
+{
+  int fds[2];
+
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], 1);
+    dup2(fds[1], 2);
+    close(fds[0]);
+    close(fds[1]);
+    close(squirtd_connectionFd);
+    execl("/bin/sh", "sh", "-c", command, (char*)0);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    return -1;
+  }
+
+  job->pid = pid;
+  job->outputFd = fds[0];
+  job->id = id;
+  return 0;
+}
+
+
+static int32_t
+exec_jobWait(exec_job_t* job)
+{
+  int status;
+
+  close(job->outputFd);
+  job->outputFd = -1;
+
+  if (waitpid(job->pid, &status, 0) != job->pid || !WIFEXITED(status)) {
+    return EXEC_JOB_NOT_STARTED;
+  }
+
+  return WEXITSTATUS(status);
+}
+
+
+static uint32_t
+exec_jobs(int fd)
+{
+  uint32_t error = 0, concurrency, count, next = 0, running = 0;
+  char** commands = 0;
+  exec_job_t jobs[EXEC_MAX_JOBS];
+
+  if (recvU32(fd, &concurrency) != 0 || recvU32(fd, &count) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  if (concurrency == 0 || concurrency > EXEC_MAX_JOBS) {
+    concurrency = EXEC_MAX_JOBS;
+  }
+
+  for (uint32_t i = 0; i < concurrency; i++) {
+    jobs[i].outputFd = -1;
+  }
+
+  if (!(commands = calloc(count ? count : 1, sizeof(char*)))) {
+    return ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (!(commands[i] = recvString(fd))) {
+      error = ERROR_FATAL_RECV_FAILED;
+      goto cleanup;
+    }
+  }
+
+  while (next < count || running) {
+    // after a failed send no more jobs are started, the running ones are still drained
+    for (uint32_t i = 0; i < concurrency && next < count && !error; i++) {
+      if (jobs[i].outputFd == -1) {
+	if (exec_jobStart(&jobs[i], next, commands[next]) == 0) {
+	  running++;
+	} else if (sendU32(fd, next) != 0 || sendU32(fd, EXEC_JOB_EXITED) != 0 || sendU32(fd, EXEC_JOB_NOT_STARTED) != 0) {
+	  error = ERROR_FATAL_SEND_FAILED;
+	}
+	next++;
+      }
+    }
+
+    if (error) {
+      next = count;
+    }
+
+    if (!running) {
+      continue;
+    }
+
+    struct pollfd pfds[EXEC_MAX_JOBS];
+    exec_job_t* polled[EXEC_MAX_JOBS];
+    int npfds = 0;
+
+    for (uint32_t i = 0; i < concurrency; i++) {
+      if (jobs[i].outputFd != -1) {
+	pfds[npfds].fd = jobs[i].outputFd;
+	pfds[npfds].events = POLLIN;
+	polled[npfds++] = &jobs[i];
+      }
+    }
+
+    if (poll(pfds, npfds, -1) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      error = ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+      break;
+    }
+
+    for (int i = 0; i < npfds; i++) {
+      if (!pfds[i].revents) {
+	continue;
+      }
+
+      exec_job_t* job = polled[i];
+      char buffer[256];
+      ssize_t len = read(job->outputFd, buffer, sizeof(buffer));
+
+      if (len > 0) {
+	if (!error &&
+	    (sendU32(fd, job->id) != 0 || sendU32(fd, len) != 0 ||
+	     sendAll(fd, buffer, len) != 0 || sendFlush(fd) != 0)) {
+	  error = ERROR_FATAL_SEND_FAILED;
+	}
+      } else if (len == 0 || errno != EINTR) {
+	int32_t returnCode = exec_jobWait(job);
+	running--;
+	if (!error &&
+	    (sendU32(fd, job->id) != 0 || sendU32(fd, EXEC_JOB_EXITED) != 0 || sendU32(fd, returnCode) != 0)) {
+	  error = ERROR_FATAL_SEND_FAILED;
+	}
+      }
+    }
+  }
+
+  if (error != ERROR_FATAL_SEND_FAILED && sendU32(fd, EXEC_JOBS_DONE) != 0) {
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+ cleanup:
+
+  for (uint32_t i = 0; running && i < concurrency; i++) {
+    if (jobs[i].outputFd != -1) {
+      kill(jobs[i].pid, SIGTERM);
+      exec_jobWait(&jobs[i]);
+    }
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    free(commands[i]);
+  }
+  free(commands);
+
+  return error;
+}
+
+
+static uint32_t
+exec_dir(int fd, const char* dir)
+{
+  uint32_t error = 0;
+  char* path = posix_mapPath(dir);
+  DIR* dp = opendir(path);
+
+  if (!dp) {
+    error = ERROR_FILE_READ_FAILED;
+    goto cleanup;
+  }
+
+  for (;;) {
+    uint64_t start = stats_now();
+    struct dirent* de = readdir(dp);
+    stats_dos(start);
+
+    if (!de) {
+      break;
+    }
+
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+
+    char entryPath[PATH_MAX];
+    struct stat st;
+    snprintf(entryPath, sizeof(entryPath), "%s/%s", path, de->d_name);
+    start = stats_now();
+    int statError = stat(entryPath, &st);
+    stats_dos(start);
+    if (statError != 0) {
+      continue;
+    }
+
+    uint32_t days, mins, ticks;
+    posix_dateStamp(&st, &days, &mins, &ticks);
+    char* comment = posix_comment(entryPath);
+    uint32_t nameLength = strlen(de->d_name);
+    uint32_t commentLength = strlen(comment);
+
+    int failed = sendU32(fd, nameLength) ||
+      sendAll(fd, de->d_name, nameLength) ||
+      sendU32(fd, S_ISDIR(st.st_mode) ? 2 : (uint32_t)-3) ||
+      sendU32(fd, S_ISDIR(st.st_mode) ? 0 : (uint32_t)st.st_size) ||
+      sendU32(fd, posix_protection(entryPath, &st)) ||
+      sendU32(fd, days) ||
+      sendU32(fd, mins) ||
+      sendU32(fd, ticks) ||
+      sendU32(fd, commentLength) ||
+      sendAll(fd, comment, commentLength);
+
+    free(comment);
+
+    if (failed) {
+      error = ERROR_FATAL_SEND_FAILED;
+      goto cleanup;
+    }
+  }
+
+ cleanup:
+
+  if (sendU32(fd, 0xFFFFFFFF) != 0) { // not status, terminating word
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+  if (dp) {
+    closedir(dp);
+  }
+
+  free(path);
+
+  return error;
+}
+
+
+static uint32_t
+exec_cwd(int fd)
+{
+  char cwd[PATH_MAX], name[PATH_MAX];
+  size_t rootLength = strlen(squirtd_root);
+
+  if (!getcwd(cwd, sizeof(cwd))) {
+    strcpy(cwd, squirtd_root);
+  }
+
+  if (strncmp(cwd, squirtd_root, rootLength) == 0 && cwd[rootLength] == '/') {
+    char* volume = &cwd[rootLength+1];
+    char* slash = strchr(volume, '/');
+    if (slash) {
+      *slash = 0;
+      snprintf(name, sizeof(name), "%s:%s", volume, slash+1);
+    } else {
+      snprintf(name, sizeof(name), "%s:", volume);
+    }
+  } else {
+    snprintf(name, sizeof(name), "%s", cwd);
+  }
+
+  uint32_t length = strlen(name);
+  if (sendU32(fd, length) != 0 || sendAll(fd, name, length) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+exec_volumes(int fd)
+{
+  uint32_t error = 0;
+  DIR* dp = opendir(squirtd_root);
+
+  if (!dp) {
+    error = ERROR_FILE_READ_FAILED;
+    goto cleanup;
+  }
+
+  // every directory under the root is served as a volume
+  struct dirent* de;
+  while ((de = readdir(dp)) != NULL) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", squirtd_root, de->d_name);
+    if (de->d_name[0] == '.' || stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      continue;
+    }
+
+    uint32_t nameLength = strlen(de->d_name);
+    if (sendU32(fd, nameLength) || sendAll(fd, de->d_name, nameLength) || sendU32(fd, SQUIRT_VOLUME_VOLUME)) {
+      error = ERROR_FATAL_SEND_FAILED;
+      goto cleanup;
+    }
+  }
+
+ cleanup:
+
+  if (sendU32(fd, 0xFFFFFFFF) != 0) { // not status, terminating word
+    error = ERROR_FATAL_SEND_FAILED;
+  }
+
+  if (dp) {
+    closedir(dp);
+  }
+
+  return error;
+}
+
+
+static uint32_t
+exec_cd(const char* dir)
+{
+  char* path = posix_mapPath(dir);
+  struct stat st;
+  uint32_t error = 0;
+
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode) || chdir(path) != 0) {
+    error = ERROR_CD_FAILED;
+  }
+
+  free(path);
+  return error;
+}
+
+
+static uint32_t
+posix_applyInfo(const char* filename, uint32_t protection, uint32_t days, uint32_t mins, uint32_t ticks)
+{
+  char* path = posix_mapPath(filename);
+  uint32_t error = 0;
+  struct stat st;
+
+  if (stat(path, &st) != 0) {
+    error = ERROR_SET_PROTECTION_FAILED;
+    goto cleanup;
+  }
+
+  mode_t mode = st.st_mode & ~0777;
+  mode |= (protection & 0x8) ? 0 : 0444;
+  mode |= (protection & 0x4) ? 0 : 0200;
+  mode |= ((protection & 0x2) && !S_ISDIR(st.st_mode)) ? 0 : 0111;
+  if (chmod(path, mode) != 0) {
+    error = ERROR_SET_PROTECTION_FAILED;
+    goto cleanup;
+  }
+
+#ifdef __linux__
+  uint32_t stored = htonl(protection);
+  setxattr(path, SQUIRTD_PROTECTION_XATTR, &stored, sizeof(stored), 0);
+#endif
+
+  if (days != 0xFFFFFFFF) {
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = SQUIRTD_AMIGA_EPOCH + (time_t)days*86400 + mins*60 + ticks/50;
+    tv[0].tv_usec = tv[1].tv_usec = (ticks % 50) * 20000;
+    if (utimes(path, tv) != 0) {
+      error = ERROR_SET_DATESTAMP_FAILED;
+    }
+  }
+
+ cleanup:
+  free(path);
+  return error;
+}
+
+
+static uint32_t
+file_setInfo(int fd, const char* filename)
+{
+  uint32_t protection, days, mins, ticks;
+
+  if (recvU32(fd, &protection) != 0 || recvU32(fd, &days) != 0 ||
+      recvU32(fd, &mins) != 0 || recvU32(fd, &ticks) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  return posix_applyInfo(filename, protection, days, mins, ticks);
+}
+
+
+static uint32_t
+file_makeDir(const char* dir)
+{
+  char* path = posix_mapPath(dir);
+  uint32_t error = mkdir(path, 0777) == 0 ? 0 : ERROR_MKDIR_FAILED;
+  free(path);
+  return error;
+}
+
+
+static uint32_t
+file_delete(const char* filename)
+{
+  char* path = posix_mapPath(filename);
+  struct stat st;
+  uint32_t error = 0;
+
+  // AmigaDOS DeleteFile removes empty directories too
+  if (stat(path, &st) != 0 ||
+      (S_ISDIR(st.st_mode) ? rmdir(path) : unlink(path)) != 0) {
+    error = ERROR_DELETE_FAILED;
+  }
+
+  free(path);
+  return error;
+}
+
+
+static uint32_t
+file_rename(int fd, const char* filename)
+{
+  char* newName = recvString(fd);
+
+  if (!newName) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  char* from = posix_mapPath(filename);
+  char* to = posix_mapPath(newName);
+  struct stat st;
+  uint32_t error = 0;
+
+  // Rename() never replaces an existing object
+  if (lstat(to, &st) == 0 || rename(from, to) != 0) {
+    error = ERROR_RENAME_FAILED;
+  }
+
+  free(from);
+  free(to);
+  free(newName);
+  return error;
+}
+
+
+static uint32_t
+file_batch(int fd)
+{
+  uint32_t count, error = 0;
+
+  if (recvU32(fd, &count) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t command, status;
+    if (recvU32(fd, &command) != 0) {
+      return ERROR_FATAL_RECV_FAILED;
+    }
+
+    char* filename = recvString(fd);
+    if (!filename) {
+      return ERROR_FATAL_RECV_FAILED;
+    }
+
+    if (command == SQUIRT_COMMAND_MKDIR) {
+      status = file_makeDir(filename);
+    } else if (command == SQUIRT_COMMAND_DELETE) {
+      status = file_delete(filename);
+    } else if (command == SQUIRT_COMMAND_RENAME) {
+      status = file_rename(fd, filename);
+    } else {
+      status = ERROR_FATAL_RECV_FAILED; // can't skip a payload we don't understand
+    }
+
+    free(filename);
+
+    if (sendU32(fd, status) != 0) {
+      return ERROR_FATAL_SEND_FAILED;
+    }
+
+    if (ERROR_IS_FATAL(status)) {
+      return status;
+    }
+
+    if (!error) {
+      error = status;
+    }
+  }
+
+  return error;
+}
+
+
+static uint32_t
+file_get(int fd)
+{
+  uint32_t fileLength;
+  if (recvU32(fd, &fileLength) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  char* path = posix_mapPath(squirtd_filename);
+  uint64_t start = stats_now();
+  unlink(path);
+  squirtd_fileFd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  stats_dos(start);
+  free(path);
+
+  if (squirtd_fileFd < 0) {
+    return ERROR_FATAL_CREATE_FILE_FAILED;
+  }
+
+  uint32_t total = 0;
+  while (total < fileLength) {
+    int blockSize = fileLength-total < (uint32_t)BLOCK_SIZE ? (int)(fileLength-total) : BLOCK_SIZE;
+    ssize_t length = recvRaw(fd, squirtd_rxBuffer, blockSize);
+    if (length <= 0) {
+      return ERROR_FATAL_RECV_FAILED;
+    }
+    start = stats_now();
+    ssize_t written = write(squirtd_fileFd, squirtd_rxBuffer, length);
+    stats_dos(start);
+    if (written != length) {
+      return ERROR_FATAL_FILE_WRITE_FAILED;
+    }
+    total += length;
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+file_getWithInfo(int fd)
+{
+  uint32_t protection, days, mins, ticks;
+
+  if (recvU32(fd, &protection) != 0 || recvU32(fd, &days) != 0 ||
+      recvU32(fd, &mins) != 0 || recvU32(fd, &ticks) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  char* comment = recvString(fd);
+  if (!comment) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  uint32_t error = file_get(fd);
+
+  if (!error) {
+    close(squirtd_fileFd);
+    squirtd_fileFd = -1;
+    error = posix_applyInfo(squirtd_filename, protection, days, mins, ticks);
+#ifdef __linux__
+    if (!error) {
+      char* path = posix_mapPath(squirtd_filename);
+      if (*comment) {
+	setxattr(path, SQUIRTD_COMMENT_XATTR, comment, strlen(comment), 0);
+      } else {
+	removexattr(path, SQUIRTD_COMMENT_XATTR);
+      }
+      free(path);
+    }
+#endif
+  }
+
+  free(comment);
+  return error;
+}
+
+
+// a tree record's path is below the folder the tree is written to, and like a squirted file a
+// path without a volume is in the destination folder
+static uint32_t
+tree_recvPath(int fd, const char* root, char** path)
+{
+  uint32_t length;
+  size_t rootLength = strlen(root), destFolderLength = strlen(squirtd_destFolder);
+
+  if (recvU32(fd, &length) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  if (!(*path = malloc(destFolderLength+rootLength+length+2))) {
+    return ERROR_FATAL_FAILED_TO_CREATE_OS_RESOURCE;
+  }
+
+  char* name = *path+destFolderLength;
+  strcpy(name, root);
+  if (rootLength && root[rootLength-1] != ':' && root[rootLength-1] != '/') {
+    name[rootLength++] = '/';
+  }
+
+  if (recvAll(fd, name+rootLength, length) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  name[rootLength+length] = 0;
+
+  if (strchr(name, ':')) {
+    memmove(*path, name, rootLength+length+1);
+  } else {
+    memcpy(*path, squirtd_destFolder, destFolderLength);
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+tree_makeDir(const char* dir)
+{
+  char* path = posix_mapPath(dir);
+  struct stat st;
+
+  // a folder that's already there is fine
+  uint32_t error = mkdir(path, 0777) == 0 || (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) ? 0 : ERROR_MKDIR_FAILED;
+
+  free(path);
+  return error;
+}
+
+
+static uint32_t
+tree_setInfo(const char* filename, uint32_t info[4], const char* comment)
+{
+  uint32_t error = posix_applyInfo(filename, info[0], info[1], info[2], info[3]);
+
+#ifdef __linux__
+  if (!error) {
+    char* path = posix_mapPath(filename);
+    if (*comment) {
+      setxattr(path, SQUIRTD_COMMENT_XATTR, comment, strlen(comment), 0);
+    } else {
+      removexattr(path, SQUIRTD_COMMENT_XATTR);
+    }
+    free(path);
+  }
+#else
+  (void)comment;
+#endif
+
+  return error;
+}
+
+
+static uint32_t
+tree_recvInfo(int fd, uint32_t info[4], char** comment)
+{
+  for (int i = 0; i < 4; i++) {
+    if (recvU32(fd, &info[i]) != 0) {
+      return ERROR_FATAL_RECV_FAILED;
+    }
+  }
+
+  return (*comment = recvString(fd)) ? 0 : ERROR_FATAL_RECV_FAILED;
+}
+
+
+static uint32_t
+tree_info(int fd, const char* path, uint32_t* recordError)
+{
+  uint32_t info[4];
+  char* comment;
+
+  if (tree_recvInfo(fd, info, &comment) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  *recordError = tree_setInfo(path, info, comment);
+  free(comment);
+  return 0;
+}
+
+
+// a file that can't be written still has its data read, so the records after it stay in step
+static uint32_t
+tree_file(int fd, const char* filename, uint32_t* recordError)
+{
+  uint32_t info[4], fileLength, total = 0, error = 0;
+  char* comment;
+
+  if (tree_recvInfo(fd, info, &comment) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  if (recvU32(fd, &fileLength) != 0) {
+    free(comment);
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  char* path = posix_mapPath(filename);
+  uint64_t start = stats_now();
+  unlink(path);
+  squirtd_fileFd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  stats_dos(start);
+  free(path);
+
+  if (squirtd_fileFd < 0) {
+    *recordError = ERROR_CREATE_FILE_FAILED;
+  }
+
+  while (total < fileLength) {
+    size_t blockSize = fileLength-total < (uint32_t)BLOCK_SIZE ? fileLength-total : (uint32_t)BLOCK_SIZE;
+    if (recvAll(fd, squirtd_rxBuffer, blockSize) != 0) {
+      error = ERROR_FATAL_RECV_FAILED;
+      break;
+    }
+    if (!*recordError) {
+      start = stats_now();
+      ssize_t written = write(squirtd_fileFd, squirtd_rxBuffer, blockSize);
+      stats_dos(start);
+      if (written != (ssize_t)blockSize) {
+	*recordError = ERROR_FILE_WRITE_FAILED;
+      }
+    }
+    total += blockSize;
+  }
+
+  cleanupForNextRun();
+
+  if (!error && !*recordError) {
+    *recordError = tree_setInfo(filename, info, comment);
+  }
+
+  free(comment);
+  return error;
+}
+
+
+// the records are streamed without waiting for replies, so a failed record is noted and the rest carry on
+static uint32_t
+file_tree(int fd, const char* root)
+{
+  uint32_t type, record = 0, failed = 0, error = 0;
+  uint32_t failures[TREE_MAX_FAILURES*2];
+
+  for (;; record++) {
+    uint32_t recordError = 0;
+    char* path = 0;
+
+    if (recvU32(fd, &type) != 0) {
+      error = ERROR_FATAL_RECV_FAILED;
+      break;
+    }
+
+    if (type == TREE_RECORD_END) {
+      break;
+    }
+
+    if ((error = tree_recvPath(fd, root, &path)) == 0) {
+      if (type == TREE_RECORD_DIR) {
+	recordError = tree_makeDir(path);
+      } else if (type == TREE_RECORD_FILE) {
+	error = tree_file(fd, path, &recordError);
+      } else if (type == TREE_RECORD_INFO) {
+	error = tree_info(fd, path, &recordError);
+      } else {
+	error = ERROR_FATAL_RECV_FAILED; // can't skip a record we don't understand
+      }
+    }
+
+    free(path);
+
+    if (error) {
+      return error;
+    }
+
+    if (recordError) {
+      if (failed < TREE_MAX_FAILURES) {
+	failures[failed*2] = record;
+	failures[failed*2+1] = recordError;
+      }
+      failed++;
+    }
+  }
+
+  if (error || sendU32(fd, failed) != 0) {
+    return error ? error : ERROR_FATAL_SEND_FAILED;
+  }
+
+  for (uint32_t i = 0; i < failed && i < TREE_MAX_FAILURES; i++) {
+    if (sendU32(fd, failures[i*2]) != 0 || sendU32(fd, failures[i*2+1]) != 0) {
+      return ERROR_FATAL_SEND_FAILED;
+    }
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+file_stat(int fd, const char* filename)
+{
+  char* path = posix_mapPath(filename);
+  uint32_t error = 0, type = 0, size = 0, protection = 0, days = 0, mins = 0, ticks = 0;
+  struct stat st;
+
+  if (stat(path, &st) == 0) {
+    type = S_ISDIR(st.st_mode) ? 2 : (uint32_t)-3;
+    size = S_ISDIR(st.st_mode) ? 0 : (uint32_t)st.st_size;
+    protection = posix_protection(path, &st);
+    posix_dateStamp(&st, &days, &mins, &ticks);
+  } else {
+    error = ERROR_FILE_READ_FAILED;
+  }
+
+  free(path);
+
+  if (sendU32(fd, STAT_LENGTH) || sendU32(fd, type) || sendU32(fd, size) ||
+      sendU32(fd, protection) || sendU32(fd, days) || sendU32(fd, mins) || sendU32(fd, ticks)) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  return error;
+}
+
+
+static uint32_t
+file_send(int fd, const char* filename)
+{
+  char* path = posix_mapPath(filename);
+  struct stat st;
+
+  if (stat(path, &st) != 0) {
+    free(path);
+    return sendU32(fd, 0xFFFFFFFF);
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    free(path);
+    return sendU32(fd, 0xFFFFFFFF) ? ERROR_FATAL_SEND_FAILED : ERROR_SUCK_ON_DIR;
+  }
+
+  uint64_t start = stats_now();
+  squirtd_fileFd = open(path, O_RDONLY);
+  stats_dos(start);
+  uint32_t protection = posix_protection(path, &st);
+  free(path);
+
+  if (squirtd_fileFd < 0) {
+    return sendU32(fd, 0xFFFFFFFF) ? ERROR_FATAL_SEND_FAILED : ERROR_FILE_READ_FAILED;
+  }
+
+  uint32_t size = st.st_size;
+  if (sendU32(fd, size) != 0 || sendU32(fd, protection) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  sendCork(fd, 1);
+
+  uint32_t total = 0;
+  while (total < size) {
+    start = stats_now();
+    ssize_t len = read(squirtd_fileFd, squirtd_rxBuffer, BLOCK_SIZE);
+    stats_dos(start);
+    if (len <= 0) {
+      // the client is waiting for size bytes, so this connection can't recover
+      return ERROR_FATAL_SEND_FAILED;
+    }
+    if ((uint32_t)len > size-total) {
+      len = size-total;
+    }
+    if (sendAll(fd, squirtd_rxBuffer, len) != 0) {
+      return ERROR_FATAL_SEND_FAILED;
+    }
+    total += len;
+  }
+
+  // left corked so the status goes out with the tail of the file
+  return 0;
+}
+
+
+static uint32_t
+exec_memory(int fd)
+{
+  // the length goes first, an older squirtd answers with a bare zero status
+  if (sendU32(fd, MEMORY_LENGTH) != 0 ||
+      sendU32(fd, squirtd_memCurrent) != 0 ||
+      sendU32(fd, squirtd_memPeak) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+exec_hello(int fd)
+{
+  // the length goes first, an older squirtd answers with a bare zero status
+  if (sendU32(fd, HELLO_LENGTH) != 0 ||
+      sendU32(fd, SQUIRT_PROTOCOL_VERSION) != 0 ||
+      sendU32(fd, SQUIRTD_CAPABILITIES) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+sendU64(int fd, uint64_t value)
+{
+  return sendU32(fd, value >> 32) || sendU32(fd, value);
+}
+
+
+// there's no chip ram here, fast ram is whatever physical memory is free
+static uint32_t
+posix_availMem(void)
+{
+#ifdef _SC_AVPHYS_PAGES
+  uint64_t avail = (uint64_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  return avail > 0xFFFFFFFF ? 0xFFFFFFFF : avail;
+#else
+  return 0;
+#endif
+}
+
+
+static uint32_t
+exec_stats(int fd)
+{
+  // the length goes first, an older squirtd answers with a bare zero status
+  if (sendU32(fd, (SQUIRT_STATS_COMMANDS + SQUIRT_COMMAND_COUNT) * 4) != 0 ||
+      sendU32(fd, time(0) - squirtd_started) != 0 ||
+      sendU64(fd, squirtd_bytesIn) != 0 ||
+      sendU64(fd, squirtd_bytesOut) != 0 ||
+      sendU32(fd, squirtd_memCurrent) != 0 ||
+      sendU32(fd, squirtd_memPeak) != 0 ||
+      sendU32(fd, 0) != 0 ||
+      sendU32(fd, posix_availMem()) != 0 ||
+      sendU64(fd, squirtd_dosTime / 1000) != 0 ||
+      sendU64(fd, squirtd_socketTime / 1000) != 0 ||
+      sendU32(fd, SQUIRT_COMMAND_COUNT) != 0) {
+    return ERROR_FATAL_SEND_FAILED;
+  }
+
+  for (int i = 0; i < SQUIRT_COMMAND_COUNT; i++) {
+    if (sendU32(fd, squirtd_commands[i]) != 0) {
+      return ERROR_FATAL_SEND_FAILED;
+    }
+  }
+
+  return 0;
+}
+
+
+static uint32_t
+squirtd_command(int fd)
+{
+  uint32_t command, nameLength;
+
+  // waiting for the client isn't socket I/O
+  uint64_t socketTime = squirtd_socketTime;
+  if (recvU32(fd, &command) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+  squirtd_socketTime = socketTime;
+
+  if (recvU32(fd, &nameLength) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  if (command < SQUIRT_COMMAND_COUNT) {
+    squirtd_commands[command]++;
+  }
+
+  const char* destFolder = command == SQUIRT_COMMAND_SQUIRT ? squirtd_destFolder : "";
+  size_t destFolderLength = strlen(destFolder);
+
+  if (session_allocate() != 0 || !session_filename(destFolderLength+nameLength)) {
+    return ERROR_FATAL_ERROR;
+  }
+
+  strcpy(squirtd_filename, destFolder);
+
+  if (recvAll(fd, squirtd_filename+destFolderLength, nameLength) != 0) {
+    return ERROR_FATAL_RECV_FAILED;
+  }
+
+  squirtd_filename[destFolderLength+nameLength] = 0;
+
+  if (squirtd_legacy && command > SQUIRT_COMMAND_SET_INFO) {
+    // like the original squirtd: just a status, any payload is read as the next command
+    return 0;
+  }
+
+  switch (command) {
+  case SQUIRT_COMMAND_CLI:
+    return exec_run(fd, squirtd_filename, 0);
+  case SQUIRT_COMMAND_CLI_FRAMED:
+    return exec_run(fd, squirtd_filename, 1);
+  case SQUIRT_COMMAND_CD:
+    return exec_cd(squirtd_filename);
+  case SQUIRT_COMMAND_SUCK:
+    return file_send(fd, squirtd_filename);
+  case SQUIRT_COMMAND_DIR:
+    return exec_dir(fd, squirtd_filename);
+  case SQUIRT_COMMAND_CWD:
+    return exec_cwd(fd);
+  case SQUIRT_COMMAND_SET_INFO:
+    return file_setInfo(fd, squirtd_filename);
+  case SQUIRT_COMMAND_MKDIR:
+    return file_makeDir(squirtd_filename);
+  case SQUIRT_COMMAND_DELETE:
+    return file_delete(squirtd_filename);
+  case SQUIRT_COMMAND_RENAME:
+    return file_rename(fd, squirtd_filename);
+  case SQUIRT_COMMAND_BATCH:
+    return file_batch(fd);
+  case SQUIRT_COMMAND_SQUIRT:
+  case SQUIRT_COMMAND_SQUIRT_TO_CWD:
+    return file_get(fd);
+  case SQUIRT_COMMAND_SQUIRT_WITH_INFO:
+    return file_getWithInfo(fd);
+  case SQUIRT_COMMAND_STAT:
+    return file_stat(fd, squirtd_filename);
+  case SQUIRT_COMMAND_TREE:
+    return file_tree(fd, squirtd_filename);
+  case SQUIRT_COMMAND_VOLUMES:
+    return exec_volumes(fd);
+  case SQUIRT_COMMAND_MEMORY:
+    return exec_memory(fd);
+  case SQUIRT_COMMAND_HELLO:
+    return exec_hello(fd);
+  case SQUIRT_COMMAND_STATS:
+    return exec_stats(fd);
+  case SQUIRT_COMMAND_EXEC_JOBS:
+    return exec_jobs(fd);
+  default:
+    // like the Amiga daemon, unknown commands are answered with a bare status
+    return 0;
+  }
+}
+
+
+static void
+squirtd_serve(void)
+{
+  uint32_t error;
+
+  do {
+    error = squirtd_command(squirtd_connectionFd);
+
+    if (error != ERROR_FATAL_RECV_FAILED &&
+	(sendU32(squirtd_connectionFd, error) != 0 || sendFlush(squirtd_connectionFd) != 0)) {
+      error = ERROR_FATAL_SEND_FAILED;
+    }
+    sendCork(squirtd_connectionFd, 0);
+
+    cleanupForNextRun();
+  } while (!ERROR_IS_FATAL(error));
+
+  close(squirtd_connectionFd);
+  squirtd_connectionFd = -1;
+  squirtd_txLength = 0;
+  squirtd_corked = 0;
+}
+
+
+_Noreturn static void
+squirtd_usage(void)
+{
+  fprintf(stderr, "usage: squirtd_posix [--port=port] [--multi] [--legacy] root_folder dest_folder\n");
+  exit(1);
+}
+
+
+int
+main(int argc, char** argv)
+{
+  int port = NETWORK_PORT, multiSession = 0;
+
+  static struct option long_options[] =
+    {
+     {"port", required_argument, 0, 'p'},
+     {"multi", no_argument, 0, 'm'},
+     {"legacy", no_argument, 0, 'l'},
+     {0, 0, 0, 0}
+    };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, 0)) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'm':
+      multiSession = 1;
+      break;
+    case 'l':
+      squirtd_legacy = 1;
+      break;
+    default:
+      squirtd_usage();
+    }
+  }
+
+  if (argc - optind != 2) {
+    squirtd_usage();
+  }
+
+  if (!realpath(argv[optind], squirtd_root)) {
+    fatalError("unable to resolve root folder");
+  }
+
+  squirtd_destFolder = argv[optind+1];
+  squirtd_started = time(0);
+
+  signal(SIGPIPE, SIG_IGN);
+  if (multiSession) {
+    signal(SIGCHLD, SIG_IGN);
+  }
+
+  // squirtd stays in the folder it was started in, only squirted files go to the destination folder
+  if (chdir(squirtd_root) != 0) {
+    fatalError("unable to chdir to root folder");
+  }
+
+  struct sockaddr_in sa = {0};
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_ANY);
+  sa.sin_port = htons(port);
+
+  if ((squirtd_listenFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    fatalError("socket() failed");
+  }
+
+  const int ONE = 1;
+  setsockopt(squirtd_listenFd, SOL_SOCKET, SO_REUSEADDR, (void*)&ONE, sizeof(ONE));
+
+  if (bind(squirtd_listenFd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+    fatalError("bind() failed");
+  }
+
+  if (listen(squirtd_listenFd, multiSession ? SQUIRTD_LISTEN_BACKLOG : 1)) {
+    fatalError("listen() failed");
+  }
+
+  for (;;) {
+    if ((squirtd_connectionFd = accept(squirtd_listenFd, 0, 0)) == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      fatalError("accept failed");
+    }
+
+    setsockopt(squirtd_connectionFd, IPPROTO_TCP, TCP_NODELAY, (void*)&ONE, sizeof(ONE));
+
+    if (!multiSession) {
+      squirtd_serve();
+      continue;
+    }
+
+    // like squirtd --multi, each session gets its own process and with it its own current dir
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(squirtd_listenFd);
+      squirtd_listenFd = -1;
+      signal(SIGCHLD, SIG_DFL); // exec_run's pclose() needs to reap the shell
+      squirtd_serve();
+      exit(0);
+    }
+
+    if (pid < 0) {
+      fprintf(stderr, "squirtd_posix: fork failed: %s\n", strerror(errno));
+    }
+
+    close(squirtd_connectionFd);
+    squirtd_connectionFd = -1;
+  }
+
+  return 0;
+}
@@ -37,9 +37,7 @@ static void srl_resetTabTracking(void);
 static void srl_enableRawMode(void);
 static void srl_disableRawMode(void);
 static void srl_refreshLine(void);
-static void srl_addToHistory(const char* line);
 static void srl_handleTabCompletion(void);
-static void srl_loadHistory(void);
 
 // Terminal control
 #ifdef _WIN32
@@ -62,10 +60,7 @@ static char srl_killBuffer[MAX_INPUT_LENGTH] = {0};
 static char srl_searchBuffer[MAX_INPUT_LENGTH] = {0};
 static char srl_searchPrompt[MAX_INPUT_LENGTH] = {0};
 
-// History management
-#define MAX_HISTORY_ENTRIES 100
-static char* srl_history[MAX_HISTORY_ENTRIES];
-static int srl_historyCount = 0;
+// History management, the entries live in history.c
 static int srl_historyIndex = -1;
 
 // Reset tab completion tracking
@@ -302,14 +297,13 @@ srl_historySelectNext(void)
 {
   srl_resetTabTracking();
   if (srl_historyIndex >= 0) {
-    srl_historyIndex++;
-    if (srl_historyIndex >= srl_historyCount) {
-      srl_historyIndex = -1;
+    srl_historyIndex = history_next(srl_historyIndex);
+    if (srl_historyIndex < 0) {
       srl_inputBuffer[0] = '\0';
       srl_bufferLength = 0;
       srl_cursorPos = 0;
     } else {
-      strcpy(srl_inputBuffer, srl_history[srl_historyIndex]);
+      strlcpy(srl_inputBuffer, history_get(srl_historyIndex), sizeof(srl_inputBuffer));
       srl_bufferLength = strlen(srl_inputBuffer);
       srl_cursorPos = srl_bufferLength;
     }
@@ -321,62 +315,21 @@ static void
 srl_historySelectPrev(void)
 {
   srl_resetTabTracking(); // Reset tab completion tracking
-  if (srl_historyCount > 0) {
-    if (srl_historyIndex == -1) srl_historyIndex = srl_historyCount - 1;
-    else if (srl_historyIndex > 0) srl_historyIndex--;
-    
-    if (srl_historyIndex >= 0) {
-      strcpy(srl_inputBuffer, srl_history[srl_historyIndex]);
-      srl_bufferLength = strlen(srl_inputBuffer);
-      srl_cursorPos = srl_bufferLength;
-      srl_refreshLine();
-    }
+  int index = history_previous(srl_historyIndex);
+
+  if (index >= 0) {
+    srl_historyIndex = index;
+    strlcpy(srl_inputBuffer, history_get(srl_historyIndex), sizeof(srl_inputBuffer));
+    srl_bufferLength = strlen(srl_inputBuffer);
+    srl_cursorPos = srl_bufferLength;
+    srl_refreshLine();
   }
 }
 
 static const char*
 srl_findHistoryMatch(const char* candidate, int n)
 {
-  if (!candidate || n < 0) return NULL;
-
-  int match_index = 0;
-  const char* last_content = NULL;
-
-  for (int i = MAX_HISTORY_ENTRIES - 1; i >= 0; i--) {
-    const char* entry = srl_history[i];
-    if (entry && strstr(entry, candidate)) {
-      if (!last_content || strcmp(entry, last_content) != 0) {
-        if (match_index == n) {
-          return entry;
-        }
-        last_content = entry;
-        match_index++;
-      }
-    }
-  }
-
-  return NULL;
-}
-
-static void
-srl_addToHistory(const char* line)
-{
-  if (!line || !*line) return;
-  
-  // Check if same as last entry
-  if (srl_historyCount > 0 && strcmp(srl_history[srl_historyCount-1], line) == 0) {
-    return;
-  }
-  
-  if (srl_historyCount >= MAX_HISTORY_ENTRIES) {
-    free(srl_history[0]);
-    for (int i = 0; i < MAX_HISTORY_ENTRIES-1; i++) {
-      srl_history[i] = srl_history[i+1];
-    }
-    srl_historyCount = MAX_HISTORY_ENTRIES - 1;
-  }
-  
-  srl_history[srl_historyCount++] = strdup(line);
+  return history_search(candidate, n);
 }
 
 // Tab completion handling
@@ -698,6 +651,9 @@ srl_gets(void)
   srl_bufferLength = 0;
   srl_historyIndex = -1;
   memset(srl_inputBuffer, 0, MAX_INPUT_LENGTH);
+
+  // pick up commands run in other sessions since the last prompt
+  history_sync();
   
   // Display prompt
   printf("%s",  srl_getPrompt());
@@ -970,7 +926,7 @@ srl_gets(void)
   
   // Add to history if non-empty
   if (srl_bufferLength > 0) {
-    srl_addToHistory(srl_lineRead);
+    history_add(srl_lineRead);
   }
   
   return srl_lineRead;
@@ -1002,20 +958,6 @@ srl_escapeSpaces(const char* str)
   return ptr;
 }
 
-void
-srl_writeHistory(void)
-{
-  // Custom history writing - save our internal history to file
-  FILE* file = fopen(util_getHistoryFile(), "w");
-  if (file) {
-    for (int i = 0; i < srl_historyCount; i++) {
-      fprintf(file, "%s\n", srl_history[i]);
-    }
-    fclose(file);
-  }
-}
-
-
 void
 srl_cleanup(void)
 {
@@ -1026,35 +968,6 @@ srl_cleanup(void)
   
   // Cleanup custom input wrapper
   srl_disableRawMode();
-  
-  // Free history
-  for (int i = 0; i < srl_historyCount; i++) {
-    free(srl_history[i]);
-  }
-  srl_historyCount = 0;
-}
-
-
-// Custom history loading
-static void srl_loadHistory(void)
-{
-  FILE* file = fopen(util_getHistoryFile(), "r");
-  if (!file) return;
-  
-  char line[MAX_INPUT_LENGTH];
-  while (fgets(line, sizeof(line), file) && srl_historyCount < MAX_HISTORY_ENTRIES) {
-    // Remove trailing newline
-    size_t len = strlen(line);
-    if (len > 0 && line[len-1] == '\n') {
-      line[len-1] = '\0';
-    }
-    
-    if (strlen(line) > 0) {
-      srl_history[srl_historyCount++] = strdup(line);
-    }
-  }
-  
-  fclose(file);
 }
 
 
@@ -1068,14 +981,10 @@ srl_init(const char*(*prompt)(void),void (*complete_hook)(const char* text, cons
   
   // Initialize state
   srl_terminalSetup = 0;
-  srl_historyCount = 0;
   srl_historyIndex = -1;
   srl_cursorPos = 0;
   srl_bufferLength = 0;
   
-  // Load history from file
-  srl_loadHistory();
-  
   // Custom input wrapper is ready!
   // No more readline dependencies or limitations!
 }
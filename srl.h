@@ -6,9 +6,6 @@ srl_init(const char*(*_srl_prompt)(void),void (*complete_hook)(const char* text,
 char*
 srl_escapeSpaces(const char* str);
 
-void
-srl_writeHistory(void);
-
 void
 srl_cleanup(void);
 
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "common.h"
+
+/*
+ * squirtd's counters: uptime, commands served, bytes, memory and where its time went. With
+ * --interval it polls, connecting for each poll so a single session squirtd isn't held, and
+ * prints a line of the changes since the last one.
+ */
+
+#define STATS_WORDS (SQUIRT_STATS_COMMANDS+SQUIRT_COMMAND_COUNT)
+
+typedef struct {
+  uint32_t words[STATS_WORDS];
+} stats_t;
+
+static const char* stats_commandNames[SQUIRT_COMMAND_COUNT] = {
+  [SQUIRT_COMMAND_SQUIRT] = "squirt",
+  [SQUIRT_COMMAND_SQUIRT_TO_CWD] = "squirt to cwd",
+  [SQUIRT_COMMAND_CLI] = "cli",
+  [SQUIRT_COMMAND_CD] = "cd",
+  [SQUIRT_COMMAND_SUCK] = "suck",
+  [SQUIRT_COMMAND_DIR] = "dir",
+  [SQUIRT_COMMAND_CWD] = "cwd",
+  [SQUIRT_COMMAND_SET_INFO] = "set info",
+  [SQUIRT_COMMAND_MKDIR] = "mkdir",
+  [SQUIRT_COMMAND_DELETE] = "delete",
+  [SQUIRT_COMMAND_RENAME] = "rename",
+  [SQUIRT_COMMAND_BATCH] = "batch",
+  [SQUIRT_COMMAND_SQUIRT_WITH_INFO] = "squirt with info",
+  [SQUIRT_COMMAND_STAT] = "stat",
+  [SQUIRT_COMMAND_VOLUMES] = "volumes",
+  [SQUIRT_COMMAND_MEMORY] = "memory",
+  [SQUIRT_COMMAND_HELLO] = "hello",
+  [SQUIRT_COMMAND_STATS] = "stats",
+  [SQUIRT_COMMAND_EXEC_JOBS] = "exec jobs",
+  [SQUIRT_COMMAND_CLI_FRAMED] = "cli framed",
+  [SQUIRT_COMMAND_TREE] = "tree",
+};
+
+
+static uint64_t
+stats_u64(stats_t* stats, int hi)
+{
+  return ((uint64_t)stats->words[hi] << 32) | stats->words[hi+1];
+}
+
+
+static uint32_t
+stats_commands(stats_t* stats)
+{
+  uint32_t total = 0;
+  for (int i = 0; i < SQUIRT_COMMAND_COUNT; i++) {
+    total += stats->words[SQUIRT_STATS_COMMANDS+i];
+  }
+  return total;
+}
+
+
+static void
+stats_read(stats_t* stats)
+{
+  uint32_t length, word, error;
+
+  if (!hello_supports(SQUIRT_CAP_STATS)) {
+    fatalError("this squirtd doesn't keep stats");
+  }
+
+  if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_STATS) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(main_socketFd, "stats") != 0 ||
+      util_recvU32(main_socketFd, &length) != 0) {
+    fatalError("failed to read squirtd stats");
+  }
+
+  if (length == 0) {
+    fatalError("this squirtd doesn't keep stats");
+  }
+
+  // a newer squirtd may know more commands, they're skipped
+  memset(stats, 0, sizeof(*stats));
+  for (uint32_t i = 0; i < length/4; i++) {
+    if (util_recvU32(main_socketFd, &word) != 0) {
+      fatalError("failed to read squirtd stats");
+    }
+    if (i < STATS_WORDS) {
+      stats->words[i] = word;
+    }
+  }
+
+  if (util_recvU32(main_socketFd, &error) != 0) {
+    fatalError("failed to read squirtd stats");
+  }
+}
+
+
+static const char*
+stats_formatBytes(uint64_t bytes)
+{
+  static char buffer[32];
+  static const char* units[] = {"bytes", "KB", "MB", "GB", "TB"};
+  double value = bytes;
+  int unit = 0;
+
+  while (value >= 1024 && unit < (int)(sizeof(units)/sizeof(units[0]))-1) {
+    value /= 1024;
+    unit++;
+  }
+
+  if (unit == 0) {
+    snprintf(buffer, sizeof(buffer), "%llu bytes", (unsigned long long)bytes);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%.1f %s", value, units[unit]);
+  }
+
+  return buffer;
+}
+
+
+static void
+stats_print(stats_t* stats)
+{
+  uint32_t uptime = stats->words[SQUIRT_STATS_UPTIME];
+
+  printf("uptime        %ud %02u:%02u:%02u\n", uptime/86400, uptime/3600%24, uptime/60%60, uptime%60);
+  printf("bytes in      %s\n", stats_formatBytes(stats_u64(stats, SQUIRT_STATS_BYTES_IN_HI)));
+  printf("bytes out     %s\n", stats_formatBytes(stats_u64(stats, SQUIRT_STATS_BYTES_OUT_HI)));
+  printf("dos i/o       %.3f seconds\n", stats_u64(stats, SQUIRT_STATS_DOS_USECS_HI) / 1000000.0);
+  printf("socket i/o    %.3f seconds\n", stats_u64(stats, SQUIRT_STATS_SOCKET_USECS_HI) / 1000000.0);
+  printf("allocated     %s", stats_formatBytes(stats->words[SQUIRT_STATS_MEMORY_CURRENT]));
+  printf(" (%s peak)\n", stats_formatBytes(stats->words[SQUIRT_STATS_MEMORY_PEAK]));
+  printf("chip free     %s\n", stats_formatBytes(stats->words[SQUIRT_STATS_CHIP_FREE]));
+  printf("fast free     %s\n", stats_formatBytes(stats->words[SQUIRT_STATS_FAST_FREE]));
+  printf("commands      %u\n", stats_commands(stats));
+
+  for (int i = 0; i < SQUIRT_COMMAND_COUNT; i++) {
+    if (stats->words[SQUIRT_STATS_COMMANDS+i]) {
+      printf("  %-16s %u\n", stats_commandNames[i], stats->words[SQUIRT_STATS_COMMANDS+i]);
+    }
+  }
+}
+
+
+static void
+stats_printChange(stats_t* stats, stats_t* last)
+{
+  // a restarted squirtd starts counting again
+  if (stats->words[SQUIRT_STATS_UPTIME] < last->words[SQUIRT_STATS_UPTIME]) {
+    memset(last, 0, sizeof(*last));
+  }
+
+  uint32_t seconds = stats->words[SQUIRT_STATS_UPTIME] - last->words[SQUIRT_STATS_UPTIME];
+  double elapsed = seconds ? seconds : 1;
+  time_t now = time(0);
+  char clock[16];
+
+  strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now));
+
+  printf("%-8s %9.1f %10.1f %10.1f %7.1f%% %7.1f%% %11u %11u %11u\n", clock,
+	 (stats_commands(stats) - stats_commands(last)) / elapsed,
+	 (stats_u64(stats, SQUIRT_STATS_BYTES_IN_HI) - stats_u64(last, SQUIRT_STATS_BYTES_IN_HI)) / elapsed / 1024,
+	 (stats_u64(stats, SQUIRT_STATS_BYTES_OUT_HI) - stats_u64(last, SQUIRT_STATS_BYTES_OUT_HI)) / elapsed / 1024,
+	 (stats_u64(stats, SQUIRT_STATS_DOS_USECS_HI) - stats_u64(last, SQUIRT_STATS_DOS_USECS_HI)) / elapsed / 10000,
+	 (stats_u64(stats, SQUIRT_STATS_SOCKET_USECS_HI) - stats_u64(last, SQUIRT_STATS_SOCKET_USECS_HI)) / elapsed / 10000,
+	 stats->words[SQUIRT_STATS_MEMORY_CURRENT], stats->words[SQUIRT_STATS_CHIP_FREE], stats->words[SQUIRT_STATS_FAST_FREE]);
+  fflush(stdout);
+
+  *last = *stats;
+}
+
+
+static void
+stats_usage(void)
+{
+  fatalError("usage: %s [--interval=seconds] [--count=N] hostname", main_argv0);
+}
+
+
+void
+stats_main(int argc, char* argv[])
+{
+  int argvIndex = 1, interval = 0, count = 0;
+  char* hostname = 0;
+
+  while (argvIndex < argc) {
+    static struct option long_options[] =
+      {
+       {"interval", required_argument, 0, 'i'},
+       {"count", required_argument, 0, 'c'},
+       {0, 0, 0, 0}
+      };
+    int option_index = 0;
+    int c = getopt_long (argc, argv, "", long_options, &option_index);
+    if (c != -1) {
+      argvIndex = optind;
+      switch (c) {
+      case 0:
+	break;
+      case 'i':
+	interval = atoi(optarg);
+	break;
+      case 'c':
+	count = atoi(optarg);
+	break;
+      case '?':
+      default:
+	stats_usage();
+	break;
+      }
+    } else {
+      if (hostname == 0) {
+	hostname = argv[argvIndex];
+      } else {
+	stats_usage();
+      }
+      optind++;
+      argvIndex++;
+    }
+  }
+
+  if (hostname == 0 || interval < 0 || count < 0) {
+    stats_usage();
+  }
+
+  stats_t stats, last;
+
+  if (interval == 0) {
+    util_connect(hostname);
+    stats_read(&stats);
+    stats_print(&stats);
+    return;
+  }
+
+  // the first line is the average since squirtd started
+  memset(&last, 0, sizeof(last));
+  printf("%-8s %9s %10s %10s %8s %8s %11s %11s %11s\n", "", "cmds/s", "in KB/s", "out KB/s", "dos", "socket", "allocated", "chip free", "fast free");
+
+  for (int i = 0; count == 0 || i < count; i++) {
+    // util_connect() takes the port off the hostname
+    char host[PATH_MAX];
+    snprintf(host, sizeof(host), "%s", hostname);
+
+    if (i) {
+      sleep(interval);
+    }
+    util_connect(host);
+    stats_read(&stats);
+    util_disconnect(1);
+    stats_printChange(&stats, &last);
+  }
+}
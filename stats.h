@@ -0,0 +1,4 @@
+#pragma once
+
+void
+stats_main(int argc, char* argv[]);
@@ -7,6 +7,7 @@
 
 #include "main.h"
 #include "common.h"
+#include "crc32.h"
 
 static int suck_fileFd = 0;
 static char* suck_readBuffer = 0;
@@ -28,24 +29,95 @@ suck_cleanup(void)
 }
 
 
-int32_t
-squirt_suckFile(const char* filename, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), const char* destFilename, uint32_t* protection)
+// writes filename's cached copy where suck_receive() would have written the download
+static int32_t
+suck_fromCache(int cacheFd, const char* filename, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), uint32_t fileLength, int fd, crc32_ctx_t* crc)
 {
   int32_t total = 0;
+  int len;
+
+  if (progress == util_printProgress) {
+    printf("sucking %s (%s bytes) from the cache\n", filename, util_formatNumber(fileLength));
+  }
+
+  suck_readBuffer = malloc(BLOCK_SIZE);
+  gettimeofday(&suck_start, NULL);
+
+  while ((len = read(cacheFd, suck_readBuffer, BLOCK_SIZE)) > 0) {
+    if (write(fd, suck_readBuffer, len) != len) {
+      fflush(stdout);
+      fatalError("\nfailed to write %s", filename);
+    }
+    if (crc) {
+      crc32_computeBlock(crc, (uint8_t*)suck_readBuffer, len);
+    }
+    total += len;
+  }
+
+  close(cacheFd);
+
+  if (len < 0 || (uint32_t)total != fileLength) {
+    fatalError("failed to read the cached copy of %s", filename);
+  }
+
+  if (progress) {
+    progress(progressHeader ? progressHeader : filename, &suck_start, total, fileLength);
+    fflush(stdout);
+  }
+
+  suck_cleanup();
+
+  return total;
+}
+
+
+// listing is the file's directory entry if the caller has one
+static int32_t
+suck_receive(const char* filename, dir_entry_t* listing, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), const char* destFilename, uint32_t* protection, int outputFd, crc32_ctx_t* crc)
+{
+  int32_t total = 0;
+  trace_span_t span;
+  dir_entry_t remote = {0};
+  int cacheFd = -1, statPending = 0;
 
   fflush(stdout);
 
-  if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_SUCK) !=  0) {
+  if (cache_enabled(filename)) {
+    if (listing) {
+      remote = *listing;
+      cacheFd = cache_open(filename, &remote);
+    } else if (hello_supports(SQUIRT_CAP_STAT)) {
+      if (cache_contains(filename)) {
+	// only worth a round trip if there's a copy that might still be good
+	if (dir_stat(filename, &remote) == 0) {
+	  cacheFd = cache_open(filename, &remote);
+	}
+      } else {
+	// the size and datestamp to cache the download under come back ahead of it
+	dir_sendStat(filename);
+	statPending = 1;
+      }
+    }
+  }
+
+  trace_begin(&span);
+
+  if (cacheFd < 0 && util_sendCommand(main_socketFd, SQUIRT_COMMAND_SUCK) !=  0) {
     fatalError("failed to connect to squirtd server");
   }
 
-  if (util_sendLengthAndUtf8StringAsLatin1(main_socketFd, filename) != 0) {
+  if (cacheFd < 0 && util_sendLengthAndUtf8StringAsLatin1(main_socketFd, filename) != 0) {
     fatalError("send() filename failed");
   }
 
+  if (statPending && dir_recvStat(&remote) != 0) {
+    // not found or unreadable, the suck reports that
+    remote.type = 0;
+  }
+
 
-  int32_t fileLength;
-  if (util_recv32(main_socketFd, &fileLength) != 0) {
+  int32_t fileLength = remote.size;
+  if (cacheFd < 0 && util_recv32(main_socketFd, &fileLength) != 0) {
     fatalError("util_recv() Filelength failed");
   }
 
@@ -55,10 +127,13 @@ squirt_suckFile(const char* filename, const char* progressHeader,  void (*progre
     util_recvU32(main_socketFd, &status);
     printf("Error: Remote file '%s' not found\n", filename);
     suck_cleanup();
+    trace_end(&span, "suck", filename);
     return -1;
   }
 
-  if (util_recvU32(main_socketFd, protection) != 0) {
+  if (cacheFd >= 0) {
+    *protection = remote.prot;
+  } else if (util_recvU32(main_socketFd, protection) != 0) {
     fatalError("util_recv() protection failed");
   }
 
@@ -70,19 +145,33 @@ squirt_suckFile(const char* filename, const char* progressHeader,  void (*progre
     baseName = destFilename;
   }
 
-  // Use util_safeName to handle Windows reserved filenames
-  char* safeBaseName = util_safeName(baseName);
-  if (!safeBaseName) {
-    fatalError("memory allocation failed for safe filename");
+  int fd = outputFd;
+
+  if (fd < 0) {
+    // Use util_safeName to handle Windows reserved filenames
+    char* safeBaseName = util_safeName(baseName);
+    if (!safeBaseName) {
+      fatalError("memory allocation failed for safe filename");
+    }
+
+    suck_fileFd = open(safeBaseName, O_WRONLY|O_CREAT|O_TRUNC|_O_BINARY, 0777);
+    free(safeBaseName); // Free the allocated safe name
+
+    if (suck_fileFd == -1) {
+      fatalError("failed to open %s", baseName);
+    }
+
+    fd = suck_fileFd;
   }
-  
-  suck_fileFd = open(safeBaseName, O_WRONLY|O_CREAT|O_TRUNC|_O_BINARY, 0777);
-  free(safeBaseName); // Free the allocated safe name
 
-  if (suck_fileFd == -1) {
-    fatalError("failed to open %s", baseName);
+  if (cacheFd >= 0) {
+    total = suck_fromCache(cacheFd, filename, progressHeader, progress, fileLength, fd, crc);
+    trace_end(&span, "suck (cached)", filename);
+    return total;
   }
 
+  int caching = cache_create(filename, &remote);
+
   suck_readBuffer = malloc(BLOCK_SIZE);
 
   if (fileLength > 0) {
@@ -109,10 +198,16 @@ squirt_suckFile(const char* filename, const char* progressHeader,  void (*progre
 	  progress(progressHeader ? progressHeader : filename, &suck_start, total, fileLength);
 	}
 	int readLen;
-	if ((readLen = write(suck_fileFd, suck_readBuffer, len)) != len) {
+	if ((readLen = write(fd, suck_readBuffer, len)) != len) {
 	  fflush(stdout);
 	  fatalError("\nfailed to write to %s %d",  baseName, readLen);
 	}
+	if (crc) {
+	  crc32_computeBlock(crc, (uint8_t*)suck_readBuffer, len);
+	}
+	if (caching) {
+	  cache_write(suck_readBuffer, len);
+	}
 	total += len;
       }
     } while (total < fileLength);
@@ -128,9 +223,20 @@ squirt_suckFile(const char* filename, const char* progressHeader,  void (*progre
 
   uint32_t error;
   if (util_recvU32(main_socketFd, &error) != 0) {
+    if (caching) {
+      cache_commit(0);
+    }
+    suck_cleanup();
+    trace_end(&span, "suck", filename);
     return -1;
   }
 
+  trace_end(&span, "suck", filename);
+
+  if (caching) {
+    cache_commit(error == 0 && (uint32_t)total == remote.size);
+  }
+
   if (error) {
     total = -error;
     if (progress == util_printProgress) {
@@ -144,6 +250,42 @@ squirt_suckFile(const char* filename, const char* progressHeader,  void (*progre
 }
 
 
+int32_t
+squirt_suckFile(const char* filename, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), const char* destFilename, uint32_t* protection)
+{
+  return suck_receive(filename, 0, progressHeader, progress, destFilename, protection, -1, 0);
+}
+
+
+int32_t
+squirt_suckFileCached(const char* filename, dir_entry_t* listing, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), const char* destFilename, uint32_t* protection)
+{
+  return suck_receive(filename, listing, progressHeader, progress, destFilename, protection, -1, 0);
+}
+
+
+int32_t
+squirt_suckFileWithCrc(const char* filename, const char* destFilename, uint32_t* protection, uint32_t* crc)
+{
+  crc32_ctx_t ctx;
+  crc32_init(&ctx);
+
+  int32_t total = suck_receive(filename, 0, 0, 0, destFilename, protection, -1, &ctx);
+
+  crc32_finilize(&ctx);
+  *crc = ctx.crc;
+
+  return total;
+}
+
+
+int32_t
+squirt_suckFileToFd(const char* filename, dir_entry_t* listing, int fd, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), uint32_t* protection)
+{
+  return suck_receive(filename, listing, progressHeader, progress, 0, protection, fd, 0);
+}
+
+
 void
 suck_main(int argc, char* argv[])
 {
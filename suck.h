@@ -1,9 +1,23 @@
 #pragma once
 #include <stdint.h>
+#include "dir.h"
 
+// served from the local cache if the copy there is current, which squirtd is asked about
 int32_t
 squirt_suckFile(const char* filename, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), const char* destFilename, uint32_t* protection);
 
+// as squirt_suckFile(), listing is the file's directory entry if the caller has one, saving the STAT
+int32_t
+squirt_suckFileCached(const char* filename, dir_entry_t* listing, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), const char* destFilename, uint32_t* protection);
+
+// as squirt_suckFile(), hashing the file with crc32_sum()'s crc as it arrives
+int32_t
+squirt_suckFileWithCrc(const char* filename, const char* destFilename, uint32_t* protection, uint32_t* crc);
+
+// as squirt_suckFileCached(), writing to fd rather than a file
+int32_t
+squirt_suckFileToFd(const char* filename, dir_entry_t* listing, int fd, const char* progressHeader,  void (*progress)(const char* progressHeader, struct timeval* start, uint32_t total, uint32_t fileLength), uint32_t* protection);
+
 void
 suck_cleanup(void);
 
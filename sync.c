@@ -0,0 +1,1114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "main.h"
+#include "common.h"
+#include "exall.h"
+#include "crc32.h"
+
+/*
+ * squirt_sync: mirrors a local folder and an Amiga folder in either direction. Both trees are
+ * listed into manifests up front, the manifests are compared to plan the transfers, deletes and
+ * metadata updates needed, then the plan is carried out a folder at a time. Before each batch
+ * the folder is listed again and anything that changed on either side since the manifests were
+ * made is reported as a conflict and left alone.
+ *
+ * The local folder is laid out like a squirt_backup, the metadata kept in .__squirt is used when
+ * it's there. A plain file only has its size, datestamp and whether it's writable.
+ */
+
+#define SYNC_TEMP_NAME ".__squirt_sync"
+
+typedef enum {
+  SYNC_DELETE,
+  SYNC_MKDIR,
+  SYNC_COPY,
+  SYNC_INFO,
+  SYNC_CONFLICT,
+} sync_op_t;
+
+typedef struct {
+  char* path;          // relative to the folders being synced
+  dir_entry_t* info;
+  int exact;           // info has all the metadata, not just what a plain local file has
+  time_t mtime;        // local entries only
+  int infoPlanned;
+} sync_entry_t;
+
+typedef struct {
+  sync_entry_t* entries;
+  uint32_t count;
+  uint32_t capacity;
+} sync_manifest_t;
+
+typedef struct {
+  sync_op_t op;
+  sync_entry_t* source;  // 0 for deletes, unless the delete makes way for it
+  sync_entry_t* dest;    // as the destination was listed, 0 if it's missing or deleted first
+  const char* path;
+  const char* reason;
+  uint32_t depth;
+} sync_action_t;
+
+static int sync_pull = 0;
+static int sync_delete = 0;
+static int sync_crcVerify = 0;
+static int sync_dryRun = 0;
+static char* sync_localRoot = 0;
+static const char* sync_remoteRoot = 0;
+static int sync_remoteMissing = 0;
+static int sync_localMissing = 0;
+static sync_manifest_t sync_local = {0};
+static sync_manifest_t sync_remote = {0};
+static sync_action_t* sync_plan = 0;
+static uint32_t sync_planCount = 0;
+static uint32_t sync_planCapacity = 0;
+static uint32_t sync_extra = 0;
+
+
+static void
+sync_freeManifest(sync_manifest_t* manifest)
+{
+  for (uint32_t i = 0; i < manifest->count; i++) {
+    free(manifest->entries[i].path);
+    dir_freeEntry(manifest->entries[i].info);
+  }
+  free(manifest->entries);
+  memset(manifest, 0, sizeof(*manifest));
+}
+
+
+void
+sync_cleanup(void)
+{
+  sync_freeManifest(&sync_local);
+  sync_freeManifest(&sync_remote);
+
+  free(sync_plan);
+  sync_plan = 0;
+  sync_planCount = sync_planCapacity = 0;
+
+  free(sync_localRoot);
+  sync_localRoot = 0;
+}
+
+
+static void
+sync_parent(char* buffer, const char* path)
+{
+  const char* slash = strrchr(path, '/');
+  snprintf(buffer, PATH_MAX, "%.*s", slash ? (int)(slash-path) : 0, path);
+}
+
+
+static uint32_t
+sync_depth(const char* path)
+{
+  uint32_t depth = 0;
+  for (; *path; path++) {
+    depth += *path == '/';
+  }
+  return depth;
+}
+
+
+static void
+sync_remotePath(char* buffer, const char* path)
+{
+  util_joinPath(buffer, sync_remoteRoot, path);
+}
+
+
+// the local name of an Amiga name may have been changed by util_safeName()
+static void
+sync_localPath(char* buffer, const char* path)
+{
+  char parent[PATH_MAX], dir[PATH_MAX];
+  char* safe = util_safeName(util_amigaBaseName(path));
+
+  if (!safe) {
+    fatalError("out of memory");
+  }
+
+  sync_parent(parent, path);
+  util_joinPath(dir, sync_localRoot, parent);
+  util_joinPath(buffer, dir, safe);
+  free(safe);
+}
+
+
+static void
+sync_localDir(const char* path)
+{
+  char parent[PATH_MAX], dir[PATH_MAX];
+
+  sync_parent(parent, path);
+  util_joinPath(dir, sync_localRoot, parent);
+
+  if (chdir(dir) != 0) {
+    fatalError("unable to chdir to %s", dir);
+  }
+}
+
+
+static int
+sync_compareEntries(const void* a, const void* b)
+{
+  // AmigaDOS names are case insensitive
+  return strcasecmp(((const sync_entry_t*)a)->path, ((const sync_entry_t*)b)->path);
+}
+
+
+static void
+sync_addEntry(sync_manifest_t* manifest, const char* path, dir_entry_t* info, int exact, time_t mtime)
+{
+  if (manifest->count == manifest->capacity) {
+    manifest->capacity = manifest->capacity ? manifest->capacity*2 : 256;
+    manifest->entries = realloc(manifest->entries, manifest->capacity*sizeof(sync_entry_t));
+    if (!manifest->entries) {
+      fatalError("out of memory");
+    }
+  }
+
+  sync_entry_t* entry = &manifest->entries[manifest->count++];
+  memset(entry, 0, sizeof(*entry));
+  entry->path = strdup(path);
+  entry->info = info;
+  entry->exact = exact;
+  entry->mtime = mtime;
+
+  if (!entry->path) {
+    fatalError("out of memory");
+  }
+}
+
+
+static dir_entry_t*
+sync_localInfo(const char* filename, const char* name, struct stat* st, int* exact)
+{
+  dir_entry_t* info = dir_newDirEntry();
+  char exallName[PATH_MAX];
+  struct stat exallSt;
+
+  if (!info) {
+    fatalError("out of memory");
+  }
+
+  snprintf(exallName, sizeof(exallName), "%s%s", SQUIRT_EXALL_INFO_DIR_NAME, filename);
+
+  if (stat(exallName, &exallSt) == 0 && exall_readExAllData(info, name)) {
+    dir_datestamp_t ds;
+    dir_localDateStamp(st->st_mtime, &ds);
+
+    // backup set the file's date to the one it saved, a file edited since then is just a file
+    if (S_ISDIR(st->st_mode) ||
+	(info->size == (uint32_t)st->st_size && info->ds.days == ds.days && info->ds.mins == ds.mins && info->ds.ticks/50 == ds.ticks/50)) {
+      *exact = 1;
+      return info;
+    }
+
+    free((void*)info->name);
+    free((void*)info->comment);
+    memset(info, 0, sizeof(*info));
+  }
+
+  *exact = 0;
+  info->name = strdup(name);
+  info->type = S_ISDIR(st->st_mode) ? 2 : -3;
+  info->size = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+  info->prot = dir_localProtection(st->st_mode);
+  dir_localDateStamp(st->st_mtime, &info->ds);
+
+  if (!info->name) {
+    fatalError("out of memory");
+  }
+
+  return info;
+}
+
+
+static void
+sync_readLocal(const char* path)
+{
+  char dir[PATH_MAX];
+  util_joinPath(dir, sync_localRoot, path);
+
+  DIR* dp = opendir(dir);
+  if (!dp) {
+    fatalError("unable to read %s", dir);
+  }
+
+  struct dirent* de;
+  while ((de = readdir(dp)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 ||
+	strcmp(de->d_name, "..") == 0 ||
+	strcmp(de->d_name, SQUIRT_EXALL_INFO_DIR) == 0 ||
+	strcmp(de->d_name, SYNC_TEMP_NAME) == 0) {
+      continue;
+    }
+
+    const char* name = de->d_name;
+#ifdef _WIN32
+    if (strncmp(name, "squirt_", 7) == 0) {
+      name += 7;
+    }
+#endif
+
+    char child[PATH_MAX];
+    struct stat st;
+    int exact;
+
+    // the metadata is read relative to the folder
+    if (chdir(dir) != 0) {
+      fatalError("unable to chdir to %s", dir);
+    }
+
+    if (stat(de->d_name, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+      continue;
+    }
+
+    util_joinPath(child, path, name);
+    dir_entry_t* info = sync_localInfo(de->d_name, name, &st, &exact);
+    sync_addEntry(&sync_local, child, info, exact, st.st_mtime);
+
+    if (S_ISDIR(st.st_mode)) {
+      sync_readLocal(child);
+    }
+  }
+
+  closedir(dp);
+}
+
+
+static dir_entry_t*
+sync_copyInfo(dir_entry_t* entry)
+{
+  dir_entry_t* info = dir_newDirEntry();
+
+  if (!info) {
+    fatalError("out of memory");
+  }
+
+  *info = *entry;
+  info->next = 0;
+  info->name = strdup(entry->name);
+  info->comment = entry->comment && *entry->comment ? strdup(entry->comment) : 0;
+
+  if (!info->name) {
+    fatalError("out of memory");
+  }
+
+  return info;
+}
+
+
+static void
+sync_readRemote(const char* path)
+{
+  char dir[PATH_MAX];
+  sync_remotePath(dir, path);
+
+  dir_entry_list_t* list = dir_read(dir);
+  if (!list) {
+    fatalError("unable to read %s", dir);
+  }
+
+  for (dir_entry_t* entry = list->head; entry; entry = entry->next) {
+    char child[PATH_MAX];
+    util_joinPath(child, path, entry->name);
+    sync_addEntry(&sync_remote, child, sync_copyInfo(entry), 1, 0);
+
+    if (entry->type > 0) {
+      sync_readRemote(child);
+    }
+  }
+
+  dir_freeEntryList(list);
+}
+
+
+static sync_entry_t*
+sync_findEntry(sync_manifest_t* manifest, const char* path)
+{
+  sync_entry_t key = {.path = (char*)path};
+  return bsearch(&key, manifest->entries, manifest->count, sizeof(sync_entry_t), sync_compareEntries);
+}
+
+
+static sync_action_t*
+sync_addAction(sync_op_t op, sync_entry_t* source, sync_entry_t* dest, const char* reason)
+{
+  if (sync_planCount == sync_planCapacity) {
+    sync_planCapacity = sync_planCapacity ? sync_planCapacity*2 : 256;
+    sync_plan = realloc(sync_plan, sync_planCapacity*sizeof(sync_action_t));
+    if (!sync_plan) {
+      fatalError("out of memory");
+    }
+  }
+
+  sync_action_t* action = &sync_plan[sync_planCount++];
+  action->op = op;
+  action->source = source;
+  action->dest = dest;
+  action->path = op == SYNC_DELETE ? dest->path : source->path;
+  action->reason = reason;
+  action->depth = sync_depth(action->path);
+
+  if (op == SYNC_INFO) {
+    source->infoPlanned = 1;
+  }
+
+  return action;
+}
+
+
+static int
+sync_sameDateStamp(dir_entry_t* a, dir_entry_t* b, int exact)
+{
+  // a plain local file's date only has seconds
+  return a->ds.days == b->ds.days && a->ds.mins == b->ds.mins &&
+    (exact ? a->ds.ticks == b->ds.ticks : a->ds.ticks/50 == b->ds.ticks/50);
+}
+
+
+static int
+sync_metadataDiffers(sync_entry_t* source, sync_entry_t* dest)
+{
+  int exact = source->exact && dest->exact;
+  uint32_t mask = exact ? 0xFFFFFFFF : DIR_PROTECTION_WRITE_DELETE;
+  const char* one = source->info->comment ? source->info->comment : "";
+  const char* two = dest->info->comment ? dest->info->comment : "";
+
+  return !sync_sameDateStamp(source->info, dest->info, exact) ||
+    ((source->info->prot ^ dest->info->prot) & mask) != 0 ||
+    (exact && strcmp(one, two) != 0);
+}
+
+
+static int
+sync_localCrc(sync_entry_t* entry, uint32_t* crc)
+{
+  char path[PATH_MAX];
+  sync_localPath(path, entry->path);
+  return crc32_sum(path, crc);
+}
+
+
+static int
+sync_remoteCrc(sync_entry_t* entry, uint32_t* crc)
+{
+  char path[PATH_MAX], command[PATH_MAX+16];
+  sync_remotePath(path, entry->path);
+  snprintf(command, sizeof(command), "ssum \"%s\"", path);
+
+  char* result = util_execCapture(command);
+  if (!result) {
+    return -1;
+  }
+
+  char* end;
+  *crc = strtoul(result, &end, 16);
+  int error = end == result;
+  free(result);
+
+  return error;
+}
+
+
+static void
+sync_compare(sync_entry_t* source, sync_entry_t* dest)
+{
+  int sourceDir = source->info->type > 0, destDir = dest->info->type > 0;
+
+  if (sourceDir != destDir) {
+    if (!sync_delete) {
+      sync_addAction(SYNC_CONFLICT, source, dest, "a file on one side and a folder on the other");
+    } else {
+      // the delete expects what replaces it to be there
+      sync_addAction(SYNC_DELETE, source, dest, 0);
+      sync_addAction(sourceDir ? SYNC_MKDIR : SYNC_COPY, source, 0, 0);
+    }
+    return;
+  }
+
+  if (sourceDir) {
+    // a plain local folder's metadata is whatever writing its files left it with
+    if (source->exact && sync_metadataDiffers(source, dest)) {
+      sync_addAction(SYNC_INFO, source, dest, 0);
+    }
+    return;
+  }
+
+  if (source->info->size != dest->info->size) {
+    sync_addAction(SYNC_COPY, source, dest, 0);
+    return;
+  }
+
+  if (sync_crcVerify) {
+    uint32_t local, remote;
+    sync_entry_t* localEntry = sync_pull ? dest : source;
+    sync_entry_t* remoteEntry = sync_pull ? source : dest;
+
+    // same contents with a different date only needs the date set
+    if (sync_localCrc(localEntry, &local) == 0 && sync_remoteCrc(remoteEntry, &remote) == 0) {
+      if (local != remote) {
+	sync_addAction(SYNC_COPY, source, dest, 0);
+      } else if (sync_metadataDiffers(source, dest)) {
+	sync_addAction(SYNC_INFO, source, dest, 0);
+      }
+      return;
+    }
+  }
+
+  if (!sync_sameDateStamp(source->info, dest->info, source->exact && dest->exact)) {
+    sync_addAction(SYNC_COPY, source, dest, 0);
+  } else if (sync_metadataDiffers(source, dest)) {
+    sync_addAction(SYNC_INFO, source, dest, 0);
+  }
+}
+
+
+// below a folder that conflicts with a file nothing can be done
+static int
+sync_belowConflict(const char* path)
+{
+  for (uint32_t i = 0; i < sync_planCount; i++) {
+    size_t length = strlen(sync_plan[i].path);
+    if (sync_plan[i].op == SYNC_CONFLICT && strncasecmp(path, sync_plan[i].path, length) == 0 && path[length] == '/') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+static void
+sync_buildPlan(void)
+{
+  sync_manifest_t* source = sync_pull ? &sync_remote : &sync_local;
+  sync_manifest_t* dest = sync_pull ? &sync_local : &sync_remote;
+  uint32_t i = 0, j = 0;
+
+  while (i < source->count || j < dest->count) {
+    int compare = i == source->count ? 1 : j == dest->count ? -1 : sync_compareEntries(&source->entries[i], &dest->entries[j]);
+    sync_entry_t* s = 0;
+    sync_entry_t* d = 0;
+    const char* path;
+
+    if (compare <= 0) {
+      s = &source->entries[i++];
+      path = s->path;
+    }
+    if (compare >= 0) {
+      d = &dest->entries[j++];
+      path = d->path;
+    }
+
+    if (sync_belowConflict(path)) {
+      continue;
+    }
+
+    if (s && d) {
+      sync_compare(s, d);
+    } else if (s) {
+      sync_addAction(s->info->type > 0 ? SYNC_MKDIR : SYNC_COPY, s, 0, 0);
+    } else if (sync_delete) {
+      sync_addAction(SYNC_DELETE, 0, d, 0);
+    } else {
+      sync_extra++;
+    }
+  }
+
+  // a new folder gets its metadata once it's made, and writing into a folder changes its date
+  uint32_t count = sync_planCount;
+  for (uint32_t k = 0; k < count; k++) {
+    // adding actions moves the plan
+    sync_action_t action = sync_plan[k];
+    char parent[PATH_MAX];
+
+    if (action.op == SYNC_MKDIR && action.source->exact && !action.source->infoPlanned) {
+      sync_addAction(SYNC_INFO, action.source, 0, 0);
+    }
+
+    sync_parent(parent, action.path);
+    if (sync_pull || !*parent || action.op == SYNC_CONFLICT) {
+      continue;
+    }
+
+    sync_entry_t* folder = sync_findEntry(source, parent);
+    if (folder && folder->exact && !folder->infoPlanned) {
+      sync_addAction(SYNC_INFO, folder, sync_findEntry(dest, parent), 0);
+    }
+  }
+}
+
+
+static int
+sync_phase(const sync_action_t* action)
+{
+  if (action->op == SYNC_CONFLICT) {
+    return SYNC_CONFLICT+1;
+  }
+
+  // folder metadata goes last, after everything written into them
+  if (action->op == SYNC_INFO && action->source->info->type > 0) {
+    return SYNC_INFO+1;
+  }
+
+  return action->op;
+}
+
+
+static int
+sync_compareActions(const void* a, const void* b)
+{
+  const sync_action_t* one = a;
+  const sync_action_t* two = b;
+  int phase = sync_phase(one);
+
+  if (phase != sync_phase(two)) {
+    return phase - sync_phase(two);
+  }
+
+  // deletes and folder metadata deepest first, everything else parents first
+  if (one->depth != two->depth) {
+    int deeper = one->depth > two->depth ? 1 : -1;
+    return phase == SYNC_DELETE || phase == SYNC_INFO+1 ? -deeper : deeper;
+  }
+
+  return strcasecmp(one->path, two->path);
+}
+
+
+static const char*
+sync_describe(sync_action_t* action)
+{
+  switch (action->op) {
+  case SYNC_DELETE:
+    return "delete  ";
+  case SYNC_MKDIR:
+    return "mkdir   ";
+  case SYNC_COPY:
+    return sync_pull ? "download" : "upload  ";
+  case SYNC_INFO:
+    return "update  ";
+  case SYNC_CONFLICT:
+  default:
+    return "conflict";
+  }
+}
+
+
+static void
+sync_printAction(sync_action_t* action, const char* reason)
+{
+  char path[PATH_MAX];
+
+  if (sync_pull) {
+    sync_localPath(path, action->path);
+  } else {
+    sync_remotePath(path, action->path);
+  }
+
+  printf("%s %s", sync_describe(action), path);
+  if (action->op == SYNC_COPY) {
+    printf(" (%'u bytes)", action->source->info->size);
+  }
+  if (reason) {
+    printf(" (%s)", reason);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+
+static dir_entry_t*
+sync_findListed(dir_entry_list_t* list, const char* path)
+{
+  const char* name = util_amigaBaseName(path);
+
+  for (dir_entry_t* entry = list ? list->head : 0; entry; entry = entry->next) {
+    if (strcasecmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+
+  return 0;
+}
+
+
+static const char*
+sync_localChanged(sync_action_t* action, sync_entry_t* expected, int made)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  sync_localPath(path, action->path);
+
+  if (stat(path, &st) != 0) {
+    return expected || made ? "gone from the local folder" : 0;
+  } else if (!expected) {
+    return made && S_ISDIR(st.st_mode) ? 0 : "appeared in the local folder";
+  } else if ((expected->info->type > 0) != (S_ISDIR(st.st_mode) != 0)) {
+    return "changed type in the local folder";
+  } else if (!S_ISDIR(st.st_mode) && (st.st_size != (off_t)expected->info->size || st.st_mtime != expected->mtime)) {
+    return "changed in the local folder";
+  }
+
+  return 0;
+}
+
+
+static const char*
+sync_remoteChanged(sync_action_t* action, sync_entry_t* expected, int made, dir_entry_list_t* list)
+{
+  dir_entry_t* entry = sync_findListed(list, action->path);
+
+  if (!entry) {
+    return expected || made ? "gone from the Amiga" : 0;
+  } else if (!expected) {
+    return made && entry->type > 0 ? 0 : "appeared on the Amiga";
+  } else if ((expected->info->type > 0) != (entry->type > 0)) {
+    return "changed type on the Amiga";
+  } else if (entry->type < 0 && (entry->size != expected->info->size || !sync_sameDateStamp(entry, expected->info, 1))) {
+    return "changed on the Amiga";
+  }
+
+  return 0;
+}
+
+
+// the reason the action can't go ahead, 0 if neither side has changed since it was planned
+static const char*
+sync_conflict(sync_action_t* action, dir_entry_list_t* list)
+{
+  // a new folder's metadata is set after it's made
+  int made = action->op == SYNC_INFO && !action->dest;
+  sync_entry_t* local = sync_pull ? action->dest : action->source;
+  sync_entry_t* remote = sync_pull ? action->source : action->dest;
+  const char* reason;
+
+  if (!list) {
+    return "its folder is missing on the Amiga";
+  }
+
+  if ((reason = sync_localChanged(action, local, made && sync_pull))) {
+    return reason;
+  }
+
+  return sync_remoteChanged(action, remote, made && !sync_pull, list);
+}
+
+
+static int
+sync_pushAction(sync_action_t* action)
+{
+  char local[PATH_MAX], remote[PATH_MAX];
+
+  sync_localPath(local, action->path);
+  sync_remotePath(remote, action->path);
+
+  switch (action->op) {
+  case SYNC_COPY:
+    return squirt_fileWithInfo(local, 0, remote, action->source->info, 0);
+  case SYNC_INFO:
+    return restore_applyExAll(action->source->info, action->source->info->name, remote);
+  default:
+    return 0;
+  }
+}
+
+
+static void
+sync_pushFsops(sync_action_t** actions, uint32_t count, uint32_t* done, uint32_t* failed)
+{
+  fsop_operation_t operations[FSOP_MAX_BATCH];
+  // a batch of paths is too big for the stack
+  char (*paths)[PATH_MAX] = malloc(count*sizeof(*paths));
+
+  if (!paths) {
+    fatalError("out of memory");
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    sync_remotePath(paths[i], actions[i]->path);
+    operations[i].command = actions[i]->op == SYNC_DELETE ? SQUIRT_COMMAND_DELETE : SQUIRT_COMMAND_MKDIR;
+    operations[i].name = paths[i];
+    operations[i].newName = 0;
+  }
+
+  fsop_batch(operations, count);
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (operations[i].error) {
+      fprintf(stderr, "%s: failed to %s %s (%s)\n", main_argv0, actions[i]->op == SYNC_DELETE ? "delete" : "create", paths[i], util_getErrorString(operations[i].error));
+      (*failed)++;
+    } else {
+      sync_printAction(actions[i], 0);
+      (*done)++;
+    }
+  }
+
+  free(paths);
+}
+
+
+static int
+sync_pullAction(sync_action_t* action)
+{
+  char path[PATH_MAX];
+  const char* name = util_amigaBaseName(action->path);
+  char* safe = util_safeName(name);
+
+  if (!safe) {
+    fatalError("out of memory");
+  }
+
+  sync_localPath(path, action->path);
+  sync_localDir(action->path);
+
+  int error = 0;
+
+  switch (action->op) {
+  case SYNC_DELETE:
+    {
+      char exallName[PATH_MAX];
+      snprintf(exallName, sizeof(exallName), "%s%s", SQUIRT_EXALL_INFO_DIR_NAME, safe);
+      error = action->dest->info->type > 0 ? util_rmdir(safe) : unlink(safe);
+      if (!error && unlink(exallName) != 0 && errno != ENOENT) {
+	error = -1;
+      }
+    }
+    break;
+  case SYNC_MKDIR:
+    error = util_mkdir(safe, 0777);
+    break;
+  case SYNC_COPY:
+    {
+      char remote[PATH_MAX];
+      uint32_t protection;
+      sync_remotePath(remote, action->path);
+
+      // an interrupted download leaves the old copy alone
+      error = squirt_suckFileCached(remote, action->source->info, 0, 0, SYNC_TEMP_NAME, &protection) < 0 ||
+	rename(SYNC_TEMP_NAME, safe) != 0 ||
+	!exall_saveExAllData(action->source->info, name);
+      if (error) {
+	unlink(SYNC_TEMP_NAME);
+      }
+    }
+    break;
+  case SYNC_INFO:
+    error = !exall_saveExAllData(action->source->info, name);
+    break;
+  case SYNC_CONFLICT:
+    break;
+  }
+
+  if (error) {
+    fprintf(stderr, "%s: failed to %s %s\n", main_argv0, sync_describe(action), path);
+  }
+
+  free(safe);
+  return error;
+}
+
+
+static void
+sync_runBatch(sync_action_t* actions, uint32_t count, uint32_t* done, uint32_t* failed, uint32_t* conflicts)
+{
+  sync_action_t* ready[FSOP_MAX_BATCH];
+  uint32_t readyCount = 0;
+  char parent[PATH_MAX], remoteDir[PATH_MAX];
+
+  // one listing checks the whole batch
+  sync_parent(parent, actions[0].path);
+  sync_remotePath(remoteDir, parent);
+  dir_entry_list_t* list = dir_read(remoteDir);
+
+  for (uint32_t i = 0; i < count; i++) {
+    const char* reason = sync_conflict(&actions[i], list);
+    if (reason) {
+      actions[i].op = SYNC_CONFLICT;
+      sync_printAction(&actions[i], reason);
+      (*conflicts)++;
+    } else {
+      ready[readyCount++] = &actions[i];
+    }
+  }
+
+  if (list) {
+    dir_freeEntryList(list);
+  }
+
+  if (readyCount == 0) {
+    return;
+  }
+
+  if (!sync_pull && (ready[0]->op == SYNC_DELETE || ready[0]->op == SYNC_MKDIR)) {
+    sync_pushFsops(ready, readyCount, done, failed);
+    return;
+  }
+
+  for (uint32_t i = 0; i < readyCount; i++) {
+    if ((sync_pull ? sync_pullAction(ready[i]) : sync_pushAction(ready[i])) != 0) {
+      (*failed)++;
+    } else {
+      sync_printAction(ready[i], 0);
+      (*done)++;
+    }
+  }
+}
+
+
+static void
+sync_execute(uint32_t* done, uint32_t* failed, uint32_t* conflicts)
+{
+  uint32_t i = 0;
+
+  while (i < sync_planCount) {
+    char parent[PATH_MAX], next[PATH_MAX];
+    uint32_t count = 1;
+
+    if (sync_plan[i].op == SYNC_CONFLICT) {
+      i++;
+      continue;
+    }
+
+    sync_parent(parent, sync_plan[i].path);
+    while (i+count < sync_planCount && count < FSOP_MAX_BATCH &&
+	   sync_phase(&sync_plan[i+count]) == sync_phase(&sync_plan[i])) {
+      sync_parent(next, sync_plan[i+count].path);
+      if (strcasecmp(next, parent) != 0) {
+	break;
+      }
+      count++;
+    }
+
+    sync_runBatch(&sync_plan[i], count, done, failed, conflicts);
+    i += count;
+  }
+}
+
+
+static void
+sync_printPlan(void)
+{
+  uint32_t mkdirs = 0, copies = 0, updates = 0, deletes = 0, conflicts = 0;
+  uint64_t bytes = 0;
+
+  if (sync_remoteMissing || sync_localMissing) {
+    printf("mkdir    %s\n", sync_pull ? sync_localRoot : sync_remoteRoot);
+  }
+
+  for (uint32_t i = 0; i < sync_planCount; i++) {
+    sync_action_t* action = &sync_plan[i];
+    sync_printAction(action, action->reason);
+    switch (action->op) {
+    case SYNC_DELETE:
+      deletes++;
+      break;
+    case SYNC_MKDIR:
+      mkdirs++;
+      break;
+    case SYNC_COPY:
+      copies++;
+      bytes += action->source->info->size;
+      break;
+    case SYNC_INFO:
+      updates++;
+      break;
+    case SYNC_CONFLICT:
+      conflicts++;
+      break;
+    }
+  }
+
+  printf("\n%u folders to create, %u files to %s (%'llu bytes), %u metadata updates, %u deletes, %u conflicts\n",
+	 mkdirs, copies, sync_pull ? "download" : "upload", (unsigned long long)bytes, updates, deletes, conflicts);
+}
+
+
+static void
+sync_readManifests(void)
+{
+  struct stat st;
+
+  if (stat(sync_localRoot, &st) != 0) {
+    if (!sync_pull) {
+      fatalError("unable to read %s", sync_localRoot);
+    } else if (sync_dryRun) {
+      sync_localMissing = 1;
+    } else if (util_mkdir(sync_localRoot, 0777) != 0) {
+      fatalError("failed to mkdir %s", sync_localRoot);
+    }
+  } else if (!S_ISDIR(st.st_mode)) {
+    fatalError("%s is not a folder", sync_localRoot);
+  }
+
+  dir_entry_t remote = {0};
+  size_t length = strlen(sync_remoteRoot);
+  int volume = length && sync_remoteRoot[length-1] == ':';
+
+  if (!volume && dir_stat(sync_remoteRoot, &remote) != 0) {
+    // a daemon without stat gets the listing's error instead
+    dir_entry_list_t* list = hello_supports(SQUIRT_CAP_STAT) ? 0 : dir_read(sync_remoteRoot);
+    if (list) {
+      dir_freeEntryList(list);
+      remote.type = 2;
+    } else if (sync_pull) {
+      fatalError("unable to read %s", sync_remoteRoot);
+    } else if (sync_dryRun) {
+      sync_remoteMissing = 1;
+    } else if (fsop_makeDir(sync_remoteRoot) != 0) {
+      fatalError("failed to create %s", sync_remoteRoot);
+    } else {
+      remote.type = 2;
+    }
+  }
+
+  if (!volume && !sync_remoteMissing && remote.type <= 0) {
+    fatalError("%s is not a folder", sync_remoteRoot);
+  }
+
+  if (!sync_localMissing) {
+    sync_readLocal("");
+  }
+  if (!sync_remoteMissing) {
+    sync_readRemote("");
+  }
+
+  qsort(sync_local.entries, sync_local.count, sizeof(sync_entry_t), sync_compareEntries);
+  qsort(sync_remote.entries, sync_remote.count, sizeof(sync_entry_t), sync_compareEntries);
+}
+
+
+_Noreturn static void
+sync_usage(void)
+{
+  fatalError("invalid arguments\nusage: %s [--pull] [--delete] [--crc32] [--dry-run] hostname local_folder remote_folder", main_argv0);
+}
+
+
+void
+sync_main(int argc, char* argv[])
+{
+  const char* hostname = 0;
+  const char* localDir = 0;
+  int argvIndex = 1;
+
+  while (argvIndex < argc) {
+    static struct option long_options[] =
+      {
+       {"pull",     no_argument, &sync_pull, 'p'},
+       {"delete",   no_argument, &sync_delete, 'D'},
+       {"crc32",    no_argument, &sync_crcVerify, 'c'},
+       {"dry-run",  no_argument, &sync_dryRun, 'd'},
+       {0, 0, 0, 0}
+      };
+    int option_index = 0;
+    int c = getopt_long (argc, argv, "", long_options, &option_index);
+
+    if (c != -1) {
+      argvIndex = optind;
+      switch (c) {
+      case 0:
+	break;
+      case '?':
+      default:
+	sync_usage();
+	break;
+      }
+    } else {
+      if (hostname == 0) {
+	hostname = argv[argvIndex];
+      } else if (localDir == 0) {
+	localDir = argv[argvIndex];
+      } else if (sync_remoteRoot == 0) {
+	sync_remoteRoot = argv[argvIndex];
+      } else {
+	sync_usage();
+      }
+      argvIndex++;
+      optind++;
+    }
+  }
+
+  if (!hostname || !localDir || !sync_remoteRoot || !strchr(sync_remoteRoot, ':')) {
+    sync_usage();
+  }
+
+  // the local folder is changed into while the plan runs
+  char* cwd = getcwd(0, 0);
+  if (!cwd) {
+    fatalError("unable to get the current folder");
+  }
+  if (localDir[0] == '/') {
+    sync_localRoot = strdup(localDir);
+  } else if ((sync_localRoot = malloc(PATH_MAX))) {
+    util_joinPath(sync_localRoot, cwd, localDir);
+  }
+  if (!sync_localRoot) {
+    fatalError("out of memory");
+  }
+
+  util_connect(hostname);
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  sync_readManifests();
+  sync_buildPlan();
+  qsort(sync_plan, sync_planCount, sizeof(sync_action_t), sync_compareActions);
+
+  uint32_t unfinished = 0;
+
+  if (sync_dryRun) {
+    sync_printPlan();
+  } else {
+    uint32_t done = 0, failed = 0, conflicts = 0;
+
+    for (uint32_t i = 0; i < sync_planCount; i++) {
+      if (sync_plan[i].op == SYNC_CONFLICT) {
+	sync_printAction(&sync_plan[i], sync_plan[i].reason);
+	conflicts++;
+      }
+    }
+
+    sync_execute(&done, &failed, &conflicts);
+
+    gettimeofday(&end, NULL);
+    printf("\n%u changes made in %0.02f seconds", done, (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0);
+    if (failed) {
+      printf(", %u failed", failed);
+    }
+    if (conflicts) {
+      printf(", %u conflicts left alone", conflicts);
+    }
+    printf("\n");
+    unfinished = failed + conflicts;
+  }
+
+  if (sync_extra) {
+    printf("%u not in the %s folder, --delete removes them\n", sync_extra, sync_pull ? "Amiga" : "local");
+  }
+
+  if (chdir(cwd) != 0) {
+    fatalError("failed to cd to %s", cwd);
+  }
+  free(cwd);
+
+  if (unfinished) {
+    fflush(stdout);
+    fatalError("%u of the planned changes were not made", unfinished);
+  }
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+void
+sync_cleanup(void);
+
+void
+sync_main(int argc, char* argv[]);
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "main.h"
+
+/*
+ * Request tracing. --trace=file.json writes a Chrome trace event ("X") for each traced request,
+ * one write() per event so restore jobs can share the file. --stats prints the count, bytes and
+ * round trip percentiles of each kind of request on exit.
+ */
+
+#define TRACE_EVENT_SIZE 1024
+
+typedef struct {
+  const char* name;
+  uint32_t count;
+  uint32_t capacity;
+  uint64_t bytes;
+  double* times;
+} trace_stat_t;
+
+static int trace_fd = -1;
+static pid_t trace_ownerPid = 0;
+static double trace_epoch = 0;
+static uint64_t trace_bytes = 0;
+static int trace_stats = 0;
+static trace_stat_t* trace_statList = 0;
+static uint32_t trace_statCount = 0;
+static pid_t trace_statPid = 0;
+
+
+static double
+trace_now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+
+static int
+trace_compare(const void* a, const void* b)
+{
+  double one = *(const double*)a, two = *(const double*)b;
+  return one < two ? -1 : one > two;
+}
+
+
+static void
+trace_write(const char* event, size_t length)
+{
+  if (write(trace_fd, event, length) != (ssize_t)length) {
+    close(trace_fd);
+    trace_fd = -1;
+    fprintf(stderr, "%s: failed to write trace, tracing stopped\n", main_argv0);
+  }
+}
+
+
+// appends a JSON string, truncated to fit
+static size_t
+trace_appendString(char* buffer, size_t length, size_t size, const char* string)
+{
+  if (length + 3 > size) {
+    return length;
+  }
+
+  buffer[length++] = '"';
+  for (const unsigned char* s = (const unsigned char*)string; *s && length + 8 < size; s++) {
+    if (*s == '"' || *s == '\\') {
+      buffer[length++] = '\\';
+      buffer[length++] = *s;
+    } else if (*s < 0x20) {
+      length += snprintf(&buffer[length], size-length, "\\u%04x", *s);
+    } else {
+      buffer[length++] = *s;
+    }
+  }
+  buffer[length++] = '"';
+
+  return length;
+}
+
+
+static void
+trace_writeEvent(const char* name, const char* detail, double start, double duration, uint64_t bytes)
+{
+  char event[TRACE_EVENT_SIZE];
+  size_t length = snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"cat\":\"squirt\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%d,\"args\":{\"bytes\":%llu,\"detail\":", name, start-trace_epoch, duration, (int)getpid(), (int)getpid(), (unsigned long long)bytes);
+
+  length = trace_appendString(event, length, sizeof(event)-4, detail ? detail : "");
+  length += snprintf(&event[length], sizeof(event)-length, "}}");
+
+  trace_write(event, length);
+}
+
+
+static void
+trace_addStat(const char* name, double duration, uint64_t bytes)
+{
+  trace_stat_t* stat = 0;
+
+  // a restore job starts with a copy of the parent's stats
+  if (trace_statPid != getpid()) {
+    for (uint32_t i = 0; i < trace_statCount; i++) {
+      trace_statList[i].count = 0;
+      trace_statList[i].bytes = 0;
+    }
+    trace_statPid = getpid();
+  }
+
+  for (uint32_t i = 0; i < trace_statCount; i++) {
+    if (strcmp(trace_statList[i].name, name) == 0) {
+      stat = &trace_statList[i];
+      break;
+    }
+  }
+
+  if (!stat) {
+    trace_statList = realloc(trace_statList, (trace_statCount+1) * sizeof(trace_stat_t));
+    if (!trace_statList) {
+      fatalError("out of memory");
+    }
+    stat = &trace_statList[trace_statCount++];
+    memset(stat, 0, sizeof(*stat));
+    stat->name = name;
+  }
+
+  if (stat->count == stat->capacity) {
+    stat->capacity = stat->capacity ? stat->capacity * 2 : 64;
+    stat->times = realloc(stat->times, stat->capacity * sizeof(double));
+    if (!stat->times) {
+      fatalError("out of memory");
+    }
+  }
+
+  stat->times[stat->count++] = duration;
+  stat->bytes += bytes;
+}
+
+
+static double
+trace_percentile(trace_stat_t* stat, int percent)
+{
+  // nearest rank
+  uint32_t rank = (stat->count * percent + 99) / 100;
+  return stat->times[rank ? rank-1 : 0] / 1000.0;
+}
+
+
+static void
+trace_printStats(void)
+{
+  // nothing recorded since this job forked
+  if (trace_statCount == 0 || trace_statPid != getpid()) {
+    return;
+  }
+
+  if (getpid() != trace_ownerPid) {
+    fprintf(stderr, "job %d:\n", (int)getpid());
+  }
+
+  fprintf(stderr, "%-10s %8s %14s %9s %9s %9s\n", "request", "count", "bytes", "p50 ms", "p95 ms", "p99 ms");
+
+  for (uint32_t i = 0; i < trace_statCount; i++) {
+    trace_stat_t* stat = &trace_statList[i];
+    if (stat->count == 0) {
+      continue;
+    }
+    qsort(stat->times, stat->count, sizeof(double), trace_compare);
+    fprintf(stderr, "%-10s %8u %14llu %9.2f %9.2f %9.2f\n", stat->name, stat->count, (unsigned long long)stat->bytes,
+	    trace_percentile(stat, 50), trace_percentile(stat, 95), trace_percentile(stat, 99));
+  }
+}
+
+
+void
+trace_cleanup(void)
+{
+  if (trace_stats) {
+    trace_printStats();
+  }
+
+  for (uint32_t i = 0; i < trace_statCount; i++) {
+    free(trace_statList[i].times);
+  }
+  free(trace_statList);
+  trace_statList = 0;
+  trace_statCount = 0;
+
+  if (trace_fd >= 0) {
+    // the jobs share the file, only the process that opened it finishes the array
+    if (getpid() == trace_ownerPid) {
+      trace_write("\n]\n", 3);
+    }
+    if (trace_fd >= 0) {
+      close(trace_fd);
+      trace_fd = -1;
+    }
+  }
+}
+
+
+// takes --trace=file and --stats out of the options before the first argument, returns the new argc
+int
+trace_parseArgs(int argc, char* argv[])
+{
+  int i = 1;
+
+  while (i < argc && argv[i][0] == '-') {
+    if (strncmp(argv[i], "--trace=", 8) == 0) {
+      const char* filename = &argv[i][8];
+      if (trace_fd >= 0) {
+	close(trace_fd);
+      }
+      if ((trace_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0666)) < 0) {
+	fatalError("failed to open %s", filename);
+      }
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      trace_stats = 1;
+    } else {
+      i++;
+      continue;
+    }
+
+    memmove(&argv[i], &argv[i+1], (argc-i) * sizeof(char*));
+    argc--;
+  }
+
+  trace_ownerPid = getpid();
+  trace_epoch = trace_now();
+
+  if (trace_fd >= 0) {
+    char event[TRACE_EVENT_SIZE];
+    size_t length = snprintf(event, sizeof(event)-4, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", (int)trace_ownerPid);
+    length = trace_appendString(event, length, sizeof(event)-4, main_argv0);
+    length += snprintf(&event[length], sizeof(event)-length, "}}");
+    trace_write(event, length);
+  }
+
+  return argc;
+}
+
+
+void
+trace_addBytes(size_t bytes)
+{
+  trace_bytes += bytes;
+}
+
+
+void
+trace_begin(trace_span_t* span)
+{
+  if (trace_fd >= 0 || trace_stats) {
+    span->start = trace_now();
+    span->bytes = trace_bytes;
+  }
+}
+
+
+void
+trace_end(trace_span_t* span, const char* name, const char* detail)
+{
+  if (trace_fd < 0 && !trace_stats) {
+    return;
+  }
+
+  double duration = trace_now() - span->start;
+  uint64_t bytes = trace_bytes - span->bytes;
+
+  if (trace_fd >= 0) {
+    trace_writeEvent(name, detail, span->start, duration, bytes);
+  }
+
+  if (trace_stats) {
+    trace_addStat(name, duration, bytes);
+  }
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+  double start;
+  uint64_t bytes;
+} trace_span_t;
+
+void
+trace_cleanup(void);
+
+int
+trace_parseArgs(int argc, char* argv[]);
+
+void
+trace_addBytes(size_t bytes);
+
+void
+trace_begin(trace_span_t* span);
+
+void
+trace_end(trace_span_t* span, const char* name, const char* detail);
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "common.h"
+#include "exall.h"
+
+/*
+ * Tree upload: folders, files and their metadata are streamed to squirtd as the records of one
+ * SQUIRT_COMMAND_TREE request and squirtd answers once at the end, so a tree costs one round trip
+ * rather than a few for every file. Against an older squirtd each record is sent as its own
+ * request as it's added.
+ */
+
+typedef struct {
+  char* path;
+  uint32_t error;
+} tree_record_entry_t;
+
+static char* tree_root = 0;
+static int tree_streaming = 0;
+static tree_record_entry_t* tree_records = 0;
+static uint32_t tree_recordCount = 0;
+static uint32_t tree_recordCapacity = 0;
+static char* tree_buffer = 0;
+static trace_span_t tree_span;
+static uint32_t tree_files = 0, tree_dirs = 0;
+static uint64_t tree_bytes = 0;
+
+
+void
+tree_cleanup(void)
+{
+  for (uint32_t i = 0; i < tree_recordCount; i++) {
+    free(tree_records[i].path);
+  }
+  free(tree_records);
+  tree_records = 0;
+  tree_recordCount = tree_recordCapacity = 0;
+
+  free(tree_root);
+  tree_root = 0;
+
+  free(tree_buffer);
+  tree_buffer = 0;
+}
+
+
+static uint32_t
+tree_addRecord(const char* path)
+{
+  if (tree_recordCount == tree_recordCapacity) {
+    tree_recordCapacity = tree_recordCapacity ? tree_recordCapacity*2 : 64;
+    tree_records = realloc(tree_records, tree_recordCapacity*sizeof(tree_record_entry_t));
+    if (!tree_records) {
+      fatalError("out of memory");
+    }
+  }
+
+  tree_records[tree_recordCount].path = strdup(path);
+  tree_records[tree_recordCount].error = 0;
+  return tree_recordCount++;
+}
+
+
+// where a record goes when it's sent as its own request, which older squirtds resolve against their
+// current directory rather than their destination folder
+static void
+tree_fullPath(char* fullPath, const char* path)
+{
+  util_joinPath(fullPath, tree_root, path);
+  if (!strchr(fullPath, ':')) {
+    fatalError("squirtd is too old to put %s in its destination folder, give a volume with --dest", fullPath);
+  }
+}
+
+
+static void
+tree_sendRecord(tree_record_t type, const char* path)
+{
+  if (util_sendU32(main_socketFd, type) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(main_socketFd, path) != 0) {
+    fatalError("send() tree record failed");
+  }
+}
+
+
+static void
+tree_sendInfo(dir_entry_t* info)
+{
+  // without a datestamp squirtd leaves the one the file was written with
+  if (util_sendU32(main_socketFd, info ? info->prot : 0) != 0 ||
+      util_sendU32(main_socketFd, info ? info->ds.days : 0xFFFFFFFF) != 0 ||
+      util_sendU32(main_socketFd, info ? info->ds.mins : 0) != 0 ||
+      util_sendU32(main_socketFd, info ? info->ds.ticks : 0) != 0 ||
+      util_sendLengthAndUtf8StringAsLatin1(main_socketFd, info && info->comment ? info->comment : "") != 0) {
+    fatalError("send() tree record failed");
+  }
+}
+
+
+// starts a tree below remoteFolder, "" or a path without a volume is in squirtd's destination folder
+void
+tree_begin(const char* remoteFolder)
+{
+  tree_cleanup();
+  tree_root = strdup(remoteFolder);
+  tree_buffer = malloc(BLOCK_SIZE);
+  tree_streaming = hello_supports(SQUIRT_CAP_TREE);
+  tree_files = tree_dirs = 0;
+  tree_bytes = 0;
+
+  trace_begin(&tree_span);
+
+  if (tree_streaming) {
+    if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_TREE) != 0 ||
+	util_sendLengthAndUtf8StringAsLatin1(main_socketFd, remoteFolder) != 0) {
+      fatalError("failed to connect to squirtd server");
+    }
+    util_cork(main_socketFd, 1);
+  }
+}
+
+
+uint32_t
+tree_makeDir(const char* path)
+{
+  uint32_t record = tree_addRecord(path);
+  tree_dirs++;
+
+  if (tree_streaming) {
+    tree_sendRecord(TREE_RECORD_DIR, path);
+  } else {
+    char fullPath[PATH_MAX];
+    dir_entry_t entry = {0};
+    tree_fullPath(fullPath, path);
+    if ((tree_records[record].error = fsop_makeDir(fullPath)) != 0 &&
+	dir_stat(fullPath, &entry) == 0 && entry.type > 0) {
+      tree_records[record].error = 0;
+    }
+  }
+
+  return record;
+}
+
+
+// size bytes are read from fd, which is owned by the caller
+uint32_t
+tree_fileFromFd(int fd, uint32_t size, const char* path, dir_entry_t* info)
+{
+  uint32_t record = tree_addRecord(path);
+  tree_files++;
+  tree_bytes += size;
+
+  if (!tree_streaming) {
+    char fullPath[PATH_MAX];
+    tree_fullPath(fullPath, path);
+    tree_records[record].error = squirt_fileFromFd(fd, size, fullPath, 0, fullPath, info, 0);
+    if (ERROR_IS_FATAL(tree_records[record].error)) {
+      // squirtd hangs up after a fatal error, so there's no carrying on with the rest
+      fatalError("failed to squirt %s", fullPath);
+    }
+    return record;
+  }
+
+  tree_sendRecord(TREE_RECORD_FILE, path);
+  tree_sendInfo(info);
+
+  if (util_sendU32(main_socketFd, size) != 0) {
+    fatalError("send() tree record failed");
+  }
+
+  uint32_t total = 0;
+  while (total < size) {
+    int len, requestLength = size-total > (uint32_t)BLOCK_SIZE ? BLOCK_SIZE : (int)(size-total);
+    if ((len = read(fd, tree_buffer, requestLength)) <= 0) {
+      fatalError("failed to read %s", path);
+    }
+    if (util_send(main_socketFd, tree_buffer, len) != 0) {
+      fatalError("send() failed");
+    }
+    total += len;
+  }
+
+  return record;
+}
+
+
+uint32_t
+tree_file(const char* localPath, const char* path, dir_entry_t* info)
+{
+  struct stat st;
+  int fd;
+
+  if (stat(localPath, &st) != 0 || (fd = util_open(localPath, O_RDONLY|_O_BINARY)) < 0) {
+    fatalError("failed to open %s", localPath);
+  }
+
+  uint32_t record = tree_fileFromFd(fd, st.st_size, path, info);
+  close(fd);
+  return record;
+}
+
+
+// sets the metadata of a file or folder that's already there, folders are best done after their contents
+uint32_t
+tree_setInfo(const char* path, dir_entry_t* info)
+{
+  uint32_t record = tree_addRecord(path);
+
+  if (tree_streaming) {
+    tree_sendRecord(TREE_RECORD_INFO, path);
+    tree_sendInfo(info);
+  } else {
+    char fullPath[PATH_MAX];
+    tree_fullPath(fullPath, path);
+    tree_records[record].error = squirt_applyInfo(fullPath, info);
+  }
+
+  return record;
+}
+
+
+// the number of records that failed, each is reported on stderr
+uint32_t
+tree_end(void)
+{
+  uint32_t failed = 0, reported, record, error;
+
+  if (tree_streaming) {
+    if (util_sendU32(main_socketFd, TREE_RECORD_END) != 0 || util_flush(main_socketFd) != 0) {
+      fatalError("send() tree record failed");
+    }
+    util_cork(main_socketFd, 0);
+
+    if (util_recvU32(main_socketFd, &failed) != 0) {
+      fatalError("tree: failed to read remote status");
+    }
+
+    reported = failed < TREE_MAX_FAILURES ? failed : TREE_MAX_FAILURES;
+    for (uint32_t i = 0; i < reported; i++) {
+      if (util_recvU32(main_socketFd, &record) != 0 || util_recvU32(main_socketFd, &error) != 0) {
+	fatalError("tree: failed to read remote status");
+      }
+      if (record < tree_recordCount) {
+	tree_records[record].error = error;
+      }
+    }
+
+    if (util_recvU32(main_socketFd, &error) != 0) {
+      fatalError("tree: failed to read remote status");
+    }
+
+    if (error != 0) {
+      fatalError("%s", util_getErrorString(error));
+    }
+  }
+
+  fflush(stdout);
+  for (uint32_t i = 0; i < tree_recordCount; i++) {
+    if (tree_records[i].error) {
+      fprintf(stderr, "**FAILED** %s: %s\n", tree_records[i].path, util_getErrorString(tree_records[i].error));
+      failed += !tree_streaming;
+    }
+  }
+
+  if (failed > TREE_MAX_FAILURES && tree_streaming) {
+    fprintf(stderr, "**FAILED** %u more\n", failed - TREE_MAX_FAILURES);
+  }
+
+  // squirtd's listings of the tree are out of date
+  for (uint32_t i = 0; i < tree_recordCount; i++) {
+    char fullPath[PATH_MAX];
+    util_joinPath(fullPath, tree_root, tree_records[i].path);
+    dir_invalidate(fullPath);
+  }
+
+  trace_end(&tree_span, "tree", tree_root);
+
+  return failed;
+}
+
+
+uint32_t
+tree_recordError(uint32_t record)
+{
+  return record < tree_recordCount ? tree_records[record].error : 0;
+}
+
+
+static void
+tree_uploadDir(const char* localDir, const char* path)
+{
+  DIR* dp = opendir(localDir);
+  if (!dp) {
+    fatalError("unable to read %s", localDir);
+  }
+
+  struct dirent* de;
+  while ((de = readdir(dp)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 ||
+	strcmp(de->d_name, "..") == 0 ||
+	strcmp(de->d_name, SQUIRT_EXALL_INFO_DIR) == 0) {
+      continue;
+    }
+
+    char local[PATH_MAX], child[PATH_MAX];
+    struct stat st;
+    dir_entry_t info = {0};
+
+    snprintf(local, sizeof(local), "%s/%s", localDir, de->d_name);
+    util_joinPath(child, path, de->d_name);
+
+    if (util_statChild(local, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+      continue;
+    }
+
+    info.prot = dir_localProtection(st.st_mode);
+    dir_localDateStamp(st.st_mtime, &info.ds);
+
+    if (S_ISDIR(st.st_mode)) {
+      tree_makeDir(child);
+      tree_uploadDir(local, child);
+      // writing the folder's contents changed its date
+      tree_setInfo(child, &info);
+    } else {
+      tree_file(local, child, &info);
+    }
+  }
+
+  closedir(dp);
+}
+
+
+// squirts localFolder and everything in it into remoteFolder
+void
+tree_upload(const char* localFolder, const char* remoteFolder)
+{
+  struct timeval start, end;
+  char* name = strdup(localFolder);
+
+  // a trailing / would leave basename() nothing
+  while (strlen(name) > 1 && name[strlen(name)-1] == '/') {
+    name[strlen(name)-1] = 0;
+  }
+
+  printf("squirting %s\n", localFolder);
+  fflush(stdout);
+  gettimeofday(&start, NULL);
+
+  struct stat st;
+  dir_entry_t info = {0};
+  if (stat(localFolder, &st) != 0) {
+    fatalError("unable to read %s", localFolder);
+  }
+  info.prot = dir_localProtection(st.st_mode);
+  dir_localDateStamp(st.st_mtime, &info.ds);
+
+  tree_begin(remoteFolder);
+  tree_makeDir(basename(name));
+  tree_uploadDir(localFolder, basename(name));
+  tree_setInfo(basename(name), &info);
+  uint32_t failed = tree_end();
+
+  gettimeofday(&end, NULL);
+  double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+  printf("squirted %u files (%s bytes) and %u folders in %0.02f seconds ", tree_files, util_formatNumber(tree_bytes), tree_dirs, elapsed);
+  util_printFormatSpeed(tree_bytes, elapsed > 0 ? elapsed : 1);
+  printf("\n");
+
+  free(name);
+
+  if (failed) {
+    fflush(stdout);
+    fatalError("%u of %u files and folders failed", failed, tree_recordCount);
+  }
+}
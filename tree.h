@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include "dir.h"
+
+void
+tree_cleanup(void);
+
+void
+tree_begin(const char* remoteFolder);
+
+uint32_t
+tree_makeDir(const char* path);
+
+uint32_t
+tree_file(const char* localPath, const char* path, dir_entry_t* info);
+
+uint32_t
+tree_fileFromFd(int fd, uint32_t size, const char* path, dir_entry_t* info);
+
+uint32_t
+tree_setInfo(const char* path, dir_entry_t* info);
+
+uint32_t
+tree_end(void);
+
+uint32_t
+tree_recordError(uint32_t record);
+
+void
+tree_upload(const char* localFolder, const char* remoteFolder);
@@ -19,8 +19,12 @@
 #ifndef _WIN32
 #include <ftw.h>
 #include <pwd.h>
+#include <sys/mman.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
 #else
 // Windows/MinGW compatibility
 typedef int socklen_t;
@@ -30,6 +34,16 @@ typedef int socklen_t;
 #include "common.h"
 #include "argv.h"
 
+#define UTIL_COMPARE_BLOCK_SIZE (64*1024)
+
+static int util_masterFd = -1;
+
+// requests are a run of small writes followed by a read, they go out as one segment
+#define UTIL_SEND_BUFFER_SIZE 1460
+static char util_sendBuffer[UTIL_SEND_BUFFER_SIZE];
+static size_t util_sendLength = 0;
+static int util_sendSocket = -1;
+
 static const char* errors[] = {
   [_ERROR_SUCCESS] = "Unknown error",
   [ERROR_FATAL_ERROR] = "fatal error",
@@ -44,6 +58,12 @@ static const char* errors[] = {
   [ERROR_CD_FAILED] = "cd failed",
   [ERROR_EXEC_FAILED] = "exec failed",
   [ERROR_SUCK_ON_DIR] = "suck on dir",
+  [ERROR_MKDIR_FAILED] = "makedir failed",
+  [ERROR_DELETE_FAILED] = "delete failed",
+  [ERROR_RENAME_FAILED] = "rename failed",
+  [ERROR_SET_COMMENT_FAILED] = "set comment failed",
+  [ERROR_CREATE_FILE_FAILED] = "create file failed",
+  [ERROR_FILE_WRITE_FAILED] = "file write failed",
 };
 
 const char*
@@ -85,8 +105,23 @@ util_getSockAddr(const char * host, int port, struct sockaddr_in * addr)
 }
 
 
-void
-util_connect(const char* hostname)
+int
+util_hostnamePort(const char* hostname)
+{
+  int port = NETWORK_PORT;
+
+  char *colon = strstr(hostname, ":");
+  if (colon) {
+    port = strtol(colon+1, NULL, 10);
+    *colon = 0;   // end hostname string here
+  }
+
+  return port;
+}
+
+
+int
+util_connectSocket(const char* hostname, int port)
 {
   struct sockaddr_in sockAddr;
   int result;
@@ -94,46 +129,37 @@ util_connect(const char* hostname)
   struct timeval timeout;
   socklen_t len;
   int error;
+  int socketFd = -1;
 #ifndef _WIN32
   int flags;
 #endif
 
-  int port=NETWORK_PORT;
-
-  char *colon=strstr(hostname,":");
-  if(colon)
-  {
-          port=strtol(colon+1,NULL,10);
-          *colon=0;   // end hostname string here
-  }
-
-
   if (!util_getSockAddr(hostname, port, &sockAddr)) {
     goto error;
   }
 
-  if ((main_socketFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+  if ((socketFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
     goto error;
   }
 
   // Set socket to non-blocking mode
 #ifdef _WIN32
   u_long mode = 1;
-  if (ioctlsocket(main_socketFd, FIONBIO, &mode) != 0) {
+  if (ioctlsocket(socketFd, FIONBIO, &mode) != 0) {
     goto error;
   }
 #else
-  flags = fcntl(main_socketFd, F_GETFL, 0);
+  flags = fcntl(socketFd, F_GETFL, 0);
   if (flags < 0) {
     goto error;
   }
-  if (fcntl(main_socketFd, F_SETFL, flags | O_NONBLOCK) < 0) {
+  if (fcntl(socketFd, F_SETFL, flags | O_NONBLOCK) < 0) {
     goto error;
   }
 #endif
 
   // Attempt to connect
-  result = connect(main_socketFd, (struct sockaddr *)&sockAddr, sizeof(struct sockaddr_in));
+  result = connect(socketFd, (struct sockaddr *)&sockAddr, sizeof(struct sockaddr_in));
   
   if (result < 0) {
 #ifdef _WIN32
@@ -146,15 +172,15 @@ util_connect(const char* hostname)
       goto error;
     }
 #endif
-    
+
     // Connection is in progress, wait for it to complete with timeout
     FD_ZERO(&writefds);
-    FD_SET(main_socketFd, &writefds);
+    FD_SET(socketFd, &writefds);
     
     timeout.tv_sec = 5;  // 5 second timeout
     timeout.tv_usec = 0;
     
-    result = select(main_socketFd + 1, NULL, &writefds, NULL, &timeout);
+    result = select(socketFd + 1, NULL, &writefds, NULL, &timeout);
     
     if (result <= 0) {
       // Timeout or error
@@ -164,9 +190,9 @@ util_connect(const char* hostname)
     // Check if connection was successful
     len = sizeof(error);
 #ifdef _WIN32
-    if (getsockopt(main_socketFd, SOL_SOCKET, SO_ERROR, (char*)&error, &len) < 0) {
+    if (getsockopt(socketFd, SOL_SOCKET, SO_ERROR, (char*)&error, &len) < 0) {
 #else
-    if (getsockopt(main_socketFd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+    if (getsockopt(socketFd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
 #endif
       goto error;
     }
@@ -184,12 +210,12 @@ util_connect(const char* hostname)
   // Restore socket to blocking mode
 #ifdef _WIN32
   mode = 0;
-  if (ioctlsocket(main_socketFd, FIONBIO, &mode) != 0) {
+  if (ioctlsocket(socketFd, FIONBIO, &mode) != 0) {
     goto error;
   }
 #else
   // Clear the O_NONBLOCK flag to ensure blocking mode
-  if (fcntl(main_socketFd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+  if (fcntl(socketFd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
     goto error;
   }
 #endif
@@ -197,16 +223,188 @@ util_connect(const char* hostname)
   // Note: Socket-level timeouts (SO_RCVTIMEO/SO_SNDTIMEO) can cause issues
   // Connection timeout is already handled above with select() during connect
 
+  // writes are coalesced in util_send(), so Nagle would only add delayed-ACK stalls
+  int one = 1;
+  setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, (const void*)&one, sizeof(one));
+
+  return socketFd;
+ error:
+  if (socketFd >= 0) {
+    close(socketFd);
+  }
+  return -1;
+}
+
+
+#ifndef _WIN32
+// a non-blocking socket that may still be connecting, it's writable once the connect has finished
+int
+util_startConnect(const char* hostname, int port)
+{
+  struct sockaddr_in sockAddr;
+  int socketFd, one = 1;
+
+  if (!util_getSockAddr(hostname, port, &sockAddr) ||
+      (socketFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    return -1;
+  }
+
+  if (fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+      (connect(socketFd, (struct sockaddr *)&sockAddr, sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS)) {
+    close(socketFd);
+    return -1;
+  }
+
+  setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, (const void*)&one, sizeof(one));
+  return socketFd;
+}
+#endif
+
+
+#ifndef _WIN32
+const char*
+util_getMasterPath(const char* hostname, int port)
+{
+  static char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/tmp/.squirt/master-%d-%s-%d", (int)getuid(), hostname, port);
+  return path;
+}
+
+
+int
+util_sendFd(int socketFd, int fd)
+{
+  char byte = 0;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {0};
+
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return sendmsg(socketFd, &msg, 0) == 1 ? 0 : -1;
+}
+
+
+int
+util_recvFd(int socketFd)
+{
+  char byte;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {0};
+  int fd = -1;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(socketFd, &msg, 0) != 1) {
+    return -1;
+  }
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  return fd;
+}
+
+
+static int
+util_connectMaster(const char* hostname, int port)
+{
+  const char* path = util_getMasterPath(hostname, port);
+  struct sockaddr_un addr = {0};
+  struct stat st;
+
+  // only ever hand our session to a master we started
+  if (stat(path, &st) != 0 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid() ||
+      strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int controlFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (controlFd < 0) {
+    return -1;
+  }
+
+  int socketFd = -1;
+  if (connect(controlFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      (socketFd = util_recvFd(controlFd)) < 0) {
+    close(controlFd);
+    return -1;
+  }
+
+  util_masterFd = controlFd;
+  return socketFd;
+}
+#endif
+
+
+void
+util_connect(const char* hostname)
+{
+  int port = util_hostnamePort(hostname);
+  trace_span_t span;
+
+  trace_begin(&span);
+
+#ifndef _WIN32
+  main_socketFd = util_connectMaster(hostname, port);
+#else
+  main_socketFd = -1;
+#endif
+
+  if (main_socketFd < 0 && (main_socketFd = util_connectSocket(hostname, port)) < 0) {
+    fatalError("failed to connect to server %s:%d", hostname,port);
+  }
+
   // Reset connection error flag for new connection
   util_resetConnectionErrorFlag();
+  hello_connected(hostname, port);
 
-  return;
- error:
-  if (main_socketFd >= 0) {
+  trace_end(&span, "connect", hostname);
+}
+
+
+void
+util_disconnect(int reusable)
+{
+  if (main_socketFd > 0) {
+    if (util_flush(main_socketFd) != 0) {
+      reusable = 0;
+    }
+#ifndef _WIN32
+    // a session borrowed from squirt_master goes back to it if it's between commands
+    if (util_masterFd >= 0 && reusable) {
+      util_sendFd(util_masterFd, main_socketFd);
+    }
+#else
+    (void)reusable;
+#endif
     close(main_socketFd);
-    main_socketFd = -1;
   }
-  fatalError("failed to connect to server %s:%d", hostname,port);
+  main_socketFd = 0;
+
+  if (util_masterFd >= 0) {
+    close(util_masterFd);
+    util_masterFd = -1;
+  }
 }
 
 
@@ -370,7 +568,7 @@ util_open(const char* filename, uint32_t mode)
 }
 
 
-static char*
+char*
 util_utf8ToLatin1(const char* buffer)
 {
   iconv_t ic = iconv_open("ISO-8859-1", "UTF-8");
@@ -476,6 +674,47 @@ util_printProgress(const char* filename, struct timeval* start, uint32_t total,
 }
 
 
+// name inside dir, for both amiga (dir "work:") and local paths. buffer is PATH_MAX long
+void
+util_joinPath(char* buffer, const char* dir, const char* name)
+{
+  size_t length = strlen(dir);
+
+  if (!*name) {
+    snprintf(buffer, PATH_MAX, "%s", dir);
+  } else if (length == 0 || dir[length-1] == '/' || dir[length-1] == ':') {
+    snprintf(buffer, PATH_MAX, "%s%s", dir, name);
+  } else {
+    snprintf(buffer, PATH_MAX, "%s/%s", dir, name);
+  }
+}
+
+
+// stat()s something found while walking a local folder. A link to a folder is -1 like a missing
+// file, as it can lead back up the tree and the walk would never end
+int
+util_statChild(const char* path, struct stat* st)
+{
+#ifndef _WIN32
+  if (lstat(path, st) != 0) {
+    return -1;
+  }
+
+  if (!S_ISLNK(st->st_mode)) {
+    return 0;
+  }
+
+  if (stat(path, st) != 0 || S_ISDIR(st->st_mode)) {
+    return -1;
+  }
+
+  return 0;
+#else
+  return stat(path, st);
+#endif
+}
+
+
 const char*
 util_amigaBaseName(const char* filename)
 {
@@ -496,14 +735,99 @@ util_resetConnectionErrorFlag(void)
   connection_error_reported = 0;
 }
 
+static int
+util_sendAll(int socketFd, const char* data, size_t length)
+{
+  while (length > 0) {
+    int sent = send(socketFd, data, length, 0);
+    if (sent <= 0) {
+      return -1;
+    }
+    trace_addBytes(sent);
+    data += sent;
+    length -= sent;
+  }
+  return 0;
+}
+
+
+int
+util_flush(int socketFd)
+{
+  if (util_sendLength == 0 || socketFd != util_sendSocket) {
+    return 0;
+  }
+
+  size_t length = util_sendLength;
+  util_sendLength = 0;
+  return util_sendAll(socketFd, util_sendBuffer, length);
+}
+
+
+int
+util_send(int socketFd, const void* data, size_t length)
+{
+  const char* ptr = data;
+
+  if (socketFd != util_sendSocket) {
+    if (util_flush(util_sendSocket) != 0) {
+      return -1;
+    }
+    util_sendSocket = socketFd;
+  }
+
+  if (util_sendLength + length <= UTIL_SEND_BUFFER_SIZE) {
+    memcpy(&util_sendBuffer[util_sendLength], ptr, length);
+    util_sendLength += length;
+    return 0;
+  }
+
+  // top up the pending request so it shares a segment with the start of the data
+  size_t fill = UTIL_SEND_BUFFER_SIZE - util_sendLength;
+  memcpy(&util_sendBuffer[util_sendLength], ptr, fill);
+  util_sendLength += fill;
+
+  if (util_flush(socketFd) != 0) {
+    return -1;
+  }
+
+  return util_sendAll(socketFd, ptr+fill, length-fill);
+}
+
+
+void
+util_cork(int socketFd, int cork)
+{
+  // hold back partial segments while bulk data is written in blocks
+#if defined(TCP_CORK)
+  setsockopt(socketFd, IPPROTO_TCP, TCP_CORK, (const void*)&cork, sizeof(cork));
+#elif defined(TCP_NOPUSH)
+  setsockopt(socketFd, IPPROTO_TCP, TCP_NOPUSH, (const void*)&cork, sizeof(cork));
+#else
+  (void)socketFd, (void)cork;
+#endif
+}
+
+
 size_t
 util_recv(int socket, void *buffer, size_t length, int flags)
 {
   uint32_t total = 0;
   char* ptr = buffer;
+
+  // the reply can't come before the request has gone out
+  if (util_flush(socket) != 0) {
+    if (!connection_error_reported) {
+      printf("Network error: %s\n", strerror(errno));
+      connection_error_reported = 1;
+    }
+    return 0;
+  }
+
   do {
     int got = recv(socket, ptr, length-total, flags);
     if (got > 0) {
+      trace_addBytes(got);
       total += got;
       ptr += got;
     } else if (got == 0) {
@@ -531,16 +855,35 @@ util_recv(int socket, void *buffer, size_t length, int flags)
 }
 
 
-int
-util_sendU32(int socketFd, uint32_t data)
+static void (*util_beforeCommand)(void) = 0;
+
+// runs once before the next request goes out, so replies to pipelined
+// requests are read before anything else is sent
+void
+util_setBeforeCommand(void (*hook)(void))
 {
-  uint32_t networkData = htonl(data);
+  util_beforeCommand = hook;
+}
 
-  if (send(socketFd, (const void*)&networkData, sizeof(networkData), 0) != sizeof(networkData)) {
-    return -1;
+
+int
+util_sendCommand(int socketFd, uint32_t command)
+{
+  if (util_beforeCommand) {
+    void (*hook)(void) = util_beforeCommand;
+    util_beforeCommand = 0;
+    hook();
   }
 
-  return 0;
+  return util_sendU32(socketFd, command);
+}
+
+
+int
+util_sendU32(int socketFd, uint32_t data)
+{
+  uint32_t networkData = htonl(data);
+  return util_send(socketFd, &networkData, sizeof(networkData));
 }
 
 
@@ -569,14 +912,12 @@ util_recv32(int socketFd, int32_t *data)
 int
 util_sendLengthAndUtf8StringAsLatin1(int socketFd, const char* str)
 {
-  int error = 0;
   char* latin1 = util_utf8ToLatin1(str);
   uint32_t length = strlen(latin1);
   uint32_t networkLength = htonl(length);
 
-  if (send(socketFd, (const void*)&networkLength, sizeof(networkLength), 0) == sizeof(networkLength)) {
-    error = send(socketFd, latin1, length, 0) != (int)length;
-  }
+  int error = util_send(socketFd, &networkLength, sizeof(networkLength)) != 0 ||
+    util_send(socketFd, latin1, length) != 0;
 
   free(latin1);
   return error;
@@ -604,7 +945,7 @@ util_recvLatin1AsUtf8(int socketFd, uint32_t length)
 const char*
 util_getErrorString(uint32_t error)
 {
-  if (error >= sizeof(errors)) {
+  if (error >= sizeof(errors)/sizeof(errors[0]) || !errors[error]) {
     error = 0;
   }
 
@@ -698,6 +1039,96 @@ util_isDirectory(const char *path)
 }
 
 
+static int
+util_compareBlocks(int fd1, int fd2)
+{
+  static char block1[UTIL_COMPARE_BLOCK_SIZE], block2[UTIL_COMPARE_BLOCK_SIZE];
+  int r1, r2;
+
+  do {
+    r1 = read(fd1, block1, sizeof(block1));
+    r2 = read(fd2, block2, sizeof(block2));
+    if (r1 != r2 || r1 < 0 || memcmp(block1, block2, r1) != 0) {
+      return 0;
+    }
+  } while (r1 > 0);
+
+  return 1;
+}
+
+
+int
+util_compareFiles(const char* one, const char* two)
+{
+  int identical = 1, fd1 = -1, fd2 = -1;
+  struct stat st1, st2;
+
+  if (one == NULL && two == NULL) {
+    goto cleanup;
+  }
+
+  if (one) {
+    fd1 = open(one, O_RDONLY|_O_BINARY);
+  }
+
+  if (two) {
+    fd2 = open(two, O_RDONLY|_O_BINARY);
+  }
+
+  if (fd1 == -1 && fd2 == -1) {
+    goto cleanup;
+  } else if (fd1 == -1 || fd2 == -1) {
+    identical = 0;
+    goto cleanup;
+  }
+
+  if (fstat(fd1, &st1) != 0 || fstat(fd2, &st2) != 0) {
+    identical = util_compareBlocks(fd1, fd2);
+    goto cleanup;
+  }
+
+  if (st1.st_size != st2.st_size) {
+    identical = 0;
+    goto cleanup;
+  }
+
+  if (st1.st_size == 0) {
+    goto cleanup;
+  }
+
+#ifndef _WIN32
+  void* map1 = mmap(0, st1.st_size, PROT_READ, MAP_PRIVATE, fd1, 0);
+  void* map2 = map1 == MAP_FAILED ? MAP_FAILED : mmap(0, st2.st_size, PROT_READ, MAP_PRIVATE, fd2, 0);
+
+  if (map2 != MAP_FAILED) {
+    identical = memcmp(map1, map2, st1.st_size) == 0;
+    munmap(map2, st2.st_size);
+    munmap(map1, st1.st_size);
+    goto cleanup;
+  }
+
+  if (map1 != MAP_FAILED) {
+    munmap(map1, st1.st_size);
+  }
+#endif
+
+  // pipes, special files and anything else mmap() won't take
+  identical = util_compareBlocks(fd1, fd2);
+
+ cleanup:
+
+  if (fd1 >= 0) {
+    close(fd1);
+  }
+
+  if (fd2 >= 0) {
+    close(fd2);
+  }
+
+  return identical;
+}
+
+
 int
 util_exec(char* command)
 {
@@ -795,6 +1226,9 @@ int
 util_cd(const char* dir)
 {
   uint32_t error = 0;
+  trace_span_t span;
+
+  trace_begin(&span);
 
   if (util_sendCommand(main_socketFd, SQUIRT_COMMAND_CD) != 0) {
     fatalError("failed to connect to squirtd server");
@@ -808,6 +1242,8 @@ util_cd(const char* dir)
     fatalError("cd: failed to read remote status");
   }
 
+  trace_end(&span, "cd", dir);
+
   return error;
 }
 
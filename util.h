@@ -2,17 +2,45 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 const char*
 util_formatNumber(int number);
 
+int
+util_hostnamePort(const char* hostname);
+
+int
+util_connectSocket(const char* hostname, int port);
+
 void
 util_connect(const char* hostname);
 
+void
+util_disconnect(int reusable);
+
+#ifndef _WIN32
+int
+util_startConnect(const char* hostname, int port);
+
+const char*
+util_getMasterPath(const char* hostname, int port);
+
+int
+util_sendFd(int socketFd, int fd);
+
+int
+util_recvFd(int socketFd);
+#endif
+
 void
 util_resetConnectionErrorFlag(void);
 
-#define util_sendCommand(s, x) util_sendU32(s, x)
+int
+util_sendCommand(int socketFd, uint32_t command);
+
+void
+util_setBeforeCommand(void (*hook)(void));
 
 const char*
 util_getHomeDir(void);
@@ -20,6 +48,9 @@ util_getHomeDir(void);
 const char*
 util_getHistoryFile(void);
 
+char*
+util_utf8ToLatin1(const char* buffer);
+
 char*
 util_latin1ToUtf8(const char* _buffer);
 
@@ -53,12 +84,27 @@ util_recv(int socket, void *buffer, size_t length, int flags);
 int
 util_recvU32(int socketFd, uint32_t *data);
 
+int
+util_send(int socketFd, const void* data, size_t length);
+
+int
+util_flush(int socketFd);
+
+void
+util_cork(int socketFd, int cork);
+
 int
 util_recv32(int socketFd, int32_t *data);
 
 int
 util_sendU32(int socketFd, uint32_t data);
 
+void
+util_joinPath(char* buffer, const char* dir, const char* name);
+
+int
+util_statChild(const char* path, struct stat* st);
+
 const char*
 util_amigaBaseName(const char* filename);
 
@@ -80,6 +126,9 @@ util_getTempFolder(void);
 int
 util_isDirectory(const char *path);
 
+int
+util_compareFiles(const char* one, const char* two);
+
 int
 util_system(char** argv);
 
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "main.h"
+#include "common.h"
+
+/*
+ * squirt --watch: squirts files below a local folder to the Amiga over one connection as they
+ * change. Linux is told about changes by inotify, elsewhere the tree is rescanned. Changes are
+ * collected until the tree has been quiet for the debounce time and then pushed as a batch.
+ */
+
+typedef struct {
+  char** items;
+  uint32_t count;
+  uint32_t capacity;
+} watch_list_t;
+
+typedef struct {
+  char* path;
+  time_t mtime;
+  off_t size;
+} watch_file_t;
+
+static const char* watch_localDir = 0;
+static const char* watch_remoteDir = 0;
+static watch_list_t watch_changed = {0};
+static watch_list_t watch_remoteDirs = {0};
+#ifdef __linux__
+static int watch_inotifyFd = -1;
+static watch_list_t watch_watches = {0}; // the relative folder of each watch descriptor
+#else
+static watch_file_t* watch_files = 0;    // the tree as it was last scanned, sorted by path
+static uint32_t watch_fileCount = 0;
+static watch_file_t* watch_scanFiles = 0;
+static uint32_t watch_scanCount = 0;
+static uint32_t watch_scanCapacity = 0;
+#endif
+
+
+static void
+watch_listFree(watch_list_t* list)
+{
+  for (uint32_t i = 0; i < list->count; i++) {
+    free(list->items[i]);
+  }
+  free(list->items);
+  memset(list, 0, sizeof(*list));
+}
+
+
+static void
+watch_listSet(watch_list_t* list, uint32_t index, const char* item)
+{
+  if (index >= list->capacity) {
+    uint32_t capacity = list->capacity ? list->capacity : 64;
+    while (capacity <= index) {
+      capacity *= 2;
+    }
+    list->items = realloc(list->items, capacity * sizeof(char*));
+    if (!list->items) {
+      fatalError("out of memory");
+    }
+    memset(&list->items[list->capacity], 0, (capacity - list->capacity) * sizeof(char*));
+    list->capacity = capacity;
+  }
+
+  free(list->items[index]);
+  list->items[index] = strdup(item);
+  if (index >= list->count) {
+    list->count = index+1;
+  }
+}
+
+
+static int
+watch_listFind(watch_list_t* list, const char* item)
+{
+  for (uint32_t i = 0; i < list->count; i++) {
+    if (list->items[i] && strcmp(list->items[i], item) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+static void
+watch_listAdd(watch_list_t* list, const char* item)
+{
+  if (!watch_listFind(list, item)) {
+    watch_listSet(list, list->count, item);
+  }
+}
+
+
+#ifndef __linux__
+static void
+watch_freeFiles(watch_file_t* files, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    free(files[i].path);
+  }
+  free(files);
+}
+#endif
+
+
+void
+watch_cleanup(void)
+{
+  watch_listFree(&watch_changed);
+  watch_listFree(&watch_remoteDirs);
+#ifdef __linux__
+  watch_listFree(&watch_watches);
+  if (watch_inotifyFd >= 0) {
+    close(watch_inotifyFd);
+    watch_inotifyFd = -1;
+  }
+#else
+  watch_freeFiles(watch_files, watch_fileCount);
+  watch_files = 0;
+  watch_fileCount = 0;
+  watch_freeFiles(watch_scanFiles, watch_scanCount);
+  watch_scanFiles = 0;
+  watch_scanCount = watch_scanCapacity = 0;
+#endif
+}
+
+
+// calls file() for each file and dir() for each folder below rel, including rel itself
+static void
+watch_walk(const char* rel, void (*dir)(const char* rel), void (*file)(const char* rel, struct stat* st))
+{
+  char path[PATH_MAX];
+  util_joinPath(path, watch_localDir, rel);
+
+  DIR* dp = opendir(path);
+  if (!dp) {
+    return;
+  }
+
+  if (dir) {
+    dir(rel);
+  }
+
+  struct dirent* de;
+  while ((de = readdir(dp)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+
+    char child[PATH_MAX], childPath[PATH_MAX];
+    struct stat st;
+    util_joinPath(child, rel, de->d_name);
+    util_joinPath(childPath, watch_localDir, child);
+
+    if (util_statChild(childPath, &st) != 0) {
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      watch_walk(child, dir, file);
+    } else if (S_ISREG(st.st_mode) && file) {
+      file(child, &st);
+    }
+  }
+
+  closedir(dp);
+}
+
+
+#ifdef __linux__
+
+static void
+watch_queueFile(const char* rel, struct stat* st)
+{
+  (void)st;
+  watch_listAdd(&watch_changed, rel);
+}
+
+
+static void
+watch_addWatch(const char* rel)
+{
+  char path[PATH_MAX];
+  util_joinPath(path, watch_localDir, rel);
+
+  int wd = inotify_add_watch(watch_inotifyFd, path, IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE);
+  if (wd < 0) {
+    fprintf(stderr, "%s: unable to watch %s (%s)\n", main_argv0, path, strerror(errno));
+    return;
+  }
+
+  watch_listSet(&watch_watches, wd, rel);
+}
+
+
+static void
+watch_start(void)
+{
+  if ((watch_inotifyFd = inotify_init()) < 0) {
+    fatalError("inotify_init() failed");
+  }
+
+  watch_walk("", watch_addWatch, 0);
+}
+
+
+static void
+watch_readEvents(void)
+{
+  union {
+    struct inotify_event event;
+    char buffer[16384];
+  } events;
+
+  ssize_t length = read(watch_inotifyFd, events.buffer, sizeof(events.buffer));
+  if (length <= 0) {
+    if (length < 0 && errno == EINTR) {
+      return;
+    }
+    fatalError("failed to read inotify events");
+  }
+
+  for (char* ptr = events.buffer; ptr < events.buffer + length;) {
+    struct inotify_event* event = (struct inotify_event*)ptr;
+    ptr += sizeof(*event) + event->len;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      fprintf(stderr, "%s: too many changes at once, some may not have been seen\n", main_argv0);
+      continue;
+    }
+
+    if (event->len == 0 || event->wd < 0 || (uint32_t)event->wd >= watch_watches.count || !watch_watches.items[event->wd]) {
+      continue;
+    }
+
+    char rel[PATH_MAX];
+    util_joinPath(rel, watch_watches.items[event->wd], event->name);
+
+    if (event->mask & IN_ISDIR) {
+      // the new folder may have been filled before it was watched
+      if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
+	watch_walk(rel, watch_addWatch, watch_queueFile);
+      }
+    } else if (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO)) {
+      watch_listAdd(&watch_changed, rel);
+    }
+  }
+}
+
+
+static void
+watch_wait(int debounceMs)
+{
+  struct pollfd pfd = {.fd = watch_inotifyFd, .events = POLLIN};
+  int ready;
+
+  while (watch_changed.count == 0) {
+    if (poll(&pfd, 1, -1) > 0) {
+      watch_readEvents();
+    } else if (errno != EINTR) {
+      fatalError("poll() failed");
+    }
+  }
+
+  while ((ready = poll(&pfd, 1, debounceMs)) != 0) {
+    if (ready > 0) {
+      watch_readEvents();
+    } else if (errno != EINTR) {
+      fatalError("poll() failed");
+    }
+  }
+}
+
+#else
+
+static int
+watch_compareFiles(const void* a, const void* b)
+{
+  return strcmp(((const watch_file_t*)a)->path, ((const watch_file_t*)b)->path);
+}
+
+
+static void
+watch_scanFile(const char* rel, struct stat* st)
+{
+  if (watch_scanCount == watch_scanCapacity) {
+    watch_scanCapacity = watch_scanCapacity ? watch_scanCapacity * 2 : 256;
+    watch_scanFiles = realloc(watch_scanFiles, watch_scanCapacity * sizeof(watch_file_t));
+    if (!watch_scanFiles) {
+      fatalError("out of memory");
+    }
+  }
+
+  watch_file_t* file = &watch_scanFiles[watch_scanCount++];
+  file->path = strdup(rel);
+  file->mtime = st->st_mtime;
+  file->size = st->st_size;
+}
+
+
+// returns how many files changed since the last scan
+static uint32_t
+watch_scan(int queue)
+{
+  uint32_t changed = 0, old = 0;
+
+  watch_scanFiles = 0;
+  watch_scanCount = watch_scanCapacity = 0;
+  watch_walk("", 0, watch_scanFile);
+  qsort(watch_scanFiles, watch_scanCount, sizeof(watch_file_t), watch_compareFiles);
+
+  // both lists are sorted, so one pass finds the new and modified files
+  for (uint32_t i = 0; i < watch_scanCount; i++) {
+    watch_file_t* file = &watch_scanFiles[i];
+    int compare = 1;
+
+    while (old < watch_fileCount && (compare = strcmp(watch_files[old].path, file->path)) < 0) {
+      old++;
+    }
+
+    if (compare != 0 || watch_files[old].mtime != file->mtime || watch_files[old].size != file->size) {
+      if (queue) {
+	watch_listAdd(&watch_changed, file->path);
+      }
+      changed++;
+    }
+  }
+
+  watch_freeFiles(watch_files, watch_fileCount);
+  watch_files = watch_scanFiles;
+  watch_fileCount = watch_scanCount;
+  watch_scanFiles = 0;
+  watch_scanCount = watch_scanCapacity = 0;
+
+  return changed;
+}
+
+
+static void
+watch_start(void)
+{
+  watch_scan(0);
+}
+
+
+static void
+watch_wait(int debounceMs)
+{
+  // nothing tells us about changes, so the debounce time is also how often the tree is scanned
+  for (;;) {
+    usleep(debounceMs * 1000);
+    if (watch_scan(1) == 0 && watch_changed.count) {
+      break;
+    }
+  }
+}
+
+#endif
+
+
+static void
+watch_makeRemoteDirs(const char* rel)
+{
+  char dir[PATH_MAX], remote[PATH_MAX];
+
+  for (const char* slash = strchr(rel, '/'); slash; slash = strchr(slash+1, '/')) {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash-rel), rel);
+    if (!watch_listFind(&watch_remoteDirs, dir)) {
+      // fails harmlessly if it's already there
+      util_joinPath(remote, watch_remoteDir, dir);
+      fsop_makeDir(remote);
+      watch_listAdd(&watch_remoteDirs, dir);
+    }
+  }
+}
+
+
+static int
+watch_compareStrings(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+static void
+watch_push(const char* command)
+{
+  struct timeval start, end;
+  uint32_t pushed = 0, failed = 0;
+  uint64_t bytes = 0;
+
+  gettimeofday(&start, NULL);
+  qsort(watch_changed.items, watch_changed.count, sizeof(char*), watch_compareStrings);
+
+  for (uint32_t i = 0; i < watch_changed.count; i++) {
+    const char* rel = watch_changed.items[i];
+    char local[PATH_MAX], remote[PATH_MAX];
+    struct stat st;
+
+    util_joinPath(local, watch_localDir, rel);
+    util_joinPath(remote, watch_remoteDir, rel);
+
+    // deleted again, or replaced by a folder, before the burst settled
+    if (stat(local, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    watch_makeRemoteDirs(rel);
+
+    dir_entry_t info = {0};
+    info.prot = dir_localProtection(st.st_mode);
+    dir_localDateStamp(st.st_mtime, &info.ds);
+
+    if (squirt_fileWithInfo(local, 0, remote, &info, 0) == 0) {
+      printf("squirted %s -> %s (%s bytes)\n", rel, remote, util_formatNumber(st.st_size));
+      pushed++;
+      bytes += st.st_size;
+    } else {
+      failed++;
+    }
+  }
+
+  watch_listFree(&watch_changed);
+
+  gettimeofday(&end, NULL);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+  printf("pushed %u file%s (%llu bytes) in %0.02f seconds", pushed, pushed == 1 ? "" : "s", (unsigned long long)bytes, seconds);
+  if (failed) {
+    printf(", %u failed", failed);
+  }
+  printf("\n");
+  fflush(stdout);
+
+  if (command && pushed) {
+    uint32_t error = exec_cmd(1, (char*[]){(char*)command});
+    if (error) {
+      fprintf(stderr, "%s: %s: %s\n", main_argv0, command, util_getErrorString(error));
+    }
+  }
+
+  fflush(stdout);
+}
+
+
+void
+watch_run(const char* localDir, const char* remoteDir, const char* command, int debounceMs)
+{
+  struct stat st;
+
+  if (stat(localDir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    fatalError("%s is not a folder", localDir);
+  }
+
+  watch_localDir = localDir;
+  watch_remoteDir = remoteDir;
+
+  size_t length = strlen(remoteDir);
+  if (length && remoteDir[length-1] != ':' && remoteDir[length-1] != '/') {
+    fsop_makeDir(remoteDir);
+  }
+
+  watch_start();
+
+  printf("watching %s, changes are squirted to %s\n", localDir, remoteDir);
+  fflush(stdout);
+
+  for (;;) {
+    watch_wait(debounceMs);
+    watch_push(command);
+  }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#define WATCH_DEFAULT_DEBOUNCE_MS 200
+
+void
+watch_cleanup(void);
+
+void
+watch_run(const char* localDir, const char* remoteDir, const char* command, int debounceMs);